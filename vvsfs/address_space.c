@@ -4,6 +4,7 @@
 #include <linux/errno.h>
 #include <linux/fs.h>
 #include <linux/init.h>
+#include <linux/iomap.h>
 #include <linux/kernel.h>
 #include <linux/mm.h>
 #include <linux/module.h>
@@ -17,6 +18,26 @@
 #include "logging.h"
 #include "vvsfs.h"
 
+// vvsfs_map_lock
+// @vi: inode information of the file
+//
+// Lock the block map of a file to change it. The block pointers (or
+// extents) of a file, and the counts that bound them, only change with
+// i_da_lock held and i_map_sem held for writing, like the i_data_sem of
+// ext4. Lookups made without i_da_lock, which includes those of reads and
+// of writeback, hold i_map_sem for reading, so that they never see an
+// extent array half shifted or an indirect pointer cache being freed.
+//
+static void vvsfs_map_lock(struct vvsfs_inode_info *vi) {
+    mutex_lock(&vi->i_da_lock);
+    down_write(&vi->i_map_sem);
+}
+
+static void vvsfs_map_unlock(struct vvsfs_inode_info *vi) {
+    up_write(&vi->i_map_sem);
+    mutex_unlock(&vi->i_da_lock);
+}
+
 // vvsfs_file_get_block
 // @inode: inode of the file
 // @iblock: the block number (relative to the beginning of the file) to be read.
@@ -28,8 +49,12 @@
 // This function translates a read operation for the "iblock"-th block
 // in a file to the actual read operation on disk. It is used by the
 // readpage/writepage operations for pagecache. This allows a simpler and more
-// modular implementation of file read/write. All we need to do is to provide a
-// primitive for reading one block at a time.
+// modular implementation of file read/write.
+//
+// The caller passes the number of blocks it is interested in through
+// bh->b_size. When those blocks are contiguous on disk, the whole run is
+// mapped at once and bh->b_size is trimmed to its length, which lets the mpage
+// and direct I/O code build a single large bio rather than one per block.
 //
 static int vvsfs_file_get_block(struct inode *inode,
                                 sector_t iblock,
@@ -37,41 +62,136 @@ static int vvsfs_file_get_block(struct inode *inode,
                                 int create) {
     struct super_block *sb = inode->i_sb;
     struct vvsfs_inode_info *vi = VVSFS_I(inode);
-    int raw_dno;
-    uint32_t dno, bno;
+    uint32_t max_blocks;
+    uint32_t dno;
+    int len;
     LOG("vvsfs - file_get_block");
-    if (iblock >= VVSFS_MAX_INODE_BLOCKS) {
+    if (iblock >= vvsfs_max_file_blocks(vi)) {
         DEBUG_LOG("vvsfs - file_get_block - block index exceeds maximum "
-                  "supported: %u >= %d\n",
+                  "supported: %u >= %u\n",
                   (uint32_t)iblock,
-                  (int)VVSFS_MAX_INODE_BLOCKS);
+                  vvsfs_max_file_blocks(vi));
         return -EFBIG;
     }
-    if (iblock > vi->i_db_count) {
+    max_blocks = max_t(uint32_t, bh->b_size >> inode->i_blkbits, 1);
+    down_read(&vi->i_map_sem);
+    if (iblock < vi->i_db_count) {
+        len = vvsfs_index_data_run(vi, sb, (uint32_t)iblock, max_blocks, &dno);
+        up_read(&vi->i_map_sem);
+        if (len < 0) {
+            DEBUG_LOG("vvsfs - file_get_block - failed to index data block\n");
+            return len;
+        }
+        // Blocks vvsfs_prealloc_range assigned for this write are as
+        // fresh as those assigned below
+        if (iblock >= vi->i_prealloc_first && iblock < vi->i_prealloc_end)
+            set_buffer_new(bh);
+        goto map;
+    }
+    up_read(&vi->i_map_sem);
+    if (iblock > vi->i_db_count || !create) {
         return 0;
     }
-    if (iblock == vi->i_db_count) {
-        if (!create) {
-            return 0;
-        }
-        raw_dno = vvsfs_assign_data_block(vi, sb, (uint32_t)iblock);
-        if (raw_dno < 0) {
-            DEBUG_LOG("vvsfs - file_get_block - failed to assign data block\n");
-            return raw_dno;
-        }
-        mark_inode_dirty(inode);
-        dno = (uint32_t)raw_dno;
-        inode->i_blocks = vi->i_db_count * VVSFS_BLOCKSIZE / VVSFS_SECTORSIZE;
-        bno = vvsfs_get_data_block(dno);
-    } else {
-        bno = vvsfs_get_data_block(
-            vvsfs_index_data_block(vi, sb, (uint32_t)iblock));
+    vvsfs_map_lock(vi);
+    len = vvsfs_assign_data_blocks(
+        vi, sb, (uint32_t)iblock, max_blocks, &dno);
+    vvsfs_map_unlock(vi);
+    if (len < 0) {
+        DEBUG_LOG("vvsfs - file_get_block - failed to assign data block\n");
+        return len;
     }
-    map_bh(bh, sb, bno);
+    mark_inode_dirty(inode);
+    inode->i_blocks = vvsfs_i_blocks(vi);
+    // Fresh blocks hold stale data, so they must not be read in
+    set_buffer_new(bh);
+map:
+    map_bh(bh, sb, vvsfs_get_data_block(sb, dno));
+    bh->b_size = (size_t)len << inode->i_blkbits;
     LOG("vvsfs - file_get_block - done\n");
     return 0;
 }
 
+// vvsfs_prealloc_range
+// @inode: inode of the file
+// @pos: byte offset of the start of the write
+// @len: length of the write in bytes
+//
+// Reserve the data blocks backing a write that extends the file in
+// contiguous runs, before block_write_begin asks for them one at a time
+// through vvsfs_file_get_block. Blocks can only be appended to the end of
+// the block list, so writes starting beyond it are left to get_block.
+// The blocks assigned are noted in i_prealloc_first and i_prealloc_end, so
+// that get_block flags them as new and a short write frees them again (see
+// vvsfs_prealloc_trim). The write holds the page they are in locked until
+// its write_end.
+//
+static void vvsfs_prealloc_range(struct inode *inode, loff_t pos, unsigned len) {
+    struct vvsfs_inode_info *vi = VVSFS_I(inode);
+    uint32_t first = pos >> inode->i_blkbits;
+    uint32_t last = (pos + len - 1) >> inode->i_blkbits;
+    uint32_t dno;
+    int ret;
+    vi->i_prealloc_first = 0;
+    vi->i_prealloc_end = 0;
+    if (len == 0 || first > vi->i_db_count || last < vi->i_db_count)
+        return;
+    vvsfs_map_lock(vi);
+    vi->i_prealloc_first = vi->i_db_count;
+    while (vi->i_db_count <= last) {
+        ret = vvsfs_assign_data_blocks(
+            vi, inode->i_sb, vi->i_db_count, last - vi->i_db_count + 1, &dno);
+        if (ret < 0) {
+            // Not fatal, vvsfs_file_get_block retries the remaining
+            // blocks one at a time and reports the error for the
+            // block that cannot be allocated
+            DEBUG_LOG("vvsfs - prealloc_range - failed to assign data blocks "
+                      "%d\n",
+                      ret);
+            break;
+        }
+    }
+    vi->i_prealloc_end = vi->i_db_count;
+    vvsfs_map_unlock(vi);
+    inode->i_blocks = vvsfs_i_blocks(vi);
+    mark_inode_dirty(inode);
+}
+
+// vvsfs_prealloc_trim
+// @inode: inode of the file
+//
+// Free the blocks vvsfs_prealloc_range assigned past the end of the file
+// when the write failed or came up short, so that they are not left
+// allocated beyond it. The page cache past the end of the file is dropped
+// first, as its buffers still map them. Like ext2_write_failed.
+//
+static void vvsfs_prealloc_trim(struct inode *inode) {
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_inode_info *vi = VVSFS_I(inode);
+    uint32_t first;
+    int started;
+    int ret;
+
+    first = max_t(uint32_t,
+                  DIV_ROUND_UP(i_size_read(inode), sb->s_blocksize),
+                  vi->i_prealloc_first);
+    if (first < vi->i_prealloc_end) {
+        truncate_pagecache(inode, i_size_read(inode));
+        vvsfs_map_lock(vi);
+        started = vvsfs_journal_start(sb);
+        ret = vvsfs_truncate_data_blocks(vi, sb, first);
+        if (ret)
+            LOG("vvsfs - prealloc_trim - failed to free blocks of %lu: %d\n",
+                inode->i_ino,
+                ret);
+        inode->i_blocks = vvsfs_i_blocks(vi);
+        mark_inode_dirty(inode);
+        vvsfs_journal_stop(sb, started);
+        vvsfs_map_unlock(vi);
+    }
+    vi->i_prealloc_first = 0;
+    vi->i_prealloc_end = 0;
+}
+
 // Address pace operation readpage/readfolio.
 // You do not need to modify this.
 static int
@@ -87,6 +207,15 @@ vvsfs_read_folio(struct file *file, struct folio *folio) {
 }
 #endif
 
+// Address space operation readahead.
+// Reads the whole readahead window through mpage, which asks get_block
+// for multi-block runs and merges contiguous blocks into large bios
+// rather than reading one page at a time.
+static void vvsfs_readahead(struct readahead_control *rac) {
+    LOG("vvsfs - readahead");
+    mpage_readahead(rac, vvsfs_file_get_block);
+}
+
 // Address pace operation readpage.
 // You do not need to modify this.
 static int vvsfs_writepage(struct page *page, struct writeback_control *wbc) {
@@ -95,6 +224,16 @@ static int vvsfs_writepage(struct page *page, struct writeback_control *wbc) {
     return block_write_full_page(page, vvsfs_file_get_block, wbc);
 }
 
+// Address space operation writepages.
+// Gathers runs of dirty pages that are contiguous on disk into large
+// bios. Pages that cannot be written that way (e.g. partially mapped
+// ones) fall back to vvsfs_writepage.
+static int vvsfs_writepages(struct address_space *mapping,
+                            struct writeback_control *wbc) {
+    LOG("vvsfs - writepages [%lu]\n", mapping->host->i_ino);
+    return mpage_writepages(mapping, wbc, vvsfs_file_get_block);
+}
+
 // Address pace operation readpage.
 // You do not need to modify this.
 static int vvsfs_write_begin(struct file *file,
@@ -106,17 +245,25 @@ static int vvsfs_write_begin(struct file *file,
 #endif
                              struct page **pagep,
                              void **fsdata) {
+    int ret;
+
     LOG("vvsfs - write_begin [%lu]\n", mapping->host->i_ino);
 
-    if (pos + len > VVSFS_MAXFILESIZE)
+    if (pos + len > (loff_t)vvsfs_max_file_blocks(VVSFS_I(mapping->host))
+                        << mapping->host->i_blkbits)
         return -EFBIG;
 
+    vvsfs_prealloc_range(mapping->host, pos, len);
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 19, 0)
-    return block_write_begin(
+    ret = block_write_begin(
         mapping, pos, len, flags, pagep, vvsfs_file_get_block);
 #else
-    return block_write_begin(mapping, pos, len, pagep, vvsfs_file_get_block);
+    ret = block_write_begin(mapping, pos, len, pagep, vvsfs_file_get_block);
 #endif
+    if (ret)
+        vvsfs_prealloc_trim(mapping->host);
+    return ret;
 }
 
 // Address pace operation readpage.
@@ -137,24 +284,1222 @@ static int vvsfs_write_end(struct file *file,
     ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
     if (ret < len) {
         LOG("wrote less than requested.");
+        vvsfs_prealloc_trim(inode);
         return ret;
     }
+    vi->i_prealloc_first = 0;
+    vi->i_prealloc_end = 0;
 
     /* Update inode metadata */
-    inode->i_blocks = vi->i_db_count * VVSFS_BLOCKSIZE / VVSFS_SECTORSIZE;
+    inode->i_blocks = vvsfs_i_blocks(vi);
     inode->i_mtime = inode->i_ctime = current_time(inode);
     mark_inode_dirty(inode);
 
     return ret;
 }
 
+// Buffer head based address space operations. Regular files use the iomap
+// based vvsfs_file_aops below, these remain for symlinks too long to be
+// fast symlinks, which are written through page_symlink.
 const struct address_space_operations vvsfs_as_operations = {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 19, 0)
     .readpage = vvsfs_readpage,
 #else
     .read_folio = vvsfs_read_folio,
 #endif
+    .readahead = vvsfs_readahead,
     .writepage = vvsfs_writepage,
+    .writepages = vvsfs_writepages,
     .write_begin = vvsfs_write_begin,
     .write_end = vvsfs_write_end,
 };
+
+// Blocks held back from the allocator for the delayed allocations of an
+// inode: the blocks themselves, plus one for an indirect or extent overflow
+// block that allocating them may need.
+static uint32_t vvsfs_da_held(uint32_t blocks) {
+    return blocks ? blocks + 1 : 0;
+}
+
+// vvsfs_da_hold
+// @inode: inode of the file
+// @count: number of blocks to add to the delayed allocation
+//
+// Extend the delayed allocation at the end of the block list by count
+// blocks. Only the free block count is charged, the blocks are chosen when
+// the data is written back. Called with i_da_lock held.
+//
+static bool vvsfs_da_hold(struct inode *inode, uint32_t count) {
+    struct vvsfs_sb_info *sbi = inode->i_sb->s_fs_info;
+    struct vvsfs_inode_info *vi = VVSFS_I(inode);
+    if (!vvsfs_bitmap_hold(&sbi->dmap,
+                           vvsfs_da_held(vi->i_da_blocks + count) -
+                               vvsfs_da_held(vi->i_da_blocks)))
+        return false;
+    vi->i_da_blocks += count;
+    return true;
+}
+
+// vvsfs_da_unhold
+// @inode: inode of the file
+// @count: number of blocks to remove from the delayed allocation
+//
+// Give count blocks of the delayed allocation back to the allocator, either
+// to allocate them for real or because they are no longer needed. Called
+// with i_da_lock held.
+//
+static void vvsfs_da_unhold(struct inode *inode, uint32_t count) {
+    struct vvsfs_sb_info *sbi = inode->i_sb->s_fs_info;
+    struct vvsfs_inode_info *vi = VVSFS_I(inode);
+    count = min(count, vi->i_da_blocks);
+    vvsfs_bitmap_unhold(&sbi->dmap,
+                        vvsfs_da_held(vi->i_da_blocks) -
+                            vvsfs_da_held(vi->i_da_blocks - count));
+    vi->i_da_blocks -= count;
+}
+
+// Drop the whole delayed allocation of an inode that is being evicted.
+void vvsfs_da_release(struct inode *inode) {
+    struct vvsfs_inode_info *vi = VVSFS_I(inode);
+    mutex_lock(&vi->i_da_lock);
+    vvsfs_da_unhold(inode, vi->i_da_blocks);
+    mutex_unlock(&vi->i_da_lock);
+}
+
+// Zero the logical blocks [first, end) of a file on disk, skipping holes
+static int vvsfs_iomap_zero_blocks(struct inode *inode,
+                                   uint32_t first,
+                                   uint32_t end) {
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_inode_info *vi = VVSFS_I(inode);
+    uint32_t dno;
+    int len;
+    int ret;
+    while (first < end) {
+        len = vvsfs_index_data_run(vi, sb, first, end - first, &dno);
+        if (len == -ENOENT) {
+            len = vvsfs_index_hole_run(vi, sb, first, end - first);
+            if (len <= 0)
+                return len ? len : -EIO;
+            first += len;
+            continue;
+        }
+        if (len < 0)
+            return len;
+        ret = sb_issue_zeroout(sb, vvsfs_get_data_block(sb, dno), len, GFP_NOFS);
+        if (ret)
+            return ret;
+        first += len;
+    }
+    return 0;
+}
+
+// An unwritten range of a file whose data is on disk, but that still reads
+// back as zeroes on disk because unwritten blocks before it have not been
+// written yet. Kept in i_written, sorted and not touching each other.
+struct vvsfs_written {
+    struct list_head list;
+    uint32_t first;
+    uint32_t end;
+};
+
+// vvsfs_unwritten_run
+// @vi: inode information of the file
+// @first: logical block past the written blocks of the file
+// @len: number of blocks to measure, at most up to i_db_count
+// @ondisk: set if the blocks read back what is on disk
+//
+// Preallocated (unwritten) blocks are always the last i_unwritten blocks of
+// the block list, and read back as zeroes. Writes to them only make them
+// read back what is on disk once the data is there (see
+// vvsfs_unwritten_record), and until all of them up to a range have been
+// written the range is kept in i_written. Called with the block map locked,
+// or held for reading.
+//
+// @return: (uint32_t) number of blocks from first, at most len, that all
+//          read back the same way
+//
+static uint32_t vvsfs_unwritten_run(struct vvsfs_inode_info *vi,
+                                    uint32_t first,
+                                    uint32_t len,
+                                    bool *ondisk) {
+    struct vvsfs_written *w;
+    list_for_each_entry(w, &vi->i_written, list) {
+        if (w->end <= first)
+            continue;
+        if (w->first <= first) {
+            *ondisk = true;
+            return min(len, w->end - first);
+        }
+        len = min(len, w->first - first);
+        break;
+    }
+    *ondisk = false;
+    return len;
+}
+
+// vvsfs_unwritten_record
+// @inode: inode of the file
+// @first: first logical block of the range
+// @end: logical block the range ends before
+//
+// Record that the unwritten blocks of a range read back what is on disk,
+// once the data written to them is there. Blocks up to the first that is
+// still waiting for its data stop being unwritten, those past it are kept
+// in i_written. Only blocks some write reached are recorded. Called with
+// the block map locked.
+//
+static void vvsfs_unwritten_record(struct inode *inode,
+                                   uint32_t first,
+                                   uint32_t end) {
+    struct vvsfs_inode_info *vi = VVSFS_I(inode);
+    uint32_t written = vi->i_db_count - vi->i_unwritten;
+    struct vvsfs_written *w;
+    struct vvsfs_written *next;
+    struct list_head *pos = &vi->i_written;
+
+    first = max(first, written);
+    end = min(end, vi->i_db_count - vi->i_untouched);
+    if (first >= end)
+        return;
+    list_for_each_entry_safe(w, next, &vi->i_written, list) {
+        if (w->end < first) {
+            pos = &w->list;
+            continue;
+        }
+        if (w->first > end)
+            break;
+        first = min(first, w->first);
+        end = max(end, w->end);
+        list_del(&w->list);
+        kfree(w);
+    }
+    if (first == written) {
+        vi->i_unwritten = vi->i_db_count - end;
+        mark_inode_dirty(inode);
+        return;
+    }
+    w = kmalloc(sizeof(*w), GFP_NOFS | __GFP_NOFAIL);
+    w->first = first;
+    w->end = end;
+    list_add(&w->list, pos);
+}
+
+// Drop the ranges of i_written that are no longer unwritten blocks some
+// write reached, after the block list shrank. Called with the block map
+// locked.
+static void vvsfs_unwritten_trim(struct vvsfs_inode_info *vi) {
+    uint32_t written = vi->i_db_count - vi->i_unwritten;
+    uint32_t touched = vi->i_db_count - vi->i_untouched;
+    struct vvsfs_written *w;
+    struct vvsfs_written *next;
+    list_for_each_entry_safe(w, next, &vi->i_written, list) {
+        w->first = max(w->first, written);
+        w->end = min(w->end, touched);
+        if (w->first < w->end)
+            continue;
+        list_del(&w->list);
+        kfree(w);
+    }
+}
+
+// Free i_written, for an inode that is going away
+void vvsfs_drop_written(struct vvsfs_inode_info *vi) {
+    struct vvsfs_written *w;
+    struct vvsfs_written *next;
+    list_for_each_entry_safe(w, next, &vi->i_written, list) {
+        list_del(&w->list);
+        kfree(w);
+    }
+}
+
+// vvsfs_unwritten_touch
+// @inode: inode of the file
+// @first: first logical block a write is about to reach
+//
+// The trailing i_untouched unwritten blocks are those no write has reached,
+// everything before them either has its data on the way or is recorded in
+// i_written. Before a write reaches blocks further on, the untouched blocks
+// it skips are zeroed on disk and recorded, as nothing else would ever
+// write them. Called with the block map locked.
+//
+// @return: (int) 0 if successful, error otherwise
+//
+static int vvsfs_unwritten_touch(struct inode *inode, uint32_t first) {
+    struct vvsfs_inode_info *vi = VVSFS_I(inode);
+    uint32_t touched = vi->i_db_count - vi->i_untouched;
+    int ret;
+    if (first <= touched)
+        return 0;
+    ret = vvsfs_iomap_zero_blocks(inode, touched, first);
+    if (ret)
+        return ret;
+    vi->i_untouched = vi->i_db_count - first;
+    vvsfs_unwritten_record(inode, touched, first);
+    return 0;
+}
+
+// vvsfs_unwritten_abandon
+// @inode: inode of the file
+// @first: first logical block of the range
+// @end: logical block the range ends before
+//
+// Record the unwritten blocks of a range that a write reached but will not
+// put data in, because it came up short or failed. Those that still wait
+// for their data are zeroed on disk first. Called with the block map
+// locked.
+//
+// @return: (int) 0 if successful, error otherwise
+//
+static int vvsfs_unwritten_abandon(struct inode *inode,
+                                   uint32_t first,
+                                   uint32_t end) {
+    struct vvsfs_inode_info *vi = VVSFS_I(inode);
+    uint32_t pos;
+    uint32_t len;
+    bool ondisk;
+    int ret;
+
+    first = max(first, vi->i_db_count - vi->i_unwritten);
+    end = min(end, vi->i_db_count - vi->i_untouched);
+    for (pos = first; pos < end; pos += len) {
+        len = vvsfs_unwritten_run(vi, pos, end - pos, &ondisk);
+        if (ondisk)
+            continue;
+        ret = vvsfs_iomap_zero_blocks(inode, pos, pos + len);
+        if (ret)
+            return ret;
+    }
+    vvsfs_unwritten_record(inode, first, end);
+    return 0;
+}
+
+// vvsfs_iomap_written
+// @inode: inode of the file
+// @offset: byte offset of the start of the write
+// @size: length of the write in bytes
+// @error: error the write completed with, 0 if none
+//
+// Called when a write to unwritten blocks completes, by writeback (see
+// vvsfs_end_bio) and direct I/O, to record that the blocks now read back
+// what was written to them. If the write failed they read back zeroes
+// instead.
+//
+void vvsfs_iomap_written(struct inode *inode,
+                         loff_t offset,
+                         size_t size,
+                         int error) {
+    struct vvsfs_inode_info *vi = VVSFS_I(inode);
+    uint32_t first = offset >> inode->i_blkbits;
+    uint32_t end = DIV_ROUND_UP(offset + size, inode->i_sb->s_blocksize);
+    int ret;
+
+    vvsfs_map_lock(vi);
+    if (error) {
+        ret = vvsfs_unwritten_abandon(inode, first, end);
+        if (ret)
+            LOG("vvsfs - iomap_written - failed to zero blocks of %lu: %d\n",
+                inode->i_ino,
+                ret);
+    } else {
+        vvsfs_unwritten_record(inode, first, end);
+    }
+    vvsfs_map_unlock(vi);
+}
+
+// vvsfs_iomap_alloc_to
+// @inode: inode of the file
+// @end: logical block to allocate up to (exclusive)
+//
+// Extend the block list up to the given block. The delayed allocation at
+// its end is allocated, in as few runs as the allocator manages, since its
+// blocks hold data in the page cache that writeback puts there. Any others
+// are a gap left by a write beyond them and become a hole. Called with the
+// block map locked, inside a journal handle.
+//
+static int vvsfs_iomap_alloc_to(struct inode *inode, uint32_t end) {
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_inode_info *vi = VVSFS_I(inode);
+    uint32_t delayed;
+    uint32_t count = vi->i_db_count;
+    uint32_t dno;
+    int len;
+    int ret = 0;
+    if (vi->i_db_count >= end)
+        return 0;
+    // Blocks appended after unwritten ones are unwritten too, until
+    // writeback puts the data of the page cache in them
+    if (vi->i_unwritten) {
+        ret = vvsfs_unwritten_touch(inode, vi->i_db_count);
+        if (ret)
+            return ret;
+    }
+    // Hand the held blocks to the allocator first, so that it can
+    // place them in a single run
+    delayed = min(end, vi->i_db_count + vi->i_da_blocks);
+    vvsfs_da_unhold(inode, delayed - vi->i_db_count);
+    while (vi->i_db_count < delayed) {
+        len = vvsfs_assign_data_blocks(
+            vi, sb, vi->i_db_count, delayed - vi->i_db_count, &dno);
+        if (len < 0) {
+            ret = len;
+            break;
+        }
+    }
+    if (!ret) {
+        vi->i_holes += end - vi->i_db_count;
+        vi->i_db_count = end;
+        // Data held in the inode moves to the blocks, see
+        // vvsfs_iomap_uninline
+        vi->i_flags &= ~VVSFS_INODE_INLINE_DATA;
+    }
+    if (vi->i_unwritten) {
+        vi->i_unwritten += vi->i_db_count - count;
+        // The gap has nothing to write
+        vvsfs_unwritten_record(inode, delayed, vi->i_db_count);
+    }
+    if (vi->i_db_count < delayed &&
+        !vvsfs_da_hold(inode, delayed - vi->i_db_count))
+        LOG("vvsfs - iomap_alloc_to - lost delayed blocks of %lu\n",
+            inode->i_ino);
+    inode->i_blocks = vvsfs_i_blocks(vi);
+    mark_inode_dirty(inode);
+    return ret;
+}
+
+// vvsfs_iomap_prealloc
+// @inode: inode of the file
+// @first: first logical block to preallocate
+// @end: logical block to preallocate up to (exclusive)
+//
+// Allocate the blocks of a file in a range without writing them, for
+// fallocate. The delayed allocation is allocated first, since new blocks
+// past the end of the block list go after it. Holes in the block list are
+// filled with zeroed blocks, and blocks past its end join the unwritten ones
+// at the end (as does the hole left before them, if any). Called with the
+// inode locked.
+//
+// @return: (int) 0 if successful, error otherwise
+//
+int vvsfs_iomap_prealloc(struct inode *inode, uint32_t first, uint32_t end) {
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_inode_info *vi = VVSFS_I(inode);
+    uint32_t limit;
+    uint32_t dno;
+    int len;
+    int ret;
+    int started;
+
+    vvsfs_map_lock(vi);
+    started = vvsfs_journal_start(sb);
+    ret = vvsfs_iomap_alloc_to(inode, vi->i_db_count + vi->i_da_blocks);
+    while (!ret && first < min(end, vi->i_db_count)) {
+        limit = min(end, vi->i_db_count) - first;
+        len = vvsfs_index_data_run(vi, sb, first, limit, &dno);
+        if (len == -ENOENT) {
+            // Holes read back as zeroes, and so must their blocks
+            len = vvsfs_index_hole_run(vi, sb, first, limit);
+            if (len > 0)
+                len = vvsfs_assign_data_blocks(vi, sb, first, len, &dno);
+            if (len > 0)
+                ret = sb_issue_zeroout(
+                    sb, vvsfs_get_data_block(sb, dno), len, GFP_NOFS);
+        }
+        if (len < 0)
+            ret = len;
+        else
+            first += len;
+    }
+    if (!ret && first > vi->i_db_count) {
+        vi->i_unwritten += first - vi->i_db_count;
+        vi->i_untouched += first - vi->i_db_count;
+        vi->i_holes += first - vi->i_db_count;
+        vi->i_db_count = first;
+    }
+    while (!ret && vi->i_db_count < end) {
+        len = vvsfs_assign_data_blocks(
+            vi, sb, vi->i_db_count, end - vi->i_db_count, &dno);
+        if (len < 0) {
+            ret = len;
+            break;
+        }
+        vi->i_unwritten += len;
+        vi->i_untouched += len;
+    }
+    inode->i_blocks = vvsfs_i_blocks(vi);
+    mark_inode_dirty(inode);
+    vvsfs_journal_stop(sb, started);
+    vvsfs_map_unlock(vi);
+    return ret;
+}
+
+// vvsfs_iomap_punch
+// @inode: inode of the file
+// @first: first logical block to free
+// @end: logical block to free up to (exclusive)
+//
+// Free the blocks of a file in a range, for hole punching. The caller has
+// written back and dropped the page cache of the range, so there is no
+// delayed allocation left in it. Called with the inode locked.
+//
+// @return: (int) 0 if successful, error otherwise
+//
+int vvsfs_iomap_punch(struct inode *inode, uint32_t first, uint32_t end) {
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_inode_info *vi = VVSFS_I(inode);
+    int ret;
+    int started;
+
+    vvsfs_map_lock(vi);
+    started = vvsfs_journal_start(sb);
+    ret = vvsfs_punch_data_blocks(vi, sb, first, end);
+    // Holes have nothing left to write
+    if (!ret)
+        vvsfs_unwritten_record(inode, first, end);
+    inode->i_blocks = vvsfs_i_blocks(vi);
+    mark_inode_dirty(inode);
+    vvsfs_journal_stop(sb, started);
+    vvsfs_map_unlock(vi);
+    return ret;
+}
+
+// vvsfs_iomap_truncate
+// @inode: inode of the file
+// @first: first logical block past the new end of the file
+//
+// Free every block of a file from a logical block on, for truncate. The
+// caller has dropped the page cache past the new size, so the delayed
+// allocation held for it is given back, and the block list shrinks to
+// end where the file does. Data held in the inode is zeroed past the new
+// size instead. Called with the inode locked.
+//
+// @return: (int) 0 if successful, error otherwise
+//
+int vvsfs_iomap_truncate(struct inode *inode, uint32_t first) {
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_inode_info *vi = VVSFS_I(inode);
+    uint32_t count;
+    uint32_t tail;
+    int ret;
+    int started;
+
+    vvsfs_map_lock(vi);
+    tail = vi->i_db_count + vi->i_da_blocks;
+    if (tail > max(first, vi->i_db_count))
+        vvsfs_da_unhold(inode, tail - max(first, vi->i_db_count));
+    started = vvsfs_journal_start(sb);
+    count = vi->i_db_count;
+    ret = vvsfs_truncate_data_blocks(vi, sb, first);
+    vi->i_untouched -= min(vi->i_untouched, count - vi->i_db_count);
+    vvsfs_unwritten_trim(vi);
+    if (vi->i_flags & VVSFS_INODE_INLINE_DATA)
+        memset(vi->i_inline + i_size_read(inode),
+               0,
+               VVSFS_INLINE_SIZE - i_size_read(inode));
+    inode->i_blocks = vvsfs_i_blocks(vi);
+    mark_inode_dirty(inode);
+    vvsfs_journal_stop(sb, started);
+    vvsfs_map_unlock(vi);
+    return ret;
+}
+
+// vvsfs_iomap_uninline
+// @inode: inode of the file
+//
+// Move the data of a file held in its inode to a data block, before a write,
+// size change or preallocation takes the file past the tail of the inode.
+// The data is put in the page cache as a delayed allocation of one block and
+// written back straight away. The inode keeps the data until writeback
+// allocates the block (see vvsfs_iomap_alloc_to), which takes the file out
+// of the inode in the same transaction. Called with the inode locked.
+//
+// @return: (int) 0 if successful, error otherwise
+//
+int vvsfs_iomap_uninline(struct inode *inode) {
+    struct vvsfs_inode_info *vi = VVSFS_I(inode);
+    loff_t size = i_size_read(inode);
+    struct page *page = NULL;
+    bool held;
+    int ret;
+
+    if (!(vi->i_flags & VVSFS_INODE_INLINE_DATA))
+        return 0;
+    if (size) {
+        page = grab_cache_page(inode->i_mapping, 0);
+        if (!page)
+            return -ENOMEM;
+        if (!PageUptodate(page)) {
+            memcpy_to_page(page, 0, (const char *)vi->i_inline, size);
+            zero_user_segment(page, size, PAGE_SIZE);
+            SetPageUptodate(page);
+        }
+    }
+    mutex_lock(&vi->i_da_lock);
+    held = !size || vvsfs_da_hold(inode, 1);
+    // Without data there is nothing to write back, and the data of
+    // an unlinked file never is
+    if (held && (!size || !inode->i_nlink))
+        vi->i_flags &= ~VVSFS_INODE_INLINE_DATA;
+    mutex_unlock(&vi->i_da_lock);
+    if (page) {
+        if (held)
+            set_page_dirty(page);
+        unlock_page(page);
+        put_page(page);
+    }
+    if (!held)
+        return -ENOSPC;
+    if (!(vi->i_flags & VVSFS_INODE_INLINE_DATA)) {
+        mark_inode_dirty(inode);
+        return 0;
+    }
+    ret = filemap_write_and_wait_range(inode->i_mapping, 0, size - 1);
+    if (ret)
+        return ret;
+    if (vi->i_flags & VVSFS_INODE_INLINE_DATA) {
+        LOG("vvsfs - iomap_uninline - data of %lu not written back\n",
+            inode->i_ino);
+        return -EIO;
+    }
+    return 0;
+}
+
+// vvsfs_iomap_inline
+// @inode: inode of the file
+// @offset: byte offset of the start of the range
+// @length: length of the range in bytes
+// @flags: IOMAP_* flags of the operation
+// @iomap: set to the mapping of the start of the range
+//
+// Map a file whose data is held in its inode. iomap copies the data between
+// the page cache (or the user buffer, for direct I/O) and the in-memory copy
+// of the inode, which is written out with the rest of the inode, so the page
+// cache is never dirtied. Past the tail of the inode is a hole, which writes
+// never reach since the file is moved to data blocks first.
+//
+static int vvsfs_iomap_inline(struct inode *inode,
+                              loff_t offset,
+                              loff_t length,
+                              unsigned flags,
+                              struct iomap *iomap) {
+    iomap->bdev = inode->i_sb->s_bdev;
+    iomap->flags = 0;
+    iomap->addr = IOMAP_NULL_ADDR;
+    if (offset >= VVSFS_INLINE_SIZE) {
+        if (flags & IOMAP_WRITE) {
+            DEBUG_LOG("vvsfs - iomap_inline - write past the inline data of "
+                      "%lu\n",
+                      inode->i_ino);
+            return -EIO;
+        }
+        iomap->type = IOMAP_HOLE;
+        iomap->offset = offset;
+        iomap->length = length;
+        return 0;
+    }
+    iomap->type = IOMAP_INLINE;
+    iomap->offset = 0;
+    iomap->length = VVSFS_INLINE_SIZE;
+    iomap->inline_data = VVSFS_I(inode)->i_inline;
+    return 0;
+}
+
+// Set on delayed mappings that extended the delayed allocation, whose unused
+// part vvsfs_iomap_end gives back
+#define VVSFS_IOMAP_F_HELD IOMAP_F_PRIVATE
+// Set on unwritten mappings of blocks no write reached before, which
+// vvsfs_iomap_end records if the write does not reach them after all. The
+// bits from IOMAP_F_PRIVATE up are left to file systems.
+#define VVSFS_IOMAP_F_BEGUN (IOMAP_F_PRIVATE << 1)
+
+// vvsfs_iomap_delalloc
+// @inode: inode of the file
+// @first: first logical block of the write
+// @max_blocks: number of blocks the write covers
+// @iomap: set to the delayed allocation mapping of the start of the write
+//
+// Buffered writes past the end of the block list only hold blocks back from
+// the allocator, which picks them at writeback once the whole dirty range is
+// known (vvsfs_map_blocks). Appends then end up contiguous however small they
+// are, and files deleted before writeback never touch the bitmap. A write
+// that starts beyond the delayed allocation allocates it now, and leaves a
+// hole for the gap after it.
+//
+// @return: (int) 1 if the start of the write was allocated in the meantime
+//          and should be mapped, 0 if mapped as delayed, error otherwise
+//
+static int vvsfs_iomap_delalloc(struct inode *inode,
+                                uint32_t first,
+                                uint32_t max_blocks,
+                                struct iomap *iomap) {
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_inode_info *vi = VVSFS_I(inode);
+    uint32_t eof;
+    uint32_t tail;
+    uint32_t len;
+    int started;
+    int ret = 0;
+
+    vvsfs_map_lock(vi);
+    if (first < vi->i_db_count) {
+        ret = 1;
+        goto out;
+    }
+    // Blocks held past the end of the file lost their pages to a
+    // truncate, and must not be allocated without them
+    eof = DIV_ROUND_UP(i_size_read(inode), inode->i_sb->s_blocksize);
+    tail = vi->i_db_count + vi->i_da_blocks;
+    if (tail > max(eof, vi->i_db_count))
+        vvsfs_da_unhold(inode, tail - max(eof, vi->i_db_count));
+    tail = vi->i_db_count + vi->i_da_blocks;
+
+    if (first > tail) {
+        started = vvsfs_journal_start(sb);
+        ret = vvsfs_iomap_alloc_to(inode, first);
+        vvsfs_journal_stop(sb, started);
+        if (ret) {
+            DEBUG_LOG("vvsfs - iomap_delalloc - failed to extend to gap %d\n",
+                      ret);
+            goto out;
+        }
+        tail = first;
+    }
+    if (first < tail) {
+        len = min(max_blocks, tail - first);
+    } else {
+        len = max_blocks;
+        while (!vvsfs_da_hold(inode, len)) {
+            if (len == 1) {
+                ret = -ENOSPC;
+                goto out;
+            }
+            len /= 2;
+        }
+        iomap->flags |= VVSFS_IOMAP_F_HELD;
+    }
+    iomap->type = IOMAP_DELALLOC;
+    iomap->addr = IOMAP_NULL_ADDR;
+    iomap->length = (u64)len << inode->i_blkbits;
+out:
+    vvsfs_map_unlock(vi);
+    return ret;
+}
+
+// vvsfs_iomap_begin
+// @inode: inode of the file
+// @offset: byte offset of the start of the range
+// @length: length of the range in bytes
+// @flags: IOMAP_* flags of the operation
+// @iomap: set to the mapping of the start of the range
+// @srcmap: unused, vvsfs has no copy on write mappings
+//
+// The iomap counterpart of vvsfs_file_get_block. Maps the run of blocks
+// starting at offset that is contiguous on disk, up to the end of the range,
+// or the data held in the inode (see vvsfs_iomap_inline).
+// Holes, and blocks past the end of the block list, are reported as a hole
+// and preallocated blocks as unwritten. Writes past the end of the block
+// list get a delayed allocation if buffered, and otherwise have the range
+// allocated in as few runs as the allocator manages, as do writes into
+// holes. Fresh blocks are flagged as new so that iomap zeroes around partial
+// block writes instead of reading stale data in. Writes to preallocated
+// blocks, or to fresh blocks among them, map them as unwritten for the same
+// reason, and the blocks only read back what was written once the write
+// completes (see vvsfs_unwritten_run).
+//
+static int vvsfs_iomap_begin(struct inode *inode,
+                             loff_t offset,
+                             loff_t length,
+                             unsigned flags,
+                             struct iomap *iomap,
+                             struct iomap *srcmap) {
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_inode_info *vi = VVSFS_I(inode);
+    uint32_t max_file_blocks = vvsfs_max_file_blocks(vi);
+    uint32_t first;
+    uint32_t max_blocks;
+    uint32_t written;
+    uint32_t touched;
+    uint32_t dno;
+    bool ondisk = false;
+    int len;
+    int ret;
+    int started;
+
+    LOG("vvsfs - iomap_begin [%lu] %lld+%lld\n", inode->i_ino, offset, length);
+    if (vi->i_flags & VVSFS_INODE_INLINE_DATA)
+        return vvsfs_iomap_inline(inode, offset, length, flags, iomap);
+    if ((offset >> inode->i_blkbits) >= max_file_blocks) {
+        DEBUG_LOG("vvsfs - iomap_begin - offset exceeds maximum file size: "
+                  "%lld\n",
+                  offset);
+        return -EFBIG;
+    }
+    first = offset >> inode->i_blkbits;
+    max_blocks = min_t(loff_t,
+                       ((offset + length - 1) >> inode->i_blkbits) - first + 1,
+                       max_file_blocks - first);
+
+    iomap->bdev = sb->s_bdev;
+    iomap->offset = (loff_t)first << inode->i_blkbits;
+    iomap->flags = 0;
+    down_read(&vi->i_map_sem);
+    if (first < vi->i_db_count)
+        goto index;
+    up_read(&vi->i_map_sem);
+    if (!(flags & IOMAP_WRITE)) {
+        iomap->type = IOMAP_HOLE;
+        iomap->addr = IOMAP_NULL_ADDR;
+        iomap->length = (u64)max_blocks << inode->i_blkbits;
+        return 0;
+    }
+    if (!(flags & IOMAP_DIRECT)) {
+        ret = vvsfs_iomap_delalloc(inode, first, max_blocks, iomap);
+        if (ret <= 0)
+            return ret;
+        goto lookup;
+    }
+    vvsfs_map_lock(vi);
+    started = vvsfs_journal_start(sb);
+    // Page cache data of a delayed allocation the write starts in has been
+    // written back by now, but not necessarily that of the blocks after it
+    ret = vvsfs_iomap_alloc_to(
+        inode, max(first, vi->i_db_count + vi->i_da_blocks));
+    if (ret) {
+        DEBUG_LOG("vvsfs - iomap_begin - failed to fill gap %d\n", ret);
+        goto unlock;
+    }
+    if (first < vi->i_db_count) {
+        vvsfs_journal_stop(sb, started);
+        vvsfs_map_unlock(vi);
+        goto lookup;
+    }
+    if (vi->i_unwritten) {
+        ret = vvsfs_unwritten_touch(inode, first);
+        if (ret)
+            goto unlock;
+    }
+    len = vvsfs_assign_data_blocks(vi, sb, first, max_blocks, &dno);
+    if (len < 0) {
+        DEBUG_LOG("vvsfs - iomap_begin - failed to assign data blocks\n");
+        ret = len;
+        goto unlock;
+    }
+    // Blocks appended after unwritten ones are unwritten too
+    if (vi->i_unwritten) {
+        vi->i_unwritten += len;
+        iomap->flags |= VVSFS_IOMAP_F_BEGUN;
+    } else {
+        iomap->flags |= IOMAP_F_NEW;
+    }
+    inode->i_blocks = vvsfs_i_blocks(vi);
+    mark_inode_dirty(inode);
+    vvsfs_journal_stop(sb, started);
+    vvsfs_map_unlock(vi);
+    if (iomap->flags & VVSFS_IOMAP_F_BEGUN)
+        goto unwritten;
+    goto map;
+unlock:
+    vvsfs_journal_stop(sb, started);
+    vvsfs_map_unlock(vi);
+    return ret;
+lookup:
+    down_read(&vi->i_map_sem);
+index:
+    len = vvsfs_index_data_run(vi, sb, first, max_blocks, &dno);
+    if (len == -ENOENT)
+        goto hole;
+    written = vi->i_db_count - vi->i_unwritten;
+    if (len > 0 && first >= written)
+        len = vvsfs_unwritten_run(vi, first, len, &ondisk);
+    up_read(&vi->i_map_sem);
+    if (len < 0) {
+        DEBUG_LOG("vvsfs - iomap_begin - failed to index data block\n");
+        return len;
+    }
+    if (first < written) {
+        len = min_t(uint32_t, len, written - first);
+        goto map;
+    }
+    if (ondisk)
+        goto map;
+    // Zeroing leaves unwritten blocks alone, as they read back as zeroes
+    if (!(flags & IOMAP_WRITE) || (flags & IOMAP_ZERO))
+        goto unwritten;
+    vvsfs_map_lock(vi);
+    touched = vi->i_db_count - vi->i_untouched;
+    ret = 0;
+    if (first < touched) {
+        len = min_t(uint32_t, len, touched - first);
+    } else {
+        // The first write to reach the blocks, see vvsfs_iomap_end
+        ret = vvsfs_unwritten_touch(inode, first);
+        if (!ret) {
+            vi->i_untouched = vi->i_db_count - (first + len);
+            iomap->flags |= VVSFS_IOMAP_F_BEGUN;
+        }
+    }
+    vvsfs_map_unlock(vi);
+    if (ret)
+        return ret;
+unwritten:
+    iomap->type = IOMAP_UNWRITTEN;
+    goto addr;
+map:
+    iomap->type = IOMAP_MAPPED;
+addr:
+    iomap->addr = (u64)vvsfs_get_data_block(sb, dno) << inode->i_blkbits;
+    iomap->length = (u64)len << inode->i_blkbits;
+    return 0;
+hole:
+    len = vvsfs_index_hole_run(vi, sb, first, max_blocks);
+    up_read(&vi->i_map_sem);
+    if (len <= 0) {
+        DEBUG_LOG("vvsfs - iomap_begin - failed to measure hole\n");
+        return len ? len : -EIO;
+    }
+    if (!(flags & IOMAP_WRITE)) {
+        iomap->type = IOMAP_HOLE;
+        iomap->addr = IOMAP_NULL_ADDR;
+        iomap->length = (u64)len << inode->i_blkbits;
+        return 0;
+    }
+    // Holes are filled straight away, delayed allocation only covers
+    // the end of the file
+    vvsfs_map_lock(vi);
+    started = vvsfs_journal_start(sb);
+    // Holes among unwritten blocks a write reached have been recorded as
+    // read back from disk, and do not run into those no write reached
+    touched = vi->i_db_count - vi->i_untouched;
+    if (first < touched)
+        len = min_t(uint32_t, len, touched - first);
+    len = vvsfs_assign_data_blocks(vi, sb, first, len, &dno);
+    if (len == -EEXIST) {
+        // Writers hold the inode lock, so nothing else fills holes
+        // between the lookup and here, but should the lookup be stale
+        // it is simply made again
+        vvsfs_journal_stop(sb, started);
+        vvsfs_map_unlock(vi);
+        goto lookup;
+    }
+    if (len < 0) {
+        DEBUG_LOG("vvsfs - iomap_begin - failed to fill hole\n");
+        ret = len;
+        goto unlock;
+    }
+    if (first >= touched) {
+        // A hole among unwritten blocks no write reached, whose fresh
+        // blocks are unwritten like them
+        ret = vvsfs_unwritten_touch(inode, first);
+        if (ret)
+            goto unlock;
+        vi->i_untouched = vi->i_db_count - (first + len);
+        iomap->flags |= VVSFS_IOMAP_F_BEGUN;
+    } else {
+        iomap->flags |= IOMAP_F_NEW;
+    }
+    inode->i_blocks = vvsfs_i_blocks(vi);
+    mark_inode_dirty(inode);
+    vvsfs_journal_stop(sb, started);
+    vvsfs_map_unlock(vi);
+    if (iomap->flags & VVSFS_IOMAP_F_BEGUN)
+        goto unwritten;
+    goto map;
+}
+
+// vvsfs_iomap_end
+// iomap only updates the in-memory i_size when a buffered write extends the
+// file, so the inode is marked dirty here to get the new size written out.
+// Blocks a short write held for delayed allocation but did not reach are
+// given back. Fresh blocks it did not reach must keep reading back as
+// zeroes: they are made unwritten when they end the block list, and are
+// freed back into a hole otherwise. Unwritten blocks it reached first but
+// did not put data in are recorded (see vvsfs_unwritten_abandon).
+//
+static int vvsfs_iomap_end(struct inode *inode,
+                           loff_t offset,
+                           loff_t length,
+                           ssize_t written,
+                           unsigned flags,
+                           struct iomap *iomap) {
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_inode_info *vi = VVSFS_I(inode);
+    uint32_t used;
+    uint32_t tail;
+    uint32_t end;
+    int started;
+    int ret = 0;
+
+    if (iomap->flags & IOMAP_F_SIZE_CHANGED)
+        mark_inode_dirty(inode);
+    if (written == length)
+        return 0;
+    used = written > 0 ? DIV_ROUND_UP(offset + written, sb->s_blocksize)
+                       : offset >> inode->i_blkbits;
+    vvsfs_map_lock(vi);
+    if (iomap->type == IOMAP_DELALLOC &&
+        (iomap->flags & VVSFS_IOMAP_F_HELD)) {
+        // Writeback may have allocated some of the blocks already
+        tail = vi->i_db_count + vi->i_da_blocks;
+        if (tail > max(used, vi->i_db_count))
+            vvsfs_da_unhold(inode, tail - max(used, vi->i_db_count));
+    } else if (iomap->type == IOMAP_UNWRITTEN &&
+               (iomap->flags & VVSFS_IOMAP_F_BEGUN)) {
+        used = max_t(uint32_t, used, iomap->offset >> inode->i_blkbits);
+        end = (iomap->offset + iomap->length) >> inode->i_blkbits;
+        ret = vvsfs_unwritten_abandon(inode, used, end);
+    } else if (iomap->type == IOMAP_MAPPED &&
+               (iomap->flags & IOMAP_F_NEW)) {
+        used = max_t(uint32_t, used, iomap->offset >> inode->i_blkbits);
+        end = (iomap->offset + iomap->length) >> inode->i_blkbits;
+        if (end == vi->i_db_count && !vi->i_unwritten) {
+            if (used < end) {
+                vi->i_unwritten = end - used;
+                vi->i_untouched = end - used;
+                mark_inode_dirty(inode);
+            }
+        } else if (used < end) {
+            started = vvsfs_journal_start(sb);
+            ret = vvsfs_punch_data_blocks(vi, sb, used, end);
+            inode->i_blocks = vvsfs_i_blocks(vi);
+            mark_inode_dirty(inode);
+            vvsfs_journal_stop(sb, started);
+        }
+    }
+    vvsfs_map_unlock(vi);
+    return ret;
+}
+
+const struct iomap_ops vvsfs_iomap_ops = {
+    .iomap_begin = vvsfs_iomap_begin,
+    .iomap_end = vvsfs_iomap_end,
+};
+
+// The iomap_begin of SEEK_HOLE and SEEK_DATA. A delayed allocation only
+// exists in the page cache, so it is reported as unwritten, which makes
+// iomap look for the data there rather than skip it as a hole.
+static int vvsfs_seek_iomap_begin(struct inode *inode,
+                                  loff_t offset,
+                                  loff_t length,
+                                  unsigned flags,
+                                  struct iomap *iomap,
+                                  struct iomap *srcmap) {
+    struct vvsfs_inode_info *vi = VVSFS_I(inode);
+    uint32_t first = offset >> inode->i_blkbits;
+    uint32_t count;
+    uint32_t tail;
+    int ret;
+
+    ret = vvsfs_iomap_begin(inode, offset, length, flags, iomap, srcmap);
+    if (ret || iomap->type != IOMAP_HOLE)
+        return ret;
+    mutex_lock(&vi->i_da_lock);
+    count = vi->i_db_count;
+    tail = count + vi->i_da_blocks;
+    mutex_unlock(&vi->i_da_lock);
+    if (first < count) {
+        // A hole within the block list ends where it does
+        iomap->length = min_t(u64, iomap->length,
+                              (u64)(count - first) << inode->i_blkbits);
+    } else if (first < tail) {
+        iomap->type = IOMAP_UNWRITTEN;
+        iomap->length = min_t(u64, iomap->length,
+                              (u64)(tail - first) << inode->i_blkbits);
+    }
+    return 0;
+}
+
+const struct iomap_ops vvsfs_seek_iomap_ops = {
+    .iomap_begin = vvsfs_seek_iomap_begin,
+};
+
+// Address space operation readpage/read_folio for regular files.
+static int
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 19, 0)
+vvsfs_iomap_readpage(struct file *file, struct page *page) {
+    LOG("vvsfs - iomap_readpage");
+    return iomap_readpage(page, &vvsfs_iomap_ops);
+}
+#else
+vvsfs_iomap_read_folio(struct file *file, struct folio *folio) {
+    LOG("vvsfs - iomap_read_folio");
+    return iomap_read_folio(folio, &vvsfs_iomap_ops);
+}
+#endif
+
+// Address space operation readahead for regular files.
+static void vvsfs_iomap_readahead(struct readahead_control *rac) {
+    LOG("vvsfs - iomap_readahead");
+    iomap_readahead(rac, &vvsfs_iomap_ops);
+}
+
+// vvsfs_da_allocate
+// @inode: inode of the file
+// @first: logical block being written back
+//
+// Allocate the delayed allocation of a file when writeback reaches it. All
+// of it up to the end of the file is allocated at once, so that the blocks
+// of the pages written out next are contiguous with these. Blocks of a
+// deleted file are not allocated, its pages are written nowhere.
+//
+static int vvsfs_da_allocate(struct inode *inode, uint32_t first) {
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_inode_info *vi = VVSFS_I(inode);
+    uint32_t end;
+    int started;
+    int ret = 0;
+
+    vvsfs_map_lock(vi);
+    // A write in progress may hold blocks past the end of the file
+    // that it has not copied data to yet
+    end = min_t(uint32_t,
+                vi->i_db_count + vi->i_da_blocks,
+                DIV_ROUND_UP(i_size_read(inode), sb->s_blocksize));
+    if (first >= vi->i_db_count && first < end && inode->i_nlink) {
+        started = vvsfs_journal_start(sb);
+        ret = vvsfs_iomap_alloc_to(inode, end);
+        vvsfs_journal_stop(sb, started);
+        if (ret)
+            LOG("vvsfs - da_allocate - failed to allocate blocks of %lu: %d\n",
+                inode->i_ino,
+                ret);
+    }
+    vvsfs_map_unlock(vi);
+    return ret;
+}
+
+// Writeback allocates delayed allocations, and otherwise only maps blocks.
+// Blocks past the end of the block list that are not part of a delayed
+// allocation are mapped as a hole, which is not written. The previous
+// mapping is reused for as long as it covers the page being written.
+static int vvsfs_map_blocks(struct iomap_writepage_ctx *wpc,
+                            struct inode *inode,
+                            loff_t offset) {
+    int ret;
+    if (offset >= wpc->iomap.offset &&
+        offset < wpc->iomap.offset + wpc->iomap.length)
+        return 0;
+    if ((offset >> inode->i_blkbits) >= VVSFS_I(inode)->i_db_count) {
+        ret = vvsfs_da_allocate(inode, offset >> inode->i_blkbits);
+        if (ret)
+            return ret;
+    }
+    // A file unlinked on its way out of its inode is still held in it, and
+    // like any deleted file its pages are written nowhere
+    if (VVSFS_I(inode)->i_flags & VVSFS_INODE_INLINE_DATA) {
+        wpc->iomap.type = IOMAP_HOLE;
+        wpc->iomap.addr = IOMAP_NULL_ADDR;
+        wpc->iomap.offset = offset;
+        wpc->iomap.length = inode->i_sb->s_blocksize;
+        wpc->iomap.flags = 0;
+        return 0;
+    }
+    return vvsfs_iomap_begin(inode,
+                             offset,
+                             max_t(loff_t, i_size_read(inode) - offset, 1),
+                             0,
+                             &wpc->iomap,
+                             NULL);
+}
+
+// Work item that records the writeback of unwritten blocks (see
+// vvsfs_end_bio). The pages of an ioend are only released once it is
+// recorded, and the inode can go away after the last of them.
+void vvsfs_ioend_work(struct work_struct *work) {
+    struct vvsfs_inode_info *vi =
+        container_of(work, struct vvsfs_inode_info, i_ioend_work);
+    struct iomap_ioend *ioend;
+    struct iomap_ioend *next;
+    unsigned long irqflags;
+    LIST_HEAD(ioends);
+    int error;
+
+    spin_lock_irqsave(&vi->i_ioend_lock, irqflags);
+    list_splice_init(&vi->i_ioends, &ioends);
+    spin_unlock_irqrestore(&vi->i_ioend_lock, irqflags);
+    list_for_each_entry_safe(ioend, next, &ioends, io_list) {
+        list_del_init(&ioend->io_list);
+        error = blk_status_to_errno(ioend->io_bio->bi_status);
+        vvsfs_iomap_written(
+            ioend->io_inode, ioend->io_offset, ioend->io_size, error);
+        iomap_finish_ioends(ioend, error);
+    }
+}
+
+// Completion of the bios of ioends that wrote unwritten blocks. Recording
+// the write takes the block map lock, which interrupt context cannot, so
+// it is left to vvsfs_ioend_work.
+static void vvsfs_end_bio(struct bio *bio) {
+    struct iomap_ioend *ioend = bio->bi_private;
+    struct vvsfs_inode_info *vi = VVSFS_I(ioend->io_inode);
+    struct vvsfs_sb_info *sbi = ioend->io_inode->i_sb->s_fs_info;
+    unsigned long irqflags;
+
+    spin_lock_irqsave(&vi->i_ioend_lock, irqflags);
+    if (list_empty(&vi->i_ioends))
+        queue_work(sbi->ioend_wq, &vi->i_ioend_work);
+    list_add_tail(&ioend->io_list, &vi->i_ioends);
+    spin_unlock_irqrestore(&vi->i_ioend_lock, irqflags);
+}
+
+// Unwritten blocks only read back what writeback put in them once it
+// completes, see vvsfs_iomap_written
+static int vvsfs_prepare_ioend(struct iomap_ioend *ioend, int status) {
+    if (!status && ioend->io_type == IOMAP_UNWRITTEN)
+        ioend->io_bio->bi_end_io = vvsfs_end_bio;
+    return status;
+}
+
+static const struct iomap_writeback_ops vvsfs_writeback_ops = {
+    .map_blocks = vvsfs_map_blocks,
+    .prepare_ioend = vvsfs_prepare_ioend,
+};
+
+// Address space operation writepages for regular files.
+static int vvsfs_iomap_writepages(struct address_space *mapping,
+                                  struct writeback_control *wbc) {
+    struct iomap_writepage_ctx wpc = {};
+    LOG("vvsfs - iomap_writepages [%lu]\n", mapping->host->i_ino);
+    return iomap_writepages(mapping, wbc, &wpc, &vvsfs_writeback_ops);
+}
+
+// Address space operation bmap for regular files. jbd2 uses it to find the
+// disk blocks of the journal file.
+static sector_t vvsfs_bmap(struct address_space *mapping, sector_t block) {
+    return iomap_bmap(mapping, block, &vvsfs_iomap_ops);
+}
+
+// Address space operations for regular files. Data is read and written with
+// iomap, which works on whole (possibly large) folios and maps multi-block
+// runs through vvsfs_iomap_begin instead of attaching a buffer head to every
+// block. Direct I/O is handled by the file operations, direct_IO only needs
+// to be set for O_DIRECT opens to be allowed.
+const struct address_space_operations vvsfs_file_aops = {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 19, 0)
+    .readpage = vvsfs_iomap_readpage,
+#else
+    .read_folio = vvsfs_iomap_read_folio,
+#endif
+    .readahead = vvsfs_iomap_readahead,
+    .writepages = vvsfs_iomap_writepages,
+    .bmap = vvsfs_bmap,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 18, 0)
+    .set_page_dirty = iomap_set_page_dirty,
+    .invalidatepage = iomap_invalidatepage,
+#else
+    .dirty_folio = filemap_dirty_folio,
+    .invalidate_folio = iomap_invalidate_folio,
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 19, 0)
+    .releasepage = iomap_releasepage,
+#else
+    .release_folio = iomap_release_folio,
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 0, 0)
+    .migratepage = iomap_migrate_page,
+#else
+    .migrate_folio = filemap_migrate_folio,
+#endif
+    .is_partially_uptodate = iomap_is_partially_uptodate,
+    .error_remove_page = generic_error_remove_page,
+    .direct_IO = noop_direct_IO,
+};
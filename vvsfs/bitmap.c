@@ -0,0 +1,477 @@
+#include <linux/bitops.h>
+#include <linux/bitmap.h>
+#include <linux/bitrev.h>
+#include <linux/math64.h>
+#include <linux/percpu.h>
+
+#include "vvsfs.h"
+
+#include "logging.h"
+
+/* Allocate an empty in-memory allocation bitmap
+ *
+ * @bm: Bitmap to initialise
+ * @bits: Number of bits (blocks) tracked by the map
+ * @group_bits: Number of bits per block group, a multiple
+ *              of the bits held by a block
+ * @block_size: Size of the blocks the map is stored in
+ *
+ * @return: (int) 0 if successful, error otherwise
+ */
+int vvsfs_bitmap_init(struct vvsfs_bitmap *bm,
+                      uint32_t bits,
+                      uint32_t group_bits,
+                      uint32_t block_size) {
+    int cpu;
+
+    bm->block_bits = block_size * BITS_PER_BYTE;
+    bm->blocks = DIV_ROUND_UP(bits, bm->block_bits);
+    bm->group_bits = group_bits;
+    bm->groups = DIV_ROUND_UP(bits, group_bits);
+    // Whole blocks, so that they load and store as they are
+    bm->map = kvzalloc((size_t)bm->blocks * block_size, GFP_KERNEL);
+    bm->dirty = bitmap_zalloc(bm->blocks, GFP_KERNEL);
+    bm->group_free = kvcalloc(bm->groups, sizeof(atomic_t), GFP_KERNEL);
+    bm->hint = alloc_percpu(uint32_t);
+    if (!bm->map || !bm->dirty || !bm->group_free || !bm->hint)
+        goto fail;
+    if (percpu_counter_init(&bm->free, 0, GFP_KERNEL))
+        goto fail;
+    if (percpu_counter_init(&bm->held, 0, GFP_KERNEL)) {
+        percpu_counter_destroy(&bm->free);
+        goto fail;
+    }
+    spin_lock_init(&bm->hold_lock);
+    bm->bits = bits;
+    // Start each CPU searching in its own part of the map, so that
+    // concurrent allocations do not keep racing for the same bits.
+    // Block 0 is always reserved, so start searching from 1
+    for_each_possible_cpu(cpu) {
+        *per_cpu_ptr(bm->hint, cpu) =
+            max_t(uint32_t, 1, div_u64((u64)bits * cpu, nr_cpu_ids));
+    }
+    return 0;
+fail:
+    free_percpu(bm->hint);
+    kvfree(bm->group_free);
+    bitmap_free(bm->dirty);
+    kvfree(bm->map);
+    bm->hint = NULL;
+    bm->group_free = NULL;
+    bm->dirty = NULL;
+    bm->map = NULL;
+    return -ENOMEM;
+}
+
+void vvsfs_bitmap_destroy(struct vvsfs_bitmap *bm) {
+    if (!bm->map)
+        return;
+    percpu_counter_destroy(&bm->held);
+    percpu_counter_destroy(&bm->free);
+    free_percpu(bm->hint);
+    kvfree(bm->group_free);
+    bitmap_free(bm->dirty);
+    kvfree(bm->map);
+    bm->hint = NULL;
+    bm->group_free = NULL;
+    bm->dirty = NULL;
+    bm->map = NULL;
+}
+
+/* Load a block of the on-disk bitmap into memory. The
+ * on-disk map stores the first block of each byte in the
+ * most significant bit, whereas the in-memory map uses
+ * little-endian bit order so that it can be scanned a word
+ * at a time with the kernel bitops.
+ *
+ * @bm: Bitmap to load into
+ * @data: On-disk bitmap block, acquired from a struct
+ *        buffer_head
+ * @block: Index of the block within the map
+ */
+void vvsfs_bitmap_load(struct vvsfs_bitmap *bm,
+                       const char *data,
+                       uint32_t block) {
+    uint32_t len = bm->block_bits / BITS_PER_BYTE;
+    uint8_t *map = bm->map + block * len;
+    uint32_t i;
+    for (i = 0; i < len; ++i)
+        map[i] = bitrev8((uint8_t)data[i]);
+}
+
+/* Store a block of the in-memory bitmap in the on-disk bit
+ * order (the inverse of vvsfs_bitmap_load)
+ *
+ * @bm: Bitmap to store from
+ * @data: On-disk bitmap block, acquired from a struct
+ *        buffer_head
+ * @block: Index of the block within the map
+ */
+void vvsfs_bitmap_store(const struct vvsfs_bitmap *bm,
+                        char *data,
+                        uint32_t block) {
+    uint32_t len = bm->block_bits / BITS_PER_BYTE;
+    const uint8_t *map = bm->map + block * len;
+    uint32_t i;
+    for (i = 0; i < len; ++i)
+        data[i] = bitrev8(map[i]);
+}
+
+/* Record that a run of bits changed, so that the map blocks
+ * holding them are stored with the next transaction or sync
+ *
+ * @bm: Bitmap that changed
+ * @pos: First bit of the run
+ * @count: Length of the run
+ */
+static void
+vvsfs_bitmap_dirty(struct vvsfs_bitmap *bm, uint32_t pos, uint32_t count) {
+    uint32_t block;
+    uint32_t last = (pos + count - 1) / bm->block_bits;
+    for (block = pos / bm->block_bits; block <= last; block++) {
+        // Most changes hit a block that is dirty already, which
+        // is then only read rather than written to
+        if (!test_bit(block, bm->dirty))
+            set_bit(block, bm->dirty);
+    }
+}
+
+/* Take the dirty state of a map block, before storing it
+ *
+ * @bm: Bitmap to store
+ * @block: Index of the block within the map
+ *
+ * @return: (bool) true if the block changed since it was
+ *          last stored
+ */
+bool vvsfs_bitmap_take_dirty(struct vvsfs_bitmap *bm, uint32_t block) {
+    return test_and_clear_bit(block, bm->dirty);
+}
+
+/* Mark a map block dirty again after failing to store it
+ *
+ * @bm: Bitmap to store
+ * @block: Index of the block within the map
+ */
+void vvsfs_bitmap_redirty(struct vvsfs_bitmap *bm, uint32_t block) {
+    set_bit(block, bm->dirty);
+}
+
+/* Mark bits that stand for nothing on disk as used, such as
+ * those past the end of a block group. Called at mount,
+ * before the free bits are counted.
+ *
+ * @bm: Bitmap to mark bits of
+ * @pos: First bit of the run
+ * @count: Length of the run
+ */
+void vvsfs_bitmap_set_unused(struct vvsfs_bitmap *bm,
+                             uint32_t pos,
+                             uint32_t count) {
+    uint32_t i;
+    for (i = 0; i < count; ++i)
+        set_bit_le(pos + i, bm->map);
+}
+
+/* Count the set bits among the first bits of a little-endian
+ * byte map. Whole words go through bitmap_weight, as the
+ * weight of a word does not depend on its byte order, but a
+ * partial word at the end would have its bits taken from the
+ * wrong bytes on big-endian hosts, so the bytes after the
+ * last whole word are counted one by one.
+ *
+ * @map: Start of the map, word aligned
+ * @bits: Number of bits to count
+ *
+ * @return: (uint32_t) number of set bits
+ */
+static uint32_t vvsfs_bitmap_weight_le(const uint8_t *map, uint32_t bits) {
+    uint32_t words = round_down(bits, BITS_PER_LONG);
+    uint32_t weight = bitmap_weight((const unsigned long *)map, words);
+    uint32_t i;
+
+    for (i = words; i + BITS_PER_BYTE <= bits; i += BITS_PER_BYTE)
+        weight += hweight8(map[i / BITS_PER_BYTE]);
+    if (i < bits)
+        weight += hweight8(map[i / BITS_PER_BYTE] &
+                           ((1U << (bits - i)) - 1));
+    return weight;
+}
+
+/* Recompute the number of free bits from the map contents,
+ * using a population count rather than testing each bit.
+ * Called once at mount, after which the counts are
+ * maintained by the reserve and free helpers.
+ *
+ * @bm: Bitmap to count
+ */
+void vvsfs_bitmap_count_free(struct vvsfs_bitmap *bm) {
+    uint32_t total = 0;
+    uint32_t free;
+    uint32_t len;
+    uint32_t g;
+    for (g = 0; g < bm->groups; g++) {
+        len = min(bm->group_bits, bm->bits - g * bm->group_bits);
+        free = len - vvsfs_bitmap_weight_le(
+                         bm->map + g * bm->group_bits / BITS_PER_BYTE, len);
+        // Bit 0 is reserved and never counted as free
+        if (g == 0 && !test_bit_le(0, bm->map))
+            free--;
+        atomic_set(&bm->group_free[g], free);
+        total += free;
+    }
+    percpu_counter_set(&bm->free, total);
+}
+
+/* Number of clear bits in the map, excluding bit 0
+ *
+ * @bm: Bitmap to count
+ *
+ * @return: (uint32_t) exact number of free bits
+ */
+uint32_t vvsfs_bitmap_free_bits(struct vvsfs_bitmap *bm) {
+    return percpu_counter_sum_positive(&bm->free);
+}
+
+/* Number of clear bits in the map that are not held back,
+ * i.e. that a reservation could still get
+ *
+ * @bm: Bitmap to count
+ *
+ * @return: (uint32_t) exact number of available bits
+ */
+uint32_t vvsfs_bitmap_avail_bits(struct vvsfs_bitmap *bm) {
+    s64 free = percpu_counter_sum_positive(&bm->free);
+    s64 held = percpu_counter_sum_positive(&bm->held);
+    return free > held ? free - held : 0;
+}
+
+/* Find the first run of count free bits within [start, limit)
+ *
+ * @map: Little-endian bitmap to search
+ * @start: First bit to consider
+ * @limit: Bit to stop searching at (exclusive)
+ * @count: Length of the run
+ *
+ * @return: (uint32_t) first bit of the run, or limit if none
+ */
+static uint32_t vvsfs_bitmap_find_run(const uint8_t *map,
+                                      uint32_t start,
+                                      uint32_t limit,
+                                      uint32_t count) {
+    unsigned long pos = start;
+    unsigned long end;
+    while (pos < limit) {
+        pos = find_next_zero_bit_le(map, limit, pos);
+        if (pos + count > limit)
+            break;
+        // Find the first used bit within the candidate run
+        end = find_next_bit_le(map, pos + count, pos);
+        if (end >= pos + count)
+            return pos;
+        pos = end + 1;
+    }
+    return limit;
+}
+
+/* Set a run of count bits that looked clear, one atomic
+ * bitop at a time. If another CPU set one of them in the
+ * meantime, the bits set so far are cleared again.
+ *
+ * @bm: Bitmap to set bits of
+ * @pos: First bit of the run
+ * @count: Length of the run
+ *
+ * @return: (uint32_t) count if the whole run was set,
+ *          otherwise the offset of the bit that was taken
+ */
+static uint32_t
+vvsfs_bitmap_claim_run(struct vvsfs_bitmap *bm, uint32_t pos, uint32_t count) {
+    uint32_t i;
+    uint32_t j;
+    for (i = 0; i < count; ++i) {
+        if (test_and_set_bit_le(pos + i, bm->map)) {
+            for (j = 0; j < i; ++j)
+                clear_bit_le(pos + j, bm->map);
+            return i;
+        }
+    }
+    atomic_sub(count, &bm->group_free[pos / bm->group_bits]);
+    vvsfs_bitmap_dirty(bm, pos, count);
+    return count;
+}
+
+/* Find and set a run of count clear bits within
+ * [start, limit), see vvsfs_bitmap_find_run. The search
+ * itself reads the map without any lock; bits lost to
+ * another CPU while claiming them only move it along.
+ *
+ * @bm: Bitmap to allocate from
+ * @start: First bit to consider
+ * @limit: Bit to stop searching at (exclusive)
+ * @count: Length of the run
+ *
+ * @return: (uint32_t) first bit of the run, or limit if none
+ */
+static uint32_t vvsfs_bitmap_take_run(struct vvsfs_bitmap *bm,
+                                      uint32_t start,
+                                      uint32_t limit,
+                                      uint32_t count) {
+    uint32_t pos = start;
+    uint32_t taken;
+    while (pos < limit) {
+        pos = vvsfs_bitmap_find_run(bm->map, pos, limit, count);
+        if (pos >= limit)
+            break;
+        taken = vvsfs_bitmap_claim_run(bm, pos, count);
+        if (taken == count)
+            return pos;
+        pos += taken + 1;
+    }
+    return limit;
+}
+
+/* Search for and set a run of count clear bits within a
+ * single group: the group of goal from goal, then the other
+ * groups in turn, wrapping around to the start of the group
+ * of goal. Groups with fewer than count free bits are not
+ * searched at all.
+ *
+ * @bm: Bitmap to allocate from
+ * @goal: First bit to consider
+ * @count: Length of the run
+ *
+ * @return: (uint32_t) first bit of the run, or 0 if none
+ */
+static uint32_t
+vvsfs_bitmap_search(struct vvsfs_bitmap *bm, uint32_t goal, uint32_t count) {
+    uint32_t group = goal / bm->group_bits;
+    uint32_t start = goal;
+    uint32_t limit;
+    uint32_t pos;
+    uint32_t i;
+
+    for (i = 0; i <= bm->groups; i++) {
+        limit = min_t(u64, (u64)(group + 1) * bm->group_bits, bm->bits);
+        // Back at the group of goal, allowing a run to straddle it
+        if (i == bm->groups)
+            limit = min(goal + count - 1, limit);
+        if (atomic_read(&bm->group_free[group]) >= (int)count) {
+            pos = vvsfs_bitmap_take_run(bm, max(start, 1U), limit, count);
+            if (pos < limit)
+                return pos;
+        }
+        group = group + 1 < bm->groups ? group + 1 : 0;
+        start = group * bm->group_bits;
+    }
+    return 0;
+}
+
+/* Reserve a run of count contiguous free bits, searching
+ * from goal and wrapping around once. The bits are held
+ * while searching so that the run cannot eat into bits
+ * held for delayed allocation. The next-fit hint of the
+ * current CPU is moved past the reserved run.
+ *
+ * @bm: Bitmap to allocate from
+ * @goal: First bit to consider, e.g. the bit following the
+ *        previous run of the same file
+ * @count: Number of contiguous bits required
+ *
+ * @return: (uint32_t) first bit of the reserved run, or 0 if
+ *          there is no such run (the map is left unchanged)
+ */
+uint32_t vvsfs_bitmap_reserve_run_goal(struct vvsfs_bitmap *bm,
+                                       uint32_t goal,
+                                       uint32_t count) {
+    uint32_t pos;
+
+    if (!vvsfs_bitmap_hold(bm, count))
+        return 0;
+    if (goal == 0 || goal >= bm->bits)
+        goal = this_cpu_read(*bm->hint);
+    pos = vvsfs_bitmap_search(bm, goal, count);
+    if (pos) {
+        percpu_counter_sub(&bm->free, count);
+        this_cpu_write(*bm->hint, pos + count < bm->bits ? pos + count : 1);
+    }
+    vvsfs_bitmap_unhold(bm, count);
+    return pos;
+}
+
+// How far the per-CPU counter estimate of the bits that can
+// still be held may be off, below which holds take the exact
+// sums under the lock instead
+#define VVSFS_BITMAP_SLACK (4 * percpu_counter_batch * nr_cpu_ids)
+
+/* Hold back count free bits from the map without choosing
+ * them, for delayed allocation. Held bits are not handed
+ * out by the reserve functions until they are unheld.
+ * While the map has plenty of free bits this only adds to
+ * the per-CPU held count.
+ *
+ * @bm: Bitmap to hold bits of
+ * @count: Number of bits to hold
+ *
+ * @return: (bool) true if successful, false if fewer than
+ *          count bits are free (nothing is held)
+ */
+bool vvsfs_bitmap_hold(struct vvsfs_bitmap *bm, uint32_t count) {
+    s64 avail;
+
+    avail = percpu_counter_read_positive(&bm->free) -
+            percpu_counter_read_positive(&bm->held);
+    if (avail >= (s64)count + VVSFS_BITMAP_SLACK) {
+        percpu_counter_add(&bm->held, count);
+        return true;
+    }
+    spin_lock(&bm->hold_lock);
+    if (vvsfs_bitmap_avail_bits(bm) < count) {
+        spin_unlock(&bm->hold_lock);
+        return false;
+    }
+    percpu_counter_add(&bm->held, count);
+    spin_unlock(&bm->hold_lock);
+    return true;
+}
+
+/* Return count held bits to the map
+ *
+ * @bm: Bitmap to unhold bits of
+ * @count: Number of bits to unhold
+ */
+void vvsfs_bitmap_unhold(struct vvsfs_bitmap *bm, uint32_t count) {
+    percpu_counter_sub(&bm->held, count);
+}
+
+/* Release a run of count bits starting at pos
+ *
+ * @bm: Bitmap to release into
+ * @pos: First bit of the run
+ * @count: Number of bits to release
+ */
+void vvsfs_bitmap_free_run(struct vvsfs_bitmap *bm,
+                           uint32_t pos,
+                           uint32_t count) {
+    uint32_t freed = 0;
+    uint32_t i;
+    if (pos == 0 || pos + count > bm->bits) {
+        DEBUG_LOG("vvsfs - bitmap_free_run - invalid run %u+%u of %u\n",
+                  pos,
+                  count,
+                  bm->bits);
+        return;
+    }
+    for (i = 0; i < count; ++i) {
+        // Only count bits that were actually in use, so that a
+        // double free cannot inflate the free count
+        if (test_and_clear_bit_le(pos + i, bm->map)) {
+            atomic_inc(&bm->group_free[(pos + i) / bm->group_bits]);
+            freed++;
+        }
+    }
+    if (freed) {
+        percpu_counter_add(&bm->free, freed);
+        vvsfs_bitmap_dirty(bm, pos, count);
+    }
+}
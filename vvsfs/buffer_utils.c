@@ -38,3 +38,33 @@ uint32_t read_int_from_buffer(char *buf) {
     data |= ((uint32_t)u_buf[3]);
     return data;
 }
+
+/* Mark a metadata buffer of an inode (dentries, indirect
+ * or extent blocks) dirty without waiting for it to reach
+ * the disk. The buffer is associated with the inode, so it
+ * is written out by fsync of that inode, and otherwise by
+ * writeback or sync_fs. Only synchronous inodes (sync or
+ * dirsync mounts, chattr +S) write it immediately.
+ *
+ * With a journal the buffer joins the running transaction
+ * instead, which fsync of the inode then commits, and
+ * synchronous inodes have the transaction committed at the
+ * end of the operation.
+ *
+ * @bh: Buffer holding the metadata
+ * @inode: Inode the metadata belongs to
+ */
+void vvsfs_mark_buffer_dirty(struct buffer_head *bh, struct inode *inode) {
+    bool sync = S_ISDIR(inode->i_mode) ? IS_DIRSYNC(inode) : IS_SYNC(inode);
+
+    if (vvsfs_has_journal(inode->i_sb)) {
+        vvsfs_journal_dirty(inode->i_sb, bh);
+        vvsfs_journal_dirty_mapping(inode);
+        if (sync)
+            vvsfs_journal_commit(inode->i_sb);
+        return;
+    }
+    mark_buffer_dirty_inode(bh, inode);
+    if (sync)
+        sync_dirty_buffer(bh);
+}
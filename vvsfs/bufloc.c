@@ -23,27 +23,18 @@
 int vvsfs_resolve_bufloc(struct inode *dir,
                          struct vvsfs_inode_info *vi,
                          struct bufloc_t *bufloc) {
-    struct buffer_head *i_bh;
-    uint32_t index;
+    int raw_dno;
     if (bufloc == NULL) {
         return -EINVAL;
     }
     if (!bl_flag_set(bufloc->flags, BL_PERSIST_BUFFER)) {
         DEBUG_LOG("vvsfs - resolve_bufloc - bufloc has no peristed buffer, "
                   "resolving\n");
-        if (bufloc->b_index < VVSFS_LAST_DIRECT_BLOCK_INDEX) {
-            bufloc->bh = READ_BLOCK(dir->i_sb, vi, bufloc->b_index);
-        } else {
-            i_bh = READ_BLOCK(dir->i_sb, vi, VVSFS_LAST_DIRECT_BLOCK_INDEX);
-            if (!i_bh) {
-                return -EIO;
-            }
-            index = read_int_from_buffer(
-                i_bh->b_data +
-                (bufloc->b_index - VVSFS_LAST_DIRECT_BLOCK_INDEX) *
-                    VVSFS_INDIRECT_PTR_SIZE);
-            bufloc->bh = READ_BLOCK_OFF(dir->i_sb, index);
+        raw_dno = vvsfs_index_data_block(vi, dir->i_sb, bufloc->b_index);
+        if (raw_dno < 0) {
+            return raw_dno;
         }
+        bufloc->bh = READ_BLOCK_OFF(dir->i_sb, raw_dno);
         if (!bufloc->bh) {
             // Buffer read failed, something has
             // changed unexpectedly
@@ -53,7 +44,40 @@ int vvsfs_resolve_bufloc(struct inode *dir,
     if (!bl_flag_set(bufloc->flags, BL_PERSIST_DENTRY)) {
         DEBUG_LOG("vvsfs - resolve_bufloc - bufloc has no persisted dentry, "
                   "resolving\n");
-        bufloc->dentry = READ_DENTRY(bufloc->bh, bufloc->d_index);
+        if (vvsfs_dir_recs(dir->i_sb)) {
+            bufloc->rec = VVSFS_REC_AT(bufloc->bh->b_data, bufloc->d_index);
+        } else {
+            bufloc->dentry = READ_DENTRY(bufloc->bh, bufloc->d_index);
+        }
     }
     return 0;
-}
\ No newline at end of file
+}
+/* Populate a bufloc for a matched dentry, persisting the
+ * buffer and dentry according to the flags. If the
+ * buffer is not persisted, it is released.
+ *
+ * @out_loc: Bufloc to populate
+ * @bh: Data block buffer containing the dentry
+ * @dentry: Matched dentry (or record) within bh
+ * @b_index: Data block index within the directory
+ * @d_index: Dentry index within the data block
+ * @flags: Behaviour flags for bufloc_t construction
+ */
+void vvsfs_fill_bufloc(struct bufloc_t *out_loc,
+                       struct buffer_head *bh,
+                       void *dentry,
+                       int b_index,
+                       int d_index,
+                       unsigned flags) {
+    out_loc->b_index = b_index;
+    out_loc->d_index = d_index;
+    out_loc->flags = flags;
+    if (bl_flag_set(flags, BL_PERSIST_BUFFER)) {
+        out_loc->bh = bh;
+        out_loc->dentry = bl_flag_set(flags, BL_PERSIST_DENTRY) ? dentry : NULL;
+    } else {
+        out_loc->bh = NULL;
+        out_loc->dentry = NULL;
+        brelse(bh);
+    }
+}
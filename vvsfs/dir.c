@@ -17,41 +17,115 @@
 #include "logging.h"
 #include "vvsfs.h"
 
+// Read a directory made of variable-length records. The directory position is
+// the byte offset of the next record to emit. Records before it in its block
+// are walked over again on the next call, since the one it was left at may
+// have been merged into an earlier record in the meantime.
+static int vvsfs_readdir_recs(struct file *filp, struct dir_context *ctx) {
+    struct inode *dir = file_inode(filp);
+    struct vvsfs_inode_info *vi = VVSFS_I(dir);
+    struct vvsfs_dir_rec *rec;
+    struct buffer_head *bh;
+    uint32_t bs = dir->i_sb->s_blocksize;
+    uint32_t offset;
+    uint32_t b;
+    loff_t start;
+    int raw_dno;
+    int next;
+    DEBUG_LOG("vvsfs - readdir_recs\n");
+    for (b = ctx->pos >> dir->i_blkbits; b < vi->i_db_count; b++) {
+        raw_dno = vvsfs_index_data_block(vi, dir->i_sb, b);
+        if (raw_dno < 0) {
+            return raw_dno;
+        }
+        bh = READ_BLOCK_OFF(dir->i_sb, raw_dno);
+        if (!bh) {
+            return -EIO;
+        }
+        start = (loff_t)b << dir->i_blkbits;
+        for (offset = 0; offset < bs; offset = next) {
+            next = vvsfs_rec_next(dir, bh, offset);
+            if (next < 0) {
+                brelse(bh);
+                return next;
+            }
+            rec = VVSFS_REC_AT(bh->b_data, offset);
+            if (start + offset < ctx->pos || !rec->inode_number) {
+                continue;
+            }
+            if (!dir_emit(ctx,
+                          rec->name,
+                          rec->name_len,
+                          rec->inode_number,
+                          rec->file_type)) {
+                brelse(bh);
+                return 0;
+            }
+            ctx->pos = start + next;
+        }
+        brelse(bh);
+        ctx->pos = start + bs;
+    }
+    DEBUG_LOG("vvsfs - readdir_recs - done");
+    return 0;
+}
+
 // vvsfs_readdir - reads a directory and places the result using filldir, cached
 // in dcache
+//
+// The directory position maps directly to a dentry slot, so each call resumes
+// from the data block holding ctx->pos and walks one block buffer at a time,
+// without copying the directory contents.
 static int vvsfs_readdir(struct file *filp, struct dir_context *ctx) {
     struct inode *dir;
+    struct vvsfs_inode_info *vi;
     struct vvsfs_dir_entry *dentry;
-    char *data;
-    int i;
-    int num_dirs;
-    int err;
+    struct buffer_head *bh;
+    uint32_t num_dirs;
+    uint32_t per_block;
+    uint32_t slot;
+    int raw_dno;
+    int d;
     DEBUG_LOG("vvsfs - readdir\n");
     // get the directory inode from file
     dir = file_inode(filp);
-    data = vvsfs_read_dentries(dir, &num_dirs);
-    if (IS_ERR(data)) {
-        int err = PTR_ERR(data);
-        DEBUG_LOG("vvsfs - readdir - failed cached dentries read: %d\n", err);
-        return err;
-    }
-    // Iterate over dentries and emit them into the dcache
-    for (i = ctx->pos / VVSFS_DENTRYSIZE;
-         i < num_dirs && filp->f_pos < dir->i_size;
-         ++i) {
-        dentry = READ_DENTRY_OFF(data, i);
-        if (!(err = dir_emit(ctx,
-                             dentry->name,
-                             strnlen(dentry->name, VVSFS_MAXNAME),
-                             dentry->inode_number,
-                             DT_UNKNOWN))) {
-            DEBUG_LOG("vvsfs - readdir - failed dir_emit: %d\n", err);
-            kfree(data);
-            return -ENOENT;
+    if (vvsfs_dir_recs(dir->i_sb))
+        return vvsfs_readdir_recs(filp, ctx);
+    vi = VVSFS_I(dir);
+    num_dirs = dir->i_size / VVSFS_DENTRYSIZE;
+    per_block = VVSFS_DENTRIES_PER_BLOCK(dir->i_sb->s_blocksize);
+    for (slot = ctx->pos / VVSFS_DENTRYSIZE; slot < num_dirs;) {
+        raw_dno =
+            vvsfs_index_data_block(vi, dir->i_sb, slot / per_block);
+        if (raw_dno < 0) {
+            DEBUG_LOG("vvsfs - readdir - failed to index block: %d\n", raw_dno);
+            return raw_dno;
+        }
+        bh = READ_BLOCK_OFF(dir->i_sb, raw_dno);
+        if (!bh) {
+            DEBUG_LOG("vvsfs - readdir - failed buffer read\n");
+            return -EIO;
+        }
+        // Emit the dentries of this block into the dcache
+        for (d = slot % per_block; d < per_block && slot < num_dirs;
+             d++, slot++) {
+            dentry = READ_DENTRY(bh, d);
+            if (!dir_emit(ctx,
+                          dentry->name,
+                          strnlen(dentry->name, VVSFS_MAXNAME),
+                          dentry->inode_number,
+                          vvsfs_dir_types(dir->i_sb) ? dentry->file_type
+                                                     : DT_UNKNOWN)) {
+                // The caller's buffer is full, resume from
+                // ctx->pos on the next call
+                brelse(bh);
+                DEBUG_LOG("vvsfs - readdir - done (buffer full)");
+                return 0;
+            }
+            ctx->pos = (slot + 1) * VVSFS_DENTRYSIZE;
         }
-        ctx->pos += VVSFS_DENTRYSIZE;
+        brelse(bh);
     }
-    kfree(data);
     DEBUG_LOG("vvsfs - readdir - done");
     return 0;
 }
@@ -64,5 +138,5 @@ const struct file_operations vvsfs_dir_operations = {
 #else
     .iterate_shared = vvsfs_readdir,
 #endif
-    .fsync = generic_file_fsync,
+    .fsync = vvsfs_fsync,
 };
@@ -0,0 +1,607 @@
+#include "vvsfs.h"
+
+#include "logging.h"
+
+#define DX_TAG(hash) ((hash) >> VVSFS_DX_SLOT_BITS)
+#define DX_ENTRY(tag, slot) (((tag) << VVSFS_DX_SLOT_BITS) | ((slot) + 1))
+#define DX_ENTRY_TAG(entry) ((entry) >> VVSFS_DX_SLOT_BITS)
+#define DX_ENTRY_SLOT(entry) (((entry)&VVSFS_DX_SLOT_MASK) - 1)
+
+/* View over the blocks of a hashed directory index. At
+ * most one index block buffer is held at a time, which
+ * is swapped as entries in other blocks are accessed.
+ */
+struct vvsfs_dx_table {
+    struct inode *dir;      // Directory owning the index
+    uint32_t start;         // First data block of the index
+    uint32_t mask;          // Number of entries - 1 (power of 2)
+    uint32_t per_block;     // Entries held by each index block
+    uint32_t b_index;       // Index block held in bh
+    struct buffer_head *bh; // Currently held index block
+};
+
+static void vvsfs_dx_table_init(struct vvsfs_dx_table *table,
+                                struct inode *dir,
+                                uint32_t start,
+                                uint32_t order) {
+    table->dir = dir;
+    table->start = start;
+    table->per_block = VVSFS_DX_ENTRIES_PER_BLOCK(dir->i_sb->s_blocksize);
+    table->mask = (table->per_block << order) - 1;
+    table->b_index = 0;
+    table->bh = NULL;
+}
+
+static void vvsfs_dx_table_release(struct vvsfs_dx_table *table) {
+    brelse(table->bh);
+    table->bh = NULL;
+}
+
+/* Ensure the index block holding a given entry position
+ * is loaded into the table
+ *
+ * @table: Index table view
+ * @pos: Entry position within the table
+ *
+ * @return: (char*) pointer to the entry within the
+ *          buffer data, or NULL if the read failed
+ */
+static char *vvsfs_dx_entry_ptr(struct vvsfs_dx_table *table, uint32_t pos) {
+    uint32_t b_index = pos / table->per_block;
+    if (!table->bh || table->b_index != b_index) {
+        brelse(table->bh);
+        table->bh = READ_BLOCK_OFF(table->dir->i_sb, table->start + b_index);
+        if (!table->bh) {
+            DEBUG_LOG("vvsfs - dx_entry_ptr - failed to read index block %u\n",
+                      b_index);
+            return NULL;
+        }
+        table->b_index = b_index;
+    }
+    return table->bh->b_data +
+           (pos % table->per_block) * VVSFS_DX_ENTRY_SIZE;
+}
+
+static int
+vvsfs_dx_get(struct vvsfs_dx_table *table, uint32_t pos, uint32_t *entry) {
+    char *ptr = vvsfs_dx_entry_ptr(table, pos);
+    if (!ptr) {
+        return -EIO;
+    }
+    *entry = read_int_from_buffer(ptr);
+    return 0;
+}
+
+static int
+vvsfs_dx_set(struct vvsfs_dx_table *table, uint32_t pos, uint32_t entry) {
+    char *ptr = vvsfs_dx_entry_ptr(table, pos);
+    if (!ptr || vvsfs_journal_access(table->dir->i_sb, table->bh)) {
+        return -EIO;
+    }
+    write_int_to_buffer(ptr, entry);
+    vvsfs_mark_buffer_dirty(table->bh, table->dir);
+    return 0;
+}
+
+/* Insert an entry into the first free position from its
+ * home bucket
+ *
+ * @table: Index table view
+ * @entry: Encoded entry (tag and slot)
+ *
+ * @return: (int) 0 if successful, error otherwise
+ */
+static int vvsfs_dx_insert(struct vvsfs_dx_table *table, uint32_t entry) {
+    uint32_t pos = DX_ENTRY_TAG(entry) & table->mask;
+    uint32_t current;
+    uint32_t probes;
+    int err;
+    for (probes = 0; probes <= table->mask; probes++) {
+        if ((err = vvsfs_dx_get(table, pos, &current))) {
+            return err;
+        }
+        if (!current) {
+            return vvsfs_dx_set(table, pos, entry);
+        }
+        pos = (pos + 1) & table->mask;
+    }
+    DEBUG_LOG("vvsfs - dx_insert - index is full\n");
+    return -ENOSPC;
+}
+
+/* Find the position of an exact entry (tag and slot)
+ *
+ * @table: Index table view
+ * @entry: Encoded entry to find
+ * @out_pos: Returned position of the entry
+ *
+ * @return: (int) 0 if found, 1 if not found, error
+ *          otherwise
+ */
+static int vvsfs_dx_locate(struct vvsfs_dx_table *table,
+                           uint32_t entry,
+                           uint32_t *out_pos) {
+    uint32_t pos = DX_ENTRY_TAG(entry) & table->mask;
+    uint32_t current;
+    uint32_t probes;
+    int err;
+    for (probes = 0; probes <= table->mask; probes++) {
+        if ((err = vvsfs_dx_get(table, pos, &current))) {
+            return err;
+        }
+        if (!current) {
+            break;
+        }
+        if (current == entry) {
+            *out_pos = pos;
+            return 0;
+        }
+        pos = (pos + 1) & table->mask;
+    }
+    return 1;
+}
+
+/* Remove the entry at a given position, shifting back
+ * any subsequent entries of the probe sequence that
+ * would otherwise become unreachable.
+ *
+ * @table: Index table view
+ * @hole: Position of the entry to remove
+ *
+ * @return: (int) 0 if successful, error otherwise
+ */
+static int vvsfs_dx_erase(struct vvsfs_dx_table *table, uint32_t hole) {
+    uint32_t pos = hole;
+    uint32_t current;
+    uint32_t home;
+    int err;
+    for (;;) {
+        pos = (pos + 1) & table->mask;
+        if ((err = vvsfs_dx_get(table, pos, &current))) {
+            return err;
+        }
+        if (!current) {
+            break;
+        }
+        home = DX_ENTRY_TAG(current) & table->mask;
+        // The entry can only fill the hole if its home
+        // bucket does not lie cyclically in (hole, pos]
+        if (((pos - home) & table->mask) < ((pos - hole) & table->mask)) {
+            continue;
+        }
+        if ((err = vvsfs_dx_set(table, hole, current))) {
+            return err;
+        }
+        hole = pos;
+    }
+    return vvsfs_dx_set(table, hole, 0);
+}
+
+/* Release the hashed directory index blocks of a
+ * directory, if it has any.
+ *
+ * @dir: Directory inode
+ */
+void vvsfs_dx_free(struct inode *dir) {
+    struct vvsfs_inode_info *vi = VVSFS_I(dir);
+    struct vvsfs_sb_info *sbi = dir->i_sb->s_fs_info;
+    if (!vi->i_dx_block) {
+        return;
+    }
+    DEBUG_LOG("vvsfs - dx_free - releasing %u index blocks @ %u\n",
+              1 << vi->i_dx_order,
+              vi->i_dx_block);
+    vvsfs_journal_forget(dir->i_sb, vi->i_dx_block, 1 << vi->i_dx_order);
+    vvsfs_free_data_run(&sbi->dmap, vi->i_dx_block, 1 << vi->i_dx_order);
+    vi->i_dx_block = 0;
+    vi->i_dx_order = 0;
+    mark_inode_dirty(dir);
+}
+
+/* Count the dentries of a directory, which is what its
+ * index is sized for
+ *
+ * @dir: Directory inode
+ * @count: Returned number of dentries
+ *
+ * @return: (int) 0 if successful, error otherwise
+ */
+static int vvsfs_dx_count(struct inode *dir, uint32_t *count) {
+    if (vvsfs_dir_recs(dir->i_sb)) {
+        return vvsfs_rec_count(dir, count);
+    }
+    *count = dir->i_size / VVSFS_DENTRYSIZE;
+    return 0;
+}
+
+/* Insert every dentry of a directory of fixed size
+ * dentries into an empty index, by slot
+ *
+ * @table: Index table view
+ * @num_dirs: Number of dentries in the directory
+ *
+ * @return: (int) 0 if successful, error otherwise
+ */
+static int vvsfs_dx_fill_slots(struct vvsfs_dx_table *table,
+                               uint32_t num_dirs) {
+    struct inode *dir = table->dir;
+    struct vvsfs_inode_info *vi = VVSFS_I(dir);
+    struct super_block *sb = dir->i_sb;
+    struct vvsfs_dir_entry *dentry;
+    struct buffer_head *bh = NULL;
+    uint32_t per_block;
+    uint32_t slot;
+    uint32_t hash;
+    int raw_dno;
+    int err;
+
+    per_block = VVSFS_DENTRIES_PER_BLOCK(sb->s_blocksize);
+    for (slot = 0; slot < num_dirs; slot++) {
+        if (slot % per_block == 0) {
+            raw_dno = vvsfs_index_data_block(vi, sb, slot / per_block);
+            if (raw_dno < 0) {
+                return raw_dno;
+            }
+            bh = READ_BLOCK_OFF(sb, raw_dno);
+            if (!bh) {
+                return -EIO;
+            }
+        }
+        dentry = READ_DENTRY(bh, slot % per_block);
+        hash = vvsfs_name_hash(dentry->name,
+                               strnlen(dentry->name, VVSFS_MAXNAME));
+        err = vvsfs_dx_insert(table, DX_ENTRY(DX_TAG(hash), slot));
+        if (err || slot % per_block == per_block - 1 ||
+            slot == num_dirs - 1) {
+            brelse(bh);
+        }
+        if (err) {
+            return err;
+        }
+    }
+    return 0;
+}
+
+/* Insert every record of a directory of variable-length
+ * records into an empty index, by block, using the hash
+ * kept in the record
+ *
+ * @table: Index table view
+ *
+ * @return: (int) 0 if successful, error otherwise
+ */
+static int vvsfs_dx_fill_recs(struct vvsfs_dx_table *table) {
+    struct inode *dir = table->dir;
+    struct vvsfs_inode_info *vi = VVSFS_I(dir);
+    struct super_block *sb = dir->i_sb;
+    struct vvsfs_dir_rec *rec;
+    struct buffer_head *bh;
+    uint32_t offset;
+    uint32_t i;
+    int raw_dno;
+    int next;
+    int err = 0;
+
+    for (i = 0; i < vi->i_db_count && !err; i++) {
+        raw_dno = vvsfs_index_data_block(vi, sb, i);
+        if (raw_dno < 0) {
+            return raw_dno;
+        }
+        bh = READ_BLOCK_OFF(sb, raw_dno);
+        if (!bh) {
+            return -EIO;
+        }
+        for (offset = 0; offset < sb->s_blocksize && !err; offset = next) {
+            next = vvsfs_rec_next(dir, bh, offset);
+            if (next < 0) {
+                err = next;
+                break;
+            }
+            rec = VVSFS_REC_AT(bh->b_data, offset);
+            if (rec->inode_number) {
+                err = vvsfs_dx_insert(table, DX_ENTRY(DX_TAG(rec->hash), i));
+            }
+        }
+        brelse(bh);
+    }
+    return err;
+}
+
+/* Build (or rebuild) the hashed index of a directory
+ * from its dentries, sized to hold all current dentries.
+ * Any previous index is released once the new one is
+ * populated.
+ *
+ * @dir: Directory inode
+ *
+ * @return: (int) 0 if successful, error otherwise
+ */
+static int vvsfs_dx_build(struct inode *dir) {
+    struct vvsfs_inode_info *vi = VVSFS_I(dir);
+    struct super_block *sb = dir->i_sb;
+    struct vvsfs_sb_info *sbi = sb->s_fs_info;
+    struct vvsfs_dx_table table;
+    struct buffer_head *bh;
+    uint32_t num_dirs;
+    uint32_t order;
+    uint32_t start;
+    uint32_t i;
+    int err;
+
+    if ((err = vvsfs_dx_count(dir, &num_dirs))) {
+        return err;
+    }
+    for (order = 0; VVSFS_DX_CAPACITY(sb->s_blocksize, order) < num_dirs;
+         order++) {
+        if (order == VVSFS_DX_MAX_ORDER) {
+            DEBUG_LOG("vvsfs - dx_build - too many dentries: %u\n", num_dirs);
+            return -ENOSPC;
+        }
+    }
+    DEBUG_LOG("vvsfs - dx_build - %u dentries, order %u\n", num_dirs, order);
+    start =
+        vvsfs_reserve_data_run(&sbi->dmap, vvsfs_data_goal(vi), 1 << order);
+    if (!start) {
+        DEBUG_LOG("vvsfs - dx_build - no contiguous run of %u blocks\n",
+                  1 << order);
+        return -ENOSPC;
+    }
+    for (i = 0; i < (1 << order); i++) {
+        bh = READ_BLOCK_OFF(sb, start + i);
+        if (!bh) {
+            err = -EIO;
+            goto free_run;
+        }
+        if ((err = vvsfs_journal_access(sb, bh))) {
+            brelse(bh);
+            goto free_run;
+        }
+        memset(bh->b_data, 0, sb->s_blocksize);
+        vvsfs_mark_buffer_dirty(bh, dir);
+        brelse(bh);
+    }
+
+    vvsfs_dx_table_init(&table, dir, start, order);
+    err = vvsfs_dir_recs(sb) ? vvsfs_dx_fill_recs(&table)
+                             : vvsfs_dx_fill_slots(&table, num_dirs);
+    if (err) {
+        goto release_table;
+    }
+    vvsfs_dx_table_release(&table);
+
+    vvsfs_dx_free(dir);
+    vi->i_dx_block = start;
+    vi->i_dx_order = order;
+    mark_inode_dirty(dir);
+    DEBUG_LOG("vvsfs - dx_build - done\n");
+    return 0;
+
+release_table:
+    vvsfs_dx_table_release(&table);
+free_run:
+    vvsfs_journal_forget(sb, start, 1 << order);
+    vvsfs_free_data_run(&sbi->dmap, start, 1 << order);
+    return err;
+}
+
+/* Find an entry within a directory through its hashed
+ * index. Only valid if the directory has an index
+ * (i_dx_block != 0).
+ *
+ * @dir: Directory inode to search
+ * @name: Name of the target dentry
+ * @len: Length of name
+ * @flags: Behavioural flags for bufloc_t data
+ * @out_loc: Returned data for location of entry if
+ * found
+ *
+ * @return: (int): 0 if found, 1 if not found,
+ * otherwise an error
+ */
+int vvsfs_dx_find_entry(struct inode *dir,
+                        const char *name,
+                        int len,
+                        unsigned flags,
+                        struct bufloc_t *out_loc) {
+    struct vvsfs_inode_info *vi = VVSFS_I(dir);
+    struct super_block *sb = dir->i_sb;
+    struct vvsfs_dx_table table;
+    struct vvsfs_dir_entry *dentry;
+    struct buffer_head *bh;
+    uint32_t num_dirs;
+    uint32_t hash;
+    uint32_t tag;
+    uint32_t pos;
+    uint32_t entry;
+    uint32_t slot;
+    uint32_t probes;
+    uint32_t per_block;
+    bool recs = vvsfs_dir_recs(sb);
+    int raw_dno;
+    int result = 1;
+
+    DEBUG_LOG("vvsfs - dx_find_entry\n");
+    // Entries of a directory of records refer to blocks
+    // rather than dentry slots
+    num_dirs = recs ? vi->i_db_count : dir->i_size / VVSFS_DENTRYSIZE;
+    per_block = recs ? 1 : VVSFS_DENTRIES_PER_BLOCK(sb->s_blocksize);
+    hash = vvsfs_name_hash(name, len);
+    tag = DX_TAG(hash);
+    vvsfs_dx_table_init(&table, dir, vi->i_dx_block, vi->i_dx_order);
+    pos = tag & table.mask;
+    for (probes = 0; probes <= table.mask; probes++) {
+        if ((result = vvsfs_dx_get(&table, pos, &entry))) {
+            break;
+        }
+        if (!entry) {
+            result = 1;
+            break;
+        }
+        pos = (pos + 1) & table.mask;
+        if (DX_ENTRY_TAG(entry) != tag) {
+            continue;
+        }
+        slot = DX_ENTRY_SLOT(entry);
+        if (slot >= num_dirs) {
+            DEBUG_LOG("vvsfs - dx_find_entry - slot %u out of range %u\n",
+                      slot,
+                      num_dirs);
+            result = -EIO;
+            break;
+        }
+        raw_dno = vvsfs_index_data_block(vi, sb, slot / per_block);
+        if (raw_dno < 0) {
+            result = raw_dno;
+            break;
+        }
+        bh = READ_BLOCK_OFF(sb, raw_dno);
+        if (!bh) {
+            result = -EIO;
+            break;
+        }
+        if (recs) {
+            // Look through the block, which also releases it
+            // unless the record is found and persisted
+            result = vvsfs_rec_find_in_block(
+                dir, bh, slot, name, len, hash, flags, out_loc);
+            if (result <= 0) {
+                break;
+            }
+            continue;
+        }
+        dentry = READ_DENTRY(bh, slot % per_block);
+        if (dentry->inode_number && namecmp(dentry->name, name, len)) {
+            vvsfs_fill_bufloc(out_loc,
+                              bh,
+                              dentry,
+                              slot / per_block,
+                              slot % per_block,
+                              flags);
+            result = 0;
+            break;
+        }
+        // Hash tag collision, keep probing
+        brelse(bh);
+        result = 1;
+    }
+    vvsfs_dx_table_release(&table);
+    DEBUG_LOG("vvsfs - dx_find_entry - done: %d\n", result);
+    return result;
+}
+
+/* Record a newly added dentry in the hashed directory
+ * index, building or growing the index as needed. Must
+ * be called after the directory i_size accounts for the
+ * new dentry. Failures drop the index, leaving the
+ * directory to be searched linearly.
+ *
+ * @dir: Directory inode
+ * @name: Name of the new dentry
+ * @len: Length of name
+ * @slot: Position of the dentry within the directory
+ */
+void vvsfs_dx_add_entry(struct inode *dir,
+                        const char *name,
+                        int len,
+                        uint32_t slot) {
+    struct vvsfs_inode_info *vi = VVSFS_I(dir);
+    struct vvsfs_dx_table table;
+    uint32_t bs = dir->i_sb->s_blocksize;
+    uint32_t num_dirs;
+    int err;
+
+    if (!vi->i_dx_block &&
+        (vvsfs_dir_recs(dir->i_sb)
+             ? vi->i_db_count <= 1
+             : dir->i_size / VVSFS_DENTRYSIZE <= VVSFS_DENTRIES_PER_BLOCK(bs))) {
+        // Single block directories are cheaper to scan
+        return;
+    }
+    if ((err = vvsfs_dx_count(dir, &num_dirs))) {
+        DEBUG_LOG("vvsfs - dx_add_entry - dropping index: %d\n", err);
+        vvsfs_dx_free(dir);
+        return;
+    }
+    if (!vi->i_dx_block || num_dirs > VVSFS_DX_CAPACITY(bs, vi->i_dx_order)) {
+        err = vvsfs_dx_build(dir);
+    } else {
+        vvsfs_dx_table_init(&table, dir, vi->i_dx_block, vi->i_dx_order);
+        err = vvsfs_dx_insert(
+            &table, DX_ENTRY(DX_TAG(vvsfs_name_hash(name, len)), slot));
+        vvsfs_dx_table_release(&table);
+    }
+    if (err) {
+        DEBUG_LOG("vvsfs - dx_add_entry - dropping index: %d\n", err);
+        vvsfs_dx_free(dir);
+    }
+}
+
+/* Remove a dentry from the hashed directory index.
+ * Failures drop the index.
+ *
+ * @dir: Directory inode
+ * @name: Name of the removed dentry
+ * @len: Length of name
+ * @slot: Position of the dentry within the directory
+ */
+void vvsfs_dx_remove_entry(struct inode *dir,
+                           const char *name,
+                           int len,
+                           uint32_t slot) {
+    struct vvsfs_inode_info *vi = VVSFS_I(dir);
+    struct vvsfs_dx_table table;
+    uint32_t pos;
+    int err;
+
+    if (!vi->i_dx_block) {
+        return;
+    }
+    vvsfs_dx_table_init(&table, dir, vi->i_dx_block, vi->i_dx_order);
+    err = vvsfs_dx_locate(
+        &table, DX_ENTRY(DX_TAG(vvsfs_name_hash(name, len)), slot), &pos);
+    if (!err) {
+        err = vvsfs_dx_erase(&table, pos);
+    }
+    vvsfs_dx_table_release(&table);
+    if (err) {
+        DEBUG_LOG("vvsfs - dx_remove_entry - dropping index: %d\n", err);
+        vvsfs_dx_free(dir);
+    }
+}
+
+/* Update the hashed directory index for a dentry that
+ * has moved to a different slot. Failures drop the
+ * index.
+ *
+ * @dir: Directory inode
+ * @name: Name of the moved dentry
+ * @len: Length of name
+ * @from: Previous position of the dentry
+ * @to: New position of the dentry
+ */
+void vvsfs_dx_move_entry(struct inode *dir,
+                         const char *name,
+                         int len,
+                         uint32_t from,
+                         uint32_t to) {
+    struct vvsfs_inode_info *vi = VVSFS_I(dir);
+    struct vvsfs_dx_table table;
+    uint32_t tag;
+    uint32_t pos;
+    int err;
+
+    if (!vi->i_dx_block) {
+        return;
+    }
+    tag = DX_TAG(vvsfs_name_hash(name, len));
+    vvsfs_dx_table_init(&table, dir, vi->i_dx_block, vi->i_dx_order);
+    err = vvsfs_dx_locate(&table, DX_ENTRY(tag, from), &pos);
+    if (!err) {
+        err = vvsfs_dx_set(&table, pos, DX_ENTRY(tag, to));
+    }
+    vvsfs_dx_table_release(&table);
+    if (err) {
+        DEBUG_LOG("vvsfs - dx_move_entry - dropping index: %d\n", err);
+        vvsfs_dx_free(dir);
+    }
+}
@@ -0,0 +1,390 @@
+#include "vvsfs.h"
+
+#include "logging.h"
+
+/* Check the record at a given offset of a directory
+ * block and find the one after it
+ *
+ * @dir: Directory inode
+ * @bh: Directory block
+ * @offset: Offset of a record within the block
+ *
+ * @return: (int) offset of the next record (the block
+ *          size after the last), or -EIO if the record
+ *          is corrupt
+ */
+int vvsfs_rec_next(struct inode *dir,
+                   struct buffer_head *bh,
+                   uint32_t offset) {
+    uint32_t bs = dir->i_sb->s_blocksize;
+    struct vvsfs_dir_rec *rec;
+    if (bs - offset < VVSFS_REC_LEN(0)) {
+        goto corrupt;
+    }
+    rec = VVSFS_REC_AT(bh->b_data, offset);
+    if (rec->rec_len < VVSFS_REC_LEN(0) || rec->rec_len % VVSFS_REC_ALIGN ||
+        rec->rec_len > bs - offset ||
+        (rec->inode_number && rec->rec_len < VVSFS_REC_LEN(rec->name_len))) {
+        goto corrupt;
+    }
+    return offset + rec->rec_len;
+
+corrupt:
+    LOG("vvsfs - rec_next - corrupt record at %u of block %llu in "
+        "directory %lu\n",
+        offset,
+        (unsigned long long)bh->b_blocknr,
+        dir->i_ino);
+    return -EIO;
+}
+
+/* Find a record within a directory block by name. The
+ * block is released unless the record is found and the
+ * flags persist it.
+ *
+ * @dir: Directory inode
+ * @bh: Directory block
+ * @b_index: Index of the block within the directory
+ * @name: Name of the target record
+ * @len: Length of name
+ * @hash: vvsfs_name_hash of name
+ * @flags: Behaviour flags for bufloc_t construction
+ * @out_loc: Returned location of the record if found
+ *
+ * @return: (int) 0 if found, 1 if not found, error
+ *          otherwise
+ */
+int vvsfs_rec_find_in_block(struct inode *dir,
+                            struct buffer_head *bh,
+                            int b_index,
+                            const char *name,
+                            int len,
+                            uint32_t hash,
+                            unsigned flags,
+                            struct bufloc_t *out_loc) {
+    struct vvsfs_dir_rec *rec;
+    uint32_t offset;
+    int next;
+    for (offset = 0; offset < dir->i_sb->s_blocksize; offset = next) {
+        next = vvsfs_rec_next(dir, bh, offset);
+        if (next < 0) {
+            brelse(bh);
+            return next;
+        }
+        rec = VVSFS_REC_AT(bh->b_data, offset);
+        // Other records are passed over on their hash and length,
+        // the name is only compared once both match
+        if (!rec->inode_number || rec->hash != hash || rec->name_len != len ||
+            memcmp(rec->name, name, len) != 0) {
+            continue;
+        }
+        vvsfs_fill_bufloc(out_loc, bh, rec, b_index, offset, flags);
+        DEBUG_LOG("vvsfs - rec_find_in_block - done (found)\n");
+        return 0;
+    }
+    brelse(bh);
+    return 1;
+}
+
+/* Find a record within a directory by scanning its
+ * blocks
+ *
+ * @dir: Directory inode
+ * @name: Name of the target record
+ * @len: Length of name
+ * @flags: Behaviour flags for bufloc_t construction
+ * @out_loc: Returned location of the record if found
+ *
+ * @return: (int) 0 if found, 1 if not found, error
+ *          otherwise
+ */
+int vvsfs_rec_find_entry(struct inode *dir,
+                         const char *name,
+                         int len,
+                         unsigned flags,
+                         struct bufloc_t *out_loc) {
+    struct vvsfs_inode_info *vi = VVSFS_I(dir);
+    struct super_block *sb = dir->i_sb;
+    struct buffer_head *bh;
+    uint32_t hash = vvsfs_name_hash(name, len);
+    uint32_t i;
+    int raw_dno;
+    int result;
+    DEBUG_LOG("vvsfs - rec_find_entry\n");
+    for (i = 0; i < vi->i_db_count; i++) {
+        raw_dno = vvsfs_index_data_block(vi, sb, i);
+        if (raw_dno < 0) {
+            return raw_dno;
+        }
+        bh = READ_BLOCK_OFF(sb, raw_dno);
+        if (!bh) {
+            return -EIO;
+        }
+        result =
+            vvsfs_rec_find_in_block(dir, bh, i, name, len, hash, flags, out_loc);
+        if (result <= 0) {
+            return result;
+        }
+    }
+    DEBUG_LOG("vvsfs - rec_find_entry - done (not found)\n");
+    return 1;
+}
+
+/* Find room for a record of a given length in the
+ * existing blocks of a directory, from the first block
+ * that may have any. Moves the hint past leading blocks
+ * found to be too full for even the shortest record.
+ *
+ * @dir: Directory inode
+ * @need: Length of the new record
+ * @out_bh: Returned block with room, with journal access
+ * @out_index: Returned index of the block
+ * @out_offset: Returned offset of the record whose slack
+ *              has room
+ *
+ * @return: (int) 0 if found, 1 if there is no room,
+ *          error otherwise
+ */
+static int vvsfs_rec_find_room(struct inode *dir,
+                               uint32_t need,
+                               struct buffer_head **out_bh,
+                               uint32_t *out_index,
+                               uint32_t *out_offset) {
+    struct vvsfs_inode_info *vi = VVSFS_I(dir);
+    struct super_block *sb = dir->i_sb;
+    struct vvsfs_dir_rec *rec;
+    struct buffer_head *bh;
+    uint32_t offset;
+    uint32_t used;
+    uint32_t i;
+    bool room;
+    int raw_dno;
+    int next;
+    int err;
+    for (i = vi->i_dir_hint; i < vi->i_db_count; i++) {
+        raw_dno = vvsfs_index_data_block(vi, sb, i);
+        if (raw_dno < 0) {
+            return raw_dno;
+        }
+        bh = READ_BLOCK_OFF(sb, raw_dno);
+        if (!bh) {
+            return -EIO;
+        }
+        room = false;
+        for (offset = 0; offset < sb->s_blocksize; offset = next) {
+            next = vvsfs_rec_next(dir, bh, offset);
+            if (next < 0) {
+                brelse(bh);
+                return next;
+            }
+            rec = VVSFS_REC_AT(bh->b_data, offset);
+            used = rec->inode_number ? VVSFS_REC_LEN(rec->name_len) : 0;
+            if (rec->rec_len - used < need) {
+                room |= rec->rec_len - used >= VVSFS_REC_LEN(1);
+                continue;
+            }
+            if ((err = vvsfs_journal_access(sb, bh))) {
+                brelse(bh);
+                return err;
+            }
+            *out_bh = bh;
+            *out_index = i;
+            *out_offset = offset;
+            return 0;
+        }
+        brelse(bh);
+        if (!room && vi->i_dir_hint == i) {
+            vi->i_dir_hint = i + 1;
+        }
+    }
+    return 1;
+}
+
+/* Add a record for an inode to a directory, in the first
+ * block with room for it or else in a new block
+ *
+ * @dir: Directory inode
+ * @dentry: Dentry of the new entry
+ * @inode: Inode the entry refers to
+ *
+ * @return: (int) 0 if successful, error otherwise
+ */
+int vvsfs_rec_add_entry(struct inode *dir,
+                        struct dentry *dentry,
+                        struct inode *inode) {
+    struct vvsfs_inode_info *vi = VVSFS_I(dir);
+    struct super_block *sb = dir->i_sb;
+    const char *name = dentry->d_name.name;
+    int len = dentry->d_name.len;
+    uint32_t need = VVSFS_REC_LEN(len);
+    struct vvsfs_dir_rec *rec;
+    struct vvsfs_dir_rec *new_rec;
+    struct buffer_head *bh;
+    uint32_t b_index;
+    uint32_t offset;
+    uint32_t used;
+    int newblock;
+    int err;
+
+    err = vvsfs_rec_find_room(dir, need, &bh, &b_index, &offset);
+    if (err < 0) {
+        return err;
+    }
+    if (err) {
+        // Every block is full, start a new one holding a single
+        // free record
+        b_index = vi->i_db_count;
+        if (b_index >= VVSFS_INODE_BLOCKS(sb->s_blocksize)) {
+            DEBUG_LOG("vvsfs - rec_add_entry - directory is full\n");
+            return -ENOSPC;
+        }
+        newblock = vvsfs_assign_data_block(vi, sb, b_index);
+        if (newblock < 0) {
+            DEBUG_LOG("vvsfs - rec_add_entry - failed data block "
+                      "assignment\n");
+            return newblock;
+        }
+        bh = sb_getblk(sb, vvsfs_get_data_block(sb, newblock));
+        if (!bh) {
+            return -EIO;
+        }
+        lock_buffer(bh);
+        memset(bh->b_data, 0, sb->s_blocksize);
+        set_buffer_uptodate(bh);
+        unlock_buffer(bh);
+        if ((err = vvsfs_journal_access(sb, bh))) {
+            brelse(bh);
+            return err;
+        }
+        VVSFS_REC_AT(bh->b_data, 0)->rec_len = sb->s_blocksize;
+        offset = 0;
+        dir->i_size = (loff_t)vi->i_db_count * sb->s_blocksize;
+    }
+
+    // Take the slack at the end of the record, or the whole
+    // record if it is free
+    rec = VVSFS_REC_AT(bh->b_data, offset);
+    used = rec->inode_number ? VVSFS_REC_LEN(rec->name_len) : 0;
+    if (used) {
+        new_rec = VVSFS_REC_AT(bh->b_data, offset + used);
+        new_rec->rec_len = rec->rec_len - used;
+        rec->rec_len = used;
+        rec = new_rec;
+    }
+    rec->inode_number = inode->i_ino;
+    rec->hash = vvsfs_name_hash(name, len);
+    rec->name_len = len;
+    rec->file_type = fs_umode_to_dtype(inode->i_mode);
+    memcpy(rec->name, name, len);
+    vvsfs_mark_buffer_dirty(bh, dir);
+    brelse(bh);
+
+    DEBUG_LOG("vvsfs - rec_add_entry - record (%.*s, %lu) added at %u of "
+              "block %u\n",
+              len,
+              name,
+              inode->i_ino,
+              offset + used,
+              b_index);
+
+    if (vi->i_dir_count != VVSFS_DIR_COUNT_UNKNOWN) {
+        vi->i_dir_count++;
+    }
+    vvsfs_dx_add_entry(dir, name, len, b_index);
+    dir->i_blocks = vi->i_db_count * (sb->s_blocksize / VVSFS_SECTORSIZE);
+    dir->i_ctime = dir->i_mtime = current_time(dir);
+    mark_inode_dirty(dir);
+    return 0;
+}
+
+/* Remove the record of a bufloc from its block, which
+ * must be resolved and have journal access
+ *
+ * @dir: Directory inode
+ * @bufloc: Location of the record
+ *
+ * @return: (int) 0 if successful, error otherwise
+ */
+int vvsfs_rec_delete_entry(struct inode *dir, struct bufloc_t *bufloc) {
+    struct vvsfs_inode_info *vi = VVSFS_I(dir);
+    struct vvsfs_dir_rec *rec = bufloc->rec;
+    struct vvsfs_dir_rec *prev = NULL;
+    uint32_t offset;
+    int next;
+    DEBUG_LOG("vvsfs - rec_delete_entry\n");
+    // Records only lead forwards, so find the one before from the
+    // start of the block
+    for (offset = 0; offset < bufloc->d_index; offset = next) {
+        next = vvsfs_rec_next(dir, bufloc->bh, offset);
+        if (next < 0) {
+            return next;
+        }
+        prev = VVSFS_REC_AT(bufloc->bh->b_data, offset);
+    }
+    if (offset != bufloc->d_index) {
+        LOG("vvsfs - rec_delete_entry - no record at %d in directory %lu\n",
+            bufloc->d_index,
+            dir->i_ino);
+        return -EIO;
+    }
+    vvsfs_dx_remove_entry(dir, rec->name, rec->name_len, bufloc->b_index);
+    if (prev) {
+        prev->rec_len += rec->rec_len;
+    } else {
+        rec->inode_number = 0;
+    }
+    if (vi->i_dir_count != VVSFS_DIR_COUNT_UNKNOWN) {
+        vi->i_dir_count--;
+    }
+    vi->i_dir_hint = min(vi->i_dir_hint, (uint32_t)bufloc->b_index);
+    DEBUG_LOG("vvsfs - rec_delete_entry - done\n");
+    return 0;
+}
+
+/* Count the records of a directory, reading its blocks
+ * only the first time after the inode is read
+ *
+ * @dir: Directory inode
+ * @count: Returned number of records
+ *
+ * @return: (int) 0 if successful, error otherwise
+ */
+int vvsfs_rec_count(struct inode *dir, uint32_t *count) {
+    struct vvsfs_inode_info *vi = VVSFS_I(dir);
+    struct super_block *sb = dir->i_sb;
+    struct buffer_head *bh;
+    uint32_t records = 0;
+    uint32_t offset;
+    uint32_t i;
+    int raw_dno;
+    int next;
+    if (vi->i_dir_count != VVSFS_DIR_COUNT_UNKNOWN) {
+        *count = vi->i_dir_count;
+        return 0;
+    }
+    for (i = 0; i < vi->i_db_count; i++) {
+        raw_dno = vvsfs_index_data_block(vi, sb, i);
+        if (raw_dno < 0) {
+            return raw_dno;
+        }
+        bh = READ_BLOCK_OFF(sb, raw_dno);
+        if (!bh) {
+            return -EIO;
+        }
+        for (offset = 0; offset < sb->s_blocksize; offset = next) {
+            next = vvsfs_rec_next(dir, bh, offset);
+            if (next < 0) {
+                brelse(bh);
+                return next;
+            }
+            if (VVSFS_REC_AT(bh->b_data, offset)->inode_number) {
+                records++;
+            }
+        }
+        brelse(bh);
+    }
+    DEBUG_LOG("vvsfs - rec_count - %u records\n", records);
+    vi->i_dir_count = records;
+    *count = records;
+    return 0;
+}
@@ -0,0 +1,566 @@
+#include "vvsfs.h"
+
+#include "logging.h"
+
+#define EXT_END(ext) ((ext)->e_lblk + (ext)->e_len)
+#define EXT_BLOCK(bh) ((struct vvsfs_extent *)(bh)->b_data)
+
+/* Binary search a sorted array of extents for the first
+ * extent that ends after a given logical block
+ *
+ * @ext: Extents sorted by logical block
+ * @n: Number of extents
+ * @lblk: Logical block to search for
+ *
+ * @return: (uint32_t) index of the extent, n if there is no
+ *          such extent
+ */
+static uint32_t
+vvsfs_ext_search(const struct vvsfs_extent *ext, uint32_t n, uint32_t lblk) {
+    uint32_t lo = 0;
+    uint32_t hi = n;
+    uint32_t mid;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (EXT_END(&ext[mid]) <= lblk) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Map a logical block through a sorted array of extents
+ *
+ * @ext: Extents sorted by logical block
+ * @n: Number of extents
+ * @lblk: Logical block to map
+ * @max: Maximum length of the run to report
+ * @dno: Set to the data block map index of lblk
+ *
+ * @return: (int) number of blocks from lblk mapped
+ *          contiguously (at most max), -ENOENT if the block
+ *          is not mapped
+ */
+static int vvsfs_ext_map(const struct vvsfs_extent *ext,
+                         uint32_t n,
+                         uint32_t lblk,
+                         uint32_t max,
+                         uint32_t *dno) {
+    uint32_t i = vvsfs_ext_search(ext, n, lblk);
+    if (i >= n || ext[i].e_lblk > lblk) {
+        return -ENOENT;
+    }
+    *dno = ext[i].e_pblk + (lblk - ext[i].e_lblk);
+    return min(max, EXT_END(&ext[i]) - lblk);
+}
+
+/* Measure the gap between extents that a logical block falls
+ * in, through a sorted array of extents
+ *
+ * @ext: Extents sorted by logical block
+ * @n: Number of extents
+ * @lblk: Logical block to measure from
+ * @max: Maximum length of the gap to report
+ *
+ * @return: (uint32_t) number of blocks from lblk up to the
+ *          next extent (at most max), 0 if lblk is mapped
+ */
+static uint32_t vvsfs_ext_gap(const struct vvsfs_extent *ext,
+                              uint32_t n,
+                              uint32_t lblk,
+                              uint32_t max) {
+    uint32_t i = vvsfs_ext_search(ext, n, lblk);
+    if (i >= n) {
+        return max;
+    }
+    if (ext[i].e_lblk <= lblk) {
+        return 0;
+    }
+    return min(max, ext[i].e_lblk - lblk);
+}
+
+/* Get an extent of an inode by index, whether inline or in
+ * the overflow block
+ *
+ * @root: Extent root of the inode
+ * @bh: Overflow extent block, if the inode has one
+ * @i: Index of the extent
+ *
+ * @return: (struct vvsfs_extent *) the extent
+ */
+static struct vvsfs_extent *
+vvsfs_ext_at(struct vvsfs_extent_root *root, struct buffer_head *bh, uint32_t i) {
+    if (i < VVSFS_N_INLINE_EXTENTS) {
+        return &root->er_extents[i];
+    }
+    return &EXT_BLOCK(bh)[i - VVSFS_N_INLINE_EXTENTS];
+}
+
+/* Binary search all extents of an inode for the first one
+ * that ends after a given logical block
+ *
+ * @root: Extent root of the inode
+ * @bh: Overflow extent block, if the inode has one
+ * @lblk: Logical block to search for
+ *
+ * @return: (uint32_t) index of the extent, er_count if there
+ *          is no such extent
+ */
+static uint32_t vvsfs_ext_lookup(struct vvsfs_extent_root *root,
+                                 struct buffer_head *bh,
+                                 uint32_t lblk) {
+    uint32_t lo = 0;
+    uint32_t hi = root->er_count;
+    uint32_t mid;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (EXT_END(vvsfs_ext_at(root, bh, mid)) <= lblk) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Read the overflow extent block of an inode to modify it
+ *
+ * @vi: Inode information of the target inode
+ * @sb: Superblock of the filesystem
+ * @bh: Set to the overflow block, NULL if the inode has none
+ *
+ * @return: (int) 0 if successful, error otherwise
+ */
+static int vvsfs_ext_get_overflow(struct vvsfs_inode_info *vi,
+                                  struct super_block *sb,
+                                  struct buffer_head **bh) {
+    int ret;
+    *bh = NULL;
+    if (vi->i_ext.er_count <= VVSFS_N_INLINE_EXTENTS) {
+        return 0;
+    }
+    *bh = READ_BLOCK_OFF(sb, vi->i_ext.er_block);
+    if (!*bh) {
+        DEBUG_LOG("vvsfs - ext_get_overflow - failed to read extent block\n");
+        return -EIO;
+    }
+    if ((ret = vvsfs_journal_access(sb, *bh))) {
+        brelse(*bh);
+        *bh = NULL;
+    }
+    return ret;
+}
+
+/* Insert an extent at a given index, moving the extents
+ * from there on up by one. The overflow block is allocated
+ * when the inline extents run out.
+ *
+ * @vi: Inode information of the target inode
+ * @sb: Superblock of the filesystem
+ * @bh: Overflow extent block, set when it is allocated
+ * @i: Index to insert at
+ * @new: Extent to insert
+ *
+ * @return: (int) 0 if successful, error otherwise
+ */
+static int vvsfs_ext_insert(struct vvsfs_inode_info *vi,
+                            struct super_block *sb,
+                            struct buffer_head **bh,
+                            uint32_t i,
+                            const struct vvsfs_extent *new) {
+    struct vvsfs_sb_info *sbi = sb->s_fs_info;
+    struct vvsfs_extent_root *root = &vi->i_ext;
+    uint32_t ext_block;
+    uint32_t j;
+
+    if (root->er_count >= VVSFS_MAX_EXTENTS(sb->s_blocksize)) {
+        DEBUG_LOG("vvsfs - ext_insert - extent limit reached\n");
+        return -EFBIG;
+    }
+    if (root->er_count == VVSFS_N_INLINE_EXTENTS) {
+        // First extent that does not fit inline
+        ext_block = vvsfs_reserve_data_block(&sbi->dmap, vvsfs_data_goal(vi));
+        if (!ext_block) {
+            return -ENOSPC;
+        }
+        *bh = sb_getblk(sb, vvsfs_get_data_block(sb, ext_block));
+        if (!*bh) {
+            vvsfs_free_data_block(&sbi->dmap, ext_block);
+            return -EIO;
+        }
+        lock_buffer(*bh);
+        memset((*bh)->b_data, 0, sb->s_blocksize);
+        set_buffer_uptodate(*bh);
+        unlock_buffer(*bh);
+        vvsfs_journal_access(sb, *bh);
+        root->er_block = ext_block;
+    }
+    for (j = root->er_count; j > i; j--) {
+        *vvsfs_ext_at(root, *bh, j) = *vvsfs_ext_at(root, *bh, j - 1);
+    }
+    *vvsfs_ext_at(root, *bh, i) = *new;
+    root->er_count++;
+    return 0;
+}
+
+/* Remove the extent at a given index, moving the extents
+ * after it down by one. The overflow block is freed once
+ * the extents fit inline again.
+ *
+ * @vi: Inode information of the target inode
+ * @sb: Superblock of the filesystem
+ * @bh: Overflow extent block, cleared when it is freed
+ * @i: Index to remove
+ */
+static void vvsfs_ext_remove(struct vvsfs_inode_info *vi,
+                             struct super_block *sb,
+                             struct buffer_head **bh,
+                             uint32_t i) {
+    struct vvsfs_sb_info *sbi = sb->s_fs_info;
+    struct vvsfs_extent_root *root = &vi->i_ext;
+    uint32_t j;
+
+    for (j = i; j + 1 < root->er_count; j++) {
+        *vvsfs_ext_at(root, *bh, j) = *vvsfs_ext_at(root, *bh, j + 1);
+    }
+    root->er_count--;
+    memset(vvsfs_ext_at(root, *bh, root->er_count),
+           0,
+           sizeof(struct vvsfs_extent));
+    if (root->er_count == VVSFS_N_INLINE_EXTENTS) {
+        brelse(*bh);
+        *bh = NULL;
+        vvsfs_journal_forget(sb, root->er_block, 1);
+        vvsfs_free_data_block(&sbi->dmap, root->er_block);
+        root->er_block = 0;
+    }
+}
+
+/* Calculate the data block map index for a logical block of
+ * an extent mapped inode, along with the length of the
+ * contiguous run starting there. The inline extents always
+ * precede those in the overflow block, so the overflow
+ * block is only read for blocks beyond the last inline
+ * extent.
+ *
+ * @vi: Inode information of the target inode
+ * @sb: Superblock of the filesystem
+ * @lblk: Logical block within the inode
+ * @max: Maximum length of the run to report
+ * @dno: Set to the data block map index of lblk
+ *
+ * @return: (int) number of blocks mapped contiguously (at
+ *          least 1) if the block is mapped, error otherwise
+ */
+int vvsfs_ext_index_run(struct vvsfs_inode_info *vi,
+                        struct super_block *sb,
+                        uint32_t lblk,
+                        uint32_t max,
+                        uint32_t *dno) {
+    struct vvsfs_extent_root *root = &vi->i_ext;
+    struct buffer_head *bh;
+    uint32_t n_inline;
+    int ret;
+
+    n_inline = min(root->er_count, (uint32_t)VVSFS_N_INLINE_EXTENTS);
+    if (n_inline == 0) {
+        return -ENOENT;
+    }
+    if (lblk < EXT_END(&root->er_extents[n_inline - 1])) {
+        return vvsfs_ext_map(root->er_extents, n_inline, lblk, max, dno);
+    }
+    if (root->er_count <= VVSFS_N_INLINE_EXTENTS) {
+        return -ENOENT;
+    }
+    bh = READ_BLOCK_OFF(sb, root->er_block);
+    if (!bh) {
+        DEBUG_LOG("vvsfs - ext_index_run - failed to read extent block\n");
+        return -EIO;
+    }
+    ret = vvsfs_ext_map(EXT_BLOCK(bh),
+                        root->er_count - VVSFS_N_INLINE_EXTENTS,
+                        lblk,
+                        max,
+                        dno);
+    brelse(bh);
+    return ret;
+}
+
+/* Calculate the data block map index for a logical block of
+ * an extent mapped inode
+ *
+ * @vi: Inode information of the target inode
+ * @sb: Superblock of the filesystem
+ * @lblk: Logical block within the inode
+ *
+ * @return: (int) 0 or greater if the block is mapped, error
+ *          otherwise
+ */
+int vvsfs_ext_index_block(struct vvsfs_inode_info *vi,
+                          struct super_block *sb,
+                          uint32_t lblk) {
+    uint32_t dno;
+    int ret = vvsfs_ext_index_run(vi, sb, lblk, 1, &dno);
+    return ret < 0 ? ret : dno;
+}
+
+/* Calculate the number of blocks from a logical block of an
+ * extent mapped inode that are a hole
+ *
+ * @vi: Inode information of the target inode
+ * @sb: Superblock of the filesystem
+ * @lblk: Logical block within the inode
+ * @max: Maximum length of the hole to report
+ *
+ * @return: (int) number of blocks up to the next extent (at
+ *          most max, 0 if lblk is mapped), error otherwise
+ */
+int vvsfs_ext_hole_run(struct vvsfs_inode_info *vi,
+                       struct super_block *sb,
+                       uint32_t lblk,
+                       uint32_t max) {
+    struct vvsfs_extent_root *root = &vi->i_ext;
+    struct buffer_head *bh;
+    uint32_t n_inline;
+    int ret;
+
+    n_inline = min(root->er_count, (uint32_t)VVSFS_N_INLINE_EXTENTS);
+    if (n_inline > 0 && lblk < EXT_END(&root->er_extents[n_inline - 1])) {
+        return vvsfs_ext_gap(root->er_extents, n_inline, lblk, max);
+    }
+    if (root->er_count <= VVSFS_N_INLINE_EXTENTS) {
+        return max;
+    }
+    bh = READ_BLOCK_OFF(sb, root->er_block);
+    if (!bh) {
+        DEBUG_LOG("vvsfs - ext_hole_run - failed to read extent block\n");
+        return -EIO;
+    }
+    ret = vvsfs_ext_gap(EXT_BLOCK(bh),
+                        root->er_count - VVSFS_N_INLINE_EXTENTS,
+                        lblk,
+                        max);
+    brelse(bh);
+    return ret;
+}
+
+/* Assign a run of up to count new data blocks to an extent
+ * mapped inode, either at the end of the file or into a hole
+ * (no further than its end). The run is allocated right
+ * after the extent before it where possible, in which case
+ * that extent is simply lengthened (and merged with the one
+ * after it if the hole is filled), otherwise a new extent is
+ * inserted.
+ *
+ * @vi: Inode information of the target inode
+ * @sb: Superblock of the filesystem
+ * @d_pos: Logical block to create at, either a hole or the
+ *         current data block count of the inode
+ * @count: Maximum number of blocks to assign
+ * @first: Set to the data block map index of the first
+ *         assigned block
+ *
+ * @return: (int) number of blocks assigned (at least 1),
+ *                error otherwise
+ */
+int vvsfs_ext_assign_blocks(struct vvsfs_inode_info *vi,
+                            struct super_block *sb,
+                            uint32_t d_pos,
+                            uint32_t count,
+                            uint32_t *first) {
+    struct vvsfs_sb_info *sbi = sb->s_fs_info;
+    struct vvsfs_extent_root *root = &vi->i_ext;
+    struct vvsfs_extent *prev = NULL;
+    struct vvsfs_extent *next = NULL;
+    struct vvsfs_extent new;
+    struct buffer_head *bh;
+    uint32_t newblock;
+    uint32_t goal = vvsfs_data_goal(vi);
+    uint32_t i;
+    int ret;
+
+    DEBUG_LOG("vvsfs - ext_assign_blocks - %u at %u\n", count, d_pos);
+    if (d_pos > vi->i_db_count || d_pos >= vvsfs_max_file_blocks(vi)) {
+        return -EFBIG;
+    }
+    count = min(count, vvsfs_max_file_blocks(vi) - d_pos);
+    if (count == 0) {
+        return -EINVAL;
+    }
+    if ((ret = vvsfs_ext_get_overflow(vi, sb, &bh))) {
+        return ret;
+    }
+    i = vvsfs_ext_lookup(root, bh, d_pos);
+    if (i < root->er_count) {
+        next = vvsfs_ext_at(root, bh, i);
+        if (next->e_lblk <= d_pos) {
+            ret = -EEXIST;
+            goto out;
+        }
+        count = min(count, next->e_lblk - d_pos);
+    }
+    // Aim for the blocks that line up with the extent before,
+    // so that filling the holes between extents joins them
+    if (i > 0) {
+        prev = vvsfs_ext_at(root, bh, i - 1);
+        goal = prev->e_pblk + (d_pos - prev->e_lblk);
+    }
+    newblock = vvsfs_bitmap_reserve_run_goal(&sbi->dmap, goal, count);
+    while (!newblock && count > 1) {
+        count /= 2;
+        newblock = vvsfs_bitmap_reserve_run_goal(&sbi->dmap, goal, count);
+    }
+    if (!newblock) {
+        ret = -ENOSPC;
+        goto out;
+    }
+    DEBUG_LOG(
+        "vvsfs - ext_assign_blocks - reserved %u at %u\n", count, newblock);
+
+    if (prev && EXT_END(prev) == d_pos && newblock == goal) {
+        prev->e_len += count;
+        if (next && EXT_END(prev) == next->e_lblk &&
+            prev->e_pblk + prev->e_len == next->e_pblk) {
+            prev->e_len += next->e_len;
+            vvsfs_ext_remove(vi, sb, &bh, i);
+        }
+        goto done;
+    }
+    if (next && d_pos + count == next->e_lblk &&
+        newblock + count == next->e_pblk) {
+        next->e_lblk = d_pos;
+        next->e_pblk = newblock;
+        next->e_len += count;
+        goto done;
+    }
+    new.e_lblk = d_pos;
+    new.e_pblk = newblock;
+    new.e_len = count;
+    if ((ret = vvsfs_ext_insert(vi, sb, &bh, i, &new))) {
+        vvsfs_free_data_run(&sbi->dmap, newblock, count);
+        goto out;
+    }
+done:
+    // The overflow block is only held if it was modified
+    if (bh) {
+        vvsfs_mark_buffer_dirty(bh, &vi->vfs_inode);
+    }
+    vvsfs_assigned_blocks(vi, d_pos, count);
+    *first = newblock;
+    ret = count;
+out:
+    brelse(bh);
+    return ret;
+}
+
+/* Free the data blocks of an extent mapped inode in a range
+ * of logical blocks, trimming the extents that overlap it
+ * and splitting one that covers it in the middle
+ *
+ * @vi: Inode information of the target inode
+ * @sb: Superblock of the filesystem
+ * @first: First logical block to free
+ * @end: Logical block to stop before
+ *
+ * @return: (int) 0 if successful, error otherwise
+ */
+int vvsfs_ext_punch_blocks(struct vvsfs_inode_info *vi,
+                           struct super_block *sb,
+                           uint32_t first,
+                           uint32_t end) {
+    struct vvsfs_sb_info *sbi = sb->s_fs_info;
+    struct vvsfs_extent_root *root = &vi->i_ext;
+    struct vvsfs_extent *ext;
+    struct vvsfs_extent tail;
+    struct buffer_head *bh;
+    uint32_t start;
+    uint32_t stop;
+    uint32_t i;
+    int ret;
+
+    DEBUG_LOG("vvsfs - ext_punch_blocks - %u to %u\n", first, end);
+    if ((ret = vvsfs_ext_get_overflow(vi, sb, &bh))) {
+        return ret;
+    }
+    i = vvsfs_ext_lookup(root, bh, first);
+    while (i < root->er_count) {
+        ext = vvsfs_ext_at(root, bh, i);
+        if (ext->e_lblk >= end) {
+            break;
+        }
+        start = max(ext->e_lblk, first);
+        stop = min(EXT_END(ext), end);
+        if (start > ext->e_lblk && stop < EXT_END(ext)) {
+            // Split, keeping the blocks on both sides
+            tail.e_lblk = stop;
+            tail.e_pblk = ext->e_pblk + (stop - ext->e_lblk);
+            tail.e_len = EXT_END(ext) - stop;
+            if ((ret = vvsfs_ext_insert(vi, sb, &bh, i + 1, &tail))) {
+                break;
+            }
+            ext = vvsfs_ext_at(root, bh, i);
+        }
+        vvsfs_free_data_run(
+            &sbi->dmap, ext->e_pblk + (start - ext->e_lblk), stop - start);
+        vi->i_holes += stop - start;
+        if (start == ext->e_lblk && stop == EXT_END(ext)) {
+            vvsfs_ext_remove(vi, sb, &bh, i);
+            continue;
+        }
+        if (start == ext->e_lblk) {
+            ext->e_pblk += stop - start;
+            ext->e_lblk = stop;
+        }
+        ext->e_len -= stop - start;
+        i++;
+    }
+    if (bh) {
+        vvsfs_mark_buffer_dirty(bh, &vi->vfs_inode);
+        brelse(bh);
+    }
+    return ret;
+}
+
+/* Free all data blocks of an extent mapped inode, along with
+ * its overflow extent block
+ *
+ * @vi: Inode information of the target inode
+ * @sb: Superblock of the filesystem
+ *
+ * @return: (int) 0 if successful, error otherwise
+ */
+int vvsfs_ext_free_blocks(struct vvsfs_inode_info *vi,
+                          struct super_block *sb) {
+    struct vvsfs_sb_info *sbi = sb->s_fs_info;
+    struct vvsfs_extent_root *root = &vi->i_ext;
+    struct vvsfs_extent *ext;
+    struct buffer_head *bh;
+    uint32_t i;
+
+    DEBUG_LOG("vvsfs - ext_free_blocks - %u extents\n", root->er_count);
+    if (root->er_count > VVSFS_N_INLINE_EXTENTS) {
+        bh = READ_BLOCK_OFF(sb, root->er_block);
+        if (!bh) {
+            DEBUG_LOG("vvsfs - ext_free_blocks - failed to read extent "
+                      "block\n");
+            return -EIO;
+        }
+        ext = EXT_BLOCK(bh);
+        for (i = 0; i < root->er_count - VVSFS_N_INLINE_EXTENTS; i++) {
+            vvsfs_free_data_run(&sbi->dmap, ext[i].e_pblk, ext[i].e_len);
+        }
+        brelse(bh);
+        vvsfs_journal_forget(sb, root->er_block, 1);
+        vvsfs_free_data_block(&sbi->dmap, root->er_block);
+    }
+    for (i = 0; i < min(root->er_count, (uint32_t)VVSFS_N_INLINE_EXTENTS);
+         i++) {
+        ext = &root->er_extents[i];
+        vvsfs_free_data_run(&sbi->dmap, ext->e_pblk, ext->e_len);
+    }
+    memset(root, 0, sizeof(*root));
+    vi->i_db_count = 0;
+    return 0;
+}
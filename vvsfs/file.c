@@ -2,8 +2,10 @@
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/errno.h>
+#include <linux/falloc.h>
 #include <linux/fs.h>
 #include <linux/init.h>
+#include <linux/iomap.h>
 #include <linux/kernel.h>
 #include <linux/mm.h>
 #include <linux/module.h>
@@ -16,14 +18,365 @@
 
 #include "vvsfs.h"
 
-// File operations; leave as is. We are using the generic VFS implementations
-// to take care of read/write/seek/fsync. The read/write operations rely on the
-// address space operations, so there's no need to modify these.
+// Issue a direct I/O through iomap
+static ssize_t vvsfs_dio_rw(struct kiocb *iocb,
+                            struct iov_iter *iter,
+                            const struct iomap_dio_ops *dops,
+                            unsigned int dio_flags) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 16, 0)
+    return iomap_dio_rw(iocb, iter, &vvsfs_iomap_ops, dops, dio_flags);
+#else
+    return iomap_dio_rw(
+        iocb, iter, &vvsfs_iomap_ops, dops, dio_flags, NULL, 0);
+#endif
+}
+
+// Direct writes that extend the file update i_size once the data is on disk,
+// and unwritten blocks they wrote read back their data from then on. Those
+// that extend the file are waited for (see vvsfs_file_write_iter), so this
+// runs under the inode lock of the writer rather than from the completion
+// of an asynchronous write.
+static int vvsfs_dio_write_end_io(struct kiocb *iocb,
+                                  ssize_t size,
+                                  int error,
+                                  unsigned flags) {
+    struct inode *inode = file_inode(iocb->ki_filp);
+    if (flags & IOMAP_DIO_UNWRITTEN)
+        vvsfs_iomap_written(inode, iocb->ki_pos, size, error);
+    if (error)
+        return error;
+    if (size && iocb->ki_pos + size > i_size_read(inode)) {
+        i_size_write(inode, iocb->ki_pos + size);
+        mark_inode_dirty(inode);
+    }
+    return 0;
+}
+
+static const struct iomap_dio_ops vvsfs_dio_write_ops = {
+    .end_io = vvsfs_dio_write_end_io,
+};
+
+// File operation read_iter. Buffered reads go through the page cache and
+// the iomap address space operations, O_DIRECT reads go to iomap directly.
+static ssize_t vvsfs_file_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    struct inode *inode = file_inode(iocb->ki_filp);
+    ssize_t ret;
+
+    if (!(iocb->ki_flags & IOCB_DIRECT))
+        return generic_file_read_iter(iocb, to);
+    if (!iov_iter_count(to))
+        return 0;
+
+    inode_lock_shared(inode);
+    ret = vvsfs_dio_rw(iocb, to, NULL, 0);
+    inode_unlock_shared(inode);
+    file_accessed(iocb->ki_filp);
+    return ret;
+}
+
+// File operation write_iter. Copies the data in with iomap, which asks
+// vvsfs_iomap_begin for the whole remaining write at a time rather than
+// calling into the filesystem once per page and block.
+static ssize_t vvsfs_file_write_iter(struct kiocb *iocb,
+                                     struct iov_iter *from) {
+    struct inode *inode = file_inode(iocb->ki_filp);
+    unsigned int dio_flags = 0;
+    ssize_t ret;
+
+    inode_lock(inode);
+    ret = generic_write_checks(iocb, from);
+    if (ret <= 0)
+        goto out;
+    ret = file_remove_privs(iocb->ki_filp);
+    if (ret)
+        goto out;
+    ret = file_update_time(iocb->ki_filp);
+    if (ret)
+        goto out;
+    // Data held in the inode moves to a data block before the
+    // file grows past the tail of the inode
+    if (iocb->ki_pos + iov_iter_count(from) > VVSFS_INLINE_SIZE) {
+        ret = vvsfs_iomap_uninline(inode);
+        if (ret)
+            goto out;
+    }
+
+    if (iocb->ki_flags & IOCB_DIRECT) {
+        // Writes past the end of the file complete before the inode is
+        // unlocked, as the size is updated when they do
+        if (iocb->ki_pos + iov_iter_count(from) > i_size_read(inode))
+            dio_flags = IOMAP_DIO_FORCE_WAIT;
+        ret = vvsfs_dio_rw(iocb, from, &vvsfs_dio_write_ops, dio_flags);
+        // -ENOTBLK means the page cache could not be invalidated before
+        // anything was written, the write is retried through it instead
+        if (ret != -ENOTBLK)
+            goto out;
+    }
+    ret = iomap_file_buffered_write(iocb, from, &vvsfs_iomap_ops);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 4, 0)
+    if (ret > 0)
+        iocb->ki_pos += ret;
+#endif
+out:
+    inode_unlock(inode);
+    if (ret > 0)
+        ret = generic_write_sync(iocb, ret);
+    return ret;
+}
+
+// Flush the device write cache, sharing flushes between concurrent callers
+// (typically fsync). A flush started after a caller's writes completed
+// covers them, so a caller that finds one was started while it waited for
+// the lock does not issue its own.
+int vvsfs_flush_device(struct super_block *sb) {
+    struct vvsfs_sb_info *sbi = sb->s_fs_info;
+    uint64_t seq;
+    int err;
+
+    // Order the completion of the caller's writes before the sample
+    smp_mb();
+    seq = READ_ONCE(sbi->flush_seq);
+    mutex_lock(&sbi->flush_lock);
+    if (sbi->flush_seq == seq) {
+        WRITE_ONCE(sbi->flush_seq, seq + 1);
+        sbi->flush_err = blkdev_issue_flush(sb->s_bdev);
+    }
+    err = sbi->flush_err;
+    mutex_unlock(&sbi->flush_lock);
+    return err;
+}
+
+// fsync for files and directories. Writes the dirty pages in the range,
+// then only the metadata of this inode: without a journal its dentry,
+// indirect and extent blocks (which are associated with it when dirtied),
+// and the inode itself unless fdatasync can do without it. With a journal
+// the transaction holding the inode's metadata is committed, if it is not
+// already. The device cache is flushed last, unless the commit did so.
+int vvsfs_fsync(struct file *file, loff_t start, loff_t end, int datasync) {
+    struct inode *inode = file->f_mapping->host;
+    int err;
+    int ret;
+
+    err = file_write_and_wait_range(file, start, end);
+    if (err)
+        return err;
+
+    if (vvsfs_has_journal(inode->i_sb)) {
+        ret = vvsfs_journal_sync_inode(inode, datasync);
+        if (ret < 0)
+            return ret;
+        if (!ret)
+            err = vvsfs_flush_device(inode->i_sb);
+        goto out;
+    }
+
+    inode_lock(inode);
+    err = sync_mapping_buffers(inode->i_mapping);
+    // Timestamps alone are not needed to read the data back
+    if ((inode->i_state & I_DIRTY_ALL) &&
+        (!datasync || (inode->i_state & I_DIRTY_DATASYNC))) {
+        ret = sync_inode_metadata(inode, 1);
+        if (!err)
+            err = ret;
+    }
+    inode_unlock(inode);
+    ret = vvsfs_flush_device(inode->i_sb);
+    if (!err)
+        err = ret;
+out:
+    ret = file_check_and_advance_wb_err(file);
+    return err ? err : ret;
+}
+
+// Punch a hole in a file: the blocks wholly inside the range are freed, the
+// partial blocks at either end are zeroed. Dirty pages of the range are
+// written back first, which allocates any delayed allocation in it, and the
+// page cache is then dropped so that the freed blocks are not read through
+// it. Called with the inode locked.
+static long vvsfs_punch_hole(struct inode *inode, loff_t offset, loff_t len) {
+    loff_t end = offset + len;
+    uint32_t first = DIV_ROUND_UP(offset, inode->i_sb->s_blocksize);
+    uint32_t last = end >> inode->i_blkbits;
+    int ret;
+
+    inode_dio_wait(inode);
+    ret = filemap_write_and_wait_range(inode->i_mapping, offset, end - 1);
+    if (ret)
+        return ret;
+    filemap_invalidate_lock(inode->i_mapping);
+    truncate_pagecache_range(inode, offset, end - 1);
+    if (first < last) {
+        ret = vvsfs_iomap_punch(inode, first, last);
+        if (ret)
+            goto out;
+    }
+    // Only the partial blocks are still mapped, and zeroing stops
+    // at the end of the file so as not to extend it
+    if (offset < i_size_read(inode)) {
+        ret = iomap_zero_range(inode,
+                               offset,
+                               min(end, i_size_read(inode)) - offset,
+                               NULL,
+                               &vvsfs_iomap_ops);
+        if (ret)
+            goto out;
+    }
+    inode->i_mtime = inode->i_ctime = current_time(inode);
+    mark_inode_dirty(inode);
+out:
+    filemap_invalidate_unlock(inode->i_mapping);
+    return ret;
+}
+
+// fallocate for files. Preallocation allocates the blocks of the range that
+// are not allocated yet without writing them (see vvsfs_iomap_prealloc),
+// and grows the file to cover the range unless FALLOC_FL_KEEP_SIZE is
+// given. A file held in its inode moves to a data block first.
+// FALLOC_FL_PUNCH_HOLE frees the blocks of the range instead.
+static long vvsfs_fallocate(struct file *file,
+                            int mode,
+                            loff_t offset,
+                            loff_t len) {
+    struct inode *inode = file_inode(file);
+    loff_t end = offset + len;
+    int ret;
+
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+        return -EOPNOTSUPP;
+    if (DIV_ROUND_UP(end, inode->i_sb->s_blocksize) >
+        vvsfs_max_file_blocks(VVSFS_I(inode)))
+        return -EFBIG;
+
+    inode_lock(inode);
+    if (mode & FALLOC_FL_PUNCH_HOLE) {
+        ret = vvsfs_punch_hole(inode, offset, len);
+        goto out;
+    }
+    if (!(mode & FALLOC_FL_KEEP_SIZE)) {
+        ret = inode_newsize_ok(inode, end);
+        if (ret)
+            goto out;
+    }
+    ret = vvsfs_iomap_uninline(inode);
+    if (ret)
+        goto out;
+    ret = vvsfs_iomap_prealloc(inode,
+                               offset >> inode->i_blkbits,
+                               DIV_ROUND_UP(end, inode->i_sb->s_blocksize));
+    if (ret)
+        goto out;
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode)) {
+        i_size_write(inode, end);
+        inode->i_mtime = inode->i_ctime = current_time(inode);
+        mark_inode_dirty(inode);
+    }
+out:
+    inode_unlock(inode);
+    return ret;
+}
+
+// File operation llseek. SEEK_HOLE and SEEK_DATA are answered by iomap from
+// the block mapping and, for unwritten and delayed blocks, the page cache.
+// Everything else uses the generic VFS implementation.
+static loff_t vvsfs_file_llseek(struct file *file, loff_t offset, int whence) {
+    struct inode *inode = file->f_mapping->host;
+
+    switch (whence) {
+    case SEEK_HOLE:
+    case SEEK_DATA:
+        inode_lock_shared(inode);
+        if (whence == SEEK_HOLE)
+            offset = iomap_seek_hole(inode, offset, &vvsfs_seek_iomap_ops);
+        else
+            offset = iomap_seek_data(inode, offset, &vvsfs_seek_iomap_ops);
+        inode_unlock_shared(inode);
+        if (offset < 0)
+            return offset;
+        return vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
+    default:
+        return generic_file_llseek(file, offset, whence);
+    }
+}
+
+// File operations. Reads, writes and seeking for holes are implemented on
+// top of iomap (see address_space.c).
 const struct file_operations vvsfs_file_operations = {
-    .llseek = generic_file_llseek,
-    .fsync = generic_file_fsync,
-    .read_iter = generic_file_read_iter,
-    .write_iter = generic_file_write_iter,
+    .llseek = vvsfs_file_llseek,
+    .fsync = vvsfs_fsync,
+    .read_iter = vvsfs_file_read_iter,
+    .write_iter = vvsfs_file_write_iter,
+    .fallocate = vvsfs_fallocate,
 };
 
-const struct inode_operations vvsfs_file_inode_operations = {};
\ No newline at end of file
+// Change the size of a file. Shrinking zeroes the tail of the new last
+// block and frees every block past it (see vvsfs_iomap_truncate); growing
+// zeroes from the old end up to the end of its last block, and leaves the
+// rest as a hole. A file held in its inode moves to a data block first if
+// it grows past the tail of the inode.
+static int vvsfs_setsize(struct inode *inode, loff_t newsize) {
+    loff_t oldsize = i_size_read(inode);
+    loff_t zero_end;
+    int ret = 0;
+
+    if (DIV_ROUND_UP(newsize, inode->i_sb->s_blocksize) >
+        vvsfs_max_file_blocks(VVSFS_I(inode)))
+        return -EFBIG;
+    if (newsize > VVSFS_INLINE_SIZE) {
+        ret = vvsfs_iomap_uninline(inode);
+        if (ret)
+            return ret;
+    }
+    inode_dio_wait(inode);
+    filemap_invalidate_lock(inode->i_mapping);
+    if (newsize < oldsize) {
+        ret = iomap_truncate_page(inode, newsize, NULL, &vvsfs_iomap_ops);
+        if (ret)
+            goto out;
+        truncate_setsize(inode, newsize);
+        ret = vvsfs_iomap_truncate(inode,
+                                   DIV_ROUND_UP(newsize, inode->i_sb->s_blocksize));
+    } else {
+        // Past the old last block is a hole, zeroing it would get it
+        // allocated as a delayed allocation
+        zero_end = min_t(
+            loff_t, newsize, round_up(oldsize, inode->i_sb->s_blocksize));
+        ret = iomap_zero_range(
+            inode, oldsize, zero_end - oldsize, NULL, &vvsfs_iomap_ops);
+        if (ret)
+            goto out;
+        truncate_setsize(inode, newsize);
+    }
+    inode->i_mtime = inode->i_ctime = current_time(inode);
+out:
+    filemap_invalidate_unlock(inode->i_mapping);
+    return ret;
+}
+
+// Inode operation setattr for files, which handles size changes
+static int
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+vvsfs_setattr(struct user_namespace *namespace,
+#else
+vvsfs_setattr(struct mnt_idmap *namespace,
+#endif
+              struct dentry *dentry,
+              struct iattr *attr) {
+    struct inode *inode = d_inode(dentry);
+    int ret;
+
+    ret = setattr_prepare(namespace, dentry, attr);
+    if (ret)
+        return ret;
+    if ((attr->ia_valid & ATTR_SIZE) && attr->ia_size != i_size_read(inode)) {
+        ret = vvsfs_setsize(inode, attr->ia_size);
+        if (ret)
+            return ret;
+    }
+    setattr_copy(namespace, inode, attr);
+    mark_inode_dirty(inode);
+    return 0;
+}
+
+const struct inode_operations vvsfs_file_inode_operations = {
+    .setattr = vvsfs_setattr,
+};
\ No newline at end of file
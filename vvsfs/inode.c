@@ -13,21 +13,17 @@
 #include <linux/statfs.h>
 #include <linux/types.h>
 #include <linux/version.h>
+#include <linux/workqueue.h>
 
 #include "logging.h"
 #include "vvsfs.h"
 
 struct inode *vvsfs_iget(struct super_block *sb, unsigned long ino);
 
-// This implements the super operation for writing a
-// 'dirty' inode to disk Note that this does not sync
-// the actual data blocks pointed to by the inode; it
-// only saves the meta data (e.g., the data block
-// pointers, but not the actual data contained in the
-// data blocks). Data blocks sync is taken care of by
-// file and directory operations.
-static int vvsfs_write_inode(struct inode *inode,
-                             struct writeback_control *wbc) {
+// Copy an inode into its inode table block, which is
+// returned held so that the caller can write it out or
+// add it to the journal.
+struct buffer_head *vvsfs_inode_to_block(struct inode *inode) {
     struct super_block *sb;
     struct vvsfs_inode *disk_inode;
     struct vvsfs_inode_info *inode_info;
@@ -35,15 +31,13 @@ static int vvsfs_write_inode(struct inode *inode,
     uint32_t inode_block, inode_offset;
     int i;
 
-    // LOG("vvsfs - write_inode");
-
     // get the vvsfs_inode_info associated with this
     // (VFS) inode from cache.
     inode_info = VVSFS_I(inode);
 
     sb = inode->i_sb;
-    inode_block = vvsfs_get_inode_block(inode->i_ino);
-    inode_offset = vvsfs_get_inode_offset(inode->i_ino);
+    inode_block = vvsfs_get_inode_block(sb, inode->i_ino);
+    inode_offset = vvsfs_get_inode_offset(sb, inode->i_ino);
 
     /*LOG("vvsfs - write_inode - ino: %ld, block: "*/
     /*"%d, offset: %d",*/
@@ -52,7 +46,11 @@ static int vvsfs_write_inode(struct inode *inode,
     /*inode_offset);*/
     bh = sb_bread(sb, inode_block);
     if (!bh)
-        return -EIO;
+        return NULL;
+    if (vvsfs_journal_access(sb, bh)) {
+        brelse(bh);
+        return NULL;
+    }
 
     disk_inode = (struct vvsfs_inode *)((uint8_t *)bh->b_data + inode_offset);
     disk_inode->i_mode = inode->i_mode;
@@ -67,17 +65,74 @@ static int vvsfs_write_inode(struct inode *inode,
     disk_inode->i_rdev = inode->i_rdev;
     for (i = 0; i < VVSFS_N_BLOCKS; ++i)
         disk_inode->i_block[i] = inode_info->i_data[i];
+    disk_inode->i_dx_block = inode_info->i_dx_block;
+    disk_inode->i_dx_order = inode_info->i_dx_order;
+    disk_inode->i_flags = inode_info->i_flags;
+    disk_inode->i_unwritten = inode_info->i_unwritten;
+    disk_inode->i_holes = inode_info->i_holes;
+    // Inline data goes in the tail of the inode
+    if (inode_info->i_flags & VVSFS_INODE_INLINE_DATA)
+        memcpy(disk_inode + 1, inode_info->i_inline, VVSFS_INLINE_SIZE);
 
     // TODO: if you have additional data added to the
     // on-disk inode structure, you need to sync it
     // here.
 
+    return bh;
+}
+
+// This implements the super operation for writing a
+// 'dirty' inode to disk Note that this does not sync
+// the actual data blocks pointed to by the inode; it
+// only saves the meta data (e.g., the data block
+// pointers, but not the actual data contained in the
+// data blocks). Data blocks sync is taken care of by
+// file and directory operations.
+static int vvsfs_write_inode(struct inode *inode,
+                             struct writeback_control *wbc) {
+    struct vvsfs_sb_info *sbi = inode->i_sb->s_fs_info;
+    struct buffer_head *bh;
+    int err = 0;
+
+    // LOG("vvsfs - write_inode");
+
+    if (sbi->jbd2) {
+        // The inode was journalled when it was dirtied, so
+        // data integrity writeback only waits for the commit.
+        // Reclaim must not wait for the journal.
+        if (wbc->sync_mode != WB_SYNC_ALL || (current->flags & PF_MEMALLOC))
+            return 0;
+        return vvsfs_journal_commit(inode->i_sb);
+    }
+
+    if (sbi->journal) {
+        // Only queued, as dirty_inode does: copying the inode
+        // into its block here could race with the commit
+        // copying that block into the log. The next commit
+        // copies it under the barrier, and data integrity
+        // writeback waits for it.
+        vvsfs_journal_dirty_inode(inode, I_DIRTY_SYNC);
+        if (wbc->sync_mode == WB_SYNC_ALL)
+            err = vvsfs_journal_commit(inode->i_sb);
+        return err;
+    }
+
+    bh = vvsfs_inode_to_block(inode);
+    if (!bh)
+        return -EIO;
+
+    // Only wait for the inode to reach the disk when writeback is for data
+    // integrity (fsync, sync), otherwise it is left to the block device
     mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
+    if (wbc->sync_mode == WB_SYNC_ALL) {
+        sync_dirty_buffer(bh);
+        if (buffer_req(bh) && !buffer_uptodate(bh))
+            err = -EIO;
+    }
     brelse(bh);
 
     // LOG("vvsfs - write_inode done: %ld\n", inode->i_ino);
-    return 0;
+    return err;
 }
 
 // This implements the super operation to allocate a
@@ -92,6 +147,7 @@ static int vvsfs_write_inode(struct inode *inode,
 // information you want to attach to the
 // vvsfs_inode_info structure.
 static struct inode *vvsfs_alloc_inode(struct super_block *sb) {
+    struct vvsfs_sb_info *sbi = sb->s_fs_info;
     struct vvsfs_inode_info *c_inode =
         kmem_cache_alloc(vvsfs_inode_cache, GFP_KERNEL);
 
@@ -100,15 +156,39 @@ static struct inode *vvsfs_alloc_inode(struct super_block *sb) {
     if (!c_inode)
         return NULL;
 
+    c_inode->i_indirect = NULL;
+    c_inode->i_dir_count = VVSFS_DIR_COUNT_UNKNOWN;
+    c_inode->i_dir_hint = 0;
+    c_inode->i_da_blocks = 0;
+    c_inode->i_prealloc_first = 0;
+    c_inode->i_prealloc_end = 0;
+    mutex_init(&c_inode->i_da_lock);
+    init_rwsem(&c_inode->i_map_sem);
+    INIT_LIST_HEAD(&c_inode->i_written);
+    spin_lock_init(&c_inode->i_ioend_lock);
+    INIT_LIST_HEAD(&c_inode->i_ioends);
+    INIT_WORK(&c_inode->i_ioend_work, vvsfs_ioend_work);
+    INIT_LIST_HEAD(&c_inode->i_journal);
+    c_inode->i_jflags = 0;
+    if (sbi->jbd2)
+        vvsfs_jbd2_init_inode(sb, c_inode);
     inode_init_once(&c_inode->vfs_inode);
     return &c_inode->vfs_inode;
 }
 
-// Deallocate the inode cache.
+// Release what the inode cache holds on to.
 static void vvsfs_destroy_inode(struct inode *inode) {
     struct vvsfs_inode_info *c_inode =
         container_of(inode, struct vvsfs_inode_info, vfs_inode);
-    kmem_cache_free(vvsfs_inode_cache, c_inode);
+    vvsfs_drop_indirect(c_inode);
+    vvsfs_drop_written(c_inode);
+}
+
+// Deallocate the inode cache. The VFS calls this after an RCU grace
+// period, since a path walk in RCU mode may still be following the
+// target of a fast symlink (inode->i_link) in the freed inode.
+static void vvsfs_free_inode(struct inode *inode) {
+    kmem_cache_free(vvsfs_inode_cache, VVSFS_I(inode));
 }
 
 // put_super is part of the super operations. This
@@ -121,28 +201,20 @@ static void vvsfs_put_super(struct super_block *sb) {
     LOG("vvsfs - put_super\n");
 
     if (sbi) {
-        kfree(sbi->imap);
-        kfree(sbi->dmap);
+        // Recording writeback may still dirty inodes
+        if (sbi->ioend_wq)
+            destroy_workqueue(sbi->ioend_wq);
+        // The final commit still writes the bitmaps
+        if (sbi->journal)
+            vvsfs_journal_destroy(sb);
+        if (sbi->jbd2)
+            vvsfs_jbd2_destroy(sb);
+        vvsfs_bitmap_destroy(&sbi->imap);
+        vvsfs_bitmap_destroy(&sbi->dmap);
         kfree(sbi);
     }
 }
 
-static uint32_t count_free(uint8_t *map, uint32_t size) {
-    int i;
-    uint8_t j;
-    uint32_t count = 0;
-    for (i = 0; i < size; i++) {
-        for (j = 0; j < 8; j++) {
-            if (i == 0 && j == 0) {
-                continue; // Block 0 is reserved
-            } else if ((~map[i]) & (VVSFS_SET_MAP_BIT >> j)) {
-                count++;
-            }
-        }
-    }
-    return count;
-}
-
 // statfs -- this is currently incomplete.
 // See
 // https://elixir.bootlin.com/linux/v5.15.89/source/fs/ext2/super.c#L1407
@@ -159,27 +231,164 @@ static int vvsfs_statfs(struct dentry *dentry, struct kstatfs *buf) {
     // Convert the raw device id to __kernel_fsid_t
     buf->f_fsid = u64_to_fsid(id);
     buf->f_blocks = i_sb->nblocks;
-    buf->f_bfree = count_free(i_sb->dmap, VVSFS_DMAP_SIZE);
+    // Blocks held for delayed allocation are as good as used
+    buf->f_bfree = vvsfs_bitmap_avail_bits(&i_sb->dmap);
     // We don't have any privilege scoped block access
     // behaviour so bavail is the same as bfree
     buf->f_bavail = buf->f_bfree;
     buf->f_files = i_sb->ninodes;
-    buf->f_ffree = count_free(i_sb->imap, VVSFS_IMAP_SIZE);
-    buf->f_namelen = VVSFS_MAXNAME;
+    buf->f_ffree = vvsfs_bitmap_avail_bits(&i_sb->imap);
+    buf->f_namelen = vvsfs_max_name(sb);
     buf->f_type = VVSFS_MAGIC;
-    buf->f_bsize = VVSFS_BLOCKSIZE;
+    buf->f_bsize = sb->s_blocksize;
     LOG("vvsfs - statfs - done\n");
     return 0;
 }
 
+// Work out where everything is on disk from the geometry
+// recorded in the super block, checking that it is
+// consistent. Images formatted before the geometry was
+// recorded have the default geometry, and images without
+// block groups are a single group.
+static int vvsfs_load_geometry(struct super_block *s,
+                               struct vvsfs_sb_info *sbi,
+                               const struct vvsfs_super_block *vsb) {
+    uint32_t block_size = vsb->s_block_size;
+    uint32_t imap_blocks = vsb->s_imap_blocks;
+    uint32_t dmap_blocks = vsb->s_dmap_blocks;
+    uint32_t inode_blocks = vsb->s_inode_blocks;
+    uint32_t meta;
+    uint64_t bits;
+    uint64_t last;
+    uint64_t device_blocks;
+
+    sbi->nblocks = vsb->s_blocks_count;
+    sbi->ninodes = vsb->s_inodes_count;
+    sbi->data_blocks = vsb->s_data_blocks;
+    if (!block_size) {
+        block_size = VVSFS_BLOCKSIZE;
+        imap_blocks = 1;
+        dmap_blocks = VVSFS_DMAP_SIZE / VVSFS_BLOCKSIZE;
+        inode_blocks = VVSFS_DATA_BLOCK_OFF - VVSFS_INODE_BLOCK_OFF;
+        sbi->nblocks = VVSFS_MAXBLOCKS;
+        sbi->ninodes = VVSFS_MAX_INODE_ENTRIES;
+        sbi->data_blocks = VVSFS_DMAP_SIZE * 8;
+    }
+    if (block_size < VVSFS_MIN_BLOCKSIZE || block_size > VVSFS_MAX_BLOCKSIZE ||
+        !is_power_of_2(block_size)) {
+        LOG("vvsfs - unsupported block size %u\n", block_size);
+        return -EINVAL;
+    }
+    if (!sb_set_blocksize(s, block_size)) {
+        LOG("vvsfs - device blocks are too large for %u byte blocks\n",
+            block_size);
+        return -EINVAL;
+    }
+
+    meta = imap_blocks + dmap_blocks + inode_blocks;
+    sbi->inodes_per_block = block_size / VVSFS_INODESIZE;
+    sbi->imap_block = 1;
+    sbi->dmap_block = sbi->imap_block + imap_blocks;
+    sbi->inode_block = sbi->dmap_block + dmap_blocks;
+    sbi->data_block = sbi->inode_block + inode_blocks;
+    if (vsb->s_block_size && vsb->s_groups) {
+        sbi->groups = vsb->s_groups;
+        sbi->group_blocks = vsb->s_group_blocks;
+        sbi->group_inodes = vsb->s_group_inodes;
+        sbi->group_data = min(sbi->group_blocks - meta, sbi->data_blocks);
+    } else {
+        sbi->groups = 1;
+        sbi->group_blocks = sbi->nblocks - 1;
+        sbi->group_inodes = sbi->ninodes;
+        sbi->group_data = sbi->data_blocks;
+    }
+
+    // Each map and the inode table must cover their group,
+    // the groups must make up the file system, and a run of
+    // data block numbers must not carry on into the next
+    // group
+    bits = (uint64_t)block_size * 8;
+    sbi->ino_stride = bits * imap_blocks;
+    sbi->dno_stride = bits * dmap_blocks;
+    last = (uint64_t)sbi->nblocks - 1 -
+           (uint64_t)(sbi->groups - 1) * sbi->group_blocks;
+    if (!sbi->group_inodes || !sbi->group_data ||
+        meta >= sbi->group_blocks || last <= meta ||
+        last > sbi->group_blocks ||
+        sbi->group_inodes > bits * imap_blocks ||
+        sbi->group_inodes > (uint64_t)sbi->inodes_per_block * inode_blocks ||
+        sbi->group_data > bits * dmap_blocks ||
+        (sbi->groups > 1 && sbi->group_data == bits * dmap_blocks) ||
+        sbi->ninodes != (uint64_t)sbi->groups * sbi->group_inodes ||
+        sbi->data_blocks >
+            (uint64_t)(sbi->groups - 1) * sbi->group_data + last - meta ||
+        (sbi->groups > 1 &&
+         sbi->data_blocks !=
+             (uint64_t)(sbi->groups - 1) * sbi->group_data + last - meta) ||
+        (uint64_t)sbi->groups * sbi->ino_stride > U32_MAX ||
+        (uint64_t)sbi->groups * sbi->dno_stride > U32_MAX) {
+        LOG("vvsfs - inconsistent geometry\n");
+        return -EINVAL;
+    }
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 16, 0)
+    device_blocks = i_size_read(s->s_bdev->bd_inode) >> s->s_blocksize_bits;
+#else
+    device_blocks = bdev_nr_bytes(s->s_bdev) >> s->s_blocksize_bits;
+#endif
+    if (sbi->nblocks > device_blocks) {
+        LOG("vvsfs - file system larger than the device\n");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+// Disk block of a block of the inode or data map, whose
+// blocks in group 0 start at start
+static uint32_t vvsfs_map_block(struct vvsfs_sb_info *sbi,
+                                struct vvsfs_bitmap *bm,
+                                uint32_t start,
+                                uint32_t block) {
+    uint32_t per_group = bm->group_bits / bm->block_bits;
+    return start + block / per_group * sbi->group_blocks + block % per_group;
+}
+
+// Load the inode or data map from its blocks. Of each group
+// but the last, only the first used bits stand for inodes or
+// data blocks; the rest are marked used.
+static int vvsfs_load_bitmap(struct super_block *s,
+                             struct vvsfs_bitmap *bm,
+                             uint32_t start,
+                             uint32_t stride,
+                             uint32_t used,
+                             uint32_t last) {
+    struct vvsfs_sb_info *sbi = s->s_fs_info;
+    struct buffer_head *bh;
+    uint32_t i;
+
+    if (vvsfs_bitmap_init(
+            bm, (sbi->groups - 1) * stride + last, stride, s->s_blocksize))
+        return -ENOMEM;
+    for (i = 0; i < bm->blocks; i++) {
+        bh = sb_bread(s, vvsfs_map_block(sbi, bm, start, i));
+        if (!bh)
+            return -EIO;
+        vvsfs_bitmap_load(bm, bh->b_data, i);
+        brelse(bh);
+    }
+    for (i = 0; i + 1 < sbi->groups; i++)
+        vvsfs_bitmap_set_unused(bm, i * stride + used, stride - used);
+    return 0;
+}
+
 // Fill the super_block structure with information
 // specific to vvsfs
 int vvsfs_fill_super(struct super_block *s, void *data, int silent) {
     struct inode *root_inode;
-    int hblock;
     struct buffer_head *bh;
-    uint32_t magic;
+    struct vvsfs_super_block vsb;
+    uint32_t features;
     struct vvsfs_sb_info *sbi;
+    int err;
 
     LOG("vvsfs - fill super\n");
 
@@ -187,25 +396,38 @@ int vvsfs_fill_super(struct super_block *s, void *data, int silent) {
     s->s_op = &vvsfs_ops;
     s->s_magic = VVSFS_MAGIC;
 
-    hblock = bdev_logical_block_size(s->s_bdev);
-    if (hblock > VVSFS_BLOCKSIZE) {
-        LOG("vvsfs - device blocks are too small!!");
-        return -1;
+    // The super block is at the start of block 0 whatever
+    // the block size, which is only known once it is read
+    if (!sb_min_blocksize(s, VVSFS_MIN_BLOCKSIZE)) {
+        LOG("vvsfs - device blocks are too large!!");
+        return -EINVAL;
     }
 
-    sb_set_blocksize(s, VVSFS_BLOCKSIZE);
-
-    /* Read first block of the superblock.
-        For this basic version, it contains just the
-       magic number. */
+    /* Read first block of the superblock. Only the
+       magic number and the geometry are checked here,
+       the free counts are recomputed from the bitmaps
+       below. */
 
     bh = sb_bread(s, 0);
-    magic = *((uint32_t *)bh->b_data);
-    if (magic != VVSFS_MAGIC) {
+    if (!bh)
+        return -EIO;
+    memcpy(&vsb, bh->b_data, sizeof(vsb));
+    brelse(bh);
+    if (vsb.s_magic != VVSFS_MAGIC) {
         LOG("vvsfs - wrong magic number\n");
         return -EINVAL;
     }
-    brelse(bh);
+    features = vsb.s_features;
+    /* Refuse to mount formats we do not know how to map */
+    if (features & ~VVSFS_FEATURE_SUPPORTED) {
+        LOG("vvsfs - unsupported features 0x%x\n",
+            features & ~VVSFS_FEATURE_SUPPORTED);
+        return -EINVAL;
+    }
+    if ((features & VVSFS_FEATURE_JOURNAL) && (features & VVSFS_FEATURE_JBD2)) {
+        LOG("vvsfs - both journal features set\n");
+        return -EINVAL;
+    }
 
     /* Allocate super block info to load inode & data
      * map */
@@ -214,41 +436,57 @@ int vvsfs_fill_super(struct super_block *s, void *data, int silent) {
         LOG("vvsfs - error allocating vvsfs_sb_info");
         return -ENOMEM;
     }
+    sbi->features = features;
+    mutex_init(&sbi->flush_lock);
+    s->s_fs_info = sbi;
 
-    /* Set max supported blocks */
-    sbi->nblocks = VVSFS_MAXBLOCKS;
-    /* Set max supported inodes */
-    sbi->ninodes = VVSFS_MAX_INODE_ENTRIES;
+    err = vvsfs_load_geometry(s, sbi, &vsb);
+    if (err)
+        goto free_sbi;
 
-    /* Load the inode map */
-    sbi->imap = kzalloc(VVSFS_IMAP_SIZE, GFP_KERNEL);
-    if (!sbi->imap)
-        return -ENOMEM;
-    bh = sb_bread(s, 1);
-    if (!bh)
-        return -EIO;
-    memcpy(sbi->imap, bh->b_data, VVSFS_IMAP_SIZE);
-    brelse(bh);
-
-    /* Load the data map. Note that the data map
-     * occupies 2 blocks.  */
-    sbi->dmap = kzalloc(VVSFS_DMAP_SIZE, GFP_KERNEL);
-    if (!sbi->dmap)
-        return -ENOMEM;
-    bh = sb_bread(s, 2);
-    if (!bh)
-        return -EIO;
-    memcpy(sbi->dmap, bh->b_data, VVSFS_BLOCKSIZE);
-    brelse(bh);
-    bh = sb_bread(s, 3);
-    if (!bh)
-        return -EIO;
-    memcpy(sbi->dmap + VVSFS_BLOCKSIZE, bh->b_data, VVSFS_BLOCKSIZE);
-    brelse(bh);
+    /* Replay the journal before any metadata is read */
+    if (features & VVSFS_FEATURE_JOURNAL) {
+        err = vvsfs_journal_load(s, vsb.s_journal_block, vsb.s_journal_blocks);
+        if (err)
+            goto free_sbi;
+    }
+    if (features & VVSFS_FEATURE_JBD2) {
+        err = vvsfs_jbd2_load(s, VVSFS_JBD2_INUM);
+        if (err)
+            goto free_sbi;
+    }
 
-    /* Attach the bitmaps to the in-memory super_block
-     * s */
-    s->s_fs_info = sbi;
+    /* Load the inode map and the data map */
+    err = vvsfs_load_bitmap(s,
+                            &sbi->imap,
+                            sbi->imap_block,
+                            sbi->ino_stride,
+                            sbi->group_inodes,
+                            sbi->group_inodes);
+    if (err)
+        goto destroy_journal;
+    err = vvsfs_load_bitmap(s,
+                            &sbi->dmap,
+                            sbi->dmap_block,
+                            sbi->dno_stride,
+                            sbi->group_data,
+                            sbi->data_blocks -
+                                (sbi->groups - 1) * sbi->group_data);
+    if (err)
+        goto destroy_journal;
+
+    /* Compute the free counts once, statfs then reads
+     * the incrementally maintained counters */
+    vvsfs_bitmap_count_free(&sbi->imap);
+    vvsfs_bitmap_count_free(&sbi->dmap);
+
+    /* Writeback of unwritten blocks completes here */
+    sbi->ioend_wq =
+        alloc_workqueue("vvsfs-ioend/%s", WQ_MEM_RECLAIM, 0, s->s_id);
+    if (!sbi->ioend_wq) {
+        err = -ENOMEM;
+        goto destroy_journal;
+    }
 
     /* Read the root inode from disk */
     root_inode = vvsfs_iget(s, 1);
@@ -256,7 +494,8 @@ int vvsfs_fill_super(struct super_block *s, void *data, int silent) {
     if (IS_ERR(root_inode)) {
         LOG("vvsfs - fill_super - error getting "
             "root inode");
-        return PTR_ERR(root_inode);
+        err = PTR_ERR(root_inode);
+        goto destroy_wq;
     }
 
     /* Initialise the owner */
@@ -267,61 +506,160 @@ int vvsfs_fill_super(struct super_block *s, void *data, int silent) {
 #endif
     mark_inode_dirty(root_inode);
 
+    // d_make_root puts the inode if it fails
     s->s_root = d_make_root(root_inode);
 
     if (!s->s_root) {
         LOG("vvsfs - fill_super - failed setting "
             "up root directory");
-        iput(root_inode);
-        return -ENOMEM;
+        err = -ENOMEM;
+        goto destroy_wq;
     }
 
     LOG("vvsfs - fill super done\n");
 
     return 0;
+
+    /* put_super is only called once there is a root, so
+     * a failed mount releases what it set up itself, in
+     * the same order */
+destroy_wq:
+    destroy_workqueue(sbi->ioend_wq);
+destroy_journal:
+    if (sbi->journal)
+        vvsfs_journal_destroy(s);
+    if (sbi->jbd2)
+        vvsfs_jbd2_destroy(s);
+    vvsfs_bitmap_destroy(&sbi->imap);
+    vvsfs_bitmap_destroy(&sbi->dmap);
+free_sbi:
+    s->s_fs_info = NULL;
+    kfree(sbi);
+    return err;
 }
 
-// sync_fs super operation.
-// This writes super block data to disk.
-// For the current version, this is mainly the inode
-// map and the data map.
-static int vvsfs_sync_fs(struct super_block *sb, int wait) {
-    struct vvsfs_sb_info *sbi = sb->s_fs_info;
+// Store the map blocks of a bitmap that changed since
+// they were last stored, see vvsfs_store_fs_info
+static int vvsfs_store_bitmap(struct super_block *sb,
+                              struct vvsfs_bitmap *bm,
+                              uint32_t start,
+                              void (*add)(struct super_block *sb,
+                                          struct buffer_head *bh)) {
     struct buffer_head *bh;
+    uint32_t i;
+
+    for (i = 0; i < bm->blocks; i++) {
+        if (!vvsfs_bitmap_take_dirty(bm, i))
+            continue;
+        bh = sb_bread(sb, vvsfs_map_block(sb->s_fs_info, bm, start, i));
+        if (!bh || vvsfs_journal_access(sb, bh)) {
+            brelse(bh);
+            vvsfs_bitmap_redirty(bm, i);
+            return -EIO;
+        }
+        vvsfs_bitmap_store(bm, bh->b_data, i);
+        add(sb, bh);
+        brelse(bh);
+    }
+    return 0;
+}
 
-    LOG("vvsfs -- sync_fs");
+// Store the free counts, and the blocks of the inode map
+// and the data map that changed since they were last
+// stored, into their blocks. Each block is passed to add,
+// which writes it out or adds it to the journal, and is
+// released afterwards.
+int vvsfs_store_fs_info(struct super_block *sb,
+                        void (*add)(struct super_block *sb,
+                                    struct buffer_head *bh)) {
+    struct vvsfs_sb_info *sbi = sb->s_fs_info;
+    struct vvsfs_super_block *vsb;
+    struct buffer_head *bh;
+    int err;
 
-    /* Write the inode map to disk */
-    bh = sb_bread(sb, 1);
-    if (!bh)
+    /* The free counts in the super block */
+    bh = sb_bread(sb, 0);
+    if (!bh || vvsfs_journal_access(sb, bh)) {
+        brelse(bh);
         return -EIO;
-    memcpy(bh->b_data, sbi->imap, VVSFS_IMAP_SIZE);
-    mark_buffer_dirty(bh);
-    if (wait)
-        sync_dirty_buffer(bh);
+    }
+    vsb = (struct vvsfs_super_block *)bh->b_data;
+    vsb->s_free_blocks = vvsfs_bitmap_free_bits(&sbi->dmap);
+    vsb->s_free_inodes = vvsfs_bitmap_free_bits(&sbi->imap);
+    add(sb, bh);
     brelse(bh);
 
-    /* Write the data map */
+    /* The inode map and the data map */
+    err = vvsfs_store_bitmap(sb, &sbi->imap, sbi->imap_block, add);
+    if (err)
+        return err;
+    return vvsfs_store_bitmap(sb, &sbi->dmap, sbi->dmap_block, add);
+}
 
-    bh = sb_bread(sb, 2);
-    if (!bh)
-        return -EIO;
-    memcpy(bh->b_data, sbi->dmap, VVSFS_BLOCKSIZE);
+// Write out a block of the free counts and bitmaps
+static void vvsfs_write_fs_info(struct super_block *sb, struct buffer_head *bh) {
     mark_buffer_dirty(bh);
-    if (wait)
-        sync_dirty_buffer(bh);
-    brelse(bh);
+}
 
-    bh = sb_bread(sb, 3);
-    if (!bh)
-        return -EIO;
-    memcpy(bh->b_data, sbi->dmap + VVSFS_BLOCKSIZE, VVSFS_BLOCKSIZE);
+// The same, waiting for the write to complete
+static void vvsfs_sync_fs_info(struct super_block *sb, struct buffer_head *bh) {
     mark_buffer_dirty(bh);
-    if (wait)
-        sync_dirty_buffer(bh);
-    brelse(bh);
+    sync_dirty_buffer(bh);
+}
 
-    return 0;
+// sync_fs super operation.
+// This writes super block data to disk.
+// For the current version, this is the free counts,
+// the inode map and the data map. With a journal they
+// are part of every commit instead.
+static int vvsfs_sync_fs(struct super_block *sb, int wait) {
+    struct vvsfs_sb_info *sbi = sb->s_fs_info;
+
+    LOG("vvsfs -- sync_fs");
+
+    if (sbi->journal) {
+        if (wait)
+            return vvsfs_journal_commit(sb);
+        mod_delayed_work(system_wq, &sbi->journal->commit_work, 0);
+        return 0;
+    }
+    if (sbi->jbd2) {
+        // An empty handle adds the bitmaps when it stops
+        vvsfs_journal_stop(sb, vvsfs_journal_start(sb));
+        if (wait)
+            return vvsfs_journal_commit(sb);
+        jbd2_journal_start_commit(sbi->jbd2, NULL);
+        return 0;
+    }
+
+    return vvsfs_store_fs_info(sb,
+                               wait ? vvsfs_sync_fs_info : vvsfs_write_fs_info);
+}
+
+// evict_inode super operation.
+// Dentry, indirect and extent blocks are associated with
+// the inode they belong to when they are dirtied (see
+// vvsfs_mark_buffer_dirty), so that fsync can find them.
+// They have to be detached before the inode goes away;
+// the block device still writes them back.
+// With a journal, the inode is also taken off the list of
+// inodes the running transaction writes out. Blocks still
+// held for its delayed allocations are given back.
+static void vvsfs_evict_inode(struct inode *inode) {
+    vvsfs_journal_forget_inode(inode);
+    vvsfs_da_release(inode);
+    truncate_inode_pages_final(&inode->i_data);
+    invalidate_inode_buffers(inode);
+    clear_inode(inode);
+}
+
+// dirty_inode super operation.
+// With a journal, inodes are copied into the transaction
+// when it commits rather than whenever writeback gets to
+// them, so that it holds them along with the directory
+// and bitmap updates made by the same operations.
+static void vvsfs_dirty_inode(struct inode *inode, int flags) {
+    vvsfs_journal_dirty_inode(inode, flags);
 }
 
 const struct super_operations vvsfs_ops = {
@@ -329,6 +667,9 @@ const struct super_operations vvsfs_ops = {
     .put_super = vvsfs_put_super,
     .alloc_inode = vvsfs_alloc_inode,
     .destroy_inode = vvsfs_destroy_inode,
+    .free_inode = vvsfs_free_inode,
     .write_inode = vvsfs_write_inode,
+    .dirty_inode = vvsfs_dirty_inode,
+    .evict_inode = vvsfs_evict_inode,
     .sync_fs = vvsfs_sync_fs,
 };
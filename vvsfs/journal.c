@@ -0,0 +1,786 @@
+#include <linux/crc32.h>
+#include <linux/sched.h>
+
+#include "vvsfs.h"
+
+#include "logging.h"
+
+#define JOURNAL_HEADER(bh) ((struct vvsfs_journal_header *)(bh)->b_data)
+#define JOURNAL_DESCRIPTOR(bh) ((struct vvsfs_journal_descriptor *)(bh)->b_data)
+#define JOURNAL_COMMIT(bh) ((struct vvsfs_journal_commit *)(bh)->b_data)
+
+/* Buffers in the running transaction carry a private state
+ * bit, so that a block dirtied many times is logged once */
+enum { BH_VvsfsJournal = BH_PrivateStart };
+BUFFER_FNS(VvsfsJournal, vvsfs_journal)
+
+static struct vvsfs_journal *vvsfs_journal_of(struct super_block *sb) {
+    return ((struct vvsfs_sb_info *)sb->s_fs_info)->journal;
+}
+
+// The public functions below hand over to journal_jbd2.c when the
+// journal is kept by jbd2
+static bool vvsfs_uses_jbd2(struct super_block *sb) {
+    return ((struct vvsfs_sb_info *)sb->s_fs_info)->jbd2 != NULL;
+}
+
+/* Calculate the number of blocks a transaction can log
+ * such that it fits in the log along with its descriptor
+ * blocks and commit block
+ *
+ * @bs: Filesystem block size
+ * @blocks: Journal size, including its super block
+ *
+ * @return: (uint32_t) maximum number of logged blocks
+ */
+static uint32_t vvsfs_journal_capacity(uint32_t bs, uint32_t blocks) {
+    return ((blocks - 2) * VVSFS_JOURNAL_TAGS(bs)) /
+           (VVSFS_JOURNAL_TAGS(bs) + 1);
+}
+
+/* Write the journal super block, recording that every
+ * transaction before a given sequence is checkpointed
+ *
+ * @j: Journal
+ * @sequence: First sequence that may need replaying
+ *
+ * @return: (int) 0 if successful, error otherwise
+ */
+static int vvsfs_journal_write_super(struct vvsfs_journal *j,
+                                     uint32_t sequence) {
+    struct vvsfs_journal_super *js;
+    struct buffer_head *bh;
+    int err;
+
+    bh = sb_bread(j->sb, j->start);
+    if (!bh)
+        return -EIO;
+    js = (struct vvsfs_journal_super *)bh->b_data;
+    js->js_sequence = sequence;
+    mark_buffer_dirty(bh);
+    err = sync_dirty_buffer(bh);
+    brelse(bh);
+    return err;
+}
+
+/* Replay the last transaction in the log if it was
+ * committed and not yet known to be checkpointed. The log
+ * is scanned from its first block for descriptor blocks
+ * of a single sequence, up to a commit block whose
+ * checksum matches them, and the blocks are then copied to
+ * their home locations.
+ *
+ * @j: Journal, with start and blocks set
+ * @sequence: First sequence that may need replaying, set
+ *            to the sequence to continue from
+ *
+ * @return: (int) 0 if successful, error otherwise
+ */
+static int vvsfs_journal_recover(struct vvsfs_journal *j, uint32_t *sequence) {
+    struct super_block *sb = j->sb;
+    struct vvsfs_sb_info *sbi = sb->s_fs_info;
+    struct vvsfs_journal_descriptor *jd;
+    struct vvsfs_journal_header *jh;
+    struct buffer_head *bh;
+    struct buffer_head *home;
+    uint32_t *targets;
+    uint32_t *positions;
+    uint32_t n = 0;
+    uint32_t pos = 1;
+    uint32_t seq = 0;
+    uint32_t crc = ~0;
+    uint32_t i;
+    bool committed = false;
+    int err = 0;
+
+    targets = kvmalloc_array(j->max_buffers, sizeof(uint32_t), GFP_KERNEL);
+    positions = kvmalloc_array(j->max_buffers, sizeof(uint32_t), GFP_KERNEL);
+    if (!targets || !positions) {
+        err = -ENOMEM;
+        goto out;
+    }
+
+    while (pos < j->blocks && !committed) {
+        bh = sb_bread(sb, j->start + pos);
+        if (!bh) {
+            err = -EIO;
+            goto out;
+        }
+        jh = JOURNAL_HEADER(bh);
+        if (jh->jh_magic != VVSFS_JOURNAL_MAGIC ||
+            jh->jh_sequence < *sequence || (pos > 1 && jh->jh_sequence != seq)) {
+            brelse(bh);
+            break;
+        }
+        seq = jh->jh_sequence;
+        if (jh->jh_type == VVSFS_JOURNAL_COMMIT) {
+            committed = JOURNAL_COMMIT(bh)->jc_checksum == crc;
+            brelse(bh);
+            break;
+        }
+        jd = JOURNAL_DESCRIPTOR(bh);
+        if (jh->jh_type != VVSFS_JOURNAL_DESCRIPTOR ||
+            jd->jd_count > VVSFS_JOURNAL_TAGS(sb->s_blocksize) ||
+            jd->jd_count > j->max_buffers - n ||
+            pos + jd->jd_count >= j->blocks) {
+            brelse(bh);
+            break;
+        }
+        crc = crc32(crc, bh->b_data, sb->s_blocksize);
+        for (i = 0; i < jd->jd_count; i++) {
+            targets[n] = jd->jd_blocks[i];
+            positions[n++] = ++pos;
+        }
+        brelse(bh);
+        for (i = n - jd->jd_count; i < n; i++) {
+            bh = sb_bread(sb, j->start + positions[i]);
+            if (!bh) {
+                err = -EIO;
+                goto out;
+            }
+            crc = crc32(crc, bh->b_data, sb->s_blocksize);
+            brelse(bh);
+        }
+        pos++;
+    }
+
+    if (!committed) {
+        LOG("vvsfs - journal_recover - nothing to replay\n");
+        goto out;
+    }
+    LOG("vvsfs - journal_recover - replaying %u blocks of transaction %u\n",
+        n,
+        seq);
+    for (i = 0; i < n; i++) {
+        if (targets[i] >= sbi->nblocks ||
+            (targets[i] >= j->start && targets[i] < j->start + j->blocks)) {
+            LOG("vvsfs - journal_recover - bad home block %u\n", targets[i]);
+            err = -EUCLEAN;
+            goto out;
+        }
+        bh = sb_bread(sb, j->start + positions[i]);
+        if (!bh) {
+            err = -EIO;
+            goto out;
+        }
+        home = sb_getblk(sb, targets[i]);
+        if (!home) {
+            brelse(bh);
+            err = -EIO;
+            goto out;
+        }
+        lock_buffer(home);
+        memcpy(home->b_data, bh->b_data, sb->s_blocksize);
+        set_buffer_uptodate(home);
+        unlock_buffer(home);
+        mark_buffer_dirty(home);
+        write_dirty_buffer(home, 0);
+        brelse(home);
+        brelse(bh);
+    }
+    err = sync_blockdev(sb->s_bdev);
+out:
+    // Never reuse the sequence of a transaction found in the log
+    if (!err && seq >= *sequence)
+        *sequence = seq + 1;
+    kvfree(targets);
+    kvfree(positions);
+    return err;
+}
+
+static void vvsfs_journal_commit_work(struct work_struct *work) {
+    struct vvsfs_journal *j =
+        container_of(to_delayed_work(work), struct vvsfs_journal, commit_work);
+    vvsfs_journal_commit(j->sb);
+}
+
+/* Load the journal of a file system, replaying the last
+ * committed transaction if needed
+ *
+ * @sb: Superblock of the filesystem
+ * @block: First data block of the journal
+ * @blocks: Journal size in blocks
+ *
+ * @return: (int) 0 if successful, error otherwise
+ */
+int vvsfs_journal_load(struct super_block *sb, uint32_t block, uint32_t blocks) {
+    struct vvsfs_sb_info *sbi = sb->s_fs_info;
+    struct vvsfs_journal_super *js;
+    struct vvsfs_journal *j;
+    struct buffer_head *bh;
+    uint32_t sequence;
+    int err;
+
+    if (blocks < VVSFS_JOURNAL_MIN_BLOCKS || blocks > VVSFS_JOURNAL_MAX_BLOCKS ||
+        block == 0 || block + blocks > sbi->group_data) {
+        LOG("vvsfs - journal_load - bad journal location %u+%u\n",
+            block,
+            blocks);
+        return -EINVAL;
+    }
+
+    j = kzalloc(sizeof(*j), GFP_KERNEL);
+    if (!j)
+        return -ENOMEM;
+    j->sb = sb;
+    j->start = vvsfs_get_data_block(sb, block);
+    j->blocks = blocks;
+    j->max_buffers = vvsfs_journal_capacity(sb->s_blocksize, blocks);
+    // Every map block of every group may have changed by the
+    // time of a commit
+    j->fs_info = 1 + sbi->groups * (sbi->inode_block - sbi->imap_block);
+    if (j->max_buffers < j->fs_info + VVSFS_JOURNAL_CREDITS) {
+        LOG("vvsfs - journal_load - journal of %u blocks too small\n",
+            blocks);
+        kfree(j);
+        return -EINVAL;
+    }
+    init_rwsem(&j->barrier);
+    mutex_init(&j->lock);
+    spin_lock_init(&j->inode_lock);
+    INIT_LIST_HEAD(&j->inodes);
+    INIT_DELAYED_WORK(&j->commit_work, vvsfs_journal_commit_work);
+    j->buffers =
+        kvmalloc_array(j->max_buffers, sizeof(*j->buffers), GFP_KERNEL);
+    j->log = kvmalloc_array(blocks, sizeof(*j->log), GFP_KERNEL);
+    if (!j->buffers || !j->log) {
+        err = -ENOMEM;
+        goto fail;
+    }
+
+    bh = sb_bread(sb, j->start);
+    if (!bh) {
+        err = -EIO;
+        goto fail;
+    }
+    js = (struct vvsfs_journal_super *)bh->b_data;
+    if (js->js_magic != VVSFS_JOURNAL_MAGIC || js->js_blocks != blocks) {
+        LOG("vvsfs - journal_load - bad journal super block\n");
+        brelse(bh);
+        err = -EINVAL;
+        goto fail;
+    }
+    sequence = js->js_sequence;
+    brelse(bh);
+
+    err = vvsfs_journal_recover(j, &sequence);
+    if (err)
+        goto fail;
+    // Everything before the new sequence is now on disk
+    err = vvsfs_journal_write_super(j, sequence);
+    if (err)
+        goto fail;
+    j->sequence = sequence;
+    sbi->journal = j;
+    return 0;
+fail:
+    kvfree(j->buffers);
+    kvfree(j->log);
+    kfree(j);
+    return err;
+}
+
+/* Commit the running transaction and release the journal
+ * at unmount
+ *
+ * @sb: Superblock of the filesystem
+ */
+void vvsfs_journal_destroy(struct super_block *sb) {
+    struct vvsfs_sb_info *sbi = sb->s_fs_info;
+    struct vvsfs_journal *j = sbi->journal;
+
+    cancel_delayed_work_sync(&j->commit_work);
+    if (vvsfs_journal_commit(sb))
+        LOG("vvsfs - journal_destroy - final commit failed\n");
+    // Each commit is checkpointed, so the log need not be
+    // replayed on the next mount
+    if (vvsfs_journal_write_super(j, j->sequence))
+        LOG("vvsfs - journal_destroy - failed to write journal super\n");
+    sbi->journal = NULL;
+    kvfree(j->buffers);
+    kvfree(j->log);
+    kfree(j);
+}
+
+/* Begin an operation that updates several metadata
+ * blocks. Commits wait for it to finish, so that they
+ * never see it half done. Handles nest, only the
+ * outermost one holds the barrier.
+ *
+ * @sb: Superblock of the filesystem
+ *
+ * @return: (int) 1 if a handle was started, which must be
+ *          passed to vvsfs_journal_stop, 0 otherwise
+ */
+int vvsfs_journal_start(struct super_block *sb) {
+    struct vvsfs_journal *j = vvsfs_journal_of(sb);
+    if (vvsfs_uses_jbd2(sb))
+        return vvsfs_jbd2_start(sb);
+    if (!j || current->journal_info)
+        return 0;
+    // Leave room in the running transaction for this handle
+    if (READ_ONCE(j->nbuffers) + READ_ONCE(j->ninodes) + j->fs_info +
+            VVSFS_JOURNAL_CREDITS >
+        j->max_buffers)
+        vvsfs_journal_commit(sb);
+    down_read(&j->barrier);
+    current->journal_info = j;
+    return 1;
+}
+
+/* End an operation started with vvsfs_journal_start
+ *
+ * @sb: Superblock of the filesystem
+ * @started: Return value of vvsfs_journal_start
+ */
+void vvsfs_journal_stop(struct super_block *sb, int started) {
+    struct vvsfs_journal *j = vvsfs_journal_of(sb);
+    if (!started)
+        return;
+    if (vvsfs_uses_jbd2(sb)) {
+        vvsfs_jbd2_stop(sb);
+        return;
+    }
+    current->journal_info = NULL;
+    up_read(&j->barrier);
+    if (test_and_clear_bit(VVSFS_JOURNAL_FORCE, &j->flags))
+        vvsfs_journal_commit(sb);
+}
+
+/* Declare that a metadata buffer is about to be modified.
+ * Only jbd2 needs to know, to keep a copy of the block if
+ * it is part of the transaction being committed; vvsfs'
+ * own log copies blocks under the barrier instead.
+ *
+ * @sb: Superblock of the filesystem
+ * @bh: Buffer of the block
+ *
+ * @return: (int) 0 if successful, error otherwise
+ */
+int vvsfs_journal_access(struct super_block *sb, struct buffer_head *bh) {
+    if (vvsfs_uses_jbd2(sb))
+        return vvsfs_jbd2_access(sb, bh);
+    return 0;
+}
+
+/* Abort the journal and make the file system read-only.
+ * The running transaction and any after it are dropped
+ * rather than committed, so that the disk keeps the state
+ * of the last commit instead of part of an operation.
+ * Must be called with j->lock held.
+ *
+ * @j: Journal
+ */
+static void vvsfs_journal_abort(struct vvsfs_journal *j) {
+    if (!test_and_set_bit(VVSFS_JOURNAL_ABORTED, &j->flags))
+        LOG("vvsfs - journal_abort - aborted in transaction %u\n",
+            j->sequence);
+    j->sb->s_flags |= SB_RDONLY;
+}
+
+/* Drop the blocks of the running transaction without
+ * writing them, after the journal was aborted. Must be
+ * called with j->lock held.
+ *
+ * @j: Journal
+ */
+static void vvsfs_journal_drop(struct vvsfs_journal *j) {
+    uint32_t i;
+
+    for (i = 0; i < j->nbuffers; i++) {
+        clear_buffer_vvsfs_journal(j->buffers[i]);
+        brelse(j->buffers[i]);
+    }
+    j->nbuffers = 0;
+}
+
+/* Add a buffer to the running transaction. Must be called
+ * with j->lock held.
+ */
+static void __vvsfs_journal_dirty(struct vvsfs_journal *j,
+                                  struct buffer_head *bh) {
+    if (buffer_vvsfs_journal(bh) || test_bit(VVSFS_JOURNAL_ABORTED, &j->flags))
+        return;
+    if (j->nbuffers == j->max_buffers) {
+        // Only possible when a single operation dirties more
+        // blocks than the journal holds. Committing part of it
+        // would tear it, and handles cannot wait for a commit
+        // (which waits for them), so the journal is aborted.
+        // The block is not written behind its back either.
+        LOG("vvsfs - journal_dirty - transaction %u outgrew the journal\n",
+            j->sequence);
+        vvsfs_journal_abort(j);
+        return;
+    }
+    // The transaction holds a reference, so the block stays
+    // in memory until it is checkpointed
+    get_bh(bh);
+    set_buffer_vvsfs_journal(bh);
+    j->buffers[j->nbuffers++] = bh;
+    if (j->nbuffers == 1)
+        schedule_delayed_work(&j->commit_work,
+                              VVSFS_JOURNAL_COMMIT_INTERVAL * HZ);
+}
+
+// Add a block of the free counts or bitmaps to the
+// committing transaction, see vvsfs_store_fs_info
+static void vvsfs_journal_add_fs_info(struct super_block *sb,
+                                      struct buffer_head *bh) {
+    __vvsfs_journal_dirty(vvsfs_journal_of(sb), bh);
+}
+
+/* Add a modified metadata block to the running
+ * transaction, instead of marking it dirty. It is written
+ * to its home location once the transaction commits.
+ *
+ * @sb: Superblock of the filesystem
+ * @bh: Buffer of the modified block
+ */
+void vvsfs_journal_dirty(struct super_block *sb, struct buffer_head *bh) {
+    struct vvsfs_journal *j = vvsfs_journal_of(sb);
+    if (vvsfs_uses_jbd2(sb)) {
+        vvsfs_jbd2_dirty(sb, bh);
+        return;
+    }
+    mutex_lock(&j->lock);
+    __vvsfs_journal_dirty(j, bh);
+    mutex_unlock(&j->lock);
+}
+
+/* Add an inode to the running transaction, which copies
+ * it into its block on commit
+ *
+ * @j: Journal
+ * @vi: Inode
+ * @datasync: Whether fdatasync of the inode needs the commit
+ */
+static void vvsfs_journal_add_inode(struct vvsfs_journal *j,
+                                    struct vvsfs_inode_info *vi,
+                                    bool datasync) {
+    bool first;
+
+    spin_lock(&j->inode_lock);
+    first = list_empty(&j->inodes);
+    if (list_empty(&vi->i_journal)) {
+        list_add_tail(&vi->i_journal, &j->inodes);
+        j->ninodes++;
+    }
+    if (datasync)
+        __set_bit(VVSFS_I_DATASYNC, &vi->i_jflags);
+    spin_unlock(&j->inode_lock);
+    if (first)
+        schedule_delayed_work(&j->commit_work,
+                              VVSFS_JOURNAL_COMMIT_INTERVAL * HZ);
+}
+
+/* Record that an inode was dirtied in the running
+ * transaction
+ *
+ * @inode: Dirtied inode
+ * @flags: I_DIRTY_* flags it was dirtied with
+ */
+void vvsfs_journal_dirty_inode(struct inode *inode, int flags) {
+    struct vvsfs_journal *j = vvsfs_journal_of(inode->i_sb);
+
+    if (vvsfs_uses_jbd2(inode->i_sb)) {
+        vvsfs_jbd2_dirty_inode(inode, flags);
+        return;
+    }
+    if (!j || !(flags & I_DIRTY_INODE))
+        return;
+    vvsfs_journal_add_inode(j, VVSFS_I(inode), flags & I_DIRTY_DATASYNC);
+}
+
+/* Record that a metadata block of an inode (an indirect,
+ * extent or directory block) was dirtied in the running
+ * transaction, so that fsync and fdatasync of the inode
+ * commit it
+ *
+ * @inode: Inode owning the block
+ */
+void vvsfs_journal_dirty_mapping(struct inode *inode) {
+    struct vvsfs_journal *j = vvsfs_journal_of(inode->i_sb);
+
+    if (vvsfs_uses_jbd2(inode->i_sb)) {
+        vvsfs_jbd2_dirty_mapping(inode);
+        return;
+    }
+    if (j)
+        vvsfs_journal_add_inode(j, VVSFS_I(inode), true);
+}
+
+/* Make the metadata of an inode durable for fsync. Only
+ * commits when the running transaction holds metadata of
+ * the inode, and for fdatasync only when that metadata is
+ * needed to read the data back.
+ *
+ * @inode: Inode being synced
+ * @datasync: Whether this is fdatasync
+ *
+ * @return: (int) 1 if a commit flushed the device cache, 0
+ *          if no commit was needed, error otherwise
+ */
+int vvsfs_journal_sync_inode(struct inode *inode, int datasync) {
+    struct vvsfs_journal *j = vvsfs_journal_of(inode->i_sb);
+    struct vvsfs_inode_info *vi = VVSFS_I(inode);
+    bool dirty;
+    int err;
+
+    if (vvsfs_uses_jbd2(inode->i_sb))
+        return vvsfs_jbd2_sync_inode(inode, datasync);
+    if (!j)
+        return 0;
+
+    spin_lock(&j->inode_lock);
+    dirty = (!list_empty(&vi->i_journal) &&
+             (!datasync || test_bit(VVSFS_I_DATASYNC, &vi->i_jflags))) ||
+            test_bit(VVSFS_JOURNAL_EVICTED, &j->flags);
+    spin_unlock(&j->inode_lock);
+    if (!dirty) {
+        // A commit that already took the inode may still be
+        // writing it; it holds the barrier until it is done
+        down_read(&j->barrier);
+        up_read(&j->barrier);
+        return 0;
+    }
+    err = vvsfs_journal_commit(inode->i_sb);
+    return err ? err : 1;
+}
+
+/* Drop an inode that is being evicted from the running
+ * transaction. Waits for a commit in progress, which may
+ * be copying the inode. Its block is already in the
+ * transaction, but fsync of the inode once read back can
+ * no longer tell, so every fsync commits until then.
+ *
+ * @inode: Evicted inode
+ */
+void vvsfs_journal_forget_inode(struct inode *inode) {
+    struct vvsfs_journal *j = vvsfs_journal_of(inode->i_sb);
+    struct vvsfs_inode_info *vi = VVSFS_I(inode);
+
+    if (!j)
+        return;
+    mutex_lock(&j->lock);
+    spin_lock(&j->inode_lock);
+    if (!list_empty(&vi->i_journal)) {
+        list_del_init(&vi->i_journal);
+        __clear_bit(VVSFS_I_DATASYNC, &vi->i_jflags);
+        j->ninodes--;
+        set_bit(VVSFS_JOURNAL_EVICTED, &j->flags);
+    }
+    spin_unlock(&j->inode_lock);
+    mutex_unlock(&j->lock);
+}
+
+/* Note that a run of metadata blocks (directory, index,
+ * indirect or extent blocks) is being freed, so that
+ * replaying the journal after a crash does not overwrite
+ * whatever the blocks are reused for. vvsfs' own log only
+ * ever holds the latest transaction, whose replay
+ * restores the metadata the blocks belonged to, so only
+ * jbd2 needs to revoke them.
+ *
+ * @sb: Superblock of the filesystem
+ * @dno: First data block of the run
+ * @count: Number of blocks
+ */
+void vvsfs_journal_forget(struct super_block *sb,
+                          uint32_t dno,
+                          uint32_t count) {
+    if (vvsfs_uses_jbd2(sb))
+        vvsfs_jbd2_forget(sb, dno, count);
+}
+
+/* Write the running transaction to the log, then its
+ * blocks to their home locations. If logging fails, the
+ * journal is aborted instead. Must be called with
+ * the barrier held exclusively and j->lock held.
+ *
+ * @j: Journal
+ *
+ * @return: (int) 0 if successful, error otherwise
+ */
+static int vvsfs_journal_write(struct vvsfs_journal *j) {
+    struct super_block *sb = j->sb;
+    struct vvsfs_journal_descriptor *jd = NULL;
+    struct vvsfs_journal_commit *jc;
+    struct buffer_head *bh;
+    uint32_t tags = VVSFS_JOURNAL_TAGS(sb->s_blocksize);
+    uint32_t nlog = 0;
+    uint32_t crc = ~0;
+    uint32_t i;
+    int err = 0;
+
+    // Descriptor blocks, each followed by the blocks it lists
+    for (i = 0; i < j->nbuffers; i++) {
+        if (i % tags == 0) {
+            bh = sb_getblk(sb, j->start + 1 + nlog);
+            if (!bh) {
+                err = -EIO;
+                goto release;
+            }
+            lock_buffer(bh);
+            memset(bh->b_data, 0, sb->s_blocksize);
+            jd = JOURNAL_DESCRIPTOR(bh);
+            jd->jd_header.jh_magic = VVSFS_JOURNAL_MAGIC;
+            jd->jd_header.jh_type = VVSFS_JOURNAL_DESCRIPTOR;
+            jd->jd_header.jh_sequence = j->sequence;
+            jd->jd_count = min(j->nbuffers - i, tags);
+            set_buffer_uptodate(bh);
+            unlock_buffer(bh);
+            j->log[nlog++] = bh;
+        }
+        jd->jd_blocks[i % tags] = j->buffers[i]->b_blocknr;
+        bh = sb_getblk(sb, j->start + 1 + nlog);
+        if (!bh) {
+            err = -EIO;
+            goto release;
+        }
+        lock_buffer(bh);
+        memcpy(bh->b_data, j->buffers[i]->b_data, sb->s_blocksize);
+        set_buffer_uptodate(bh);
+        unlock_buffer(bh);
+        j->log[nlog++] = bh;
+    }
+    // The descriptors are complete only now, so the checksum
+    // is computed in log order in a second pass
+    for (i = 0; i < nlog; i++) {
+        crc = crc32(crc, j->log[i]->b_data, sb->s_blocksize);
+        mark_buffer_dirty(j->log[i]);
+        write_dirty_buffer(j->log[i], 0);
+    }
+    for (i = 0; i < nlog; i++) {
+        wait_on_buffer(j->log[i]);
+        if (!buffer_uptodate(j->log[i]))
+            err = -EIO;
+    }
+    if (err)
+        goto release;
+
+    // The commit block is written with a cache flush before it
+    // and forced to stable storage, making the transaction
+    // durable once it completes
+    bh = sb_getblk(sb, j->start + 1 + nlog);
+    if (!bh) {
+        err = -EIO;
+        goto release;
+    }
+    lock_buffer(bh);
+    memset(bh->b_data, 0, sb->s_blocksize);
+    jc = JOURNAL_COMMIT(bh);
+    jc->jc_header.jh_magic = VVSFS_JOURNAL_MAGIC;
+    jc->jc_header.jh_type = VVSFS_JOURNAL_COMMIT;
+    jc->jc_header.jh_sequence = j->sequence;
+    jc->jc_checksum = crc;
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    mark_buffer_dirty(bh);
+    err = __sync_dirty_buffer(bh, REQ_SYNC | REQ_PREFLUSH | REQ_FUA);
+    brelse(bh);
+release:
+    for (i = 0; i < nlog; i++)
+        brelse(j->log[i]);
+    if (err) {
+        // Without a commit on disk, writing the blocks home
+        // could tear the transaction in a crash, so it is
+        // dropped and the journal aborted
+        LOG("vvsfs - journal_write - failed to log transaction %u: %d\n",
+            j->sequence,
+            err);
+        vvsfs_journal_abort(j);
+        vvsfs_journal_drop(j);
+        return err;
+    }
+
+    // Checkpoint: write the blocks home and wait for them, as
+    // the next transaction overwrites the log
+    for (i = 0; i < j->nbuffers; i++) {
+        mark_buffer_dirty(j->buffers[i]);
+        write_dirty_buffer(j->buffers[i], 0);
+    }
+    for (i = 0; i < j->nbuffers; i++) {
+        wait_on_buffer(j->buffers[i]);
+        if (!buffer_uptodate(j->buffers[i]) && !err)
+            err = -EIO;
+        clear_buffer_vvsfs_journal(j->buffers[i]);
+        brelse(j->buffers[i]);
+    }
+    j->nbuffers = 0;
+    if (!err)
+        err = blkdev_issue_flush(sb->s_bdev);
+    return err;
+}
+
+/* Commit the running transaction: copy the inodes dirtied
+ * in it and the bitmaps into their blocks, write them all
+ * to the log, then to their home locations. When called
+ * from within a handle, the commit is deferred to the end
+ * of the handle.
+ *
+ * @sb: Superblock of the filesystem
+ *
+ * @return: (int) 0 if successful, error otherwise
+ */
+int vvsfs_journal_commit(struct super_block *sb) {
+    struct vvsfs_journal *j = vvsfs_journal_of(sb);
+    struct vvsfs_inode_info *vi;
+    struct buffer_head *bh;
+    int err = 0;
+    int i;
+
+    if (vvsfs_uses_jbd2(sb))
+        return vvsfs_jbd2_commit(sb);
+    if (!j)
+        return 0;
+    if (current->journal_info == j) {
+        set_bit(VVSFS_JOURNAL_FORCE, &j->flags);
+        return 0;
+    }
+
+    down_write(&j->barrier);
+    mutex_lock(&j->lock);
+    clear_bit(VVSFS_JOURNAL_FORCE, &j->flags);
+    clear_bit(VVSFS_JOURNAL_EVICTED, &j->flags);
+
+    // Evicting an inode takes j->lock, so the inodes stay
+    // around while they are copied
+    spin_lock(&j->inode_lock);
+    while (!list_empty(&j->inodes)) {
+        vi = list_first_entry(&j->inodes, struct vvsfs_inode_info, i_journal);
+        list_del_init(&vi->i_journal);
+        __clear_bit(VVSFS_I_DATASYNC, &vi->i_jflags);
+        j->ninodes--;
+        spin_unlock(&j->inode_lock);
+        bh = vvsfs_inode_to_block(&vi->vfs_inode);
+        if (bh) {
+            __vvsfs_journal_dirty(j, bh);
+            brelse(bh);
+        } else {
+            err = -EIO;
+        }
+        spin_lock(&j->inode_lock);
+    }
+    spin_unlock(&j->inode_lock);
+
+    if (j->nbuffers && !test_bit(VVSFS_JOURNAL_ABORTED, &j->flags) &&
+        vvsfs_store_fs_info(sb, vvsfs_journal_add_fs_info))
+        err = -EIO;
+    if (test_bit(VVSFS_JOURNAL_ABORTED, &j->flags)) {
+        // Dropped, see vvsfs_journal_abort
+        vvsfs_journal_drop(j);
+        err = -EROFS;
+    } else if (j->nbuffers) {
+        DEBUG_LOG("vvsfs - journal_commit - transaction %u, %u blocks\n",
+                  j->sequence,
+                  j->nbuffers);
+        i = vvsfs_journal_write(j);
+        if (!err)
+            err = i;
+        j->sequence++;
+    }
+
+    mutex_unlock(&j->lock);
+    up_write(&j->barrier);
+    return err;
+}
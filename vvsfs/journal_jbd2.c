@@ -0,0 +1,365 @@
+#include <linux/jbd2.h>
+#include <linux/sched.h>
+
+#include "vvsfs.h"
+
+#include "logging.h"
+
+struct inode *vvsfs_iget(struct super_block *sb, unsigned long ino);
+
+static journal_t *vvsfs_jbd2_of(struct super_block *sb) {
+    return ((struct vvsfs_sb_info *)sb->s_fs_info)->jbd2;
+}
+
+/* Open the jbd2 journal kept in an internal file and
+ * replay any transactions left in it by a crash
+ *
+ * @sb: Superblock of the filesystem
+ * @inum: Inode number of the journal file
+ *
+ * @return: (int) 0 if successful, error otherwise
+ */
+int vvsfs_jbd2_load(struct super_block *sb, uint32_t inum) {
+    struct vvsfs_sb_info *sbi = sb->s_fs_info;
+    struct inode *inode;
+    journal_t *journal;
+    int err;
+
+    inode = vvsfs_iget(sb, inum);
+    if (IS_ERR(inode)) {
+        LOG("vvsfs - jbd2_load - failed to read journal inode %u\n", inum);
+        return PTR_ERR(inode);
+    }
+    if (!S_ISREG(inode->i_mode) || inode->i_nlink == 0) {
+        LOG("vvsfs - jbd2_load - bad journal inode %u\n", inum);
+        iput(inode);
+        return -EUCLEAN;
+    }
+
+    // jbd2 maps the file through bmap once, at load
+    journal = jbd2_journal_init_inode(inode);
+    if (IS_ERR_OR_NULL(journal)) {
+        LOG("vvsfs - jbd2_load - failed to open journal\n");
+        iput(inode);
+        return journal ? PTR_ERR(journal) : -EINVAL;
+    }
+    journal->j_private = sb;
+    // Commit blocks are written with a cache flush and FUA, so
+    // that a commit also makes the data written before it durable
+    write_lock(&journal->j_state_lock);
+    journal->j_flags |= JBD2_BARRIER;
+    write_unlock(&journal->j_state_lock);
+
+    err = jbd2_journal_load(journal);
+    if (err) {
+        LOG("vvsfs - jbd2_load - failed to load journal: %d\n", err);
+        jbd2_journal_destroy(journal);
+        iput(inode);
+        return err;
+    }
+    sbi->jbd2 = journal;
+    return 0;
+}
+
+/* Commit and checkpoint everything, then release the
+ * journal at unmount
+ *
+ * @sb: Superblock of the filesystem
+ */
+void vvsfs_jbd2_destroy(struct super_block *sb) {
+    struct vvsfs_sb_info *sbi = sb->s_fs_info;
+    journal_t *journal = sbi->jbd2;
+    struct inode *inode = journal->j_inode;
+
+    sbi->jbd2 = NULL;
+    if (jbd2_journal_destroy(journal))
+        LOG("vvsfs - jbd2_destroy - journal was aborted\n");
+    iput(inode);
+}
+
+/* Abort the journal and make the file system read-only
+ * after a journal operation failed. Metadata changed
+ * outside a working handle is then never written, rather
+ * than written behind the back of the journal: the disk
+ * keeps the state of the last commit, which is consistent.
+ *
+ * @sb: Superblock of the filesystem
+ * @what: Operation that failed, for the log
+ * @err: Error it failed with
+ */
+static void
+vvsfs_jbd2_abort(struct super_block *sb, const char *what, int err) {
+    journal_t *journal = vvsfs_jbd2_of(sb);
+
+    if (!is_journal_aborted(journal)) {
+        LOG("vvsfs - %s failed: %d, aborting journal\n", what, err);
+        jbd2_journal_abort(journal, err);
+    }
+    sb->s_flags |= SB_RDONLY;
+}
+
+/* Start (or nest into) a jbd2 handle. The outermost
+ * handle reserves credits for a typical operation, which
+ * vvsfs_jbd2_access extends when they run low. If none
+ * can be started the journal is aborted, and the changes
+ * the caller goes on to make are not written.
+ *
+ * @sb: Superblock of the filesystem
+ *
+ * @return: (int) 1 if a handle was started, 0 otherwise
+ */
+int vvsfs_jbd2_start(struct super_block *sb) {
+    handle_t *handle;
+
+    handle = jbd2__journal_start(vvsfs_jbd2_of(sb),
+                                 VVSFS_JOURNAL_CREDITS + VVSFS_FS_INFO_CREDITS,
+                                 0,
+                                 VVSFS_JOURNAL_CREDITS,
+                                 GFP_NOFS,
+                                 0,
+                                 0);
+    if (IS_ERR(handle)) {
+        vvsfs_jbd2_abort(sb, "jbd2_start", PTR_ERR(handle));
+        return 0;
+    }
+    return 1;
+}
+
+/* Stop the current handle. The outermost handle of an
+ * operation also adds the bitmaps and free counts, so
+ * that they commit along with the blocks they describe.
+ *
+ * @sb: Superblock of the filesystem
+ */
+void vvsfs_jbd2_stop(struct super_block *sb) {
+    handle_t *handle = journal_current_handle();
+    int err;
+
+    if (handle->h_ref == 1) {
+        err = vvsfs_store_fs_info(sb, vvsfs_jbd2_dirty);
+        if (err)
+            vvsfs_jbd2_abort(sb, "jbd2_stop (bitmaps)", err);
+    }
+    err = jbd2_journal_stop(handle);
+    if (err)
+        vvsfs_jbd2_abort(sb, "jbd2_stop", err);
+}
+
+/* Get write access to a metadata buffer in the current
+ * handle, before it is modified
+ *
+ * @sb: Superblock of the filesystem
+ * @bh: Buffer of the block
+ *
+ * @return: (int) 0 if successful, error otherwise
+ */
+int vvsfs_jbd2_access(struct super_block *sb, struct buffer_head *bh) {
+    handle_t *handle = journal_current_handle();
+    int err;
+
+    // The handle failed to start, see vvsfs_jbd2_start
+    if (!handle) {
+        vvsfs_jbd2_abort(sb, "jbd2_access (no handle)", -EROFS);
+        return -EROFS;
+    }
+    // Keep enough credits for the block and the bitmaps
+    // that the outermost handle adds when it stops
+    if (jbd2_handle_buffer_credits(handle) <= VVSFS_FS_INFO_CREDITS &&
+        jbd2_journal_extend(handle, VVSFS_JOURNAL_CREDITS, 0))
+        DEBUG_LOG("vvsfs - jbd2_access - failed to extend handle\n");
+    err = jbd2_journal_get_write_access(handle, bh);
+    if (err)
+        vvsfs_jbd2_abort(sb, "jbd2_access", err);
+    return err;
+}
+
+/* Add a modified metadata buffer to the current handle.
+ * A buffer that cannot be added aborts the journal, and is
+ * not written.
+ *
+ * @sb: Superblock of the filesystem
+ * @bh: Buffer of the block
+ */
+void vvsfs_jbd2_dirty(struct super_block *sb, struct buffer_head *bh) {
+    handle_t *handle = journal_current_handle();
+    int err;
+
+    // The handle failed to start, see vvsfs_jbd2_start
+    if (!handle) {
+        vvsfs_jbd2_abort(sb, "jbd2_dirty (no handle)", -EROFS);
+        return;
+    }
+    // A block freed by this handle is not written at all
+    if (buffer_revoked(bh))
+        return;
+    // Access is cheap when already granted, and keeps a missed
+    // vvsfs_journal_access from tripping jbd2's assertions
+    if (vvsfs_jbd2_access(sb, bh))
+        return;
+    err = jbd2_journal_dirty_metadata(handle, bh);
+    if (err)
+        vvsfs_jbd2_abort(sb, "jbd2_dirty", err);
+}
+
+/* Start an inode off as if its metadata was last changed
+ * in the newest transaction, as an inode evicted with
+ * uncommitted changes may be read back before they commit
+ *
+ * @sb: Superblock of the filesystem
+ * @vi: Newly allocated inode
+ */
+void vvsfs_jbd2_init_inode(struct super_block *sb,
+                           struct vvsfs_inode_info *vi) {
+    journal_t *journal = vvsfs_jbd2_of(sb);
+    transaction_t *transaction;
+    tid_t tid;
+
+    read_lock(&journal->j_state_lock);
+    transaction = journal->j_running_transaction;
+    if (!transaction)
+        transaction = journal->j_committing_transaction;
+    tid = transaction ? transaction->t_tid : journal->j_commit_sequence;
+    read_unlock(&journal->j_state_lock);
+    vi->i_sync_tid = tid;
+    vi->i_datasync_tid = tid;
+}
+
+/* Note the transaction of the current handle as the one
+ * fsync (and with @datasync, fdatasync) of an inode waits
+ * for
+ *
+ * @inode: Inode whose metadata the handle changes
+ * @handle: Current handle
+ * @datasync: Whether the data of the inode depends on it
+ */
+static void vvsfs_jbd2_track(struct inode *inode,
+                             handle_t *handle,
+                             bool datasync) {
+    struct vvsfs_inode_info *vi = VVSFS_I(inode);
+    tid_t tid = handle->h_transaction->t_tid;
+
+    WRITE_ONCE(vi->i_sync_tid, tid);
+    if (datasync)
+        WRITE_ONCE(vi->i_datasync_tid, tid);
+}
+
+/* Copy a dirtied inode into its block in a handle, so that
+ * it commits with the operation that dirtied it
+ *
+ * @inode: Dirtied inode
+ * @flags: I_DIRTY_* flags it was dirtied with
+ */
+void vvsfs_jbd2_dirty_inode(struct inode *inode, int flags) {
+    struct super_block *sb = inode->i_sb;
+    struct buffer_head *bh;
+
+    if (!(flags & I_DIRTY_INODE))
+        return;
+    if (!vvsfs_jbd2_start(sb))
+        return;
+    bh = vvsfs_inode_to_block(inode);
+    if (bh) {
+        vvsfs_jbd2_dirty(sb, bh);
+        brelse(bh);
+    }
+    vvsfs_jbd2_track(inode, journal_current_handle(), flags & I_DIRTY_DATASYNC);
+    vvsfs_jbd2_stop(sb);
+}
+
+/* Note that the current handle dirtied a metadata block
+ * of an inode (an indirect, extent or directory block)
+ *
+ * @inode: Inode owning the block
+ */
+void vvsfs_jbd2_dirty_mapping(struct inode *inode) {
+    handle_t *handle = journal_current_handle();
+
+    if (handle)
+        vvsfs_jbd2_track(inode, handle, true);
+}
+
+/* Wait for the transaction holding the latest metadata of
+ * an inode to commit, committing it if it is still running
+ *
+ * @inode: Inode being synced
+ * @datasync: Whether this is fdatasync
+ *
+ * @return: (int) 1 if the commit flushes the device cache, 0
+ *          if it was already done, error otherwise
+ */
+int vvsfs_jbd2_sync_inode(struct inode *inode, int datasync) {
+    struct vvsfs_inode_info *vi = VVSFS_I(inode);
+    journal_t *journal = vvsfs_jbd2_of(inode->i_sb);
+    tid_t tid;
+    int flushes;
+    int err;
+
+    tid = datasync ? READ_ONCE(vi->i_datasync_tid) : READ_ONCE(vi->i_sync_tid);
+    // Asked before waiting, as afterwards the transaction is
+    // committed whether or not this waited for it
+    flushes = jbd2_trans_will_send_data_barrier(journal, tid);
+    err = jbd2_complete_transaction(journal, tid);
+    if (err)
+        return err;
+    return flushes;
+}
+
+/* Revoke a run of freed metadata blocks, so that earlier
+ * transactions still in the log do not overwrite them
+ * when replayed
+ *
+ * @sb: Superblock of the filesystem
+ * @dno: First data block of the run
+ * @count: Number of blocks
+ */
+void vvsfs_jbd2_forget(struct super_block *sb, uint32_t dno, uint32_t count) {
+    handle_t *handle = journal_current_handle();
+    struct buffer_head *bh;
+    sector_t block;
+    uint32_t i;
+    int err;
+
+    if (!handle)
+        return;
+    // Without the revokes, replaying the log could overwrite
+    // the blocks once they are reused
+    err = 0;
+    if (handle->h_revoke_credits < count)
+        err = jbd2_journal_extend(handle, 0, count - handle->h_revoke_credits);
+    if (err) {
+        vvsfs_jbd2_abort(sb, "jbd2_forget", err);
+        return;
+    }
+    for (i = 0; i < count; i++) {
+        block = vvsfs_get_data_block(sb, dno + i);
+        // A cached block is also dropped from the running
+        // transaction; jbd2_journal_revoke releases it
+        bh = sb_find_get_block(sb, block);
+        if (bh && buffer_revoked(bh)) {
+            brelse(bh);
+            continue;
+        }
+        err = jbd2_journal_revoke(handle, block, bh);
+        if (err) {
+            vvsfs_jbd2_abort(sb, "jbd2_forget", err);
+            return;
+        }
+    }
+}
+
+/* Commit the running transaction and wait for it. Inside a
+ * handle, the commit happens when the handle stops.
+ *
+ * @sb: Superblock of the filesystem
+ *
+ * @return: (int) 0 if successful, error otherwise
+ */
+int vvsfs_jbd2_commit(struct super_block *sb) {
+    handle_t *handle = journal_current_handle();
+
+    if (handle) {
+        handle->h_sync = 1;
+        return 0;
+    }
+    return jbd2_journal_force_commit(vvsfs_jbd2_of(sb));
+}
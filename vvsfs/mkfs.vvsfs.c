@@ -5,6 +5,7 @@
  *
  */
 
+#include <arpa/inet.h>
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -24,7 +25,128 @@ static void die(char *mess) {
     exit(1);
 }
 
-static void usage(void) { die("Usage : mkfs.vvsfs <device name>)"); }
+static void usage(void) {
+    die("Usage : mkfs.vvsfs [-e] [-d] [-r] [-t] [-j blocks | -J blocks] [-b block_size] "
+        "[-s blocks] [-i bytes_per_inode] [-g blocks_per_group] "
+        "<device name>)");
+}
+
+static uint32_t parse_number(const char *arg) {
+    char *end;
+    unsigned long value = strtoul(arg, &end, 10);
+    if (*end || !*arg || value == 0 || value > UINT32_MAX)
+        usage();
+    return value;
+}
+
+/* Lay out a file system of the given size. Without any
+ * geometry option the layout is the fixed one of earlier
+ * versions: the inode map, the data map and the inode table
+ * follow the super block, and the rest is data. Otherwise the
+ * blocks after the super block are split into block groups,
+ * each with a block of inode map, a block of data map, its
+ * slice of the inode table and then its data. */
+struct geometry {
+    uint32_t block_size;
+    uint32_t blocks;
+    uint32_t inodes;
+    uint32_t data_blocks;
+    uint32_t imap_blocks; /* per group */
+    uint32_t dmap_blocks; /* per group */
+    uint32_t inode_blocks; /* per group */
+    uint32_t data_block; /* first data block of group 0 */
+    uint32_t groups; /* 0 for the flat layout */
+    uint32_t group_blocks;
+    uint32_t group_inodes;
+};
+
+static void legacy_geometry(struct geometry *g) {
+    g->block_size = VVSFS_BLOCKSIZE;
+    g->blocks = VVSFS_MAXBLOCKS;
+    g->inodes = VVSFS_MAX_INODE_ENTRIES;
+    g->data_blocks = VVSFS_DMAP_SIZE * 8;
+    g->imap_blocks = 1;
+    g->dmap_blocks = VVSFS_DMAP_SIZE / VVSFS_BLOCKSIZE;
+    g->inode_blocks = VVSFS_DATA_BLOCK_OFF - VVSFS_INODE_BLOCK_OFF;
+    g->data_block = VVSFS_DATA_BLOCK_OFF;
+    g->groups = 0;
+    g->group_blocks = g->blocks - 1;
+    g->group_inodes = g->inodes;
+}
+
+static void
+compute_geometry(struct geometry *g, uint32_t inode_ratio, uint32_t per_group) {
+    uint32_t bits = g->block_size * 8;
+    uint32_t per_block = g->block_size / VVSFS_INODESIZE;
+    uint64_t inodes;
+    uint32_t last;
+
+    // A map block covers the inodes and the data blocks of a group
+    if (!per_group || per_group > bits)
+        per_group = bits;
+    if (g->blocks < 2)
+        die("file system too small");
+    g->group_blocks = per_group;
+    g->groups = (g->blocks - 2) / per_group + 1;
+    // Inode and data block numbers of all groups fit 32 bits
+    if ((uint64_t)g->groups * bits > UINT32_MAX) {
+        g->groups = UINT32_MAX / bits;
+        g->blocks = 1 + g->groups * per_group;
+    }
+    g->imap_blocks = 1;
+    g->dmap_blocks = 1;
+    for (;;) {
+        // At least the root and a handful of files, spread over
+        // the groups in whole inode table blocks
+        inodes = (uint64_t)g->blocks * g->block_size / inode_ratio;
+        if (inodes < 16)
+            inodes = 16;
+        inodes = (inodes + g->groups - 1) / g->groups;
+        inodes = (inodes + per_block - 1) / per_block * per_block;
+        if (inodes > bits)
+            inodes = bits;
+        g->group_inodes = inodes;
+        g->inode_blocks = inodes / per_block;
+        if (2 + g->inode_blocks >= per_group)
+            die("block groups too small");
+        // Drop a last group too small to hold any data
+        last = g->blocks - 1 - (g->groups - 1) * per_group;
+        if (last > 2 + g->inode_blocks)
+            break;
+        if (g->groups == 1)
+            die("file system too small");
+        g->groups--;
+        g->blocks = 1 + g->groups * per_group;
+    }
+    if (g->groups == 1)
+        g->group_blocks = g->blocks - 1;
+    g->inodes = g->groups * g->group_inodes;
+    g->data_block = 1 + 2 + g->inode_blocks;
+    g->data_blocks = g->blocks - 1 - g->groups * (2 + g->inode_blocks);
+}
+
+/* Set the bits from up to to of a map, in the on-disk bit
+ * order */
+static void set_bits(uint8_t *map, uint32_t from, uint32_t to) {
+    uint32_t i;
+    for (i = from; i < to; i++)
+        map[i / 8] |= 1 << (7 - i % 8);
+}
+
+/* Fill in the jbd2 super block of an empty journal. jbd2
+ * keeps its on-disk structures big endian. */
+static void
+jbd2_super_block(uint8_t *block, uint32_t block_size, uint32_t blocks) {
+    uint32_t *words = (uint32_t *)block;
+    memset(block, 0, block_size);
+    words[0] = htonl(VVSFS_JBD2_MAGIC);         // h_magic
+    words[1] = htonl(VVSFS_JBD2_SUPERBLOCK_V2); // h_blocktype
+    words[3] = htonl(block_size);               // s_blocksize
+    words[4] = htonl(blocks);                   // s_maxlen
+    words[5] = htonl(1);                        // s_first
+    words[6] = htonl(1);                        // s_sequence
+    words[16] = htonl(1);                       // s_nr_users
+}
 
 static void write_disk(off_t *pos, uint8_t *block, off_t size) {
     if (*pos != lseek(device, *pos, SEEK_SET))
@@ -36,64 +158,290 @@ static void write_disk(off_t *pos, uint8_t *block, off_t size) {
 }
 
 int main(int argc, char **argv) {
-    int i;
+    uint32_t i;
 
-    uint8_t block[VVSFS_BLOCKSIZE];
-    uint8_t magic[VVSFS_BLOCKSIZE];
-    uint8_t imap[VVSFS_BLOCKSIZE];
-    uint8_t dmap[VVSFS_DMAP_SIZE];
+    uint8_t *block;
+    uint8_t *map;
+    size_t map_size;
 
     struct vvsfs_inode inode;
+    struct vvsfs_journal_super *js;
+    struct geometry g;
+    uint32_t features = 0;
+    uint32_t journal_blocks = 0;
+    uint32_t min_blocks;
+    uint32_t block_size = 0;
+    uint32_t blocks = 0;
+    uint32_t inode_ratio = 0;
+    uint32_t per_group = 0;
+    uint32_t group;
+    uint32_t group_data;
+    off_t device_size;
+    char *end;
+    int opt;
 
-    if (argc != 2)
+    // -e: map regular files with extents rather than block pointers
+    // -d: keep the data of small regular files in their inode
+    // -r: make directories of variable-length records
+    // -t: keep the file type in dentries, for names one byte shorter
+    // -j: reserve a metadata journal of the given number of blocks
+    // -J: the same, but kept by jbd2 in an internal journal file
+    // -b: block size in bytes
+    // -s: file system size in blocks, the whole device by default
+    // -i: bytes of data per inode
+    // -g: blocks per block group, at most 8 per byte of a block
+    while ((opt = getopt(argc, argv, "edrtj:J:b:s:i:g:")) != -1) {
+        switch (opt) {
+        case 'e':
+            features |= VVSFS_FEATURE_EXTENTS;
+            break;
+        case 'd':
+            features |= VVSFS_FEATURE_INLINE_DATA;
+            break;
+        case 'r':
+            features |= VVSFS_FEATURE_DIR_RECS;
+            break;
+        case 't':
+            features |= VVSFS_FEATURE_DIR_TYPES;
+            break;
+        case 'j':
+        case 'J':
+            if (journal_blocks)
+                usage();
+            min_blocks = opt == 'j' ? VVSFS_JOURNAL_MIN_BLOCKS
+                                    : VVSFS_JBD2_MIN_BLOCKS;
+            journal_blocks = strtoul(optarg, &end, 10);
+            if (*end || journal_blocks < min_blocks ||
+                journal_blocks > VVSFS_JOURNAL_MAX_BLOCKS) {
+                fprintf(stderr,
+                        "Exit : journal size must be between %u and %u "
+                        "blocks\n",
+                        min_blocks,
+                        VVSFS_JOURNAL_MAX_BLOCKS);
+                exit(1);
+            }
+            features |=
+                opt == 'j' ? VVSFS_FEATURE_JOURNAL : VVSFS_FEATURE_JBD2;
+            break;
+        case 'b':
+            block_size = parse_number(optarg);
+            if (block_size < VVSFS_MIN_BLOCKSIZE ||
+                block_size > VVSFS_MAX_BLOCKSIZE ||
+                (block_size & (block_size - 1))) {
+                fprintf(stderr,
+                        "Exit : block size must be a power of 2 between %u "
+                        "and %u\n",
+                        VVSFS_MIN_BLOCKSIZE,
+                        VVSFS_MAX_BLOCKSIZE);
+                exit(1);
+            }
+            break;
+        case 's':
+            blocks = parse_number(optarg);
+            break;
+        case 'i':
+            inode_ratio = parse_number(optarg);
+            if (inode_ratio < VVSFS_INODESIZE)
+                die("bytes per inode must be at least the inode size");
+            break;
+        case 'g':
+            per_group = parse_number(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc - 1)
         usage();
 
     // open the device for reading and writing
-    device_name = argv[1];
+    device_name = argv[optind];
     device = open(device_name, O_RDWR);
+    if (device < 0)
+        die("cannot open device");
+
+    if (!block_size && !blocks && !inode_ratio && !per_group) {
+        legacy_geometry(&g);
+    } else {
+        g.block_size = block_size ? block_size : VVSFS_BLOCKSIZE;
+        g.blocks = blocks;
+        if (!g.blocks) {
+            device_size = lseek(device, 0, SEEK_END);
+            if (device_size < 0)
+                die("cannot find the device size");
+            if (device_size / g.block_size > UINT32_MAX)
+                g.blocks = UINT32_MAX;
+            else
+                g.blocks = device_size / g.block_size;
+        }
+        if (per_group && per_group > g.block_size * 8)
+            die("blocks per group must be at most 8 times the block size");
+        compute_geometry(&g,
+                         inode_ratio ? inode_ratio : VVSFS_DEFAULT_INODE_RATIO,
+                         per_group);
+    }
+    // The journal is in the data blocks of group 0
+    group_data = g.groups > 1 ? g.group_blocks - (g.data_block - 1)
+                              : g.data_blocks;
+    if ((uint64_t)journal_blocks + 2 > group_data)
+        die("journal does not fit in the file system");
+    printf("Block size %u, %u blocks, %u inodes, %u data blocks\n",
+           g.block_size,
+           g.blocks,
+           g.inodes,
+           g.data_blocks);
+    if (g.groups)
+        printf("%u block groups of %u blocks and %u inodes\n",
+               g.groups,
+               g.group_blocks,
+               g.group_inodes);
+
+    block = malloc(g.block_size);
+    map_size = (size_t)g.block_size *
+               (g.imap_blocks > g.dmap_blocks ? g.imap_blocks : g.dmap_blocks);
+    map = malloc(map_size);
+    if (!block || !map)
+        die("out of memory");
 
     off_t pos = 0;
 
-    printf("Writing magic number\n");
-    // set magic number for the first block
-    memset(magic, 0, VVSFS_BLOCKSIZE);
-    uint32_t *m = (uint32_t *)magic;
-    *m = VVSFS_MAGIC;
-    write_disk(&pos, magic, VVSFS_BLOCKSIZE);
-
-    printf("Writing inode bitmap\n");
-    // initialise inode map -- mark first block as taken
-    memset(imap, 0, VVSFS_BLOCKSIZE);
-    imap[0] = 1 << 7;
-    write_disk(&pos, imap, VVSFS_BLOCKSIZE);
-
-    printf("Writing data bitmap\n");
-    // initialise data blocks map -- mark first block as taken
-    memset(dmap, 0, VVSFS_DMAP_SIZE);
-    dmap[0] = 1 << 7;
-    write_disk(&pos, dmap, VVSFS_DMAP_SIZE);
-
-    printf("Writing root inode\n");
-
-    // Root inode: occupies first data block
-    memset(block, 0, VVSFS_BLOCKSIZE);
-    for (i = 0; i < VVSFS_N_BLOCKS; ++i)
-        inode.i_block[i] = 0;
-    inode.i_mode = S_IFDIR | S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR | S_IWGRP |
-                   S_IWOTH | S_IXUSR | S_IXGRP | S_IXOTH;
-    printf("Mode: %d\n", inode.i_mode);
-    inode.i_data_blocks_count = 1;
-    inode.i_links_count = 1;
-    inode.i_size = 0;
-    memcpy(block, &inode, sizeof(struct vvsfs_inode));
-    write_disk(&pos, block, VVSFS_BLOCKSIZE);
-
-    // zero remaining blocks
-    printf("Zeroing remaining blocks\n");
-    memset(block, 0, VVSFS_BLOCKSIZE);
-    for (i = 5; i < VVSFS_MAXBLOCKS; i++)
-        write_disk(&pos, block, VVSFS_BLOCKSIZE);
+    printf("Writing super block\n");
+    // set magic number and free counts for the first block. Bit 0
+    // of both maps is reserved, and is taken by the root inode and
+    // its first data block respectively. The journal, if any,
+    // takes the data blocks directly after the root's.
+    memset(block, 0, g.block_size);
+    struct vvsfs_super_block *vsb = (struct vvsfs_super_block *)block;
+    vsb->s_magic = VVSFS_MAGIC;
+    vsb->s_free_blocks = g.data_blocks - 1 - journal_blocks;
+    vsb->s_free_inodes = g.inodes - 1;
+    if (features & VVSFS_FEATURE_JBD2)
+        vsb->s_free_inodes--;
+    vsb->s_features = features;
+    if (journal_blocks) {
+        vsb->s_journal_block = 1;
+        vsb->s_journal_blocks = journal_blocks;
+    }
+    vsb->s_block_size = g.block_size;
+    vsb->s_blocks_count = g.blocks;
+    vsb->s_inodes_count = g.inodes;
+    vsb->s_data_blocks = g.data_blocks;
+    vsb->s_imap_blocks = g.imap_blocks;
+    vsb->s_dmap_blocks = g.dmap_blocks;
+    vsb->s_inode_blocks = g.inode_blocks;
+    vsb->s_groups = g.groups;
+    if (g.groups) {
+        vsb->s_group_blocks = g.group_blocks;
+        vsb->s_group_inodes = g.group_inodes;
+    }
+    write_disk(&pos, block, g.block_size);
+
+    // Each group in turn; the flat layout is a single group
+    for (group = 0; group < (g.groups ? g.groups : 1); group++) {
+        pos = (1 + (off_t)group * g.group_blocks) * g.block_size;
+        if (g.groups && group + 1 == g.groups)
+            group_data = g.data_blocks - group * group_data;
+
+        printf("Writing inode bitmap\n");
+        // initialise inode map -- mark first block as taken, and
+        // the bits past the inodes of the group
+        memset(map, 0, map_size);
+        if (group == 0) {
+            map[0] = 1 << 7;
+            if (features & VVSFS_FEATURE_JBD2)
+                map[0] |= 1 << (7 - (VVSFS_JBD2_INUM - 1));
+        }
+        if (g.groups)
+            set_bits(map, g.group_inodes, g.block_size * 8);
+        write_disk(&pos, map, (off_t)g.imap_blocks * g.block_size);
+
+        printf("Writing data bitmap\n");
+        // initialise data blocks map -- mark first block as taken,
+        // and the bits past the data blocks of the group
+        memset(map, 0, map_size);
+        if (group == 0) {
+            map[0] = 1 << 7;
+            for (i = 1; i <= journal_blocks; i++)
+                map[i / 8] |= 1 << (7 - i % 8);
+        }
+        if (g.groups)
+            set_bits(map, group_data, g.block_size * 8);
+        write_disk(&pos, map, (off_t)g.dmap_blocks * g.block_size);
+
+        memset(block, 0, g.block_size);
+        if (group == 0) {
+            printf("Writing root inode\n");
+
+            // Root inode: occupies first data block
+            memset(&inode, 0, sizeof(struct vvsfs_inode));
+            inode.i_mode = S_IFDIR | S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR |
+                           S_IWGRP | S_IWOTH | S_IXUSR | S_IXGRP | S_IXOTH;
+            printf("Mode: %d\n", inode.i_mode);
+            inode.i_data_blocks_count = 1;
+            inode.i_links_count = 1;
+            // A directory of records is as large as its blocks
+            inode.i_size =
+                (features & VVSFS_FEATURE_DIR_RECS) ? g.block_size : 0;
+            memcpy(block, &inode, sizeof(struct vvsfs_inode));
+
+            if (features & VVSFS_FEATURE_JBD2) {
+                // jbd2 journal inode: a single extent over the journal
+                // blocks, in the same inode table block as the root
+                printf("Writing journal inode\n");
+                memset(&inode, 0, sizeof(struct vvsfs_inode));
+                inode.i_mode = S_IFREG | S_IRUSR | S_IWUSR;
+                inode.i_size = (uint64_t)journal_blocks * g.block_size;
+                inode.i_links_count = 1;
+                inode.i_data_blocks_count = journal_blocks;
+                inode.i_flags = VVSFS_INODE_EXTENTS;
+                inode.i_ext.er_extents[0].e_pblk = 1;
+                inode.i_ext.er_extents[0].e_len = journal_blocks;
+                inode.i_ext.er_count = 1;
+                memcpy(block + (VVSFS_JBD2_INUM - 1) * VVSFS_INODESIZE,
+                       &inode,
+                       sizeof(struct vvsfs_inode));
+            }
+        }
+        write_disk(&pos, block, g.block_size);
+
+        // zero remaining blocks of the group
+        printf("Zeroing remaining blocks\n");
+        memset(block, 0, g.block_size);
+        while (pos < ((off_t)1 + (off_t)(group + 1) * g.group_blocks) *
+                         g.block_size &&
+               pos < (off_t)g.blocks * g.block_size)
+            write_disk(&pos, block, g.block_size);
+    }
+
+    if (features & VVSFS_FEATURE_DIR_RECS) {
+        // The first data block of the root directory holds a
+        // single free record over the whole block
+        printf("Writing root directory block\n");
+        memset(block, 0, g.block_size);
+        VVSFS_REC_AT(block, 0)->rec_len = g.block_size;
+        pos = (off_t)g.data_block * g.block_size;
+        write_disk(&pos, block, g.block_size);
+    }
+    if (features & VVSFS_FEATURE_JOURNAL) {
+        // An empty log: no descriptor block carries the
+        // sequence number the journal starts at
+        printf("Writing journal super block\n");
+        js = (struct vvsfs_journal_super *)block;
+        js->js_magic = VVSFS_JOURNAL_MAGIC;
+        js->js_blocks = journal_blocks;
+        js->js_sequence = 1;
+        pos = ((off_t)g.data_block + 1) * g.block_size;
+        write_disk(&pos, block, g.block_size);
+    }
+    if (features & VVSFS_FEATURE_JBD2) {
+        printf("Writing jbd2 super block\n");
+        jbd2_super_block(block, g.block_size, journal_blocks);
+        pos = ((off_t)g.data_block + 1) * g.block_size;
+        write_disk(&pos, block, g.block_size);
+    }
 
+    free(block);
+    free(map);
     close(device);
     printf("Done\n");
 
@@ -59,18 +59,7 @@ static int vvsfs_find_entry_in_block(struct buffer_head *bh,
         if (!inumber || !namecmp(name, target_name, target_name_len) != 0) {
             continue;
         }
-        out_loc->b_index = i;
-        out_loc->d_index = d;
-        out_loc->flags = flags;
-        if (bl_flag_set(flags, BL_PERSIST_BUFFER)) {
-            out_loc->bh = bh;
-            out_loc->dentry =
-                bl_flag_set(flags, BL_PERSIST_DENTRY) ? dentry : NULL;
-        } else {
-            out_loc->bh = NULL;
-            out_loc->dentry = NULL;
-            brelse(bh);
-        }
+        vvsfs_fill_bufloc(out_loc, bh, dentry, i, d, flags);
         DEBUG_LOG("vvsfs - find_entry_in_block - "
                   "done (found)\n");
         return 0;
@@ -115,7 +104,7 @@ static int vvsfs_find_entry_direct(struct vvsfs_inode_info *vi,
         LOG("vvsfs - find_entry - reading dno: "
             "%d, disk block: %d",
             vi->i_data[i],
-            vvsfs_get_data_block(vi->i_data[i]));
+            vvsfs_get_data_block(sb, vi->i_data[i]));
         bh = READ_BLOCK(sb, vi, i);
         if (!bh) {
             // Buffer read failed, no more data when
@@ -124,7 +113,8 @@ static int vvsfs_find_entry_direct(struct vvsfs_inode_info *vi,
         }
         current_block_dentry_count = i == vi->i_db_count - 1
                                          ? last_block_dentry_count
-                                         : VVSFS_N_DENTRY_PER_BLOCK;
+                                         : VVSFS_DENTRIES_PER_BLOCK(
+                                               sb->s_blocksize);
         if (!vvsfs_find_entry_in_block(bh,
                                        current_block_dentry_count,
                                        i,
@@ -160,30 +150,28 @@ static int vvsfs_find_entry_indirect(struct vvsfs_inode_info *vi,
                                      struct bufloc_t *out_loc,
                                      unsigned flags,
                                      int last_block_dentry_count) {
-    struct buffer_head *i_bh;
     struct buffer_head *bh;
     const char *target_name;
-    int indirect_blocks;
     int current_block_dentry_count;
     int i;
+    int raw_dno;
     int target_name_len;
     DEBUG_LOG("vvsfs - find_entry - indirect blocks\n");
     target_name = dentry->d_name.name;
     target_name_len = dentry->d_name.len;
-    i_bh = READ_BLOCK(sb, vi, VVSFS_LAST_DIRECT_BLOCK_INDEX);
-    if (!i_bh) {
-        return -EIO;
-    }
-    indirect_blocks = vi->i_db_count - VVSFS_LAST_DIRECT_BLOCK_INDEX;
-    for (i = 0; i < indirect_blocks; i++) {
-        bh = READ_INDIRECT_BLOCK(sb, i_bh, i);
+    for (i = VVSFS_LAST_DIRECT_BLOCK_INDEX; i < vi->i_db_count; i++) {
+        raw_dno = vvsfs_index_data_block(vi, sb, i);
+        if (raw_dno < 0) {
+            return raw_dno;
+        }
+        bh = READ_BLOCK_OFF(sb, raw_dno);
         if (!bh) {
-            brelse(i_bh);
             return -EIO;
         }
         current_block_dentry_count = i == vi->i_db_count - 1
                                          ? last_block_dentry_count
-                                         : VVSFS_N_DENTRY_PER_BLOCK;
+                                         : VVSFS_DENTRIES_PER_BLOCK(
+                                               sb->s_blocksize);
         if (!vvsfs_find_entry_in_block(bh,
                                        current_block_dentry_count,
                                        i,
@@ -192,14 +180,11 @@ static int vvsfs_find_entry_indirect(struct vvsfs_inode_info *vi,
                                        flags,
                                        out_loc)) {
             DEBUG_LOG("vvsfs - find_entry - indirect done (found)");
-            out_loc->b_index += VVSFS_LAST_DIRECT_BLOCK_INDEX;
-            brelse(i_bh);
             return 0;
         }
         // buffer_head release is handled within block
         // search
     }
-    brelse(i_bh);
     return 1;
 }
 
@@ -227,6 +212,16 @@ int vvsfs_find_entry(struct inode *dir,
     // inode
     vi = VVSFS_I(dir);
     sb = dir->i_sb;
+    if (vi->i_dx_block) {
+        // Large directories are searched through the
+        // hashed index instead of scanning every block
+        return vvsfs_dx_find_entry(
+            dir, dentry->d_name.name, dentry->d_name.len, flags, out_loc);
+    }
+    if (vvsfs_dir_recs(sb)) {
+        return vvsfs_rec_find_entry(
+            dir, dentry->d_name.name, dentry->d_name.len, flags, out_loc);
+    }
     LAST_BLOCK_DENTRY_COUNT(dir, last_block_dentry_count);
     DEBUG_LOG("vvsfs - find_entry - number of blocks "
               "to read %d\n",
@@ -310,7 +305,9 @@ static void vvsfs_shift_indirect_only(struct vvsfs_inode_info *vi,
     if (vi->i_db_count == VVSFS_N_BLOCKS) {
         DEBUG_LOG("vvsfs - shift_blocks_back - was last indrect, freeing "
                   "indirect block\n");
-        vvsfs_free_data_block(i_sb->dmap,
+        vvsfs_journal_forget(
+            vi->vfs_inode.i_sb, vi->i_data[VVSFS_LAST_DIRECT_BLOCK_INDEX], 1);
+        vvsfs_free_data_block(&i_sb->dmap,
                               vi->i_data[VVSFS_LAST_DIRECT_BLOCK_INDEX]);
     } else {
         DEBUG_LOG("vvsfs - shift_blocks_back - was not last indirect, "
@@ -323,7 +320,7 @@ static void vvsfs_shift_indirect_only(struct vvsfs_inode_info *vi,
                           VVSFS_INDIRECT_PTR_SIZE),
             0);
     }
-    mark_buffer_dirty(bh);
+    vvsfs_mark_buffer_dirty(bh, &vi->vfs_inode);
     brelse(bh);
 }
 
@@ -359,10 +356,17 @@ static int vvsfs_shift_blocks_back(struct vvsfs_inode_info *vi,
         vvsfs_shift_direct_only(vi, block_index);
         return 0;
     }
+    // The indirect pointers are shifted in the buffer below,
+    // so drop rather than update the cached copy
+    vvsfs_drop_indirect(vi);
     bh = READ_BLOCK(sb, vi, VVSFS_LAST_DIRECT_BLOCK_INDEX);
     if (!bh) {
         return -EIO;
     }
+    if (vvsfs_journal_access(sb, bh)) {
+        brelse(bh);
+        return -EIO;
+    }
     if (block_index >= VVSFS_N_BLOCKS) {
         // Only indirect blocks
         vvsfs_shift_indirect_only(vi, i_sb, bh, block_index);
@@ -401,7 +405,8 @@ static int vvsfs_shift_blocks_back(struct vvsfs_inode_info *vi,
         DEBUG_LOG("vvsfs - shift_blocks_back - shifted last indirect block, "
                   "freeing indirect block\n");
         brelse(bh);
-        vvsfs_free_data_block(i_sb->dmap,
+        vvsfs_journal_forget(sb, vi->i_data[VVSFS_LAST_DIRECT_BLOCK_INDEX], 1);
+        vvsfs_free_data_block(&i_sb->dmap,
                               vi->i_data[VVSFS_LAST_DIRECT_BLOCK_INDEX]);
         vi->i_data[VVSFS_LAST_DIRECT_BLOCK_INDEX] = 0;
         DEBUG_LOG("vvsfs - shift_blocks_back - zeroed last direct block "
@@ -423,7 +428,7 @@ static int vvsfs_shift_blocks_back(struct vvsfs_inode_info *vi,
                             ((vi->i_db_count - VVSFS_LAST_DIRECT_BLOCK_INDEX) *
                              VVSFS_INDIRECT_PTR_SIZE),
                         0);
-    mark_buffer_dirty(bh);
+    vvsfs_mark_buffer_dirty(bh, &vi->vfs_inode);
     brelse(bh);
     return 0;
 }
@@ -444,13 +449,14 @@ static int vvsfs_dealloc_data_block(struct inode *inode, int block_index) {
     int raw_db_index;
     uint32_t db_index;
     DEBUG_LOG("vvsfs - dealloc_data_block\n");
-    if (block_index < 0 || block_index >= VVSFS_MAX_INODE_BLOCKS) {
+    if (block_index < 0 ||
+        block_index >= VVSFS_INODE_BLOCKS(inode->i_sb->s_blocksize)) {
         DEBUG_LOG("vvsfs - dealloc_data_block - "
                   "block_index (%d) out of range "
                   "%d-%d\n",
                   block_index,
                   0,
-                  (int)VVSFS_MAX_INODE_BLOCKS - 1);
+                  (int)VVSFS_INODE_BLOCKS(inode->i_sb->s_blocksize) - 1);
         return -EINVAL;
     }
     vi = VVSFS_I(inode);
@@ -469,7 +475,8 @@ static int vvsfs_dealloc_data_block(struct inode *inode, int block_index) {
               block_index,
               db_index);
 
-    vvsfs_free_data_block(sb_info->dmap, db_index);
+    vvsfs_journal_forget(sb, db_index, 1);
+    vvsfs_free_data_block(&sb_info->dmap, db_index);
     // Move all subsequent blocks back to fill the
     // holes
     if ((err = vvsfs_shift_blocks_back(vi, sb, sb_info, block_index))) {
@@ -496,8 +503,15 @@ static int vvsfs_delete_entry_last_block(struct inode *dir,
     struct vvsfs_dir_entry *last_dentry;
     int last_block_dentry_count;
     int err;
+    uint32_t slot;
     DEBUG_LOG("vvsfs - delete_entry_last_block\n");
     LAST_BLOCK_DENTRY_COUNT(dir, last_block_dentry_count);
+    slot = bufloc->b_index * VVSFS_DENTRIES_PER_BLOCK(dir->i_sb->s_blocksize) +
+           bufloc->d_index;
+    vvsfs_dx_remove_entry(dir,
+                          bufloc->dentry->name,
+                          strnlen(bufloc->dentry->name, VVSFS_MAXNAME),
+                          slot);
     if (bufloc->d_index == last_block_dentry_count - 1) {
         // Last dentry in block remove cleanly
         DEBUG_LOG("vvsfs - delete_entry_bufloc - "
@@ -518,6 +532,11 @@ static int vvsfs_delete_entry_last_block(struct inode *dir,
                   "dentry in block, move last entry "
                   "to hole\n");
         last_dentry = READ_DENTRY(bufloc->bh, last_block_dentry_count - 1);
+        vvsfs_dx_move_entry(dir,
+                            last_dentry->name,
+                            strnlen(last_dentry->name, VVSFS_MAXNAME),
+                            slot - bufloc->d_index + last_block_dentry_count - 1,
+                            slot);
         memcpy(bufloc->dentry, last_dentry, VVSFS_DENTRYSIZE);
         // Delete the last dentry (as it has been
         // moved)
@@ -540,12 +559,12 @@ static int vvsfs_delete_entry_block(struct inode *dir,
                                     struct vvsfs_inode_info *vi,
                                     struct bufloc_t *bufloc) {
     struct vvsfs_dir_entry *last_dentry;
-    struct buffer_head *i_bh;
     struct buffer_head *bh;
     struct super_block *sb;
     int last_block_dentry_count;
     int err;
-    uint32_t index;
+    int raw_dno;
+    uint32_t slot;
     DEBUG_LOG("vvsfs - delete_entry_block\n");
     LAST_BLOCK_DENTRY_COUNT(dir, last_block_dentry_count);
     DEBUG_LOG("vvsfs - delete_entry_block - last block dentry count: %d\n",
@@ -556,35 +575,36 @@ static int vvsfs_delete_entry_block(struct inode *dir,
     DEBUG_LOG("vvsfs - delete_entry_bufloc - not "
               "last block, fill hole "
               "from last block\n");
-    if (vi->i_db_count < VVSFS_N_BLOCKS) {
-        DEBUG_LOG("vvsfs - get_remove_last_dentry - direct block: %u\n",
-                  vi->i_db_count - 1);
-        bh = READ_BLOCK(sb, vi, vi->i_db_count - 1);
-        if (!bh) {
-            DEBUG_LOG("vvsfs - get_remove_last_dentry - failed to read direct "
-                      "block\n");
-            return -EIO;
-        }
-    } else {
-        i_bh = READ_BLOCK(sb, vi, VVSFS_LAST_DIRECT_BLOCK_INDEX);
-        if (!i_bh) {
-            DEBUG_LOG("vvsfs - get_remove_last_dentry - failed to read "
-                      "indirect block\n");
-            return -EIO;
-        }
-        DEBUG_LOG("vvsfs - get_remove_last_dentry - indirect block: %u\n",
-                  vi->i_db_count - VVSFS_N_BLOCKS);
-        index = read_int_from_buffer(
-            i_bh->b_data +
-            ((vi->i_db_count - VVSFS_N_BLOCKS) * VVSFS_INDIRECT_PTR_SIZE));
-        bh = READ_BLOCK_OFF(sb, index);
-        if (!bh) {
-            brelse(i_bh);
-            return -EIO;
-        }
-        brelse(i_bh);
+    DEBUG_LOG("vvsfs - get_remove_last_dentry - last block: %u\n",
+              vi->i_db_count - 1);
+    raw_dno = vvsfs_index_data_block(vi, sb, vi->i_db_count - 1);
+    if (raw_dno < 0) {
+        DEBUG_LOG("vvsfs - get_remove_last_dentry - failed to index last "
+                  "block\n");
+        return raw_dno;
+    }
+    bh = READ_BLOCK_OFF(sb, raw_dno);
+    if (!bh) {
+        DEBUG_LOG("vvsfs - get_remove_last_dentry - failed to read last "
+                  "block\n");
+        return -EIO;
+    }
+    if ((err = vvsfs_journal_access(sb, bh))) {
+        brelse(bh);
+        return err;
     }
     last_dentry = READ_DENTRY(bh, last_block_dentry_count - 1);
+    slot = bufloc->b_index * VVSFS_DENTRIES_PER_BLOCK(dir->i_sb->s_blocksize) +
+           bufloc->d_index;
+    vvsfs_dx_remove_entry(dir,
+                          bufloc->dentry->name,
+                          strnlen(bufloc->dentry->name, VVSFS_MAXNAME),
+                          slot);
+    vvsfs_dx_move_entry(dir,
+                        last_dentry->name,
+                        strnlen(last_dentry->name, VVSFS_MAXNAME),
+                        dir->i_size / VVSFS_DENTRYSIZE - 1,
+                        slot);
     memcpy(bufloc->dentry, last_dentry, VVSFS_DENTRYSIZE);
     // Delete the last dentry (as it has been moved)
     memset(last_dentry, 0, VVSFS_DENTRYSIZE);
@@ -593,7 +613,7 @@ static int vvsfs_delete_entry_block(struct inode *dir,
         (err = vvsfs_dealloc_data_block(dir, vi->i_db_count - 1))) {
         return err;
     }
-    mark_buffer_dirty(bh);
+    vvsfs_mark_buffer_dirty(bh, dir);
     brelse(bh);
     DEBUG_LOG("vvsfs - delete_entry_block - done \n");
     return 0;
@@ -621,36 +641,112 @@ static int vvsfs_delete_entry_bufloc(struct inode *dir,
                   "failed to resolve bufloc\n");
         return err;
     }
+    if ((err = vvsfs_journal_access(dir->i_sb, bufloc->bh))) {
+        brelse(bufloc->bh);
+        return err;
+    }
     DEBUG_LOG("vvsfs - delete_dentry_bufloc - block index: %u block count "
               "(index): %u\n",
               bufloc->b_index,
               vi->i_db_count - 1);
-    // Determine if we are in the last block
-    if (bufloc->b_index == vi->i_db_count - 1) {
-        if ((err = vvsfs_delete_entry_last_block(dir, bufloc))) {
-            DEBUG_LOG("vvsfs - delete_entry_bufloc - "
-                      "failed to delete entry in "
-                      "last block\n");
+    if (vvsfs_dir_recs(dir->i_sb)) {
+        // Records are merged in place, so the directory keeps its size
+        if ((err = vvsfs_rec_delete_entry(dir, bufloc))) {
+            brelse(bufloc->bh);
             return err;
         }
     } else {
-        if ((err = vvsfs_delete_entry_block(dir, vi, bufloc))) {
-            DEBUG_LOG("vvsfs - delete_entry_bufloc - "
-                      "failed to delete entry in "
-                      "block\n");
-            return err;
+        // Determine if we are in the last block
+        if (bufloc->b_index == vi->i_db_count - 1) {
+            if ((err = vvsfs_delete_entry_last_block(dir, bufloc))) {
+                DEBUG_LOG("vvsfs - delete_entry_bufloc - "
+                          "failed to delete entry in "
+                          "last block\n");
+                return err;
+            }
+        } else {
+            if ((err = vvsfs_delete_entry_block(dir, vi, bufloc))) {
+                DEBUG_LOG("vvsfs - delete_entry_bufloc - "
+                          "failed to delete entry in "
+                          "block\n");
+                return err;
+            }
         }
+        dir->i_size -= VVSFS_DENTRYSIZE;
     }
-    // Updated parent inode size and times
-    dir->i_size -= VVSFS_DENTRYSIZE;
+    // Updated parent inode times
     dir->i_ctime = dir->i_mtime = current_time(dir);
-    mark_buffer_dirty(bufloc->bh);
+    vvsfs_mark_buffer_dirty(bufloc->bh, dir);
     brelse(bufloc->bh);
     mark_inode_dirty(dir);
     DEBUG_LOG("vvsfs - delete_entry_bufloc - done\n");
     return err;
 }
 
+/* Get the decoded pointers of the indirect block, loading
+ * them into the inode information on first use. The cache
+ * is kept up to date when blocks are assigned, and dropped
+ * when blocks are shifted back, so that block mapping is a
+ * plain array index rather than a buffer cache lookup.
+ * The inode must have an indirect block.
+ *
+ * @vi: Inode information of the target inode
+ * @sb: Superblock of the filesytsem
+ *
+ * @return: (uint32_t *) cached indirect pointers, or an
+ *                       ERR_PTR on failure
+ */
+static uint32_t *vvsfs_indirect_ptrs(struct vvsfs_inode_info *vi,
+                                     struct super_block *sb) {
+    struct buffer_head *bh;
+    uint32_t *ptrs;
+    uint32_t *cached;
+    int i;
+    // The cache is only freed with the block map locked for
+    // writing, which lookups hold off by locking it for reading
+    cached = READ_ONCE(vi->i_indirect);
+    if (cached) {
+        return cached;
+    }
+    DEBUG_LOG("vvsfs - indirect_ptrs - loading indirect block\n");
+    ptrs = kmalloc_array(
+        VVSFS_INDIRECT_PTRS(sb->s_blocksize), sizeof(uint32_t), GFP_NOFS);
+    if (!ptrs) {
+        return ERR_PTR(-ENOMEM);
+    }
+    bh = READ_BLOCK(sb, vi, VVSFS_LAST_DIRECT_BLOCK_INDEX);
+    if (!bh) {
+        DEBUG_LOG("vvsfs - indirect_ptrs - failed to read buffer data\n");
+        kfree(ptrs);
+        return ERR_PTR(-EIO);
+    }
+    for (i = 0; i < VVSFS_INDIRECT_PTRS(sb->s_blocksize); i++) {
+        ptrs[i] =
+            read_int_from_buffer(bh->b_data + (i * VVSFS_INDIRECT_PTR_SIZE));
+    }
+    brelse(bh);
+    // Block mapping may run concurrently for reads, keep
+    // whichever copy was installed first
+    cached = cmpxchg(&vi->i_indirect, NULL, ptrs);
+    if (cached) {
+        kfree(ptrs);
+        return cached;
+    }
+    return ptrs;
+}
+
+/* Drop the cached indirect block pointers of an inode, they
+ * are reloaded from disk on next use. Lookups may be using
+ * them, so the block map of a regular file must be locked for
+ * writing (see vvsfs_map_lock), and a directory locked.
+ *
+ * @vi: Inode information of the target inode
+ */
+void vvsfs_drop_indirect(struct vvsfs_inode_info *vi) {
+    kfree(vi->i_indirect);
+    vi->i_indirect = NULL;
+}
+
 /* Free all data blocks in a given inode
  *
  * @inode: Target inode to free all indirect and direct
@@ -662,11 +758,11 @@ int vvsfs_free_inode_blocks(struct inode *inode) {
     struct super_block *sb;
     struct vvsfs_sb_info *i_sb;
     struct vvsfs_inode_info *vi;
-    struct buffer_head *bh;
+    uint32_t *ptrs;
     int i;
     int indirect;
     int direct;
-    uint32_t index;
+    bool meta;
 
     DEBUG_LOG("vvsfs - free inode blocks - %lu", inode->i_ino);
 
@@ -680,29 +776,45 @@ int vvsfs_free_inode_blocks(struct inode *inode) {
     vi = VVSFS_I(inode);
     sb = inode->i_sb;
     i_sb = sb->s_fs_info;
+    vvsfs_dx_free(inode);
+    if (vi->i_flags & VVSFS_INODE_EXTENTS) {
+        if (vvsfs_ext_free_blocks(vi, sb)) {
+            return -EIO;
+        }
+        goto free_inode;
+    }
     direct = min((int)VVSFS_LAST_DIRECT_BLOCK_INDEX, (int)vi->i_db_count);
     indirect =
         max((int)0, ((int)vi->i_db_count) - VVSFS_LAST_DIRECT_BLOCK_INDEX);
+    // Directory blocks are metadata, file and symlink blocks are not
+    meta = S_ISDIR(inode->i_mode);
     for (i = 0; i < direct; i++) {
-        vvsfs_free_data_block(i_sb->dmap, vi->i_data[i]);
+        if (meta)
+            vvsfs_journal_forget(sb, vi->i_data[i], 1);
+        // Holes of regular files have nothing to free
+        else if (!vi->i_data[i])
+            continue;
+        vvsfs_free_data_block(&i_sb->dmap, vi->i_data[i]);
     }
-    if (indirect == 0) {
+    if (indirect == 0 || !vi->i_data[VVSFS_LAST_DIRECT_BLOCK_INDEX]) {
         goto free_inode;
     }
-    bh = READ_BLOCK(sb, vi, VVSFS_LAST_DIRECT_BLOCK_INDEX);
-    if (!bh) {
-        return -EIO;
+    ptrs = vvsfs_indirect_ptrs(vi, sb);
+    if (IS_ERR(ptrs)) {
+        return PTR_ERR(ptrs);
     }
     for (i = 0; i < indirect; i++) {
-        index =
-            read_int_from_buffer(bh->b_data + (i * VVSFS_INDIRECT_PTR_SIZE));
-        vvsfs_free_data_block(i_sb->dmap, index);
+        if (meta)
+            vvsfs_journal_forget(sb, ptrs[i], 1);
+        else if (!ptrs[i])
+            continue;
+        vvsfs_free_data_block(&i_sb->dmap, ptrs[i]);
     }
-    brelse(bh);
-    vvsfs_free_data_block(i_sb->dmap,
+    vvsfs_journal_forget(sb, vi->i_data[VVSFS_LAST_DIRECT_BLOCK_INDEX], 1);
+    vvsfs_free_data_block(&i_sb->dmap,
                           vi->i_data[VVSFS_LAST_DIRECT_BLOCK_INDEX]);
 free_inode:
-    vvsfs_free_inode_block(i_sb->imap, inode->i_ino);
+    vvsfs_free_inode_block(&i_sb->imap, inode->i_ino);
     return 0;
 }
 
@@ -734,27 +846,251 @@ int vvsfs_drop_inode_link(struct inode *inode) {
 int vvsfs_index_data_block(struct vvsfs_inode_info *vi,
                            struct super_block *sb,
                            uint32_t d_pos) {
-    struct buffer_head *bh;
-    int offset;
-    uint32_t index;
+    uint32_t *ptrs;
+    uint32_t dno;
     DEBUG_LOG("vvsfs - index_data_block\n");
     DEBUG_LOG("vvsfs - index_data_block - d_pos: %u\n", d_pos);
+    if (vi->i_flags & VVSFS_INODE_EXTENTS) {
+        return vvsfs_ext_index_block(vi, sb, d_pos);
+    }
     if (d_pos < VVSFS_LAST_DIRECT_BLOCK_INDEX) {
         DEBUG_LOG("vvsfs - index_data_block - direct done\n");
-        return vi->i_data[d_pos];
+        dno = vi->i_data[d_pos];
+        goto out;
     }
-    bh = READ_BLOCK(sb, vi, VVSFS_LAST_DIRECT_BLOCK_INDEX);
-    if (!bh) {
-        DEBUG_LOG("vvsfs - index_data_block - failed to read buffer data\n");
-        return -EIO;
+    if (d_pos >= vi->i_db_count ||
+        d_pos >= VVSFS_INODE_BLOCKS(sb->s_blocksize)) {
+        DEBUG_LOG("vvsfs - index_data_block - %u not allocated\n", d_pos);
+        return -ENOENT;
     }
-    offset = (d_pos - VVSFS_LAST_DIRECT_BLOCK_INDEX) * VVSFS_INDIRECT_PTR_SIZE;
-    DEBUG_LOG("vvsfs - index_data_block - offset: %u\n", offset);
-    index = read_int_from_buffer(bh->b_data + offset);
-    brelse(bh);
-    DEBUG_LOG(
-        "vvsfs - index_data_block - indirect done: %u -> %d\n", offset, index);
-    return index;
+    // A file whose indirect blocks are all holes has no indirect
+    // block to read them from
+    if (!vi->i_data[VVSFS_LAST_DIRECT_BLOCK_INDEX]) {
+        return -ENOENT;
+    }
+    ptrs = vvsfs_indirect_ptrs(vi, sb);
+    if (IS_ERR(ptrs)) {
+        return PTR_ERR(ptrs);
+    }
+    DEBUG_LOG("vvsfs - index_data_block - indirect done: %u -> %u\n",
+              d_pos,
+              ptrs[d_pos - VVSFS_LAST_DIRECT_BLOCK_INDEX]);
+    dno = ptrs[d_pos - VVSFS_LAST_DIRECT_BLOCK_INDEX];
+out:
+    // Data block 0 is the root directory's, in a regular file a
+    // zero pointer is a hole
+    if (!dno && S_ISREG(vi->vfs_inode.i_mode)) {
+        return -ENOENT;
+    }
+    return dno;
+}
+
+/* Calculate the data block map index for a given position
+ * within the given inode data blocks, along with the number
+ * of following blocks that are contiguous with it on disk.
+ *
+ * @vi: Inode information of the target inode
+ * @sb: Superblock of the filesytsem
+ * @d_pos: Position of the data block within the inode
+ * @max: Maximum length of the run to report
+ * @dno: Set to the data block map index of d_pos
+ *
+ * @return: (int) number of blocks mapped contiguously (at
+ *                least 1) if the block exists in the inode,
+ *                error otherwise
+ */
+int vvsfs_index_data_run(struct vvsfs_inode_info *vi,
+                         struct super_block *sb,
+                         uint32_t d_pos,
+                         uint32_t max,
+                         uint32_t *dno) {
+    uint32_t limit;
+    uint32_t len;
+    int raw_dno;
+    int next;
+    if (vi->i_flags & VVSFS_INODE_EXTENTS) {
+        return vvsfs_ext_index_run(vi, sb, d_pos, max, dno);
+    }
+    raw_dno = vvsfs_index_data_block(vi, sb, d_pos);
+    if (raw_dno < 0) {
+        return raw_dno;
+    }
+    *dno = (uint32_t)raw_dno;
+    limit = d_pos < vi->i_db_count ? min(max, vi->i_db_count - d_pos) : 1;
+    // Block pointers past the direct blocks are cached, so
+    // extending the run never goes to the buffer cache
+    for (len = 1; len < limit; len++) {
+        next = vvsfs_index_data_block(vi, sb, d_pos + len);
+        if (next < 0 || (uint32_t)next != *dno + len) {
+            break;
+        }
+    }
+    return len;
+}
+
+/* Calculate the number of blocks from a given position
+ * within the given inode data blocks that are holes.
+ *
+ * @vi: Inode information of the target inode
+ * @sb: Superblock of the filesytsem
+ * @d_pos: Position of the data block within the inode
+ * @max: Maximum length of the hole to report
+ *
+ * @return: (int) number of blocks that are holes (at most
+ *                max, 0 if d_pos is mapped), error otherwise
+ */
+int vvsfs_index_hole_run(struct vvsfs_inode_info *vi,
+                         struct super_block *sb,
+                         uint32_t d_pos,
+                         uint32_t max) {
+    uint32_t len;
+    int raw_dno;
+    if (vi->i_flags & VVSFS_INODE_EXTENTS) {
+        return vvsfs_ext_hole_run(vi, sb, d_pos, max);
+    }
+    for (len = 0; len < max && d_pos + len < vi->i_db_count; len++) {
+        raw_dno = vvsfs_index_data_block(vi, sb, d_pos + len);
+        if (raw_dno >= 0) {
+            return len;
+        }
+        if (raw_dno != -ENOENT) {
+            return raw_dno;
+        }
+    }
+    return max;
+}
+
+/* Given a position into the target inode data blocks,
+ * reserve a contiguous run of up to count new data blocks
+ * and assign them to consecutive positions starting at
+ * d_pos. The block pointers are filled in one pass, so the
+ * indirect block (if any) is read and written at most once.
+ * When no free run of count blocks exists the request is
+ * halved until one is found, so fewer blocks than requested
+ * may be assigned. A hole is filled no further than its end.
+ * The block map of a regular file must be locked for writing
+ * (see vvsfs_map_lock), lookups may be running alongside.
+ *
+ * @vi: Inode information of target inode
+ * @sb: Superblock of the filesystem
+ * @d_pos: Data block position to create at, either a hole
+ *         or the current data block count of the inode
+ * @count: Maximum number of blocks to assign
+ * @first: Set to the data block map index of the first
+ *         assigned block
+ *
+ * @return: (int) number of blocks assigned (at least 1),
+ *                error otherwise
+ */
+int vvsfs_assign_data_blocks(struct vvsfs_inode_info *vi,
+                             struct super_block *sb,
+                             uint32_t d_pos,
+                             uint32_t count,
+                             uint32_t *first) {
+    struct buffer_head *bh;
+    struct vvsfs_sb_info *sbi = sb->s_fs_info;
+    uint32_t indirect_block = 0;
+    uint32_t goal = vvsfs_data_goal(vi);
+    uint32_t newblock;
+    uint32_t i;
+    int ret;
+    DEBUG_LOG("vvsfs - assign_data_blocks - %u at %u\n", count, d_pos);
+    if (vi->i_flags & VVSFS_INODE_EXTENTS) {
+        return vvsfs_ext_assign_blocks(vi, sb, d_pos, count, first);
+    }
+    if (d_pos > vi->i_db_count ||
+        d_pos >= VVSFS_INODE_BLOCKS(sb->s_blocksize)) {
+        return -EFBIG;
+    }
+    count = min(count, (uint32_t)VVSFS_INODE_BLOCKS(sb->s_blocksize) - d_pos);
+    if (d_pos < vi->i_db_count) {
+        ret = vvsfs_index_hole_run(vi, sb, d_pos, count);
+        if (ret < 0) {
+            return ret;
+        }
+        if (ret == 0) {
+            return -EEXIST;
+        }
+        count = ret;
+    }
+    if (count == 0) {
+        return -EINVAL;
+    }
+    if (d_pos + count > VVSFS_LAST_DIRECT_BLOCK_INDEX &&
+        !vi->i_data[VVSFS_LAST_DIRECT_BLOCK_INDEX]) {
+        // The run reaches the indirect blocks but there is no
+        // block to store indirect pointers yet. Reserve it ahead
+        // of the data so that the run itself stays contiguous.
+        DEBUG_LOG("vvsfs - assign_data_blocks - indirect block not "
+                  "allocated, allocating\n");
+        indirect_block = vvsfs_reserve_data_block(&sbi->dmap, goal);
+        if (!indirect_block) {
+            return -ENOSPC;
+        }
+    }
+    newblock = vvsfs_reserve_data_run(&sbi->dmap, goal, count);
+    while (!newblock && count > 1) {
+        count /= 2;
+        newblock = vvsfs_reserve_data_run(&sbi->dmap, goal, count);
+    }
+    if (!newblock) {
+        if (indirect_block)
+            vvsfs_free_data_block(&sbi->dmap, indirect_block);
+        return -ENOSPC;
+    }
+    // A shortened run may no longer need the indirect block
+    if (indirect_block && d_pos + count <= VVSFS_LAST_DIRECT_BLOCK_INDEX) {
+        vvsfs_free_data_block(&sbi->dmap, indirect_block);
+        indirect_block = 0;
+    }
+    DEBUG_LOG("vvsfs - assign_data_blocks - reserved %u at %u\n",
+              count,
+              newblock);
+    for (i = 0; i < count && d_pos + i < VVSFS_LAST_DIRECT_BLOCK_INDEX; i++) {
+        vi->i_data[d_pos + i] = newblock + i;
+    }
+    if (i < count) {
+        if (indirect_block) {
+            vi->i_data[VVSFS_LAST_DIRECT_BLOCK_INDEX] = indirect_block;
+            vvsfs_drop_indirect(vi);
+            // Pointers past the run may be read as holes
+            bh = sb_getblk(sb, vvsfs_get_data_block(sb, indirect_block));
+            if (bh) {
+                lock_buffer(bh);
+                memset(bh->b_data, 0, sb->s_blocksize);
+                set_buffer_uptodate(bh);
+                unlock_buffer(bh);
+            }
+        } else {
+            bh = READ_BLOCK(sb, vi, VVSFS_LAST_DIRECT_BLOCK_INDEX);
+        }
+        if (!bh) {
+            DEBUG_LOG("vvsfs - assign_data_blocks - buffer read failed\n");
+            vvsfs_free_data_run(&sbi->dmap, newblock, count);
+            if (indirect_block) {
+                vvsfs_free_data_block(&sbi->dmap, indirect_block);
+                vi->i_data[VVSFS_LAST_DIRECT_BLOCK_INDEX] = 0;
+            }
+            return -EIO;
+        }
+        vvsfs_journal_access(sb, bh);
+        for (; i < count; i++) {
+            write_int_to_buffer(
+                bh->b_data + (d_pos + i - VVSFS_LAST_DIRECT_BLOCK_INDEX) *
+                                 VVSFS_INDIRECT_PTR_SIZE,
+                newblock + i);
+            // Write through to the cached pointers
+            if (vi->i_indirect)
+                vi->i_indirect[d_pos + i - VVSFS_LAST_DIRECT_BLOCK_INDEX] =
+                    newblock + i;
+        }
+        vvsfs_mark_buffer_dirty(bh, &vi->vfs_inode);
+        brelse(bh);
+    }
+    vvsfs_assigned_blocks(vi, d_pos, count);
+    *first = newblock;
+    DEBUG_LOG("vvsfs - assign_data_blocks - done\n");
+    return count;
 }
 
 /* Given a position into the target inode data blocks,
@@ -770,74 +1106,174 @@ int vvsfs_index_data_block(struct vvsfs_inode_info *vi,
 int vvsfs_assign_data_block(struct vvsfs_inode_info *dir_info,
                             struct super_block *sb,
                             uint32_t d_pos) {
-    struct buffer_head *bh;
-    struct vvsfs_sb_info *sbi = sb->s_fs_info;
-    int offset;
-    uint32_t indirect_block;
     uint32_t newblock;
+    int ret;
     DEBUG_LOG("vvsfs - assign_data_block\n");
-    newblock = vvsfs_reserve_data_block(sbi->dmap);
-    if (!newblock) {
-        return -ENOSPC;
+    ret = vvsfs_assign_data_blocks(dir_info, sb, d_pos, 1, &newblock);
+    if (ret < 0) {
+        return ret;
     }
-    DEBUG_LOG("vvsfs - assign-data_block - current block count: %u\n",
-              dir_info->i_db_count);
-    if (d_pos < VVSFS_LAST_DIRECT_BLOCK_INDEX) {
-        DEBUG_LOG("vvsfs - assign_data_block - direct blocks free, allocating "
-                  "direct\n");
-        // Still have room in direct blocks, assign
-        // there
-        dir_info->i_data[d_pos] = newblock;
-        dir_info->i_db_count++;
-        goto done;
-    }
-    DEBUG_LOG("vvsfs - assign_data_block - no direct blocks free, allocating "
-              "indirect\n");
-    if (unlikely(dir_info->i_db_count < VVSFS_N_BLOCKS)) {
-        // We don't have a block to store indirect pointers
-        // use the newblock just allocated for consistency
-        // and reserve another block for the actual data
-        DEBUG_LOG("vvsfs - assign_data_block - indirect block not allocated, "
-                  "allocating\n");
-        indirect_block = newblock;
-        newblock = vvsfs_reserve_data_block(sbi->dmap);
-        if (!newblock) {
-            vvsfs_free_data_block(sbi->dmap, indirect_block);
-            return -ENOSPC;
+    DEBUG_LOG("vvsfs - assign_data_block - done\n");
+    return newblock;
+}
+
+/* Free a data block as part of a run of consecutive blocks,
+ * which is only freed (in one bitmap operation) once a block
+ * that does not extend it comes along, or at the end with
+ * vvsfs_free_run_flush.
+ *
+ * @map: Data block bitmap
+ * @run: First data block of the pending run
+ * @len: Length of the pending run (0 if none)
+ * @dno: Data block to free
+ */
+static void vvsfs_free_run_add(struct vvsfs_bitmap *map,
+                               uint32_t *run,
+                               uint32_t *len,
+                               uint32_t dno) {
+    if (*len && *run + *len == dno) {
+        (*len)++;
+        return;
+    }
+    if (*len) {
+        vvsfs_free_data_run(map, *run, *len);
+    }
+    *run = dno;
+    *len = 1;
+}
+
+static void
+vvsfs_free_run_flush(struct vvsfs_bitmap *map, uint32_t run, uint32_t len) {
+    if (len) {
+        vvsfs_free_data_run(map, run, len);
+    }
+}
+
+/* Free the data blocks mapped in a range of positions within
+ * the target inode data blocks, leaving holes in their place.
+ * The block list keeps its length. Only regular files have
+ * holes. The block map must be locked for writing (see
+ * vvsfs_map_lock).
+ *
+ * @vi: Inode information of target inode
+ * @sb: Superblock of the filesystem
+ * @first: First data block position to free
+ * @end: Data block position to stop before
+ *
+ * @return: (int) 0 if successful, error otherwise
+ */
+int vvsfs_punch_data_blocks(struct vvsfs_inode_info *vi,
+                            struct super_block *sb,
+                            uint32_t first,
+                            uint32_t end) {
+    struct vvsfs_sb_info *sbi = sb->s_fs_info;
+    struct buffer_head *bh;
+    uint32_t offset;
+    uint32_t dno;
+    uint32_t run = 0;
+    uint32_t len = 0;
+    uint32_t i;
+    int err = 0;
+    DEBUG_LOG("vvsfs - punch_data_blocks - %u to %u\n", first, end);
+    if (!S_ISREG(vi->vfs_inode.i_mode)) {
+        return -EINVAL;
+    }
+    if (vi->i_flags & VVSFS_INODE_EXTENTS) {
+        return vvsfs_ext_punch_blocks(vi, sb, first, end);
+    }
+    end = min(end, vi->i_db_count);
+    for (i = first; i < end && i < VVSFS_LAST_DIRECT_BLOCK_INDEX; i++) {
+        if (vi->i_data[i]) {
+            vvsfs_free_run_add(&sbi->dmap, &run, &len, vi->i_data[i]);
+            vi->i_data[i] = 0;
+            vi->i_holes++;
         }
-        dir_info->i_data[VVSFS_LAST_DIRECT_BLOCK_INDEX] = indirect_block;
     }
-    bh = READ_BLOCK(sb, dir_info, VVSFS_LAST_DIRECT_BLOCK_INDEX);
+    if (i >= end || !vi->i_data[VVSFS_LAST_DIRECT_BLOCK_INDEX]) {
+        goto out;
+    }
+    bh = READ_BLOCK(sb, vi, VVSFS_LAST_DIRECT_BLOCK_INDEX);
     if (!bh) {
-        DEBUG_LOG("vvsfs - assign_data_block - buffer read failed\n");
-        vvsfs_free_data_block(sbi->dmap, newblock);
-        vvsfs_free_data_block(sbi->dmap, indirect_block);
-        dir_info->i_data[VVSFS_LAST_DIRECT_BLOCK_INDEX] = 0;
-        return -EIO;
+        DEBUG_LOG("vvsfs - punch_data_blocks - buffer read failed\n");
+        err = -EIO;
+        goto out;
     }
-    dir_info->i_db_count++;
-    offset = (d_pos - VVSFS_LAST_DIRECT_BLOCK_INDEX) * VVSFS_INDIRECT_PTR_SIZE;
-    DEBUG_LOG("vvsfs - assign_data_block - indirect block offset: %d <- %u\n",
-              offset,
-              newblock);
-
-    write_int_to_buffer(bh->b_data + offset, newblock);
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
+    if ((err = vvsfs_journal_access(sb, bh))) {
+        brelse(bh);
+        goto out;
+    }
+    for (; i < end; i++) {
+        offset = (i - VVSFS_LAST_DIRECT_BLOCK_INDEX) * VVSFS_INDIRECT_PTR_SIZE;
+        dno = read_int_from_buffer(bh->b_data + offset);
+        if (!dno) {
+            continue;
+        }
+        vvsfs_free_run_add(&sbi->dmap, &run, &len, dno);
+        write_int_to_buffer(bh->b_data + offset, 0);
+        // Write through to the cached pointers
+        if (vi->i_indirect)
+            vi->i_indirect[i - VVSFS_LAST_DIRECT_BLOCK_INDEX] = 0;
+        vi->i_holes++;
+    }
+    vvsfs_mark_buffer_dirty(bh, &vi->vfs_inode);
     brelse(bh);
-done:
-    DEBUG_LOG("vvsfs - assign_data_block - done\n");
-    return newblock;
+out:
+    vvsfs_free_run_flush(&sbi->dmap, run, len);
+    return err;
+}
+
+/* Shorten the block list of a regular file, freeing every data
+ * block past its new end along with the indirect block once it
+ * is no longer needed. Runs of consecutive blocks are freed in
+ * one bitmap operation. The block map must be locked for
+ * writing (see vvsfs_map_lock), since the cached indirect
+ * pointers go with the indirect block.
+ *
+ * @vi: Inode information of target inode
+ * @sb: Superblock of the filesystem
+ * @end: New data block count of the inode
+ *
+ * @return: (int) 0 if successful, error otherwise
+ */
+int vvsfs_truncate_data_blocks(struct vvsfs_inode_info *vi,
+                               struct super_block *sb,
+                               uint32_t end) {
+    struct vvsfs_sb_info *sbi = sb->s_fs_info;
+    uint32_t removed;
+    int err;
+    DEBUG_LOG("vvsfs - truncate_data_blocks - %u to %u\n", vi->i_db_count, end);
+    if (end >= vi->i_db_count) {
+        return 0;
+    }
+    if ((err = vvsfs_punch_data_blocks(vi, sb, end, vi->i_db_count))) {
+        return err;
+    }
+    if (!(vi->i_flags & VVSFS_INODE_EXTENTS) &&
+        end <= VVSFS_LAST_DIRECT_BLOCK_INDEX &&
+        vi->i_data[VVSFS_LAST_DIRECT_BLOCK_INDEX]) {
+        vvsfs_drop_indirect(vi);
+        vvsfs_journal_forget(sb, vi->i_data[VVSFS_LAST_DIRECT_BLOCK_INDEX], 1);
+        vvsfs_free_data_block(&sbi->dmap,
+                              vi->i_data[VVSFS_LAST_DIRECT_BLOCK_INDEX]);
+        vi->i_data[VVSFS_LAST_DIRECT_BLOCK_INDEX] = 0;
+    }
+    // Everything past the new end is a hole now, and goes
+    removed = vi->i_db_count - end;
+    vi->i_holes -= removed;
+    vi->i_unwritten -= min(vi->i_unwritten, removed);
+    vi->i_db_count = end;
+    return 0;
 }
 
 // vvsfs_reserve_inode_block
 // @map: a bitmap representing inode blocks on disk
+// @goal: position in the map to search from, 0 for anywhere
 //
 // On success, this function returns a valid inode number and update the
 // corresponding inode bitmap. On failure, it will return 0 (which is an invalid
 // inode number), and leave the bitmap unchanged.
-uint32_t vvsfs_reserve_inode_block(uint8_t *map) {
-    uint32_t i = vvsfs_find_free_block(map, VVSFS_IMAP_SIZE);
+uint32_t vvsfs_reserve_inode_block(struct vvsfs_bitmap *map, uint32_t goal) {
+    uint32_t i = vvsfs_bitmap_reserve_run_goal(map, goal, 1);
     if (i == 0)
         return 0;
     return BNO_TO_INO(i);
@@ -858,7 +1294,7 @@ vvsfs_new_inode(const struct inode *dir, umode_t mode, dev_t rdev) {
     struct super_block *sb;
     struct vvsfs_sb_info *sbi;
     struct inode *inode;
-    unsigned long dno, ino;
+    unsigned long ino;
     int i;
 
     LOG("vvsfs - new inode\n");
@@ -870,11 +1306,11 @@ vvsfs_new_inode(const struct inode *dir, umode_t mode, dev_t rdev) {
 
     /*
         Find a spare inode in the vvsfs.
-        The vvsfs_reserve_inode_block() will attempt to find the first free
+        The vvsfs_reserve_inode_block() will attempt to find the next free
        inode and allocates it, and returns the inode number. Note that the inode
        number is *not* the same as the disk block address on disk.
     */
-    ino = vvsfs_reserve_inode_block(sbi->imap);
+    ino = vvsfs_reserve_inode_block(&sbi->imap, vvsfs_inode_goal(dir));
     if (BAD_INO(ino))
         return ERR_PTR(-ENOSPC);
 
@@ -882,8 +1318,7 @@ vvsfs_new_inode(const struct inode *dir, umode_t mode, dev_t rdev) {
     inode = new_inode(sb);
     if (!inode) {
         // if failed, release the inode/data blocks so they can be reused.
-        vvsfs_free_inode_block(sbi->imap, ino);
-        vvsfs_free_data_block(sbi->dmap, dno);
+        vvsfs_free_inode_block(&sbi->imap, ino);
         return ERR_PTR(-ENOMEM);
     }
 
@@ -897,7 +1332,7 @@ vvsfs_new_inode(const struct inode *dir, umode_t mode, dev_t rdev) {
     inode->i_ctime = inode->i_mtime = inode->i_atime = current_time(inode);
     inode->i_mode = mode;
     inode->i_size = 0;
-    inode->i_blocks = (VVSFS_BLOCKSIZE / VVSFS_SECTORSIZE);
+    inode->i_blocks = (sb->s_blocksize / VVSFS_SECTORSIZE);
     // increment the link counter. This basically increments inode->i_nlink,
     // but that member cannot be modified directly. Use instead set_nlink to set
     // it to a specific value.
@@ -907,7 +1342,7 @@ vvsfs_new_inode(const struct inode *dir, umode_t mode, dev_t rdev) {
     if (S_ISREG(mode)) {
         inode->i_op = &vvsfs_file_inode_operations;
         inode->i_fop = &vvsfs_file_operations;
-        inode->i_mapping->a_ops = &vvsfs_as_operations;
+        inode->i_mapping->a_ops = &vvsfs_file_aops;
     } else if (S_ISDIR(mode)) {
         inode->i_op = &vvsfs_dir_inode_operations;
         inode->i_fop = &vvsfs_dir_operations;
@@ -930,6 +1365,23 @@ vvsfs_new_inode(const struct inode *dir, umode_t mode, dev_t rdev) {
     inode_info->i_db_count = 0;
     for (i = 0; i < VVSFS_N_BLOCKS; ++i)
         inode_info->i_data[i] = 0;
+    inode_info->i_dx_block = 0;
+    inode_info->i_dx_order = 0;
+    inode_info->i_dir_count = 0;
+    inode_info->i_dir_hint = 0;
+    inode_info->i_unwritten = 0;
+    inode_info->i_untouched = 0;
+    inode_info->i_holes = 0;
+    // Regular files are extent mapped when the file system supports it,
+    // everything else keeps using block pointers
+    inode_info->i_flags = 0;
+    if (S_ISREG(mode) && (sbi->features & VVSFS_FEATURE_EXTENTS))
+        inode_info->i_flags |= VVSFS_INODE_EXTENTS;
+    // and start out with their data held in the inode when that is
+    // supported
+    if (S_ISREG(mode) && (sbi->features & VVSFS_FEATURE_INLINE_DATA))
+        inode_info->i_flags |= VVSFS_INODE_INLINE_DATA;
+    memset(inode_info->i_inline, 0, VVSFS_INLINE_SIZE);
 
     // Make sure you hash the inode, so that VFS can keep track of its "dirty"
     // status and writes it to disk if needed.
@@ -956,26 +1408,32 @@ static int vvsfs_add_new_entry(struct inode *dir,
     struct vvsfs_dir_entry *dent;
     struct buffer_head *bh;
     int num_dirs;
+    uint32_t per_block = VVSFS_DENTRIES_PER_BLOCK(sb->s_blocksize);
     uint32_t d_pos, d_off, dno;
     int newblock;
     int raw_dno;
+    int err;
+
+    if (vvsfs_dir_recs(sb)) {
+        return vvsfs_rec_add_entry(dir, dentry, inode);
+    }
 
     // calculate the number of entries from the i_size
     // of the directory's inode.
     num_dirs = dir->i_size / VVSFS_DENTRYSIZE;
-    if (num_dirs >= VVSFS_MAX_DENTRIES) {
+    if (num_dirs >= per_block * VVSFS_INODE_BLOCKS(sb->s_blocksize)) {
         DEBUG_LOG("vvsfs - add_new_entry - exceeded max dentries %d >= %u, "
                   "(i_size: %lld)\n",
                   num_dirs,
-                  (uint32_t)VVSFS_MAX_DENTRIES,
+                  per_block * VVSFS_INODE_BLOCKS(sb->s_blocksize),
                   dir->i_size);
         return -ENOSPC;
     }
 
     // Calculate the position of the new entry within
     // the data blocks
-    d_pos = num_dirs / VVSFS_N_DENTRY_PER_BLOCK;
-    d_off = num_dirs % VVSFS_N_DENTRY_PER_BLOCK;
+    d_pos = num_dirs / per_block;
+    d_off = num_dirs % per_block;
     DEBUG_LOG(
         "vvsfs - add_new_entry - position: %u, offset: %u\n", d_pos, d_off);
 
@@ -1004,7 +1462,7 @@ static int vvsfs_add_new_entry(struct inode *dir,
         "d_pos: %d, block: %d\n",
         dno,
         d_pos,
-        vvsfs_get_data_block(dno));
+        vvsfs_get_data_block(sb, dno));
 
     // Note that the i_data contains the data block
     // position within the data bitmap, This needs to
@@ -1016,12 +1474,19 @@ static int vvsfs_add_new_entry(struct inode *dir,
         DEBUG_LOG("vvsfs - add_new_entry - failed to read target data block\n");
         return -ENOMEM;
     }
+    if ((err = vvsfs_journal_access(sb, bh))) {
+        brelse(bh);
+        return err;
+    }
     dent = READ_DENTRY(bh, d_off);
     strncpy(dent->name, dentry->d_name.name, dentry->d_name.len);
-    dent->name[dentry->d_name.len] = '\0';
+    if (dentry->d_name.len < VVSFS_MAXNAME)
+        dent->name[dentry->d_name.len] = '\0';
+    // Without types, this is the NUL after a name of VVSFS_MAXNAME
+    dent->file_type = vvsfs_dir_types(sb) ? fs_umode_to_dtype(inode->i_mode)
+                                          : DT_UNKNOWN;
     dent->inode_number = inode->i_ino;
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
+    vvsfs_mark_buffer_dirty(bh, dir);
     brelse(bh);
 
     DEBUG_LOG("vvsfs - add_new_entry - directory "
@@ -1029,10 +1494,11 @@ static int vvsfs_add_new_entry(struct inode *dir,
               "block %d\n",
               dent->name,
               dent->inode_number,
-              vvsfs_get_data_block(dno));
+              vvsfs_get_data_block(sb, dno));
 
     dir->i_size = (num_dirs + 1) * VVSFS_DENTRYSIZE;
-    dir->i_blocks = dir_info->i_db_count * (VVSFS_BLOCKSIZE / VVSFS_SECTORSIZE);
+    vvsfs_dx_add_entry(dir, dentry->d_name.name, dentry->d_name.len, num_dirs);
+    dir->i_blocks = dir_info->i_db_count * (sb->s_blocksize / VVSFS_SECTORSIZE);
     dir->i_ctime = dir->i_mtime = current_time(dir);
     mark_inode_dirty(dir);
     return 0;
@@ -1053,12 +1519,12 @@ vvsfs_create(struct mnt_idmap *namespace,
              bool excl) {
     struct vvsfs_inode_info *dir_info;
     int ret;
-    struct buffer_head *bh;
+    int started;
     struct inode *inode;
 
     LOG("vvsfs - create : %s\n", dentry->d_name.name);
 
-    if (dentry->d_name.len > VVSFS_MAXNAME) {
+    if (dentry->d_name.len > vvsfs_max_name(dir->i_sb)) {
         LOG("vvsfs - create - file name too long");
         return -ENAMETOOLONG;
     }
@@ -1069,12 +1535,14 @@ vvsfs_create(struct mnt_idmap *namespace,
         return -EINVAL;
     }
 
+    started = vvsfs_journal_start(dir->i_sb);
+
     // create a new inode for the new file/directory
     inode = vvsfs_new_inode(dir, mode, 0);
     if (IS_ERR(inode)) {
         LOG("vvsfs - create - new_inode error!");
-        brelse(bh);
-        return -ENOSPC;
+        ret = -ENOSPC;
+        goto out;
     }
 
     // add the file/directory to the parent
@@ -1085,7 +1553,7 @@ vvsfs_create(struct mnt_idmap *namespace,
                   "block\n");
         vvsfs_drop_inode_link(inode);
         discard_new_inode(inode);
-        return ret;
+        goto out;
     }
 
     // attach the new inode object to the VFS
@@ -1093,137 +1561,9 @@ vvsfs_create(struct mnt_idmap *namespace,
     d_instantiate(dentry, inode);
 
     LOG("File created %ld\n", inode->i_ino);
-    return 0;
-}
-
-/* Read all direct block dentries into memory for a given inode
- *
- * @vi: Inode information for target inode
- * @sb: Superblock of the filesystem
- * @data: Data array to write dentries into
- * @db_count: Number of data blocks
- *
- * @return: (int) 0 if successful, error otherwise
- */
-static int vvsfs_read_dentries_direct(struct vvsfs_inode_info *vi,
-                                      struct super_block *sb,
-                                      bytearray_t data) {
-    struct buffer_head *bh;
-    int i;
-    uint32_t db_count;
-    DEBUG_LOG("vvsfs - read_dentries_direct\n");
-    // Ensure that we do not read the last block which is an indirection pointer
-    db_count = min((uint32_t)VVSFS_LAST_DIRECT_BLOCK_INDEX, vi->i_db_count);
-    DEBUG_LOG("vvsfs - read_dentires_direct - reading %u data blocks\n",
-              db_count);
-    for (i = 0; i < db_count; ++i) {
-        LOG("vvsfs - read_dentries_direct - reading dno: %d, disk block: %d",
-            vi->i_data[i],
-            vvsfs_get_data_block(vi->i_data[i]));
-        bh = READ_BLOCK(sb, vi, i);
-        if (!bh) {
-            // Buffer read failed, no more data when we expected some
-            DEBUG_LOG("vvsfs - read_dentries_direct - failed buffer read\n");
-            return -EIO;
-        }
-        // Copy the dentry into the data array
-        memcpy(data + i * VVSFS_BLOCKSIZE, bh->b_data, VVSFS_BLOCKSIZE);
-        brelse(bh);
-    }
-    DEBUG_LOG("vvsfs - read_dentries_direct - done\n");
-    return 0;
-}
-
-/* Read all indirect block dentries into memory for a given inode
- *
- * @vi: Inode information for target inode
- * @sb: Superblock of the filesystem
- * @data: Data array to write dentries into
- * @db_count: Number of data blocks
- *
- * @return: (int) 0 if successful, error otherwise
- */
-static int vvsfs_read_dentries_indirect(struct vvsfs_inode_info *vi,
-                                        struct super_block *sb,
-                                        bytearray_t data) {
-    struct buffer_head *i_bh;
-    struct buffer_head *bh;
-    int i;
-    uint32_t db_count;
-    uint32_t offset;
-    DEBUG_LOG("vvsfs - read_dentries_indirect\n");
-    i_bh = READ_BLOCK(sb, vi, VVSFS_LAST_DIRECT_BLOCK_INDEX);
-    if (!i_bh) {
-        // Buffer read failed, no more data when we expected some
-        DEBUG_LOG("vvsfs - read_dentries_indirect - failed buffer read\n");
-        return -EIO;
-    }
-    db_count = vi->i_db_count - VVSFS_LAST_DIRECT_BLOCK_INDEX;
-    DEBUG_LOG("vvsfs - read_dentries_indirect - reading %u data blocks\n",
-              db_count);
-    for (i = 0; i < db_count; ++i) {
-        offset =
-            read_int_from_buffer(i_bh->b_data + (i * VVSFS_INDIRECT_PTR_SIZE));
-        LOG("vvsfs - read_entries_indirect - reading dno: %d, disk block: %u\n",
-            offset,
-            vvsfs_get_data_block(offset));
-        bh = READ_BLOCK_OFF(sb, offset);
-        if (!bh) {
-            // Buffer read failed, no more data when we expected some
-            brelse(i_bh);
-            DEBUG_LOG("vvsfs - read_dentries_indirect - failed buffer read\n");
-            return -EIO;
-        }
-        // Copy the dentry into the data array
-        memcpy(data + i * VVSFS_BLOCKSIZE, bh->b_data, VVSFS_BLOCKSIZE);
-        brelse(bh);
-    }
-    brelse(i_bh);
-    DEBUG_LOG("vvsfs - read_dentries_indirect - done\n");
-    return 0;
-}
-
-// vvsfs_read_dentries - reads all dentries into memory for a given inode
-//
-// @dir: Directory inode to read from
-// @num_dirs: (output) count of dentries
-// @return: (char*) data buffer returned contains all dentry data, this *MUST*
-//                  be freed after use via `kfree(data)`
-//
-// @return: (bytearray_t) data buffer returned contains all dentry data, this
-//          *MUST* be freed after use via `kfree(data)`
-bytearray_t vvsfs_read_dentries(struct inode *dir, int *num_dirs) {
-    struct vvsfs_inode_info *vi;
-    struct super_block *sb;
-    int err;
-    bytearray_t data;
-    DEBUG_LOG("vvsfs - read_dentries\n");
-    // Retrieve vvsfs specific inode data from dir inode
-    vi = VVSFS_I(dir);
-    // Calculate number of dentries
-    *num_dirs = dir->i_size / VVSFS_DENTRYSIZE;
-    // Retrieve superblock object for R/W to disk blocks
-    sb = dir->i_sb;
-    DEBUG_LOG("vvsfs - read_dentries - number of dentries to read %d - %d\n",
-              *num_dirs,
-              vi->i_db_count);
-    // Read all dentries into mem
-    data = kzalloc(vi->i_db_count * VVSFS_BLOCKSIZE, GFP_KERNEL);
-    if (!data) {
-        return ERR_PTR(-ENOMEM);
-    }
-    if ((err = vvsfs_read_dentries_direct(vi, sb, data))) {
-        kfree(data);
-        return ERR_PTR(err);
-    }
-    if (vi->i_db_count >= VVSFS_N_BLOCKS &&
-        (err = vvsfs_read_dentries_indirect(
-             vi, sb, data + VVSFS_BUFFER_INDIRECT_OFFSET))) {
-        kfree(data);
-        return ERR_PTR(err);
-    }
-    DEBUG_LOG("vvsfs - read_dentries - done");
-    return data;
+out:
+    vvsfs_journal_stop(dir->i_sb, started);
+    return ret;
 }
 
 // vvsfs_lookup - A file/directory name in a directory. It basically attaches
@@ -1231,42 +1571,35 @@ bytearray_t vvsfs_read_dentries(struct inode *dir, int *num_dirs) {
 //                of the file to the directory entry.
 static struct dentry *
 vvsfs_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags) {
-    int num_dirs;
-    int i;
     struct inode *inode = NULL;
-    struct vvsfs_dir_entry *dent;
-    const char *target_name;
-    int target_name_len;
-    bytearray_t data;
-    target_name = (char *)dentry->d_name.name;
-    target_name_len = dentry->d_name.len;
+    struct bufloc_t loc;
+    uint32_t inumber;
+    int err;
     DEBUG_LOG("vvsfs - lookup\n");
-    if (dentry->d_name.len > VVSFS_MAXNAME) {
+    if (dentry->d_name.len > vvsfs_max_name(dir->i_sb)) {
         printk("vvsfs - lookup - file name too long");
         return ERR_PTR(-ENAMETOOLONG);
     }
 
-    data = vvsfs_read_dentries(dir, &num_dirs);
-    if (IS_ERR(data)) {
-        int err = PTR_ERR(data);
-        DEBUG_LOG("vvsfs - lookup - failed cached dentries read: %d\n", err);
+    // Only the block holding the entry is read, either
+    // through the hashed index or a block by block scan
+    err = vvsfs_find_entry(
+        dir, dentry, BL_PERSIST_BUFFER | BL_PERSIST_DENTRY, &loc);
+    if (err < 0) {
+        DEBUG_LOG("vvsfs - lookup - failed to search entries: %d\n", err);
         return ERR_PTR(err);
     }
-    for (i = 0; i < num_dirs; ++i) {
-        dent = READ_DENTRY_OFF(data, i);
-        if (namecmp(dent->name, target_name, target_name_len)) {
-            inode = vvsfs_iget(dir->i_sb, dent->inode_number);
-            if (!inode) {
-                DEBUG_LOG("vvsfs - lookup - failed to get inode: %u\n",
-                          dent->inode_number);
-                kfree(data);
-                return ERR_PTR(-EACCES);
-            }
-            d_add(dentry, inode);
-            break;
+    if (!err) {
+        inumber = vvsfs_dir_recs(dir->i_sb) ? loc.rec->inode_number
+                                            : loc.dentry->inode_number;
+        brelse(loc.bh);
+        inode = vvsfs_iget(dir->i_sb, inumber);
+        if (IS_ERR(inode)) {
+            DEBUG_LOG("vvsfs - lookup - failed to get inode: %u\n", inumber);
+            return ERR_CAST(inode);
         }
     }
-    kfree(data);
+    d_add(dentry, inode);
     DEBUG_LOG("vvsfs - lookup - done\n");
     return NULL;
 }
@@ -1294,11 +1627,12 @@ static int vvsfs_link(struct dentry *old_dentry,
                       struct dentry *dentry) {
     struct vvsfs_inode_info *dir_info;
     int ret;
+    int started;
     struct inode *inode;
 
     LOG("vvsfs - link : %s\n", dentry->d_name.name);
 
-    if (dentry->d_name.len > VVSFS_MAXNAME) {
+    if (dentry->d_name.len > vvsfs_max_name(dir->i_sb)) {
         LOG("vvsfs - link - file name too long");
         return -ENAMETOOLONG;
     }
@@ -1310,6 +1644,7 @@ static int vvsfs_link(struct dentry *old_dentry,
     }
 
     inode = d_inode(old_dentry);
+    started = vvsfs_journal_start(dir->i_sb);
 
     // minix and ext2 update the ctime so I think its
     // correct
@@ -1326,13 +1661,15 @@ static int vvsfs_link(struct dentry *old_dentry,
         // error so decrease the ref counts
         inode_dec_link_count(inode);
         iput(inode);
-        return ret;
+        goto out;
     }
 
     d_instantiate(dentry, inode);
 
     LOG("Link created %ld\n", inode->i_ino);
-    return 0;
+out:
+    vvsfs_journal_stop(dir->i_sb, started);
+    return ret;
 }
 
 /* Unlink a dentry from a given directory inode
@@ -1344,25 +1681,29 @@ static int vvsfs_link(struct dentry *old_dentry,
  */
 static int vvsfs_unlink(struct inode *dir, struct dentry *dentry) {
     int err;
+    int started;
     struct bufloc_t loc;
     struct inode *inode = d_inode(dentry);
     DEBUG_LOG("vvsfs - unlink\n");
-    if (dentry->d_name.len > VVSFS_MAXNAME) {
+    if (dentry->d_name.len > vvsfs_max_name(dir->i_sb)) {
         printk("vvsfs - unlink - file name too long");
         return -ENAMETOOLONG;
     }
 
+    started = vvsfs_journal_start(dir->i_sb);
+
     err = vvsfs_find_entry(
         dir, dentry, BL_PERSIST_BUFFER | BL_PERSIST_DENTRY, &loc);
     if (err) {
         DEBUG_LOG("vvsfs - unlink - failed to find entry\n");
-        return -ENOENT;
+        err = -ENOENT;
+        goto out;
     }
     err = vvsfs_delete_entry_bufloc(dir, &loc);
     if (err) {
         DEBUG_LOG("vvsfs - unlink - failed to delete "
                   "entry\n");
-        return err;
+        goto out;
     }
 
     inode->i_ctime = dir->i_ctime;
@@ -1370,10 +1711,12 @@ static int vvsfs_unlink(struct inode *dir, struct dentry *dentry) {
     err = vvsfs_drop_inode_link(inode);
     if (err) {
         DEBUG_LOG("vvsfs - unlink - failed to free inode blocks\n");
-        return err;
+        goto out;
     }
 
     DEBUG_LOG("vvsfs - unlink - done\n");
+out:
+    vvsfs_journal_stop(dir->i_sb, started);
     return err;
 }
 
@@ -1424,8 +1767,11 @@ static int vvsfs_empty_dir(struct inode *dir) {
     struct vvsfs_inode_info *vi;
     struct buffer_head *bh;
     int i;
+    int raw_dno;
     int last_block_dentry_count;
     int current_block_dentry_count;
+    uint32_t count;
+    int err;
     DEBUG_LOG("vvsfs - empty_dir\n");
 
     // Check that this is actually a directory
@@ -1434,6 +1780,15 @@ static int vvsfs_empty_dir(struct inode *dir) {
         return -ENOTDIR;
     }
 
+    if (vvsfs_dir_recs(dir->i_sb)) {
+        // Directories of records have no '.' or '..' entries
+        if ((err = vvsfs_rec_count(dir, &count))) {
+            return err;
+        }
+        DEBUG_LOG("vvsfs - empty_dir - done (%u records)\n", count);
+        return count == 0;
+    }
+
     // Retrieve vvsfs specific inode data from dir inode
     vi = VVSFS_I(dir);
     LAST_BLOCK_DENTRY_COUNT(dir, last_block_dentry_count);
@@ -1445,11 +1800,16 @@ static int vvsfs_empty_dir(struct inode *dir) {
     // Progressively load datablocks into memory and
     // check dentries
     for (i = 0; i < vi->i_db_count; i++) {
+        raw_dno = vvsfs_index_data_block(vi, dir->i_sb, i);
+        if (raw_dno < 0) {
+            DEBUG_LOG("vvsfs - empty_dir - failed to index block %d\n", i);
+            return raw_dno;
+        }
         LOG("vvsfs - empty_dir - reading dno: %d, "
             "disk block: %d\n",
-            vi->i_data[i],
-            vvsfs_get_data_block(vi->i_data[i]));
-        bh = READ_BLOCK(dir->i_sb, vi, i);
+            raw_dno,
+            vvsfs_get_data_block(dir->i_sb, raw_dno));
+        bh = READ_BLOCK_OFF(dir->i_sb, raw_dno);
         if (!bh) {
             // Buffer read failed, no more data when
             // we expected some
@@ -1459,7 +1819,8 @@ static int vvsfs_empty_dir(struct inode *dir) {
         }
         current_block_dentry_count = i == vi->i_db_count - 1
                                          ? last_block_dentry_count
-                                         : VVSFS_N_DENTRY_PER_BLOCK;
+                                         : VVSFS_DENTRIES_PER_BLOCK(
+                                               dir->i_sb->s_blocksize);
         // Check if there are any non-reserved
         // dentries
         if (!vvsfs_dir_only_reserved(bh, dir, current_block_dentry_count)) {
@@ -1484,23 +1845,30 @@ static int vvsfs_empty_dir(struct inode *dir) {
 static int vvsfs_rmdir(struct inode *dir, struct dentry *dentry) {
     struct inode *inode = d_inode(dentry);
     int err = -ENOTEMPTY;
+    int started;
     if (!vvsfs_empty_dir(inode)) {
         LOG("vvsfs - rmdir - directory is not "
             "empty\n");
         return err;
-    } else if ((err = vvsfs_unlink(dir, dentry))) {
+    }
+    started = vvsfs_journal_start(dir->i_sb);
+    if ((err = vvsfs_unlink(dir, dentry))) {
         DEBUG_LOG("vvsfs - rmdir - unlink error: %d\n", err);
-        return err;
+        goto out;
     }
     inode->i_size = 0;
     DEBUG_LOG("vvsfs - rmdir - done\n");
     mark_inode_dirty(dir);
     mark_inode_dirty(inode);
+out:
+    vvsfs_journal_stop(dir->i_sb, started);
     return err;
 }
 
 // The "symlink" operation.
-// Creates a new inode and stores the symlink pointer in the data
+// Creates a new inode and stores the symlink pointer in the data, or in
+// the inode itself if it is short enough and the file system has the
+// inline data feature.
 static int
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
 vvsfs_symlink(struct user_namespace *namespace,
@@ -1511,13 +1879,16 @@ vvsfs_symlink(struct mnt_idmap *namespace,
               struct dentry *dentry,
               const char *symname) {
     struct vvsfs_inode_info *dir_info;
+    struct vvsfs_sb_info *sbi = dir->i_sb->s_fs_info;
+    struct vvsfs_inode_info *inode_info;
+    size_t len = strlen(symname);
     int err;
-    struct buffer_head *bh;
+    int started;
     struct inode *inode;
 
     DEBUG_LOG("vvsfs - symlink : %s\n", dentry->d_name.name);
 
-    if (dentry->d_name.len > VVSFS_MAXNAME) {
+    if (dentry->d_name.len > vvsfs_max_name(dir->i_sb)) {
         LOG("vvsfs - symlink - file name too long");
         return -ENAMETOOLONG;
     }
@@ -1528,19 +1899,35 @@ vvsfs_symlink(struct mnt_idmap *namespace,
         return -EINVAL;
     }
 
+    started = vvsfs_journal_start(dir->i_sb);
+
     // create a new inode for the new file/directory
     inode = vvsfs_new_inode(dir, S_IFLNK | S_IRWXUGO, 0);
     if (IS_ERR(inode)) {
         LOG("vvsfs - symlink - new_inode error!");
-        brelse(bh);
-        return -ENOSPC;
+        err = -ENOSPC;
+        goto out;
     }
 
-    err = page_symlink(inode, symname, strlen(symname) + 1);
+    inode_info = VVSFS_I(inode);
+    if ((sbi->features & VVSFS_FEATURE_INLINE_DATA) &&
+        len < VVSFS_INLINE_SIZE) {
+        // i_inline was zeroed by vvsfs_new_inode, so the target
+        // stays NUL terminated
+        memcpy(inode_info->i_inline, symname, len);
+        inode_info->i_flags |= VVSFS_INODE_INLINE_DATA;
+        inode->i_size = len;
+        inode->i_blocks = 0;
+        inode->i_link = (char *)inode_info->i_inline;
+        inode->i_op = &vvsfs_fast_symlink_inode_operations;
+        err = 0;
+    } else {
+        err = page_symlink(inode, symname, len + 1);
+    }
     if (err) {
         vvsfs_drop_inode_link(inode);
         discard_new_inode(inode);
-        return err;
+        goto out;
     }
 
     // add the file/directory to the parent directory's list
@@ -1549,7 +1936,7 @@ vvsfs_symlink(struct mnt_idmap *namespace,
     if (err != 0) {
         vvsfs_drop_inode_link(inode);
         discard_new_inode(inode);
-        return err;
+        goto out;
     }
 
     d_instantiate(dentry, inode);
@@ -1557,7 +1944,9 @@ vvsfs_symlink(struct mnt_idmap *namespace,
 
     // attach the new inode object to the VFS directory entry object.
     DEBUG_LOG("Symlink created %ld\n", inode->i_ino);
-    return 0;
+out:
+    vvsfs_journal_stop(dir->i_sb, started);
+    return err;
 }
 
 // The "mknod" function
@@ -1568,9 +1957,9 @@ static int vvsfs_mknod(struct user_namespace *mnt_userns,
                        umode_t mode,
                        dev_t rdev) {
     int ret;
+    int started;
     struct inode *inode;
     struct vvsfs_inode_info *dir_info;
-    struct buffer_head *bh;
 
     if (DEBUG)
         printk("vvsfs - mknod : %s\n", dentry->d_name.name);
@@ -1578,7 +1967,7 @@ static int vvsfs_mknod(struct user_namespace *mnt_userns,
     if (!old_valid_dev(rdev))
         return -EINVAL;
 
-    if (dentry->d_name.len > VVSFS_MAXNAME) {
+    if (dentry->d_name.len > vvsfs_max_name(dir->i_sb)) {
         printk("vvsfs - mknod - file name too long");
         return -ENAMETOOLONG;
     }
@@ -1589,12 +1978,14 @@ static int vvsfs_mknod(struct user_namespace *mnt_userns,
         return -EINVAL;
     }
 
+    started = vvsfs_journal_start(dir->i_sb);
+
     // create a new inode for the new file/directory
     inode = vvsfs_new_inode(dir, mode, rdev);
     if (IS_ERR(inode)) {
         printk("vvsfs - mknod - new_inode error!");
-        brelse(bh);
-        return -ENOSPC;
+        ret = -ENOSPC;
+        goto out;
     }
 
     // add the file/directory to the parent directory's list
@@ -1603,14 +1994,16 @@ static int vvsfs_mknod(struct user_namespace *mnt_userns,
     if (ret != 0) {
         vvsfs_drop_inode_link(inode);
         discard_new_inode(inode);
-        return ret;
+        goto out;
     }
 
     // attach the new inode object to the VFS directory entry object.
     d_instantiate(dentry, inode);
 
     printk("vvsfs - mknod - created %ld\n", inode->i_ino);
-    return 0;
+out:
+    vvsfs_journal_stop(dir->i_sb, started);
+    return ret;
 }
 
 /**
@@ -1619,7 +2012,7 @@ static int vvsfs_mknod(struct user_namespace *mnt_userns,
  * @dentry: target dentry to update the inode number of
  * @existing_inode: the inode which the dentry currently points to
  *      Note: the link count and modification time of this inode will be updated
- * @replacement_inode_no: the new inode number to store in the dentry
+ * @replacement_inode: the new inode to store in the dentry
  *
  * It is the responsibility of the calling function to update the link count
  * of the replacement inode depending on the circumstance (e.g. mv, link)
@@ -1627,7 +2020,7 @@ static int vvsfs_mknod(struct user_namespace *mnt_userns,
 static int vvsfs_dentry_exchange_inode(struct inode *dir,
                                        struct dentry *dentry,
                                        struct inode *existing_inode,
-                                       uint32_t replacement_inode_no) {
+                                       struct inode *replacement_inode) {
     int err;
     struct bufloc_t loc;
 
@@ -1639,13 +2032,25 @@ static int vvsfs_dentry_exchange_inode(struct inode *dir,
         return -ENOENT;
     }
 
+    err = vvsfs_journal_access(dir->i_sb, loc.bh);
+    if (err) {
+        brelse(loc.bh);
+        return err;
+    }
+
     // Update the dentry to point to the new inode
-    loc.dentry->inode_number = replacement_inode_no;
-    mark_buffer_dirty(loc.bh);
-    // We sync this data to disk now. Although another dentry may also point to
-    // this inode, that is better than potentially having a point in time where
-    // this dentry is not pointing to any inode
-    sync_dirty_buffer(loc.bh);
+    if (vvsfs_dir_recs(dir->i_sb)) {
+        loc.rec->inode_number = replacement_inode->i_ino;
+        loc.rec->file_type = fs_umode_to_dtype(replacement_inode->i_mode);
+    } else {
+        loc.dentry->inode_number = replacement_inode->i_ino;
+        if (vvsfs_dir_types(dir->i_sb))
+            loc.dentry->file_type =
+                fs_umode_to_dtype(replacement_inode->i_mode);
+    }
+    // The dentry is updated in place, so there is never a point in time where
+    // it does not point to any inode, even before it reaches the disk
+    vvsfs_mark_buffer_dirty(loc.bh, dir);
     brelse(loc.bh);
 
     // We have changed a dentry, so update the parent directory time stats
@@ -1672,6 +2077,7 @@ static int vvsfs_rename(struct user_namespace *namespace,
                         struct dentry *new_dentry,
                         unsigned int flags) {
     int err;
+    int started;
     struct bufloc_t src_loc;
     struct inode *old_inode = d_inode(old_dentry);
     struct inode *new_inode = d_inode(new_dentry);
@@ -1696,7 +2102,7 @@ static int vvsfs_rename(struct user_namespace *namespace,
     }
 
     // Check the filename isn't too long
-    if (new_dentry->d_name.len > VVSFS_MAXNAME) {
+    if (new_dentry->d_name.len > vvsfs_max_name(new_dir->i_sb)) {
         DEBUG_LOG("vvsfs - rename - file name too long");
         return -ENAMETOOLONG;
     }
@@ -1735,23 +2141,28 @@ static int vvsfs_rename(struct user_namespace *namespace,
         return -EISDIR;
     }
 
+    // All directory updates of the rename commit together
+    started = vvsfs_journal_start(old_dir->i_sb);
+
     // Find the original dentry for the file
     err = vvsfs_find_entry(
         old_dir, old_dentry, BL_PERSIST_BUFFER | BL_PERSIST_DENTRY, &src_loc);
     if (err) {
         DEBUG_LOG("vvsfs - rename - failed to find entry\n");
-        return -ENOENT;
+        err = -ENOENT;
+        goto out;
     }
 
     // If there already exists a file at the destination, we need to overwrite
     // the dentry to point to the source inode
     if (new_inode) {
         err = vvsfs_dentry_exchange_inode(
-            new_dir, new_dentry, new_inode, src_loc.dentry->inode_number);
+            new_dir, new_dentry, new_inode, old_inode);
         if (err) {
             DEBUG_LOG("vvsfs - rename - failed to exchange the inode of an "
                       "existing dentry\n");
-            return err;
+            brelse(src_loc.bh);
+            goto out;
         }
     } else {
         // Copy the dentry to the new location
@@ -1761,7 +2172,7 @@ static int vvsfs_rename(struct user_namespace *namespace,
             DEBUG_LOG(
                 "vvsfs - rename - failed to create dentry in new location\n");
             brelse(src_loc.bh);
-            return err;
+            goto out;
         }
     }
 
@@ -1771,11 +2182,13 @@ static int vvsfs_rename(struct user_namespace *namespace,
     err = vvsfs_delete_entry_bufloc(old_dir, &src_loc);
     if (err) {
         DEBUG_LOG("vvsfs - rename - failed to delete entry\n");
-        return err;
+        goto out;
     }
 
     DEBUG_LOG("vvsfs - rename - done\n");
-    return 0;
+out:
+    vvsfs_journal_stop(old_dir->i_sb, started);
+    return err;
 }
 
 const struct inode_operations vvsfs_dir_inode_operations = {
@@ -1793,3 +2206,10 @@ const struct inode_operations vvsfs_dir_inode_operations = {
 const struct inode_operations vvsfs_symlink_inode_operations = {
     .get_link = page_get_link,
 };
+
+// Fast symlinks keep their target in inode->i_link, which
+// simple_get_link returns without sleeping, so they can be followed
+// in RCU path walk mode.
+const struct inode_operations vvsfs_fast_symlink_inode_operations = {
+    .get_link = simple_get_link,
+};
@@ -1,7 +1,19 @@
 #ifndef VVSFS_H
 #define VVSFS_H
 
-#define VVSFS_BLOCKSIZE 1024 // filesystem blocksize
+/* Geometry
+ *
+ * The block size, the number of inodes and the size of the
+ * file system are chosen by mkfs and recorded in the super
+ * block, from which the kernel derives the location of the
+ * bitmaps, the inode table and the data blocks (see struct
+ * vvsfs_sb_info). The constants below describe the default
+ * geometry, which is also that of images formatted before
+ * the geometry was recorded (s_block_size of 0).
+ */
+#define VVSFS_BLOCKSIZE 1024 // default filesystem blocksize
+#define VVSFS_MIN_BLOCKSIZE 1024
+#define VVSFS_MAX_BLOCKSIZE 4096 // at most the page size
 #define VVSFS_SECTORSIZE 512 // disk sector size
 #define VVSFS_INODESIZE 256  // inode size
 #define VVSFS_N_INODE_PER_BLOCK                                                \
@@ -15,14 +27,132 @@
 #define VVSFS_DATA_BLOCK_OFF 4100 // location of first data block
 #define VVSFS_INDIRECT_PTR_SIZE ((sizeof(uint32_t)))
 #define VVSFS_LAST_DIRECT_BLOCK_INDEX (VVSFS_N_BLOCKS - 1)
-#define VVSFS_BUFFER_INDIRECT_OFFSET                                           \
-    (VVSFS_LAST_DIRECT_BLOCK_INDEX * VVSFS_BLOCKSIZE)
 #define VVSFS_MAX_INDIRECT_PTRS ((VVSFS_BLOCKSIZE / VVSFS_INDIRECT_PTR_SIZE))
 #define VVSFS_MAX_INODE_BLOCKS ((VVSFS_N_BLOCKS - 1 + VVSFS_MAX_INDIRECT_PTRS))
 #define VVSFS_IMAP_INODES_PER_ENTRY 8
 #define VVSFS_MAX_INODE_ENTRIES (VVSFS_IMAP_SIZE * VVSFS_IMAP_INODES_PER_ENTRY)
 #define VVSFS_MAX_DENTRIES ((VVSFS_N_DENTRY_PER_BLOCK * VVSFS_MAX_INODE_BLOCKS))
 #define VVSFS_MAXFILESIZE ((VVSFS_BLOCKSIZE * VVSFS_MAX_INODE_BLOCKS))
+// The same, for a block size of bs
+#define VVSFS_INDIRECT_PTRS(bs) ((bs) / VVSFS_INDIRECT_PTR_SIZE)
+#define VVSFS_INODE_BLOCKS(bs) ((VVSFS_N_BLOCKS - 1 + VVSFS_INDIRECT_PTRS(bs)))
+// Bytes of data per inode mkfs sizes the inode table for when
+// given the size of the file system
+#define VVSFS_DEFAULT_INODE_RATIO 8192
+
+/* Hashed directory index
+ *
+ * Directories larger than a single data block carry an
+ * open addressing (linear probing) hash table, stored in
+ * a contiguous run of 2^i_dx_order data blocks. Each
+ * entry is a 32-bit big-endian value holding the upper
+ * 16 bits of the name hash (the tag) and the dentry slot
+ * + 1, so that 0 marks an empty entry. In directories of
+ * variable-length records, the slot is the directory
+ * block holding the record instead. The home bucket
+ * of an entry is derived from its tag, which allows
+ * deletions to backward shift entries rather than
+ * leaving tombstones.
+ */
+#define VVSFS_DX_ENTRY_SIZE ((sizeof(uint32_t)))
+#define VVSFS_DX_ENTRIES_PER_BLOCK(bs) ((bs) / VVSFS_DX_ENTRY_SIZE)
+// The same, for the default block size
+#define VVSFS_DX_ENTRIES_PER_DEFAULT_BLOCK                                     \
+    VVSFS_DX_ENTRIES_PER_BLOCK(VVSFS_BLOCKSIZE)
+#define VVSFS_DX_SLOT_BITS 16
+#define VVSFS_DX_SLOT_MASK ((1 << VVSFS_DX_SLOT_BITS) - 1)
+#define VVSFS_DX_MAX_ORDER 4
+/* Maximum number of entries held by an index of a given
+ * order and block size, keeping the load factor at or
+ * below 3/4 */
+#define VVSFS_DX_CAPACITY(bs, order)                                           \
+    (((VVSFS_DX_ENTRIES_PER_BLOCK(bs) << (order)) * 3) / 4)
+
+/* Extent mapped files
+ *
+ * File systems created with the extents feature map the
+ * data of regular files as (logical, physical, length)
+ * extents rather than block pointers. The first extents
+ * are held inline in the i_block area of the inode, the
+ * remainder in a single overflow block. Extents are kept
+ * sorted by logical block so lookups are a binary search.
+ */
+#define VVSFS_FEATURE_EXTENTS 0x1 // s_features: extent mapped files
+#define VVSFS_FEATURE_JOURNAL 0x2 // s_features: metadata journal
+#define VVSFS_FEATURE_JBD2 0x4    // s_features: jbd2 metadata journal
+#define VVSFS_FEATURE_INLINE_DATA 0x8 // s_features: inline file data
+#define VVSFS_FEATURE_DIR_RECS 0x10   // s_features: variable-length dirents
+#define VVSFS_FEATURE_DIR_TYPES 0x20  // s_features: file types in dentries
+#define VVSFS_FEATURE_SUPPORTED                                                \
+    ((VVSFS_FEATURE_EXTENTS | VVSFS_FEATURE_JOURNAL | VVSFS_FEATURE_JBD2 |     \
+      VVSFS_FEATURE_INLINE_DATA | VVSFS_FEATURE_DIR_RECS |                     \
+      VVSFS_FEATURE_DIR_TYPES))
+#define VVSFS_INODE_EXTENTS 0x1 // i_flags: i_block holds extents
+#define VVSFS_N_INLINE_EXTENTS 4
+#define VVSFS_EXTENT_SIZE ((sizeof(struct vvsfs_extent)))
+#define VVSFS_EXTENTS_PER_BLOCK(bs) ((bs) / VVSFS_EXTENT_SIZE)
+#define VVSFS_MAX_EXTENTS(bs)                                                  \
+    ((VVSFS_N_INLINE_EXTENTS + VVSFS_EXTENTS_PER_BLOCK(bs)))
+
+/* Metadata journal
+ *
+ * File systems created with a journal reserve a run of
+ * data blocks for it, recorded in the super block. The
+ * first block of the run holds the journal super block,
+ * the rest is the log. Metadata updates (the super block,
+ * bitmaps, inodes and directory, index, indirect and
+ * extent blocks) are grouped into transactions, each of
+ * which is written at the start of the log as descriptor
+ * blocks listing the home locations of the blocks that
+ * follow them, then a commit block holding a checksum of
+ * everything before it. Only once the commit block is on
+ * disk are the blocks written to their home locations, so
+ * the log holds at most one transaction that may need to
+ * be replayed at mount.
+ */
+#define VVSFS_JOURNAL_MAGIC 0x4A524E4C
+#define VVSFS_JOURNAL_DESCRIPTOR 1 // jh_type: descriptor block
+#define VVSFS_JOURNAL_COMMIT 2     // jh_type: commit block
+#define VVSFS_JOURNAL_TAGS(bs)                                                 \
+    (((bs) - sizeof(struct vvsfs_journal_header) - sizeof(uint32_t)) /         \
+     sizeof(uint32_t)) // home locations per descriptor block
+#define VVSFS_JOURNAL_MIN_BLOCKS 64
+#define VVSFS_JOURNAL_MAX_BLOCKS 4096
+#define VVSFS_JOURNAL_DEFAULT_BLOCKS 1024
+
+/* jbd2 journal
+ *
+ * Alternatively, the journal is kept by the kernel's jbd2
+ * layer in an internal, extent mapped regular file with a
+ * reserved inode number, which is not linked into any
+ * directory. mkfs lays the file out over the journal run
+ * of data blocks and writes the jbd2 super block into its
+ * first block.
+ */
+#define VVSFS_JBD2_INUM 2 // inode of the jbd2 journal file
+#define VVSFS_JBD2_MAGIC 0xC03B3998
+#define VVSFS_JBD2_SUPERBLOCK_V2 4
+// jbd2 refuses journals of less than 1024 blocks
+#define VVSFS_JBD2_MIN_BLOCKS 1024
+
+/* Inline data
+ *
+ * On file systems created with the inline data feature, the
+ * data of a small regular file is kept in the otherwise unused
+ * tail of its on-disk inode, after struct vvsfs_inode, rather
+ * than in a data block. Files start out inline, and move to
+ * data blocks for good once they grow past the tail. Bytes of
+ * the tail past the end of the file are kept zeroed.
+ *
+ * Symlinks whose target fits in the tail along with its
+ * terminating NUL are fast symlinks: the target is kept there
+ * for good, and is followed straight from the in-memory copy.
+ */
+#define VVSFS_INODE_INLINE_DATA 0x2 // i_flags: data held in the inode
+#define VVSFS_INLINE_SIZE ((VVSFS_INODESIZE - sizeof(struct vvsfs_inode)))
+// Alignment of the inode cache objects, which start with the in-memory
+// copy of the data, so that the copy never straddles a page
+#define VVSFS_INLINE_ALIGN 256
 
 #ifdef __KERNEL__
 #include <asm/uaccess.h>
@@ -31,15 +161,21 @@
 #include <linux/errno.h>
 #include <linux/fs.h>
 #include <linux/init.h>
+#include <linux/jbd2.h>
 #include <linux/kernel.h>
 #include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/mpage.h>
+#include <linux/percpu_counter.h>
 #include <linux/proc_fs.h>
+#include <linux/rwsem.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/statfs.h>
 #include <linux/types.h>
 #include <linux/version.h>
+#include <linux/workqueue.h>
 #else
 #include <stdint.h>
 #include <string.h>
@@ -54,16 +190,91 @@
 
 /*
 
-super block:    [info               ]          1 block (only 4 bytes used)
-                [inode maps         ]          1 block (only 512 bytes used)
-                [data block maps    ]          2 blocks
-inode table:    [inode table        ]        512*8 blocks
-data blocks:    [data blocks        ]       2048*8 blocks
+super block:    [info               ]          1 block
+group 0:        [inode maps         ]          s_imap_blocks
+                [data block maps    ]          s_dmap_blocks
+                [inode table        ]          s_inode_blocks
+                [data blocks        ]          the rest of the group
+group 1:        ...
 
 inode size: 256 bytes
 
+With s_groups set, the file system is split into block groups
+of s_group_blocks blocks (the last one may be shorter), each
+with its own maps, s_group_inodes inodes and data blocks.
+Inode and data block numbers are numbered per group in steps
+of the bits held by its map blocks; the bits past the end of
+a group (or its inodes) are set in its map, so that runs of
+data blocks never span groups.
+
+Without s_groups, the file system is a single group taking
+up all of it. With the default geometry, the inode map is 1
+block (only 512 bytes used), the data map 2 blocks, the inode
+table 512*8 blocks and there are 2048*8 data blocks.
+
 */
 
+/* On-disk super block. The free counts are a snapshot taken at
+ * the last sync_fs, the authoritative counts are recomputed
+ * from the bitmaps at mount. The geometry fields are 0 on
+ * images that predate them, which have the default geometry.
+ */
+struct vvsfs_super_block {
+    uint32_t s_magic;
+    uint32_t s_free_blocks;    /* free data blocks */
+    uint32_t s_free_inodes;    /* free inodes */
+    uint32_t s_features;       /* VVSFS_FEATURE_* flags */
+    uint32_t s_journal_block;  /* first data block of the journal */
+    uint32_t s_journal_blocks; /* journal size in blocks (0 if none) */
+    uint32_t s_block_size;     /* bytes per block */
+    uint32_t s_blocks_count;   /* blocks in the file system */
+    uint32_t s_inodes_count;   /* inodes (bits in the inode map) */
+    uint32_t s_data_blocks;    /* data blocks (bits in the data map) */
+    uint32_t s_imap_blocks;    /* inode map blocks, from block 1 */
+    uint32_t s_dmap_blocks;    /* data map blocks, after the inode map */
+    uint32_t s_inode_blocks;   /* inode table blocks, after the data map */
+    uint32_t s_groups;         /* block groups, 0 for a single one */
+    uint32_t s_group_blocks;   /* blocks per group */
+    uint32_t s_group_inodes;   /* inodes per group */
+};
+
+struct vvsfs_journal_super {
+    uint32_t js_magic;
+    uint32_t js_blocks;   /* journal size, including this block */
+    uint32_t js_sequence; /* earlier transactions are all checkpointed */
+};
+
+struct vvsfs_journal_header {
+    uint32_t jh_magic;
+    uint32_t jh_type;     /* VVSFS_JOURNAL_DESCRIPTOR or _COMMIT */
+    uint32_t jh_sequence; /* transaction the block belongs to */
+};
+
+struct vvsfs_journal_descriptor {
+    struct vvsfs_journal_header jd_header;
+    uint32_t jd_count; /* number of blocks following this one */
+    uint32_t jd_blocks[]; /* their home locations */
+};
+
+struct vvsfs_journal_commit {
+    struct vvsfs_journal_header jc_header;
+    uint32_t jc_checksum; /* crc32 of the descriptor and logged blocks */
+};
+
+struct vvsfs_extent {
+    uint32_t e_lblk; /* first logical block in the file */
+    uint32_t e_pblk; /* first data block map index */
+    uint32_t e_len;  /* number of blocks */
+};
+
+/* Layout of the i_block area of an extent mapped inode */
+struct vvsfs_extent_root {
+    struct vvsfs_extent er_extents[VVSFS_N_INLINE_EXTENTS];
+    uint32_t er_count;    /* total number of extents */
+    uint32_t er_reserved; /* zero */
+    uint32_t er_block;    /* overflow extent block (0 if none) */
+};
+
 struct vvsfs_inode {
     uint32_t i_mode;
     uint32_t i_size;        // Size in bytes
@@ -72,26 +283,76 @@ struct vvsfs_inode {
         i_data_blocks_count;          /* Data block counts, for block size
                                          VVSFS_BLOCKSIZE.     Note that this may not be
                                          the same as VFS inode i_blocks member. */
-    uint32_t i_block[VVSFS_N_BLOCKS]; /* Pointers to blocks */
+    union {
+        uint32_t i_block[VVSFS_N_BLOCKS]; /* Pointers to blocks */
+        struct vvsfs_extent_root i_ext;   /* VVSFS_INODE_EXTENTS */
+    };
     uint32_t i_uid;                   // User id
     uint32_t i_gid;                   // Group id
     uint32_t i_atime;                 // Access time
     uint32_t i_mtime;                 // Modification time
     uint32_t i_ctime;                 // Creation time
     uint32_t i_rdev;                  // rdev stuff (for special files)
+    uint32_t i_dx_block; // First data block of the hashed directory index
+    uint32_t i_dx_order; // Hashed directory index size (log2 of blocks)
+    uint32_t i_flags;    // VVSFS_INODE_* flags
+    uint32_t i_unwritten; // Trailing blocks preallocated but not written
+    uint32_t i_holes;     // Blocks below i_data_blocks_count not allocated
 };
 
 #define VVSFS_MAXNAME 123 // maximum size of filename
+// With VVSFS_FEATURE_DIR_TYPES, the byte after the name holds its type
+#define VVSFS_MAXNAME_TYPED (VVSFS_MAXNAME - 1)
 
 struct vvsfs_dir_entry {
-    char name[VVSFS_MAXNAME + 1];
+    char name[VVSFS_MAXNAME];
+    // DT_* type of the inode with VVSFS_FEATURE_DIR_TYPES, otherwise the NUL
+    // after a name of VVSFS_MAXNAME
+    uint8_t file_type;
     uint32_t inode_number;
 };
 
+/* Variable-length directory entries
+ *
+ * On file systems with VVSFS_FEATURE_DIR_RECS, directory blocks
+ * hold a chain of records in the style of ext2 rather than fixed
+ * size dentries, each only as long as its name needs. rec_len
+ * leads from a record to the next, and the records of a block
+ * cover it exactly. New records are carved out of the slack at
+ * the end of a record, and a removed record is merged into the
+ * one before it, or just has its inode number cleared if it is
+ * the first of its block. Records never move, so the hashed
+ * directory index refers to the block of a record rather than
+ * its slot. The size of such a directory is its blocks times
+ * the block size.
+ *
+ * Records keep the length and the hash (vvsfs_name_hash) of
+ * their name, so that lookups pass over other records without
+ * comparing names.
+ */
+struct vvsfs_dir_rec {
+    uint32_t inode_number; // 0 for a free record
+    uint32_t hash;         // vvsfs_name_hash of the name
+    uint16_t rec_len;      // Bytes from this record to the next
+    uint8_t name_len;      // Length of the name (not NUL terminated)
+    uint8_t file_type;     // DT_* type of the inode
+    char name[];
+};
+
+#define VVSFS_REC_ALIGN 4
+// Bytes taken by a record with a name of the given length
+#define VVSFS_REC_LEN(name_len)                                                \
+    (((sizeof(struct vvsfs_dir_rec) + (name_len) + VVSFS_REC_ALIGN - 1) &      \
+      ~(VVSFS_REC_ALIGN - 1)))
+#define VVSFS_REC_AT(data, offset)                                             \
+    ((struct vvsfs_dir_rec *)((data) + (offset)))
+
 #define VVSFS_DENTRYSIZE ((sizeof(struct vvsfs_dir_entry)))
 #define VVSFS_N_DENTRY_PER_BLOCK                                               \
     ((VVSFS_BLOCKSIZE /                                                        \
       VVSFS_DENTRYSIZE)) // maximum number of directory entries per block
+// The same, for a block size of bs
+#define VVSFS_DENTRIES_PER_BLOCK(bs) ((bs) / VVSFS_DENTRYSIZE)
 
 /* Calculate the number of dentries in the last data
  * block
@@ -102,8 +363,10 @@ struct vvsfs_dir_entry {
  * @return: (int) count of dentries
  */
 #define LAST_BLOCK_DENTRY_COUNT(dir, count)                                    \
-    (count) = ((dir)->i_size / VVSFS_DENTRYSIZE) % VVSFS_N_DENTRY_PER_BLOCK;   \
-    (count) = (count) == 0 ? VVSFS_N_DENTRY_PER_BLOCK : (count)
+    (count) = ((dir)->i_size / VVSFS_DENTRYSIZE) %                             \
+              VVSFS_DENTRIES_PER_BLOCK((dir)->i_sb->s_blocksize);              \
+    (count) = (count) == 0 ? VVSFS_DENTRIES_PER_BLOCK((dir)->i_sb->s_blocksize) \
+                           : (count)
 
 /* Determine if a given name and inode represent a
  * non-reserved dentry (e.g. not '.' or '..')
@@ -121,16 +384,32 @@ struct vvsfs_dir_entry {
 
 #ifdef __KERNEL__
 
-#define VVSFS_SET_MAP_BIT 0x80
-
 // Operations
 extern const struct address_space_operations vvsfs_as_operations;
+extern const struct address_space_operations vvsfs_file_aops;
+extern const struct iomap_ops vvsfs_iomap_ops;
+extern void vvsfs_da_release(struct inode *inode);
+extern const struct iomap_ops vvsfs_seek_iomap_ops;
+extern int
+vvsfs_iomap_prealloc(struct inode *inode, uint32_t first, uint32_t end);
+extern int vvsfs_iomap_punch(struct inode *inode, uint32_t first, uint32_t end);
+extern int vvsfs_iomap_truncate(struct inode *inode, uint32_t first);
+extern int vvsfs_iomap_uninline(struct inode *inode);
+extern void vvsfs_iomap_written(struct inode *inode,
+                                loff_t offset,
+                                size_t size,
+                                int error);
+extern void vvsfs_ioend_work(struct work_struct *work);
 extern const struct inode_operations vvsfs_file_inode_operations;
 extern const struct file_operations vvsfs_file_operations;
 extern const struct inode_operations vvsfs_dir_inode_operations;
 extern const struct file_operations vvsfs_dir_operations;
 extern const struct super_operations vvsfs_ops;
 extern const struct inode_operations vvsfs_symlink_inode_operations;
+extern const struct inode_operations vvsfs_fast_symlink_inode_operations;
+extern int
+vvsfs_fsync(struct file *file, loff_t start, loff_t end, int datasync);
+extern int vvsfs_flush_device(struct super_block *sb);
 
 // inode cache -- this is used to attach vvsfs specific inode
 // data to the vfs inode
@@ -143,27 +422,158 @@ typedef uint8_t *bytearray_t;
 
 // A "container" structure that keeps the VFS inode and additional on-disk data.
 struct vvsfs_inode_info {
+    uint8_t i_inline[VVSFS_INLINE_SIZE]; /* VVSFS_INODE_INLINE_DATA */
     uint32_t i_db_count;             /* Data blocks count */
-    uint32_t i_data[VVSFS_N_BLOCKS]; /* Pointers to blocks */
+    union {
+        uint32_t i_data[VVSFS_N_BLOCKS]; /* Pointers to blocks */
+        struct vvsfs_extent_root i_ext;  /* VVSFS_INODE_EXTENTS */
+    };
+    uint32_t i_flags;                /* VVSFS_INODE_* flags */
+    uint32_t *i_indirect; /* Decoded indirect pointers (NULL until used) */
+    uint32_t i_dx_block;             /* First hashed index block (0 if none) */
+    uint32_t i_dx_order;             /* Hashed index size (log2 of blocks) */
+    uint32_t i_dir_count; /* Records of a directory (or VVSFS_DIR_COUNT_UNKNOWN) */
+    uint32_t i_dir_hint;  /* No directory block before this has free room */
+    uint32_t i_unwritten;  /* Trailing blocks that read back as zeroes */
+    uint32_t i_untouched;  /* Trailing unwritten blocks no write reached */
+    struct list_head i_written; /* Unwritten ranges with data on disk */
+    uint32_t i_holes;      /* Blocks below i_db_count that are holes */
+    uint32_t i_da_blocks;  /* Blocks past i_db_count awaiting allocation */
+    uint32_t i_prealloc_first; /* Blocks assigned by the write in progress */
+    uint32_t i_prealloc_end;   /* (vvsfs_prealloc_range), none if equal */
+    struct mutex i_da_lock; /* Serialises allocation at the end of the file */
+    struct rw_semaphore i_map_sem; /* Block map, see vvsfs_map_lock */
+    spinlock_t i_ioend_lock;    /* Protects i_ioends */
+    struct list_head i_ioends;  /* Completed writeback of unwritten blocks */
+    struct work_struct i_ioend_work; /* Records i_ioends, vvsfs_ioend_work */
+    struct list_head i_journal; /* Entry in the running transaction */
+    unsigned long i_jflags;     /* VVSFS_I_* bits, under the journal */
+    tid_t i_sync_tid;           /* jbd2 transaction fsync waits for */
+    tid_t i_datasync_tid;       /* jbd2 transaction fdatasync waits for */
     struct inode vfs_inode;
 };
 
+/* In-memory allocation bitmap. Bits are held in little-endian
+ * bit order (bit n is bit n % 8 of byte n / 8) so that the map
+ * can be scanned a word at a time with the kernel bitops. Note
+ * that this is the reverse of the on-disk bit order within each
+ * byte, which is converted on load and sync.
+ *
+ * Bits are only ever set and cleared with atomic bitops, so
+ * allocators on different CPUs do not serialise on a lock:
+ * each searches from its own next-fit hint, the hints start
+ * spread out over the map, and bits another CPU took first
+ * only move the search along. The free and held counts are
+ * per-CPU counters, whose exact sums are only taken (under
+ * hold_lock) once the map runs low.
+ *
+ * The on-disk map may span several blocks, of which only the
+ * ones that changed since they were last stored are written
+ * back (dirty).
+ *
+ * The map is split into groups of group_bits bits, one per
+ * block group, with a count of the free bits in each. The
+ * search for a run stays within a group, and skips the
+ * groups with too few free bits.
+ */
+struct vvsfs_bitmap {
+    uint8_t *map;               /* bitmap data */
+    uint32_t bits;              /* number of bits tracked */
+    uint32_t __percpu *hint;    /* per-CPU rotating next-fit search start */
+    struct percpu_counter free; /* clear bits, excluding bit 0 */
+    struct percpu_counter held; /* clear bits held back from allocation */
+    spinlock_t hold_lock;       /* serialises holds when the map is low */
+    uint32_t block_bits;        /* bits per on-disk map block */
+    uint32_t blocks;            /* on-disk map blocks */
+    unsigned long *dirty;       /* map blocks changed since last stored */
+    uint32_t group_bits;        /* bits per group, whole map blocks */
+    uint32_t groups;            /* number of groups */
+    atomic_t *group_free;       /* clear bits in each group */
+};
+
+// i_dir_count until the records of the directory have been counted
+#define VVSFS_DIR_COUNT_UNKNOWN ((uint32_t)-1)
+
 struct vvsfs_sb_info {
-    uint64_t nblocks; /* max supported blocks */
-    uint64_t ninodes; /* max supported inodes */
-    uint8_t *imap; /* inode blocks map */
-    uint8_t *dmap; /* data blocks map  */
+    uint64_t nblocks; /* blocks in the file system */
+    uint64_t ninodes; /* inodes in the file system */
+    uint32_t data_blocks; /* data blocks */
+    uint32_t imap_block;  /* first block of the inode map of group 0 */
+    uint32_t dmap_block;  /* first block of the data map of group 0 */
+    uint32_t inode_block; /* first block of the inode table of group 0 */
+    uint32_t data_block;  /* first data block of group 0 */
+    uint32_t inodes_per_block; /* inodes per inode table block */
+    uint32_t groups;       /* block groups, 1 without s_groups */
+    uint32_t group_blocks; /* blocks per group */
+    uint32_t group_inodes; /* inodes per group */
+    uint32_t group_data;   /* data blocks per group, but the last */
+    uint32_t ino_stride;   /* inode numbers per group */
+    uint32_t dno_stride;   /* data block numbers per group */
+    struct vvsfs_bitmap imap; /* inode blocks map */
+    struct vvsfs_bitmap dmap; /* data blocks map  */
+    uint32_t features;        /* VVSFS_FEATURE_* flags */
+    struct vvsfs_journal *journal; /* NULL without VVSFS_FEATURE_JOURNAL */
+    journal_t *jbd2;               /* NULL without VVSFS_FEATURE_JBD2 */
+    struct workqueue_struct *ioend_wq; /* runs vvsfs_ioend_work */
+    struct mutex flush_lock; /* serialises device cache flushes */
+    uint64_t flush_seq;      /* cache flushes started */
+    int flush_err;           /* result of the last cache flush */
 };
 
+/* In-memory state of the metadata journal (journal.c).
+ * Operations that update several metadata blocks hold a
+ * handle (the barrier, shared) for their duration, and a
+ * commit holds the barrier exclusively so that it only
+ * ever captures whole operations.
+ */
+struct vvsfs_journal {
+    struct super_block *sb;
+    uint32_t start;       /* disk block of the journal super block */
+    uint32_t blocks;      /* journal size, including the super block */
+    uint32_t max_buffers; /* most blocks a single transaction can log */
+    uint32_t fs_info;     /* blocks of the free counts and bitmaps */
+    uint32_t sequence;    /* sequence of the running transaction */
+    struct rw_semaphore barrier;  /* handles shared, commit exclusive */
+    struct mutex lock;            /* protects the running transaction */
+    struct buffer_head **buffers; /* blocks of the running transaction */
+    struct buffer_head **log;     /* log blocks of the committing one */
+    uint32_t nbuffers;
+    spinlock_t inode_lock;    /* protects inodes and ninodes */
+    struct list_head inodes;  /* inodes dirtied in the running transaction */
+    uint32_t ninodes;
+    unsigned long flags;      /* VVSFS_JOURNAL_* bits */
+    struct delayed_work commit_work;
+};
+
+// Commit at the end of the current handle (flags bit)
+#define VVSFS_JOURNAL_FORCE 0
+// An inode was evicted from the running transaction (flags bit)
+#define VVSFS_JOURNAL_EVICTED 1
+// A transaction outgrew the journal, nothing is committed (flags bit)
+#define VVSFS_JOURNAL_ABORTED 2
+// i_jflags: the running transaction holds metadata that the
+// data of the inode depends on (size, block mappings)
+#define VVSFS_I_DATASYNC 0
+// Running transactions are committed at least this often (seconds)
+#define VVSFS_JOURNAL_COMMIT_INTERVAL 5
+// Blocks a single handle may add to the running transaction
+#define VVSFS_JOURNAL_CREDITS 32
+// Blocks a handle keeps in reserve for the super block and the
+// bitmap blocks it changed, which are added when it stops
+#define VVSFS_FS_INFO_CREDITS 4
+
 /* Representation of a location of a dentry within
  * the data blocks.
  */
 struct __attribute__((packed)) bufloc_t {
     int b_index;                    // Data block index
-    int d_index;                    // Dentry index within data block
+    int d_index;                    // Dentry index (record offset) in block
     unsigned flags;                 // Flags used to construct instance
     struct buffer_head *bh;         // Data block
-    struct vvsfs_dir_entry *dentry; // Matched entry
+    union {
+        struct vvsfs_dir_entry *dentry; // Matched entry
+        struct vvsfs_dir_rec *rec;      // Matched record (DIR_RECS)
+    };
 };
 
 /* Compare the names of dentries, checks length before comparing
@@ -177,8 +587,30 @@ struct __attribute__((packed)) bufloc_t {
  */
 __attribute__((always_inline)) static inline bool
 namecmp(const char *name, const char *target_name, int target_name_len) {
-    return strlen(name) == target_name_len &&
-           strncmp(name, target_name, target_name_len) == 0;
+    // The length check is the NUL after target_name_len characters,
+    // rather than a strlen over the whole name
+    return name[target_name_len] == '\0' &&
+           memcmp(name, target_name, target_name_len) == 0;
+}
+
+/* Hash a dentry name with 32-bit FNV-1a. The result is
+ * persisted in the hashed directory index, so unlike
+ * full_name_hash it must not depend on the host.
+ *
+ * @name: Name of the dentry
+ * @len: Length of name
+ *
+ * @return: (uint32_t) hash of the name
+ */
+__attribute__((always_inline)) static inline uint32_t
+vvsfs_name_hash(const char *name, int len) {
+    uint32_t hash = 0x811C9DC5;
+    int i;
+    for (i = 0; i < len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 0x01000193;
+    }
+    return hash;
 }
 
 /* Persist the struct buffer_head object in bufloc_t
@@ -213,6 +645,232 @@ extern int vvsfs_resolve_bufloc(struct inode *dir,
                          struct vvsfs_inode_info *vi,
                          struct bufloc_t *bufloc);
 
+/* Populate a bufloc for a matched dentry, persisting the
+ * buffer and dentry according to the flags. If the
+ * buffer is not persisted, it is released.
+ *
+ * @out_loc: Bufloc to populate
+ * @bh: Data block buffer containing the dentry
+ * @dentry: Matched dentry (or record) within bh
+ * @b_index: Data block index within the directory
+ * @d_index: Dentry index within the data block
+ * @flags: Behaviour flags for bufloc_t construction
+ */
+extern void vvsfs_fill_bufloc(struct bufloc_t *out_loc,
+                              struct buffer_head *bh,
+                              void *dentry,
+                              int b_index,
+                              int d_index,
+                              unsigned flags);
+
+/* Find an entry within a directory through its hashed
+ * index. Only valid if the directory has an index
+ * (i_dx_block != 0).
+ *
+ * @dir: Directory inode to search
+ * @name: Name of the target dentry
+ * @len: Length of name
+ * @flags: Behavioural flags for bufloc_t data
+ * @out_loc: Returned data for location of entry if
+ * found
+ *
+ * @return: (int): 0 if found, 1 if not found,
+ * otherwise an error
+ */
+extern int vvsfs_dx_find_entry(struct inode *dir,
+                               const char *name,
+                               int len,
+                               unsigned flags,
+                               struct bufloc_t *out_loc);
+
+/* Record a newly added dentry in the hashed directory
+ * index, building or growing the index as needed. Must
+ * be called after the directory i_size accounts for the
+ * new dentry. Failures drop the index, leaving the
+ * directory to be searched linearly.
+ *
+ * @dir: Directory inode
+ * @name: Name of the new dentry
+ * @len: Length of name
+ * @slot: Position of the dentry within the directory
+ */
+extern void vvsfs_dx_add_entry(struct inode *dir,
+                               const char *name,
+                               int len,
+                               uint32_t slot);
+
+/* Remove a dentry from the hashed directory index.
+ * Failures drop the index.
+ *
+ * @dir: Directory inode
+ * @name: Name of the removed dentry
+ * @len: Length of name
+ * @slot: Position of the dentry within the directory
+ */
+extern void vvsfs_dx_remove_entry(struct inode *dir,
+                                  const char *name,
+                                  int len,
+                                  uint32_t slot);
+
+/* Update the hashed directory index for a dentry that
+ * has moved to a different slot. Failures drop the
+ * index.
+ *
+ * @dir: Directory inode
+ * @name: Name of the moved dentry
+ * @len: Length of name
+ * @from: Previous position of the dentry
+ * @to: New position of the dentry
+ */
+extern void vvsfs_dx_move_entry(struct inode *dir,
+                                const char *name,
+                                int len,
+                                uint32_t from,
+                                uint32_t to);
+
+/* Release the hashed directory index blocks of a
+ * directory, if it has any.
+ *
+ * @dir: Directory inode
+ */
+extern void vvsfs_dx_free(struct inode *dir);
+
+/* Determine if directories of a file system are made of
+ * variable-length records (struct vvsfs_dir_rec) rather
+ * than fixed size dentries
+ *
+ * @sb: Superblock of the filesystem
+ *
+ * @return: (bool) true for records
+ */
+__attribute__((always_inline)) static inline bool
+vvsfs_dir_recs(const struct super_block *sb) {
+    return ((struct vvsfs_sb_info *)sb->s_fs_info)->features &
+           VVSFS_FEATURE_DIR_RECS;
+}
+
+/* Determine if the fixed size dentries of a file system
+ * record the type of their inode. Records always do.
+ *
+ * @sb: Superblock of the filesystem
+ *
+ * @return: (bool) true if dentries hold a type
+ */
+__attribute__((always_inline)) static inline bool
+vvsfs_dir_types(const struct super_block *sb) {
+    return ((struct vvsfs_sb_info *)sb->s_fs_info)->features &
+           VVSFS_FEATURE_DIR_TYPES;
+}
+
+/* Find the longest name the directories of a file system
+ * hold. Dentries with a type give up a byte of the name.
+ *
+ * @sb: Superblock of the filesystem
+ *
+ * @return: (uint32_t) maximum name length
+ */
+__attribute__((always_inline)) static inline uint32_t
+vvsfs_max_name(const struct super_block *sb) {
+    if (vvsfs_dir_types(sb) && !vvsfs_dir_recs(sb))
+        return VVSFS_MAXNAME_TYPED;
+    return VVSFS_MAXNAME;
+}
+
+/* Check the record at a given offset of a directory
+ * block and find the one after it
+ *
+ * @dir: Directory inode
+ * @bh: Directory block
+ * @offset: Offset of a record within the block
+ *
+ * @return: (int) offset of the next record (the block
+ *          size after the last), or -EIO if the record
+ *          is corrupt
+ */
+extern int vvsfs_rec_next(struct inode *dir,
+                          struct buffer_head *bh,
+                          uint32_t offset);
+
+/* Find a record within a directory block by name. The
+ * block is released unless the record is found and the
+ * flags persist it.
+ *
+ * @dir: Directory inode
+ * @bh: Directory block
+ * @b_index: Index of the block within the directory
+ * @name: Name of the target record
+ * @len: Length of name
+ * @hash: vvsfs_name_hash of name
+ * @flags: Behaviour flags for bufloc_t construction
+ * @out_loc: Returned location of the record if found
+ *
+ * @return: (int) 0 if found, 1 if not found, error
+ *          otherwise
+ */
+extern int vvsfs_rec_find_in_block(struct inode *dir,
+                                   struct buffer_head *bh,
+                                   int b_index,
+                                   const char *name,
+                                   int len,
+                                   uint32_t hash,
+                                   unsigned flags,
+                                   struct bufloc_t *out_loc);
+
+/* Find a record within a directory by scanning its
+ * blocks
+ *
+ * @dir: Directory inode
+ * @name: Name of the target record
+ * @len: Length of name
+ * @flags: Behaviour flags for bufloc_t construction
+ * @out_loc: Returned location of the record if found
+ *
+ * @return: (int) 0 if found, 1 if not found, error
+ *          otherwise
+ */
+extern int vvsfs_rec_find_entry(struct inode *dir,
+                                const char *name,
+                                int len,
+                                unsigned flags,
+                                struct bufloc_t *out_loc);
+
+/* Add a record for an inode to a directory, in the first
+ * block with room for it or else in a new block
+ *
+ * @dir: Directory inode
+ * @dentry: Dentry of the new entry
+ * @inode: Inode the entry refers to
+ *
+ * @return: (int) 0 if successful, error otherwise
+ */
+extern int vvsfs_rec_add_entry(struct inode *dir,
+                               struct dentry *dentry,
+                               struct inode *inode);
+
+/* Remove the record of a bufloc from its block, which
+ * must be resolved and have journal access
+ *
+ * @dir: Directory inode
+ * @bufloc: Location of the record
+ *
+ * @return: (int) 0 if successful, error otherwise
+ */
+extern int vvsfs_rec_delete_entry(struct inode *dir, struct bufloc_t *bufloc);
+
+/* Count the records of a directory, reading its blocks
+ * only the first time after the inode is read
+ *
+ * @dir: Directory inode
+ * @count: Returned number of records
+ *
+ * @return: (int) 0 if successful, error otherwise
+ */
+extern int vvsfs_rec_count(struct inode *dir, uint32_t *count);
+
+// Drop the cached indirect block pointers of an inode
+extern void vvsfs_drop_indirect(struct vvsfs_inode_info *vi);
+extern void vvsfs_drop_written(struct vvsfs_inode_info *vi);
+
 /* Calculate the data block map index for a given position
  * within the given inode data blocks.
  *
@@ -227,6 +885,128 @@ extern int vvsfs_index_data_block(struct vvsfs_inode_info *vi,
                                   struct super_block *sb,
                                   uint32_t d_pos);
 
+// Extent mapping (extent.c), used for inodes with the
+// VVSFS_INODE_EXTENTS flag in place of the block pointer
+// functions below.
+extern int vvsfs_ext_index_block(struct vvsfs_inode_info *vi,
+                                 struct super_block *sb,
+                                 uint32_t lblk);
+extern int vvsfs_ext_index_run(struct vvsfs_inode_info *vi,
+                               struct super_block *sb,
+                               uint32_t lblk,
+                               uint32_t max,
+                               uint32_t *dno);
+extern int vvsfs_ext_assign_blocks(struct vvsfs_inode_info *vi,
+                                   struct super_block *sb,
+                                   uint32_t d_pos,
+                                   uint32_t count,
+                                   uint32_t *first);
+extern int vvsfs_ext_free_blocks(struct vvsfs_inode_info *vi,
+                                 struct super_block *sb);
+extern int vvsfs_ext_hole_run(struct vvsfs_inode_info *vi,
+                              struct super_block *sb,
+                              uint32_t lblk,
+                              uint32_t max);
+extern int vvsfs_ext_punch_blocks(struct vvsfs_inode_info *vi,
+                                  struct super_block *sb,
+                                  uint32_t first,
+                                  uint32_t end);
+
+// maximum number of data blocks an inode can map
+__attribute__((always_inline))
+static inline uint32_t
+vvsfs_max_file_blocks(const struct vvsfs_inode_info *vi) {
+    struct super_block *sb = vi->vfs_inode.i_sb;
+    struct vvsfs_sb_info *sbi = sb->s_fs_info;
+    // An extent mapped file may span every data block on disk
+    return (vi->i_flags & VVSFS_INODE_EXTENTS)
+               ? sbi->data_blocks
+               : VVSFS_INODE_BLOCKS(sb->s_blocksize);
+}
+
+// i_blocks of an inode: its allocated data blocks, in 512 byte
+// sectors. Holes take up no space.
+__attribute__((always_inline)) static inline blkcnt_t
+vvsfs_i_blocks(const struct vvsfs_inode_info *vi) {
+    return (blkcnt_t)(vi->i_db_count - vi->i_holes) *
+           (vi->vfs_inode.i_sb->s_blocksize / VVSFS_SECTORSIZE);
+}
+
+// Account for count blocks assigned at d_pos, which is either a
+// hole (that may run on past the end of the block list) or the end
+// of the block list
+__attribute__((always_inline)) static inline void
+vvsfs_assigned_blocks(struct vvsfs_inode_info *vi,
+                      uint32_t d_pos,
+                      uint32_t count) {
+    if (d_pos < vi->i_db_count)
+        vi->i_holes -= min(d_pos + count, vi->i_db_count) - d_pos;
+    if (d_pos + count > vi->i_db_count)
+        vi->i_db_count = d_pos + count;
+}
+
+/* Calculate the data block map index for a given position
+ * within the given inode data blocks, along with the number
+ * of following blocks that are contiguous with it on disk.
+ *
+ * @vi: Inode information of the target inode
+ * @sb: Superblock of the filesytsem
+ * @d_pos: Position of the data block within the inode
+ * @max: Maximum length of the run to report
+ * @dno: Set to the data block map index of d_pos
+ *
+ * @return: (int) number of blocks mapped contiguously (at
+ *                least 1) if the block exists in the inode,
+ *                error otherwise
+ */
+extern int vvsfs_index_data_run(struct vvsfs_inode_info *vi,
+                                struct super_block *sb,
+                                uint32_t d_pos,
+                                uint32_t max,
+                                uint32_t *dno);
+
+/* Calculate the number of blocks from a given position
+ * within the given inode data blocks that are holes. Regular
+ * files may have holes, which read back as zeroes: a zero
+ * block pointer (data block 0 belongs to the root
+ * directory), or a gap between extents. Everything past the
+ * end of the block list is a hole too.
+ *
+ * @vi: Inode information of the target inode
+ * @sb: Superblock of the filesytsem
+ * @d_pos: Position of the data block within the inode
+ * @max: Maximum length of the hole to report
+ *
+ * @return: (int) number of blocks that are holes (at most
+ *                max, 0 if d_pos is mapped), error otherwise
+ */
+extern int vvsfs_index_hole_run(struct vvsfs_inode_info *vi,
+                                struct super_block *sb,
+                                uint32_t d_pos,
+                                uint32_t max);
+
+/* Given a position into the target inode data blocks,
+ * reserve a contiguous run of up to count new data blocks
+ * and assign them to consecutive positions starting at
+ * d_pos.
+ *
+ * @vi: Inode information of target inode
+ * @sb: Superblock of the filesystem
+ * @d_pos: Data block position to create at, either a hole
+ *         or the current data block count of the inode
+ * @count: Maximum number of blocks to assign
+ * @first: Set to the data block map index of the first
+ *         assigned block
+ *
+ * @return: (int) number of blocks assigned (at least 1),
+ *                error otherwise
+ */
+extern int vvsfs_assign_data_blocks(struct vvsfs_inode_info *vi,
+                                    struct super_block *sb,
+                                    uint32_t d_pos,
+                                    uint32_t count,
+                                    uint32_t *first);
+
 /* Given a position into the target inode data blocks,
  * create and assign a new data block.
  *
@@ -241,6 +1021,25 @@ extern int vvsfs_assign_data_block(struct vvsfs_inode_info *dir_info,
                                    struct super_block *sb,
                                    uint32_t d_pos);
 
+/* Free the data blocks mapped in a range of positions within
+ * the target inode data blocks, leaving holes in their place.
+ * The block list keeps its length.
+ *
+ * @vi: Inode information of target inode
+ * @sb: Superblock of the filesystem
+ * @first: First data block position to free
+ * @end: Data block position to stop before
+ *
+ * @return: (int) 0 if successful, error otherwise
+ */
+extern int vvsfs_punch_data_blocks(struct vvsfs_inode_info *vi,
+                                   struct super_block *sb,
+                                   uint32_t first,
+                                   uint32_t end);
+extern int vvsfs_truncate_data_blocks(struct vvsfs_inode_info *vi,
+                                      struct super_block *sb,
+                                      uint32_t end);
+
 /* Find a given entry within the given directory inode
  *
  * @dir: Inode representation of directory to search
@@ -270,17 +1069,6 @@ extern int vvsfs_fill_super(struct super_block *s, void *data, int silent);
  */
 extern int vvsfs_free_inode_blocks(struct inode *inode);
 
-// vvsfs_read_dentries - reads all dentries into memory for a given inode
-//
-// @dir: Directory inode to read from
-// @num_dirs: (output) count of dentries
-// @return: (char*) data buffer returned contains all dentry data, this *MUST*
-//                  be freed after use via `kfree(data)`
-//
-// @return: (bytearray_t) data buffer returned contains all dentry data, this
-//          *MUST* be freed after use via `kfree(data)`
-extern bytearray_t vvsfs_read_dentries(struct inode *dir, int *num_dirs);
-
 // vvsfs_iget - get the inode from the super block
 // This function will either return the inode that
 // corresponds to a given inode number (ino), if it's
@@ -292,39 +1080,35 @@ extern bytearray_t vvsfs_read_dentries(struct inode *dir, int *num_dirs);
 // new inode that has not been allocated on disk.
 extern struct inode *vvsfs_iget(struct super_block *sb, unsigned long ino);
 
-// vvsfs_find_free_block
-// @map:  the bitmap that keeps track of free blocks
-// @size: the size of the bitmap.
-//
-// This function finds the first free block in a bitmap and toggles the
-// corresponding bit in the bitmap. Note that block 0 is always reserved, so the
-// search always start from 1. On success the position of the first free block
-// is returned, and the bitmap is updated. On failure, the function returns 0
-// and leave the bitmap unchanged. NOTE: the position returned is relative to
-// the start of the map, so it is *not* the actual location on disk.
-static uint32_t vvsfs_find_free_block(uint8_t *map, uint32_t size) {
-    int i = 0;
-    uint8_t j = 0;
-
-    for (i = 0; i < size; ++i) {
-        for (j = 0; j < 8; ++j) {
-            if (i == 0 && j == 0)
-                continue; // skip block 0 -- it is reserved.
-            if ((~map[i]) & (VVSFS_SET_MAP_BIT >> j)) {
-                map[i] = map[i] | (VVSFS_SET_MAP_BIT >> j);
-                return i * 8 + j;
-            }
-        }
-    }
-    return 0;
-}
-
-static void vvsfs_free_block(uint8_t *map, uint32_t pos) {
-    uint32_t i = pos / 8;
-    uint8_t j = pos % 8;
-
-    map[i] = map[i] & ~(VVSFS_SET_MAP_BIT >> j);
-}
+// Bitmap allocator (bitmap.c). Block 0 of every map is
+// reserved, so a returned position of 0 signals failure.
+// NOTE: the position returned is relative to the start of the
+// map, so it is *not* the actual location on disk.
+extern int vvsfs_bitmap_init(struct vvsfs_bitmap *bm,
+                             uint32_t bits,
+                             uint32_t group_bits,
+                             uint32_t block_size);
+extern void vvsfs_bitmap_destroy(struct vvsfs_bitmap *bm);
+extern void vvsfs_bitmap_load(struct vvsfs_bitmap *bm,
+                              const char *data,
+                              uint32_t block);
+extern void vvsfs_bitmap_store(const struct vvsfs_bitmap *bm,
+                               char *data,
+                               uint32_t block);
+extern bool vvsfs_bitmap_take_dirty(struct vvsfs_bitmap *bm, uint32_t block);
+extern void vvsfs_bitmap_redirty(struct vvsfs_bitmap *bm, uint32_t block);
+extern void
+vvsfs_bitmap_set_unused(struct vvsfs_bitmap *bm, uint32_t pos, uint32_t count);
+extern void vvsfs_bitmap_count_free(struct vvsfs_bitmap *bm);
+extern uint32_t vvsfs_bitmap_free_bits(struct vvsfs_bitmap *bm);
+extern uint32_t vvsfs_bitmap_avail_bits(struct vvsfs_bitmap *bm);
+extern uint32_t vvsfs_bitmap_reserve_run_goal(struct vvsfs_bitmap *bm,
+                                              uint32_t goal,
+                                              uint32_t count);
+extern void
+vvsfs_bitmap_free_run(struct vvsfs_bitmap *bm, uint32_t pos, uint32_t count);
+extern bool vvsfs_bitmap_hold(struct vvsfs_bitmap *bm, uint32_t count);
+extern void vvsfs_bitmap_unhold(struct vvsfs_bitmap *bm, uint32_t count);
 
 // mapping from position in an imap to inode number and vice versa.
 // 0 is an invalid inode number
@@ -334,62 +1118,168 @@ static void vvsfs_free_block(uint8_t *map, uint32_t pos) {
 
 // vvsfs_reserve_inode_block
 // @map: a bitmap representing inode blocks on disk
+// @goal: position in the map to search from, 0 for anywhere
 //
 // On success, this function returns a valid inode number and update the
 // corresponding inode bitmap. On failure, it will return 0 (which is an invalid
 // inode number), and leave the bitmap unchanged.
-extern uint32_t vvsfs_reserve_inode_block(uint8_t *map);
+extern uint32_t vvsfs_reserve_inode_block(struct vvsfs_bitmap *map,
+                                          uint32_t goal);
+
+// Where to search the inode map from for an inode created in dir:
+// the start of the block group of dir, so that the inodes of a
+// directory stay close together. 0 without block groups.
+__attribute__((always_inline))
+static inline uint32_t vvsfs_inode_goal(const struct inode *dir) {
+    struct vvsfs_sb_info *sbi = dir->i_sb->s_fs_info;
+    if (sbi->groups == 1)
+        return 0;
+    return max_t(uint32_t,
+                 1,
+                 INO_TO_BNO(dir->i_ino) / sbi->ino_stride * sbi->ino_stride);
+}
+
+// Where to search the data map from for the blocks of an inode
+// when there is nothing better to go by: the start of the data
+// blocks of its block group. 0 without block groups.
+__attribute__((always_inline))
+static inline uint32_t vvsfs_data_goal(const struct vvsfs_inode_info *vi) {
+    struct vvsfs_sb_info *sbi = vi->vfs_inode.i_sb->s_fs_info;
+    if (sbi->groups == 1)
+        return 0;
+    return max_t(uint32_t,
+                 1,
+                 INO_TO_BNO(vi->vfs_inode.i_ino) / sbi->ino_stride *
+                     sbi->dno_stride);
+}
 
 __attribute__((always_inline))
-static inline void vvsfs_free_inode_block(uint8_t *map, uint32_t ino) {
-    vvsfs_free_block(map, INO_TO_BNO(ino));
+static inline void vvsfs_free_inode_block(struct vvsfs_bitmap *map, uint32_t ino) {
+    vvsfs_bitmap_free_run(map, INO_TO_BNO(ino), 1);
 }
 
 __attribute__((always_inline))
-static inline uint32_t vvsfs_reserve_data_block(uint8_t *map) {
-    return vvsfs_find_free_block(map, VVSFS_DMAP_SIZE);
+static inline uint32_t vvsfs_reserve_data_block(struct vvsfs_bitmap *map,
+                                                uint32_t goal) {
+    return vvsfs_bitmap_reserve_run_goal(map, goal, 1);
 }
 
 __attribute__((always_inline))
-static inline void vvsfs_free_data_block(uint8_t *map, uint32_t dno) {
-    vvsfs_free_block(map, dno);
+static inline void vvsfs_free_data_block(struct vvsfs_bitmap *map, uint32_t dno) {
+    vvsfs_bitmap_free_run(map, dno, 1);
 }
 
-// get the disk block number for a given inode number
 __attribute__((always_inline))
-static inline uint32_t vvsfs_get_inode_block(unsigned long ino) {
-    return (VVSFS_INODE_BLOCK_OFF + INO_TO_BNO(ino) / VVSFS_N_INODE_PER_BLOCK);
+static inline uint32_t vvsfs_reserve_data_run(struct vvsfs_bitmap *map,
+                                              uint32_t goal,
+                                              uint32_t count) {
+    return vvsfs_bitmap_reserve_run_goal(map, goal, count);
+}
+
+__attribute__((always_inline))
+static inline void
+vvsfs_free_data_run(struct vvsfs_bitmap *map, uint32_t dno, uint32_t count) {
+    vvsfs_bitmap_free_run(map, dno, count);
+}
+
+// get the disk block number for a given inode number, in the
+// inode table of its block group
+__attribute__((always_inline))
+static inline uint32_t vvsfs_get_inode_block(struct super_block *sb,
+                                             unsigned long ino) {
+    struct vvsfs_sb_info *sbi = sb->s_fs_info;
+    uint32_t group = INO_TO_BNO(ino) / sbi->ino_stride;
+    uint32_t index = INO_TO_BNO(ino) % sbi->ino_stride;
+    return sbi->inode_block + group * sbi->group_blocks +
+           index / sbi->inodes_per_block;
 }
 
 // inode offset (in bytes) relative to the start of the block
 __attribute__((always_inline))
-static inline uint32_t vvsfs_get_inode_offset(unsigned long ino) {
-    return (INO_TO_BNO(ino) % VVSFS_N_INODE_PER_BLOCK) * VVSFS_INODESIZE;
+static inline uint32_t vvsfs_get_inode_offset(struct super_block *sb,
+                                              unsigned long ino) {
+    struct vvsfs_sb_info *sbi = sb->s_fs_info;
+    uint32_t index = INO_TO_BNO(ino) % sbi->ino_stride;
+    return (index % sbi->inodes_per_block) * VVSFS_INODESIZE;
 }
 
-// get the disk block number for a given logical data block number
+// get the disk block number for a given logical data block number,
+// in the data blocks of its block group
 __attribute__((always_inline))
-static inline uint32_t vvsfs_get_data_block(uint32_t bno) {
-    return VVSFS_DATA_BLOCK_OFF + bno;
+static inline uint32_t vvsfs_get_data_block(struct super_block *sb,
+                                            uint32_t bno) {
+    struct vvsfs_sb_info *sbi = sb->s_fs_info;
+    return sbi->data_block + bno / sbi->dno_stride * sbi->group_blocks +
+           bno % sbi->dno_stride;
 }
 
 // A macro to extract a vvsfs_inode_info object from a VFS inode.
 #define VVSFS_I(inode) (container_of(inode, struct vvsfs_inode_info, vfs_inode))
 
-extern uint32_t vvsfs_get_data_block(uint32_t bno);
 extern void write_int_to_buffer(char *buf, uint32_t data);
 extern uint32_t read_int_from_buffer(char *buf);
+extern void vvsfs_mark_buffer_dirty(struct buffer_head *bh,
+                                    struct inode *inode);
+
+// Metadata journal (journal.c), kept either in vvsfs' own log or by
+// jbd2 (journal_jbd2.c). Without a journal the handle functions do
+// nothing. Metadata buffers are passed to vvsfs_journal_access before
+// they are modified, and to vvsfs_journal_dirty (through
+// vvsfs_mark_buffer_dirty) after.
+extern int vvsfs_journal_load(struct super_block *sb,
+                              uint32_t block,
+                              uint32_t blocks);
+extern void vvsfs_journal_destroy(struct super_block *sb);
+extern int vvsfs_journal_start(struct super_block *sb);
+extern void vvsfs_journal_stop(struct super_block *sb, int started);
+extern int vvsfs_journal_access(struct super_block *sb,
+                                struct buffer_head *bh);
+extern void vvsfs_journal_dirty(struct super_block *sb,
+                                struct buffer_head *bh);
+extern void vvsfs_journal_dirty_inode(struct inode *inode, int flags);
+extern void vvsfs_journal_dirty_mapping(struct inode *inode);
+extern int vvsfs_journal_sync_inode(struct inode *inode, int datasync);
+extern void vvsfs_journal_forget_inode(struct inode *inode);
+extern void vvsfs_journal_forget(struct super_block *sb,
+                                 uint32_t dno,
+                                 uint32_t count);
+extern int vvsfs_journal_commit(struct super_block *sb);
+
+extern int vvsfs_jbd2_load(struct super_block *sb, uint32_t inum);
+extern void vvsfs_jbd2_destroy(struct super_block *sb);
+extern int vvsfs_jbd2_start(struct super_block *sb);
+extern void vvsfs_jbd2_stop(struct super_block *sb);
+extern int vvsfs_jbd2_access(struct super_block *sb, struct buffer_head *bh);
+extern void vvsfs_jbd2_dirty(struct super_block *sb, struct buffer_head *bh);
+extern void vvsfs_jbd2_init_inode(struct super_block *sb,
+                                  struct vvsfs_inode_info *vi);
+extern void vvsfs_jbd2_dirty_inode(struct inode *inode, int flags);
+extern void vvsfs_jbd2_dirty_mapping(struct inode *inode);
+extern int vvsfs_jbd2_sync_inode(struct inode *inode, int datasync);
+extern void
+vvsfs_jbd2_forget(struct super_block *sb, uint32_t dno, uint32_t count);
+extern int vvsfs_jbd2_commit(struct super_block *sb);
+
+static inline bool vvsfs_has_journal(struct super_block *sb) {
+    struct vvsfs_sb_info *sbi = sb->s_fs_info;
+    return sbi->journal || sbi->jbd2;
+}
+
+// Copy an inode into its (held) inode table block (inode.c)
+extern struct buffer_head *vvsfs_inode_to_block(struct inode *inode);
+
+// Store the free counts and the bitmap blocks that changed into
+// their blocks, passing each one to add (inode.c)
+extern int vvsfs_store_fs_info(struct super_block *sb,
+                               void (*add)(struct super_block *sb,
+                                           struct buffer_head *bh));
 
 #define READ_BLOCK_OFF(sb, offset)                                             \
-    sb_bread((sb), vvsfs_get_data_block((offset)))
+    sb_bread((sb), vvsfs_get_data_block((sb), (offset)))
 #define READ_BLOCK(sb, vi, index) READ_BLOCK_OFF(sb, (vi)->i_data[(index)])
 #define READ_DENTRY_OFF(data, offset)                                          \
     ((struct vvsfs_dir_entry *)((data) + (offset)*VVSFS_DENTRYSIZE))
 #define READ_DENTRY(bh, offset) READ_DENTRY_OFF((bh)->b_data, offset)
-#define READ_INDIRECT_BLOCK(sb, indirect_bh, i)                                \
-    READ_BLOCK_OFF(sb,                                                         \
-                   read_int_from_buffer((indirect_bh)->b_data +                \
-                                        ((i)*VVSFS_INDIRECT_PTR_SIZE)))
 
 #endif
 #endif // VVSFS_H
\ No newline at end of file
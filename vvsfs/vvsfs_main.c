@@ -22,8 +22,11 @@ struct inode *vvsfs_iget(struct super_block *sb, unsigned long ino);
 int vvsfs_init_inode_cache(void) {
     LOG("vvsfs - init inode cache ");
 
-    vvsfs_inode_cache = kmem_cache_create(
-        "vvsfs_cache", sizeof(struct vvsfs_inode_info), 0, 0, NULL);
+    vvsfs_inode_cache = kmem_cache_create("vvsfs_cache",
+                                          sizeof(struct vvsfs_inode_info),
+                                          VVSFS_INLINE_ALIGN,
+                                          0,
+                                          NULL);
     if (!vvsfs_inode_cache)
         return -ENOMEM;
     return 0;
@@ -49,6 +52,7 @@ struct inode *vvsfs_iget(struct super_block *sb, unsigned long ino) {
     struct inode *inode;
     struct vvsfs_inode *disk_inode;
     struct vvsfs_inode_info *inode_info;
+    struct vvsfs_sb_info *sbi = sb->s_fs_info;
     struct buffer_head *bh;
     uint32_t inode_block;
     uint32_t inode_offset;
@@ -65,8 +69,8 @@ struct inode *vvsfs_iget(struct super_block *sb, unsigned long ino) {
 
     inode_info = VVSFS_I(inode);
 
-    inode_block = vvsfs_get_inode_block(ino);
-    inode_offset = vvsfs_get_inode_offset(ino);
+    inode_block = vvsfs_get_inode_block(sb, ino);
+    inode_offset = vvsfs_get_inode_offset(sb, ino);
 
     bh = sb_bread(sb, inode_block);
     if (!bh) {
@@ -93,21 +97,60 @@ struct inode *vvsfs_iget(struct super_block *sb, unsigned long ino) {
     // inode->i_nlink directly; we need to use the
     // set_nlink function here.
     set_nlink(inode, disk_inode->i_links_count);
-    inode->i_blocks =
-        disk_inode->i_data_blocks_count * (VVSFS_BLOCKSIZE / VVSFS_SECTORSIZE);
 
     inode_info->i_db_count = disk_inode->i_data_blocks_count;
     /* store data blocks in cache */
     for (i = 0; i < VVSFS_N_BLOCKS; ++i)
         inode_info->i_data[i] = disk_inode->i_block[i];
+    inode_info->i_dx_block = disk_inode->i_dx_block;
+    inode_info->i_dx_order = disk_inode->i_dx_order;
+    inode_info->i_flags = disk_inode->i_flags;
+    inode_info->i_unwritten = disk_inode->i_unwritten;
+    inode_info->i_untouched = disk_inode->i_unwritten;
+    inode_info->i_holes = disk_inode->i_holes;
+    inode->i_blocks = vvsfs_i_blocks(inode_info);
+    if (inode_info->i_flags & VVSFS_INODE_INLINE_DATA)
+        memcpy(inode_info->i_inline, disk_inode + 1, VVSFS_INLINE_SIZE);
+
+    // Refuse extent mapped inodes on a file system without the
+    // feature, since the extents would be read as block pointers.
+    // The jbd2 journal file is extent mapped either way.
+    if ((inode_info->i_flags & VVSFS_INODE_EXTENTS) &&
+        !(sbi->features & VVSFS_FEATURE_EXTENTS) &&
+        !((sbi->features & VVSFS_FEATURE_JBD2) && ino == VVSFS_JBD2_INUM)) {
+        LOG("vvsfs - iget - extent mapped inode %lu without the extents "
+            "feature\n",
+            ino);
+        brelse(bh);
+        iget_failed(inode);
+        return ERR_PTR(-EUCLEAN);
+    }
+    // Likewise for inline data, which must fit in the inode, with
+    // room for the NUL after the target of a symlink
+    if ((inode_info->i_flags & VVSFS_INODE_INLINE_DATA) &&
+        (!(sbi->features & VVSFS_FEATURE_INLINE_DATA) ||
+         !(S_ISREG(inode->i_mode) || S_ISLNK(inode->i_mode)) ||
+         inode->i_size > VVSFS_INLINE_SIZE ||
+         (S_ISLNK(inode->i_mode) && inode->i_size == VVSFS_INLINE_SIZE))) {
+        LOG("vvsfs - iget - bad inline data in inode %lu\n", ino);
+        brelse(bh);
+        iget_failed(inode);
+        return ERR_PTR(-EUCLEAN);
+    }
 
     if (S_ISREG(inode->i_mode)) {
         inode->i_op = &vvsfs_file_inode_operations;
         inode->i_fop = &vvsfs_file_operations;
-        inode->i_mapping->a_ops = &vvsfs_as_operations;
+        inode->i_mapping->a_ops = &vvsfs_file_aops;
     } else if (S_ISDIR(inode->i_mode)) {
         inode->i_op = &vvsfs_dir_inode_operations;
         inode->i_fop = &vvsfs_dir_operations;
+    } else if (S_ISLNK(inode->i_mode) &&
+               (inode_info->i_flags & VVSFS_INODE_INLINE_DATA)) {
+        // fast symlink, followed straight from the inode
+        inode_info->i_inline[inode->i_size] = '\0';
+        inode->i_link = (char *)inode_info->i_inline;
+        inode->i_op = &vvsfs_fast_symlink_inode_operations;
     } else if (S_ISLNK(inode->i_mode)) {
         inode->i_op = &vvsfs_symlink_inode_operations;
         // since we are using page_symlink we need to set this first
@@ -0,0 +1,50 @@
+#!/bin/bash
+source ./init.sh
+log_header "Testing block groups"
+
+# 40000 blocks of 1KB make 5 groups of 8192 blocks, with 1000
+# inodes each. Inode numbers of a group start at a multiple of the
+# bits in a map block. Extents let a file outgrow a group.
+./umount.sh
+dd if=/dev/zero of=test.img bs=1024 count=65536 2>/dev/null
+../mkfs.vvsfs -e -s 40000 test.img >/dev/null
+./mount.sh
+group_inodes=$((VVSFS_BLOCKSIZE * 8))
+
+# Fill the inodes of group 0 (the root takes the first one)
+touch testdir/file{001..999}
+assert_eq "$(ls testdir | wc -l)" "999" "all files should be created"
+assert_le "$(stat -c %i testdir/file999)" "$group_inodes" "files of the root should be in its group"
+check_log_success "Inodes of the root directory in its group"
+
+# A directory created with group 0 full goes to the next group,
+# and what is created in it stays there even once group 0 has a
+# free inode again. The root still prefers its own group.
+mkdir testdir/d1
+assert_gt "$(stat -c %i testdir/d1)" "$group_inodes" "directory should be in the next group"
+rm testdir/file500
+echo "hello" >testdir/d1/inner
+assert_gt "$(stat -c %i testdir/d1/inner)" "$group_inodes" "file should be in the group of its directory"
+touch testdir/again
+assert_le "$(stat -c %i testdir/again)" "$group_inodes" "file should be in the group of the root"
+check_log_success "New inodes prefer the group of their directory"
+
+free_blocks=$(stat -f -c %f testdir)
+free_inodes=$(stat -f -c %d testdir)
+./remount.sh
+assert_eq "$(cat testdir/d1/inner)" "hello" "file should persist"
+assert_eq "$(ls testdir | wc -l)" "1000" "root entries should persist"
+assert_eq "$(stat -f -c %f testdir)" "$free_blocks" "free blocks should persist"
+assert_eq "$(stat -f -c %d testdir)" "$free_inodes" "free inodes should persist"
+check_log_success "Block groups persist across remount"
+
+# Data fills the groups in turn without running into the metadata
+# of the next group
+head -c $((16 * 1024 * 1024)) /dev/urandom >groups_expected.img
+cp groups_expected.img testdir/d1/large
+./remount.sh
+assert_eq "$(cmp groups_expected.img testdir/d1/large)" "" "file across groups should read back"
+assert_eq "$(ls testdir | wc -l)" "1000" "root entries should be intact"
+check_log_success "Data across block groups"
+
+rm -f groups_expected.img
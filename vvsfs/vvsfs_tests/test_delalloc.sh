@@ -0,0 +1,34 @@
+#!/bin/bash
+source ./init.sh
+log_header "Testing delayed allocation"
+
+free_blocks=$(stat -f -c %f testdir)
+
+# Small appends are held in the page cache until writeback
+for i in $(seq 1 64); do
+    head -c 1024 /dev/zero | tr '\0' "$((i % 10))" >>testdir/appended
+    head -c 1024 /dev/zero | tr '\0' "$((i % 10))" >>delalloc_expected.img
+done
+assert_eq "$(stat -f -c %f testdir)" "$((free_blocks - 65))" "held blocks should count as used"
+check_log_success "Delayed blocks are charged to the free count"
+
+sync
+assert_eq "$(cmp delalloc_expected.img testdir/appended)" "" "the appended file should match"
+check_log_success "Delayed blocks are allocated at writeback"
+
+# A temporary file deleted before writeback gives its blocks back
+dd if=/dev/zero of=testdir/temp bs=1024 count=32 2>/dev/null
+rm testdir/temp
+assert_eq "$(stat -f -c %f testdir)" "$((free_blocks - 65))" "the held blocks should be released"
+check_log_success "Deleted files release their delayed blocks"
+
+# Writes beyond the delayed blocks leave a zeroed gap
+dd if=/dev/zero of=delalloc_expected.img bs=1024 seek=100 count=0 2>/dev/null
+echo "tail" >>delalloc_expected.img
+echo "tail" | dd of=testdir/appended bs=1024 seek=100 2>/dev/null
+./remount.sh
+assert_eq "$(cmp delalloc_expected.img testdir/appended)" "" "the gap should read back as zeroes"
+check_log_success "Delayed allocations persist across remount"
+
+rm testdir/appended
+rm -f delalloc_expected.img
@@ -0,0 +1,61 @@
+#!/bin/bash
+source ./init.sh
+log_header "Testing hashed directory index"
+
+free_blocks=$(stat -f -c %f testdir)
+dir_sectors=$(stat -c %b testdir)
+
+# Enough dentries to build the index and grow it past a single block
+count=$((VVSFS_DX_ENTRIES_PER_DEFAULT_BLOCK * 3 / 4 + VVSFS_N_DENTRY_PER_BLOCK))
+for (( i = 0; i < count; i++ )); do
+    echo "$i" > "testdir/file$i"
+done
+sync
+
+# Each file takes a block, and the directory its dentry blocks (and an
+# indirect block past the direct ones), so the rest is the index
+sectors_per_block=$((VVSFS_BLOCKSIZE / VVSFS_SECTORSIZE))
+dir_blocks=$(($(stat -c %b testdir) / sectors_per_block))
+new_dir_blocks=$((dir_blocks - dir_sectors / sectors_per_block))
+indirect=$((dir_blocks > VVSFS_LAST_DIRECT_BLOCK_INDEX ? 1 : 0))
+used_blocks=$((free_blocks - $(stat -f -c %f testdir)))
+index_blocks=$((used_blocks - count - new_dir_blocks - indirect))
+assert_eq "2" "$index_blocks" "expected an index of two blocks to be allocated"
+check_log_success "The index is built and grows past a single block"
+
+missing=0
+for (( i = 0; i < count; i++ )); do
+    [ "$(cat "testdir/file$i")" == "$i" ] || missing=$((missing + 1))
+done
+assert_eq "0" "$missing" "expected all $count files to be found through the index"
+check_log_success "All files resolve through the index"
+
+# Removing entries relocates the last dentry, which must stay indexed
+for (( i = 0; i < count; i += 3 )); do
+    rm "testdir/file$i"
+done
+./remount.sh
+
+missing=0
+present=0
+for (( i = 0; i < count; i++ )); do
+    if (( i % 3 == 0 )); then
+        [ -e "testdir/file$i" ] && present=$((present + 1))
+    else
+        [ "$(cat "testdir/file$i")" == "$i" ] || missing=$((missing + 1))
+    fi
+done
+assert_eq "0" "$missing" "expected remaining files to be found after relocation"
+check_log_success "Relocated dentries resolve through the index after remount"
+assert_eq "0" "$present" "expected removed files to not be found"
+check_log_success "Removed dentries are not found through the index"
+
+# Renames within the indexed directory
+mv testdir/file1 testdir/renamed
+assert_eq "1" "$(cat testdir/renamed)" "expected renamed file to resolve"
+assert_eq "0" "$(find testdir -name file1 | wc -l)" "expected old name to be gone"
+check_log_success "Renamed dentries resolve through the index"
+
+rm testdir/*
+assert_eq "0" "$(ls testdir | wc -l)" "expected all files to be removed"
+check_log_success "All indexed dentries can be removed"
@@ -0,0 +1,75 @@
+#!/bin/bash
+source ./init.sh
+log_header "Testing variable-length directory entries"
+
+# Recreate the file system with directories of records
+./umount.sh
+../mkfs.vvsfs -r test.img >/dev/null
+./mount.sh
+
+# Short names take a record of 20 bytes rather than a whole dentry,
+# and enough of them build and grow the hashed index
+count=600
+mkdir testdir/d
+for (( i = 0; i < count; i++ )); do
+    echo "$i" > "testdir/d/file$i"
+done
+blocks=$(( (count * 20 + VVSFS_BLOCKSIZE - 1) / VVSFS_BLOCKSIZE ))
+assert_le "$(stat -c %s testdir/d)" "$(( (blocks + 1) * VVSFS_BLOCKSIZE ))" "records should be packed into few blocks"
+assert_lt "$(stat -c %s testdir/d)" "$(( count * VVSFS_DENTRYSIZE / 4 ))" "records should be smaller than dentries"
+./remount.sh
+assert_eq "$(ls testdir/d | wc -l)" "$count" "all records should be listed"
+missing=0
+for (( i = 0; i < count; i++ )); do
+    [ "$(cat "testdir/d/file$i")" == "$i" ] || missing=$((missing + 1))
+done
+assert_eq "0" "$missing" "expected all $count files to be found"
+check_log_success "Records are packed and found after remount"
+
+# Removed records leave room that new ones take, so the directory
+# does not grow
+size=$(stat -c %s testdir/d)
+for (( i = 0; i < count; i += 2 )); do
+    rm "testdir/d/file$i"
+done
+for (( i = 0; i < count; i += 2 )); do
+    echo "new$i" > "testdir/d/new$i"
+done
+assert_eq "$(stat -c %s testdir/d)" "$size" "new records should reuse the room of removed ones"
+./remount.sh
+missing=0
+for (( i = 0; i < count; i += 2 )); do
+    [ -e "testdir/d/file$i" ] && missing=$((missing + 1))
+    [ "$(cat "testdir/d/new$i")" == "new$i" ] || missing=$((missing + 1))
+    [ "$(cat "testdir/d/file$((i + 1))")" == "$((i + 1))" ] || missing=$((missing + 1))
+done
+assert_eq "0" "$missing" "expected removed names gone and the others found"
+assert_eq "$(ls testdir/d | wc -l)" "$count" "all records should be listed after reuse"
+check_log_success "Room of removed records is reused"
+
+# Names of every length, up to the longest
+long_name=$(head -c $VVSFS_MAXNAME /dev/zero | tr '\0' 'n')
+for (( i = 1; i <= VVSFS_MAXNAME; i++ )); do
+    touch "testdir/${long_name:0:$i}"
+done
+./remount.sh
+assert_eq "$(ls testdir | grep -c '^n*$')" "$VVSFS_MAXNAME" "names of all lengths should be listed"
+assert_eq "$(ls testdir/$long_name)" "testdir/$long_name" "longest name should be found"
+check_log_success "Records of every name length"
+
+# Renames, hard links and rmdir
+mv testdir/d/file1 testdir/renamed
+ln testdir/renamed testdir/d/linked
+assert_eq "$(cat testdir/d/linked)" "1" "renamed and linked file should resolve"
+mkdir testdir/empty
+touch testdir/empty/x
+rmdir testdir/empty 2>/dev/null
+assert_eq "$(ls -d testdir/empty)" "testdir/empty" "non-empty directory should not be removed"
+rm testdir/empty/x
+rmdir testdir/empty
+assert_eq "$(ls testdir | grep -c '^empty$')" "0" "empty directory should be removed"
+rm testdir/d/*
+./remount.sh
+assert_eq "$(ls testdir/d | wc -l)" "0" "all records should be removed"
+rmdir testdir/d
+check_log_success "Renames, links and rmdir with records"
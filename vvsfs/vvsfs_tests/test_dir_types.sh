@@ -0,0 +1,31 @@
+#!/bin/bash
+source ./init.sh
+log_header "Testing file types in dentries"
+
+# Without types, names take the whole of the dentry
+long_name=$(head -c $VVSFS_MAXNAME /dev/zero | tr '\0' 'n')
+touch "testdir/$long_name"
+./remount.sh
+assert_eq "$(ls testdir | grep -c "^$long_name\$")" "1" "the longest name should be listed whole"
+assert_eq "$(stat -f -c %l testdir)" "$VVSFS_MAXNAME" "max name length incorrect"
+check_log_success "Names of $VVSFS_MAXNAME bytes without types"
+
+# Recreate the file system with types in dentries
+./umount.sh
+../mkfs.vvsfs -t test.img >/dev/null
+./mount.sh
+
+assert_eq "$(stat -f -c %l testdir)" "$VVSFS_MAXNAME_TYPED" "max name length incorrect with types"
+touch "testdir/$long_name" 2>/dev/null
+assert_eq "$(ls testdir | grep -c '^n*$')" "0" "a name too long for typed dentries should be refused"
+touch "testdir/${long_name:0:$VVSFS_MAXNAME_TYPED}"
+mkdir testdir/dir
+ln -s dir testdir/link
+./remount.sh
+assert_eq "$(ls testdir | grep -c "^${long_name:0:$VVSFS_MAXNAME_TYPED}\$")" "1" "the longest typed name should be listed whole"
+assert_eq "$(find testdir -mindepth 1 -type d)" "testdir/dir" "directory should be listed"
+assert_eq "$(find testdir -mindepth 1 -type l)" "testdir/link" "symlink should be listed"
+check_log_success "Names of $VVSFS_MAXNAME_TYPED bytes with types"
+
+rm testdir/link "testdir/${long_name:0:$VVSFS_MAXNAME_TYPED}"
+rmdir testdir/dir
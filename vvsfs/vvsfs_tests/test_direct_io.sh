@@ -0,0 +1,28 @@
+#!/bin/bash
+source ./init.sh
+log_header "Testing direct I/O"
+
+dd if=/dev/random of=direct_random_image.img bs=4096 count=64 2>/dev/null
+
+# Extend a new file with O_DIRECT writes
+dd if=direct_random_image.img of=testdir/direct.img bs=4096 oflag=direct 2>/dev/null
+assert_eq "$(cmp direct_random_image.img testdir/direct.img)" "" "the files should be equal"
+check_log_success "O_DIRECT writes extend files"
+
+# Read back through O_DIRECT
+assert_eq "$(dd if=testdir/direct.img bs=4096 iflag=direct 2>/dev/null | cmp - direct_random_image.img)" "" "O_DIRECT reads should match"
+check_log_success "O_DIRECT reads match"
+
+# Overwrite the middle of the file in place
+dd if=/dev/random of=direct_chunk.img bs=4096 count=8 2>/dev/null
+dd if=direct_chunk.img of=direct_random_image.img bs=4096 seek=8 conv=notrunc 2>/dev/null
+dd if=direct_chunk.img of=testdir/direct.img bs=4096 seek=8 conv=notrunc oflag=direct 2>/dev/null
+assert_eq "$(cmp direct_random_image.img testdir/direct.img)" "" "the overwritten files should be equal"
+check_log_success "O_DIRECT overwrites in place"
+
+./remount.sh
+
+assert_eq "$(dd if=testdir/direct.img bs=4096 iflag=direct 2>/dev/null | cmp - direct_random_image.img)" "" "O_DIRECT reads should match after remount"
+check_log_success "O_DIRECT writes persist across remount"
+
+rm -f direct_random_image.img direct_chunk.img
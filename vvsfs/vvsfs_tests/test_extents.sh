@@ -0,0 +1,44 @@
+#!/bin/bash
+source ./init.sh
+log_header "Testing extent mapped files"
+
+# Recreate the file system with the extents feature
+./umount.sh
+../mkfs.vvsfs -e test.img >/dev/null
+./mount.sh
+
+free_blocks=$(stat -f -c %f testdir)
+
+# Write a file well past the block pointer size limit
+dd if=/dev/random count=$(echo "$VVSFS_MAXFILESIZE * 4 / 1024" | bc) bs=1024 of=large_random_image.img 2>/dev/null
+cp large_random_image.img testdir/large_random_image.img
+assert_eq "$(diff large_random_image.img testdir/large_random_image.img)" "" "the files should be equal"
+check_log_success "Can write files larger than the block pointer limit"
+
+# Interleave appends to two files so that neither is contiguous on
+# disk, which spills their extents into the overflow block
+rm -f frag_a.img frag_b.img
+for i in $(seq 1 $((VVSFS_N_INLINE_EXTENTS * 4))); do
+    head -c $VVSFS_BLOCKSIZE /dev/urandom >chunk.img
+    cat chunk.img >>frag_a.img
+    cat chunk.img >>testdir/frag_a
+    head -c $VVSFS_BLOCKSIZE /dev/urandom >chunk.img
+    cat chunk.img >>frag_b.img
+    cat chunk.img >>testdir/frag_b
+done
+assert_eq "$(diff frag_a.img testdir/frag_a)" "" "the first fragmented file should be equal"
+assert_eq "$(diff frag_b.img testdir/frag_b)" "" "the second fragmented file should be equal"
+check_log_success "Can write fragmented files"
+
+./remount.sh
+
+assert_eq "$(diff large_random_image.img testdir/large_random_image.img)" "" "the files should still be equal"
+assert_eq "$(diff frag_a.img testdir/frag_a)" "" "the first fragmented file should still be equal"
+assert_eq "$(diff frag_b.img testdir/frag_b)" "" "the second fragmented file should still be equal"
+check_log_success "Extent mapped files persist across remount"
+
+rm testdir/large_random_image.img testdir/frag_a testdir/frag_b
+assert_eq "$(stat -f -c %f testdir)" "$free_blocks" "all data and extent blocks should be freed"
+check_log_success "Removing extent mapped files frees their blocks"
+
+rm -f chunk.img frag_a.img frag_b.img
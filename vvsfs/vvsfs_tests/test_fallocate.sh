@@ -0,0 +1,72 @@
+#!/bin/bash
+source ./init.sh
+log_header "Testing fallocate"
+
+# Preallocated blocks are allocated but read back as zeroes
+fallocate -l 16384 testdir/prealloc
+assert_eq "$(stat -c %s testdir/prealloc)" "16384" "the file should grow to cover the range"
+assert_eq "$(stat -c %b testdir/prealloc)" "32" "the blocks should be allocated"
+head -c 16384 /dev/zero >fallocate_expected.img
+assert_eq "$(cmp fallocate_expected.img testdir/prealloc)" "" "preallocated blocks should read as zeroes"
+check_log_success "fallocate preallocates blocks"
+
+# Writing into the middle converts the blocks before it too
+printf "middle" | dd of=testdir/prealloc bs=1024 seek=8 conv=notrunc 2>/dev/null
+printf "middle" | dd of=fallocate_expected.img bs=1024 seek=8 conv=notrunc 2>/dev/null
+sync
+assert_eq "$(cmp fallocate_expected.img testdir/prealloc)" "" "the written data should read back"
+check_log_success "Writes into preallocated blocks"
+
+# Keeping the size only reserves blocks for later appends
+fallocate -n -l 8192 testdir/keep
+assert_eq "$(stat -c %s testdir/keep)" "0" "the size should be kept"
+assert_eq "$(stat -c %b testdir/keep)" "16" "the blocks should be allocated"
+head -c 2048 /dev/zero | tr '\0' 'a' >>testdir/keep
+head -c 2048 /dev/zero | tr '\0' 'a' >keep_expected.img
+assert_eq "$(stat -c %b testdir/keep)" "16" "appends should use the preallocated blocks"
+check_log_success "fallocate with --keep-size"
+
+./remount.sh
+assert_eq "$(cmp fallocate_expected.img testdir/prealloc)" "" "the file should persist"
+assert_eq "$(cmp keep_expected.img testdir/keep)" "" "the appended file should persist"
+assert_eq "$(stat -c %b testdir/keep)" "16" "the preallocation should persist"
+check_log_success "Preallocations persist across remount"
+
+# A write into preallocated blocks that comes up short (its source buffer
+# faults halfway) must not give back the blocks held for another file's
+# pending appends, and the blocks it did not reach keep reading as zeroes
+# when written out of order later
+free_blocks=$(stat -f -c %f testdir)
+fallocate -l 16384 testdir/short
+head -c 8192 /dev/zero | tr '\0' 'p' >testdir/pending
+head -c 8192 /dev/zero | tr '\0' 'p' >pending_expected.img
+held_blocks=$(stat -f -c %f testdir)
+written=$(python3 -c "import ctypes, mmap, os, sys
+buf = mmap.mmap(-1, 8192)
+buf[:4096] = b's' * 4096
+addr = ctypes.addressof(ctypes.c_char.from_buffer(buf))
+ctypes.CDLL(None).mprotect(ctypes.c_void_p(addr + 4096), 4096, 0)
+fd = os.open(sys.argv[1], os.O_WRONLY)
+print(os.write(fd, buf))" testdir/short)
+assert_eq "$written" "4096" "the write should come up short"
+assert_eq "$(stat -f -c %f testdir)" "$held_blocks" "the pending appends should keep their held blocks"
+printf "later" | dd of=testdir/short bs=1024 seek=12 conv=notrunc 2>/dev/null
+head -c 16384 /dev/zero >short_expected.img
+head -c 4096 /dev/zero | tr '\0' 's' | dd of=short_expected.img conv=notrunc 2>/dev/null
+printf "later" | dd of=short_expected.img bs=1024 seek=12 conv=notrunc 2>/dev/null
+sync
+./remount.sh
+assert_eq "$(cmp short_expected.img testdir/short)" "" "the short write and the later one should persist"
+assert_eq "$(cmp pending_expected.img testdir/pending)" "" "the pending appends should persist"
+assert_eq "$(stat -f -c %f testdir)" "$((free_blocks - 16 - 8))" "only the files' blocks should be in use"
+check_log_success "Short writes into preallocated blocks"
+rm testdir/short testdir/pending
+rm -f short_expected.img pending_expected.img
+
+# Only preallocation is supported
+fallocate -c -o 0 -l 1024 testdir/prealloc 2>/dev/null
+assert_eq "$?" "1" "collapsing a range should fail"
+check_log_success "Unsupported modes are rejected"
+
+rm testdir/prealloc testdir/keep
+rm -f fallocate_expected.img keep_expected.img
@@ -0,0 +1,44 @@
+#!/bin/bash
+source ./init.sh
+log_header "Testing fast symlinks"
+
+# Recreate the file system with the inline data feature
+./umount.sh
+../mkfs.vvsfs -d test.img >/dev/null
+./mount.sh
+
+# Short targets are kept in the inode and take no data block
+echo "target" >testdir/file
+free_blocks=$(stat -f -c %f testdir)
+ln -s file testdir/short
+long_name=$(head -c $((VVSFS_INLINE_SIZE - 1)) /dev/zero | tr '\0' 'a')
+ln -s $long_name testdir/longest
+sync
+assert_eq "$(stat -f -c %f testdir)" "$free_blocks" "fast symlinks should not take data blocks"
+./remount.sh
+assert_eq "$(readlink testdir/short)" "file" "fast symlink target should persist"
+assert_eq "$(readlink testdir/longest)" "$long_name" "longest fast symlink target should persist"
+assert_eq "$(cat testdir/short)" "target" "fast symlink should be followed"
+assert_eq "$(stat -c %s testdir/short)" "4" "fast symlink size should be its target length"
+assert_eq "$(stat -c %b testdir/short)" "0" "fast symlink should have no blocks"
+check_log_success "Short symlinks are fast symlinks"
+
+# Longer targets still take a data block
+free_blocks=$(stat -f -c %f testdir)
+ln -s "${long_name}a" testdir/long
+sync
+assert_lt "$(stat -f -c %f testdir)" "$free_blocks" "long symlink should take a data block"
+./remount.sh
+assert_eq "$(readlink testdir/long)" "${long_name}a" "long symlink target should persist"
+check_log_success "Long symlinks are stored in a data block"
+
+# Chains of fast symlinks across directories
+mkdir testdir/d1 testdir/d2
+echo "deep" >testdir/d2/file
+ln -s ../d2/file testdir/d1/link
+ln -s d1/link testdir/chain
+./remount.sh
+assert_eq "$(cat testdir/chain)" "deep" "chained fast symlinks should be followed"
+rm testdir/chain testdir/short testdir/longest testdir/long
+assert_eq "$(ls testdir | wc -l)" "3" "symlinks should be removed"
+check_log_success "Chains of fast symlinks"
@@ -0,0 +1,33 @@
+#!/bin/bash
+source ./init.sh
+log_header "Testing fsync and fdatasync"
+
+dd if=/dev/random of=fsync_random_image.img bs=1024 count=64 2>/dev/null
+
+# fsync of a new file, which needs its inode and block mappings
+dd if=fsync_random_image.img of=testdir/fsync.img bs=1024 conv=fsync 2>/dev/null
+assert_eq "$?" "0" "fsync should succeed"
+check_log_success "fsync writes a new file"
+
+# fdatasync of an in-place overwrite, which only needs the data
+dd if=/dev/random of=fsync_chunk.img bs=1024 count=8 2>/dev/null
+dd if=fsync_chunk.img of=fsync_random_image.img bs=1024 seek=8 conv=notrunc 2>/dev/null
+dd if=fsync_chunk.img of=testdir/fsync.img bs=1024 seek=8 conv=notrunc,fdatasync 2>/dev/null
+assert_eq "$?" "0" "fdatasync should succeed"
+check_log_success "fdatasync writes an overwrite"
+
+# fsync of a directory
+mkdir testdir/fsync_dir
+touch testdir/fsync_dir/file
+sync testdir/fsync_dir
+assert_eq "$?" "0" "fsync of a directory should succeed"
+check_log_success "fsync writes a directory"
+
+./remount.sh
+
+assert_eq "$(cmp fsync_random_image.img testdir/fsync.img)" "" "the synced file should persist"
+assert_eq "$(ls testdir/fsync_dir)" "file" "the synced directory should persist"
+check_log_success "Synced files persist across remount"
+
+rm -r testdir/fsync.img testdir/fsync_dir
+rm -f fsync_random_image.img fsync_chunk.img
@@ -0,0 +1,47 @@
+#!/bin/bash
+source ./init.sh
+log_header "Testing file system geometry"
+
+# A file system with 4KB blocks and a larger inode table than the
+# default layout
+./umount.sh
+dd if=/dev/zero of=test.img bs=4096 count=8192 2>/dev/null
+../mkfs.vvsfs -b 4096 -i 4096 test.img >/dev/null
+./mount.sh
+
+assert_eq "$(stat -f -c %S testdir)" "4096" "block size should be recorded"
+assert_eq "$(stat -f -c %b testdir)" "8192" "total block count should be the device size"
+assert_eq "$(stat -f -c %c testdir)" "8192" "inode count should follow the bytes per inode"
+check_log_success "Geometry read from the super block"
+
+# More files than the default inode table holds, and a file larger
+# than the default block map allows
+mkdir testdir/many
+touch testdir/many/file{0000..4999}
+head -c $((VVSFS_MAXFILESIZE + 65536)) /dev/urandom >geometry_expected.img
+cp geometry_expected.img testdir/large
+assert_eq "$(ls testdir/many | wc -l)" "5000" "all files should be created"
+assert_eq "$(cmp geometry_expected.img testdir/large)" "" "large file should read back"
+free_blocks=$(stat -f -c %f testdir)
+free_inodes=$(stat -f -c %d testdir)
+check_log_success "Files on a 4KB block file system"
+
+./remount.sh
+assert_eq "$(ls testdir/many | wc -l)" "5000" "files should persist"
+assert_eq "$(cmp geometry_expected.img testdir/large)" "" "large file should persist"
+assert_eq "$(stat -f -c %f testdir)" "$free_blocks" "free blocks should persist"
+assert_eq "$(stat -f -c %d testdir)" "$free_inodes" "free inodes should persist"
+check_log_success "Geometry persists across remount"
+
+rm -rf testdir/many testdir/large
+rm -f geometry_expected.img
+
+# A given size on a larger device, with the default block size
+./umount.sh
+dd if=/dev/zero of=test.img bs=1024 count=65536 2>/dev/null
+../mkfs.vvsfs -s 40000 test.img >/dev/null
+./mount.sh
+assert_eq "$(stat -f -c %S testdir)" "$VVSFS_BLOCKSIZE" "default block size should be used"
+assert_eq "$(stat -f -c %b testdir)" "40000" "total block count should be the given size"
+assert_eq "$(stat -f -c %c testdir)" "5000" "inode count should follow the default ratio"
+check_log_success "File system of a given size"
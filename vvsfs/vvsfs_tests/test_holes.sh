@@ -0,0 +1,60 @@
+#!/bin/bash
+source ./init.sh
+log_header "Testing sparse files"
+
+# Print the offset SEEK_DATA (or SEEK_HOLE) finds from a given offset
+seek() {
+    python3 -c "import os, sys
+fd = os.open(sys.argv[1], os.O_RDONLY)
+print(os.lseek(fd, int(sys.argv[3]), getattr(os, 'SEEK_' + sys.argv[2])))" "$@"
+}
+
+test_sparse() {
+    # A write far past the end leaves a hole rather than zeroed blocks
+    echo "tail" | dd of=testdir/sparse bs=1024 seek=200 2>/dev/null
+    dd if=/dev/zero of=holes_expected.img bs=1024 seek=200 count=0 2>/dev/null
+    echo "tail" >>holes_expected.img
+    sync
+    assert_eq "$(stat -c %b testdir/sparse)" "2" "only the written block should be allocated"
+    assert_eq "$(cmp holes_expected.img testdir/sparse)" "" "the hole should read as zeroes"
+    assert_eq "$(seek testdir/sparse DATA 0)" "204800" "SEEK_DATA should skip the hole"
+    assert_eq "$(seek testdir/sparse HOLE 0)" "0" "SEEK_HOLE should find the hole"
+    check_log_success "Writes past the end leave a hole"
+
+    # Writing into the hole only allocates the blocks written
+    echo "middle" | dd of=testdir/sparse bs=1024 seek=100 conv=notrunc 2>/dev/null
+    echo "middle" | dd of=holes_expected.img bs=1024 seek=100 conv=notrunc 2>/dev/null
+    sync
+    assert_eq "$(stat -c %b testdir/sparse)" "4" "the filled block should be allocated"
+    assert_eq "$(cmp holes_expected.img testdir/sparse)" "" "the filled hole should read back"
+    assert_eq "$(seek testdir/sparse HOLE 102400)" "103424" "SEEK_HOLE should find the hole after it"
+    check_log_success "Writes into a hole"
+
+    # Punching frees the whole blocks and zeroes the partial ones
+    head -c 65536 /dev/urandom >punch_expected.img
+    cp punch_expected.img testdir/punch
+    fallocate -p -o 1536 -l 16384 testdir/punch
+    dd if=/dev/zero of=punch_expected.img bs=512 seek=3 count=32 conv=notrunc 2>/dev/null
+    assert_eq "$(stat -c %b testdir/punch)" "98" "the whole blocks should be freed"
+    assert_eq "$(cmp punch_expected.img testdir/punch)" "" "the punched range should read as zeroes"
+    assert_eq "$(seek testdir/punch HOLE 0)" "2048" "SEEK_HOLE should find the punched hole"
+    assert_eq "$(seek testdir/punch DATA 2048)" "17408" "SEEK_DATA should find the data after it"
+    check_log_success "Punching a hole"
+
+    ./remount.sh
+    assert_eq "$(cmp holes_expected.img testdir/sparse)" "" "the sparse file should persist"
+    assert_eq "$(cmp punch_expected.img testdir/punch)" "" "the punched file should persist"
+    assert_eq "$(stat -c %b testdir/punch)" "98" "the holes should persist"
+    check_log_success "Holes persist across remount"
+
+    rm testdir/sparse testdir/punch
+    rm -f holes_expected.img punch_expected.img
+}
+
+test_sparse
+
+# Extent mapped files keep holes as gaps between extents
+./umount.sh
+../mkfs.vvsfs -e test.img >/dev/null
+./mount.sh
+test_sparse
@@ -0,0 +1,51 @@
+#!/bin/bash
+source ./init.sh
+log_header "Testing inline data"
+
+# Recreate the file system with the inline data feature
+./umount.sh
+../mkfs.vvsfs -d test.img >/dev/null
+./mount.sh
+
+# Small files live in their inode and take no data block
+free_blocks=$(stat -f -c %f testdir)
+for i in $(seq 1 20); do
+    echo "small file $i" >testdir/small$i
+done
+sync
+assert_eq "$(stat -f -c %f testdir)" "$free_blocks" "small files should not take data blocks"
+./remount.sh
+assert_eq "$(cat testdir/small7)" "small file 7" "inline data should persist"
+assert_eq "$(stat -c %b testdir/small7)" "0" "inline file should have no blocks"
+check_log_success "Small files are stored inline"
+
+# A file that fills the inode tail exactly stays inline
+head -c $VVSFS_INLINE_SIZE /dev/urandom >inline_expected.img
+cp inline_expected.img testdir/full
+./remount.sh
+assert_eq "$(cmp inline_expected.img testdir/full)" "" "full inline file should read back"
+assert_eq "$(stat -c %b testdir/full)" "0" "full inline file should have no blocks"
+check_log_success "Inline data up to the size of the tail"
+
+# Growing past the tail moves the data to a block
+echo "more data" >>inline_expected.img
+echo "more data" >>testdir/full
+assert_eq "$(cmp inline_expected.img testdir/full)" "" "grown file should read back"
+./remount.sh
+assert_eq "$(cmp inline_expected.img testdir/full)" "" "grown file should persist"
+assert_eq "$(stat -c %b testdir/full)" "$((VVSFS_BLOCKSIZE / 512))" "grown file should have a block"
+check_log_success "Inline data moves to a block when the file grows"
+
+# Truncating an inline file zeroes the tail when it grows back
+echo "0123456789" >testdir/trunc
+truncate -s 4 testdir/trunc
+truncate -s 10 testdir/trunc
+printf "0123\0\0\0\0\0\0" >inline_expected.img
+assert_eq "$(cmp inline_expected.img testdir/trunc)" "" "regrown inline file should read zeroes"
+truncate -s 2000 testdir/trunc
+truncate -s 2000 inline_expected.img
+./remount.sh
+assert_eq "$(cmp inline_expected.img testdir/trunc)" "" "file truncated past the tail should read back"
+check_log_success "Truncate of inline files"
+
+rm -f inline_expected.img
@@ -0,0 +1,56 @@
+#!/bin/bash
+source ./init.sh
+
+# Runs for each journal given as an mkfs option, both by default
+journals=${*:-"-j -J"}
+
+for journal in $journals; do
+    case $journal in
+        -j) name="metadata journal" ;;
+        -J) name="jbd2 journal" ;;
+    esac
+    log_header "Testing the $name"
+
+    # Recreate the file system with the journal
+    ./umount.sh
+    ../mkfs.vvsfs $journal 1024 test.img >/dev/null
+    ./mount.sh
+
+    free_blocks=$(stat -f -c %f testdir)
+
+    mkdir testdir/dir
+    for i in $(seq 1 100); do
+        echo "file $i" >testdir/dir/file_$i
+    done
+    mv testdir/dir/file_1 testdir/moved
+    ln testdir/moved testdir/dir/link
+    rm testdir/dir/file_2
+    sync
+    check_log_success "Can update metadata with the $name"
+
+    # A copy of the image taken while mounted is what a crash leaves
+    # behind, and mounting it has to recover from the journal
+    cp test.img crash.img
+    mkdir -p crashdir
+    sudo mount -o loop -t vvsfs crash.img crashdir
+    assert_eq "$(cat crashdir/moved)" "file 1" "the renamed file should be recovered"
+    assert_eq "$(cat crashdir/dir/link)" "file 1" "the hard link should be recovered"
+    assert_eq "$(cat crashdir/dir/file_100)" "file 100" "the created files should be recovered"
+    assert_eq "$(ls crashdir/dir | wc -l)" "99" "the directory should hold the remaining entries after recovery"
+    sudo umount crashdir
+    rm -r crash.img crashdir
+    check_log_success "Journalled metadata is recovered after a crash"
+
+    ./remount.sh
+
+    assert_eq "$(cat testdir/moved)" "file 1" "the renamed file should persist"
+    assert_eq "$(cat testdir/dir/link)" "file 1" "the hard link should persist"
+    assert_eq "$(cat testdir/dir/file_100)" "file 100" "the created files should persist"
+    assert_eq "$(ls testdir/dir | wc -l)" "99" "the directory should hold the remaining entries"
+    check_log_success "Journalled metadata persists across remount"
+
+    rm -r testdir/dir testdir/moved
+    ./remount.sh
+    assert_eq "$(stat -f -c %f testdir)" "$free_blocks" "all blocks should be freed"
+    check_log_success "Journalled deletes free their blocks"
+done
@@ -0,0 +1,50 @@
+#!/bin/bash
+source ./init.sh
+log_header "Testing parallel allocation"
+
+free_blocks=$(stat -f -c %f testdir)
+free_inodes=$(stat -f -c %d testdir)
+head -c 20480 /dev/urandom >parallel_expected.img
+
+# Writers in different directories allocate inodes and blocks from
+# the same maps at the same time
+for d in $(seq 1 8); do
+    (
+        mkdir testdir/dir$d
+        for i in $(seq 1 16); do
+            cp parallel_expected.img testdir/dir$d/file$i
+        done
+        sync
+    ) &
+done
+wait
+
+for d in $(seq 1 8); do
+    for i in $(seq 1 16); do
+        assert_eq "$(cmp parallel_expected.img testdir/dir$d/file$i)" "" "dir$d/file$i should match"
+    done
+done
+check_log_success "Parallel writers get distinct blocks"
+
+./remount.sh
+for d in $(seq 1 8); do
+    for i in $(seq 1 16); do
+        assert_eq "$(cmp parallel_expected.img testdir/dir$d/file$i)" "" "dir$d/file$i should persist"
+    done
+done
+check_log_success "Parallel allocations persist across remount"
+
+for d in $(seq 1 8); do
+    rm -r testdir/dir$d &
+done
+wait
+sync
+assert_eq "$(stat -f -c %f testdir)" "$free_blocks" "all blocks should be freed"
+assert_eq "$(stat -f -c %d testdir)" "$free_inodes" "all inodes should be freed"
+check_log_success "Parallel frees keep the free counts exact"
+
+./remount.sh
+assert_eq "$(stat -f -c %f testdir)" "$free_blocks" "the free block count should persist"
+check_log_success "Free counts persist across remount"
+
+rm -f parallel_expected.img
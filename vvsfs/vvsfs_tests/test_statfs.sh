@@ -26,10 +26,10 @@ check_log_success "Fundamental block size correct"
 assert_eq "$(stat -f -c %b testdir)" "$VVSFS_MAXBLOCKS" "total block count incorrect"
 check_log_success "Total block count correct"
 # Free blocks %f
-assert_eq "$(stat -f -c %f testdir)" "16371" "free block count incorrect"
+assert_eq "$(stat -f -c %f testdir)" "16370" "free block count incorrect"
 check_log_success "Free block count correct"
 # Free blocks (nono-sudo) %a
-assert_eq "$(stat -f -c %a testdir)" "16371" "non-superuser free block count incorrect"
+assert_eq "$(stat -f -c %a testdir)" "16370" "non-superuser free block count incorrect"
 check_log_success "Non-superuser free block count correct"
 # Total inodes %c
 assert_eq "$(stat -f -c %c testdir)" "$VVSFS_MAX_INODE_ENTRIES" "total inode count incorrect"
@@ -59,10 +59,10 @@ check_log_success "Fundamental block size correct after remount"
 assert_eq "$(stat -f -c %b testdir)" "$VVSFS_MAXBLOCKS" "total block count incorrect after remount"
 check_log_success "Total block count correct after remount"
 # Free blocks %f
-assert_eq "$(stat -f -c %f testdir)" "16371" "free block count incorrect after remount"
+assert_eq "$(stat -f -c %f testdir)" "16370" "free block count incorrect after remount"
 check_log_success "Free block count correct after remount"
 # Free blocks (nono-sudo) %a
-assert_eq "$(stat -f -c %a testdir)" "16371" "non-superuser free block count incorrect after remount"
+assert_eq "$(stat -f -c %a testdir)" "16370" "non-superuser free block count incorrect after remount"
 check_log_success "Non-superuser free block count correct after remount"
 # Total inodes %c
 assert_eq "$(stat -f -c %c testdir)" "$VVSFS_MAX_INODE_ENTRIES" "total inode count incorrect after remount"
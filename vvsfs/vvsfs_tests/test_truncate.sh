@@ -0,0 +1,54 @@
+#!/bin/bash
+source ./init.sh
+log_header "Testing truncate"
+
+test_truncate() {
+    touch testdir/truncate
+    free_blocks=$(stat -f -c %f testdir)
+    head -c 65536 /dev/urandom >truncate_expected.img
+    cp truncate_expected.img testdir/truncate
+    sync
+
+    # Shrinking frees every block past the new end, including the
+    # indirect block, and keeps the partial last one
+    truncate -s 3000 testdir/truncate
+    truncate -s 3000 truncate_expected.img
+    sync
+    assert_eq "$(stat -c %b testdir/truncate)" "6" "only the blocks below the new size should remain"
+    assert_eq "$(stat -f -c %f testdir)" "$((free_blocks - 3))" "the tail blocks should be freed"
+    assert_eq "$(cmp truncate_expected.img testdir/truncate)" "" "the data below the new size should remain"
+    check_log_success "Shrinking a file"
+
+    # Growing again reads back zeroes past the old end, including in
+    # what is left of the partial last block
+    truncate -s 8192 testdir/truncate
+    truncate -s 8192 truncate_expected.img
+    assert_eq "$(cmp truncate_expected.img testdir/truncate)" "" "the grown part should read as zeroes"
+    sync
+    assert_eq "$(stat -c %b testdir/truncate)" "6" "growing should not allocate blocks"
+    echo "tail" >>testdir/truncate
+    echo "tail" >>truncate_expected.img
+    check_log_success "Growing a truncated file"
+
+    ./remount.sh
+    assert_eq "$(cmp truncate_expected.img testdir/truncate)" "" "the truncated file should persist"
+    assert_eq "$(stat -c %b testdir/truncate)" "8" "the freed blocks should stay freed"
+    check_log_success "Truncation persists across remount"
+
+    truncate -s 0 testdir/truncate
+    sync
+    assert_eq "$(stat -c %b testdir/truncate)" "0" "truncating to zero should free everything"
+    assert_eq "$(stat -f -c %f testdir)" "$free_blocks" "all blocks should be freed"
+    check_log_success "Truncating to zero"
+
+    rm testdir/truncate
+    rm -f truncate_expected.img
+}
+
+test_truncate
+
+# Extent mapped files trim their extents instead
+./umount.sh
+../mkfs.vvsfs -e test.img >/dev/null
+./mount.sh
+test_truncate